@@ -1,114 +1,518 @@
 // * This kernal module is used to encode the NFC tag data onto the NFC tag
+// * Writing a complete NDEF message to the device stores it on the tag in the field; reading returns the tag's message.
+// * The reader itself belongs to spi_mfrc522, which lends it out through nfc_reader_run().
+// * In provisioning mode (NFC_IOC_PROVISION) every write queues one image, a kthread writes each to the next fresh
+// * tag in the field, and read() returns one struct nfc_tag_event per tag.
 
 #include <linux/module.h>
 #include <linux/kernel.h>
 #include <linux/init.h>
-#include <linux/gpio.h>
 #include <linux/fs.h>
 #include <linux/uaccess.h>
 #include <linux/device.h>
-#include <linux/spi/spi.h>
+#include <linux/mutex.h>
+#include <linux/slab.h>
+#include <linux/kthread.h>
+#include <linux/wait.h>
+#include <linux/kfifo.h>
+#include <linux/poll.h>
+#include <linux/ktime.h>
+#include "nfc_reader.h"
+#include "nfc_ioctl.h"
+#include "ndef.h"
+
+#define PROVISION_QUEUE_LEN  16 // Images waiting for a tag
+#define PROVISION_EVENTS     64 // Results not yet read; new ones are dropped while it is full
+#define PROVISION_DONE_UIDS  8  // Recently provisioned tags, not written again while they stay in the field
+#define PROVISION_RETRIES    3  // Attempts on one tag before it is skipped until another tag shows up
 
 MODULE_LICENSE("Dual BSD/GPL");
 MODULE_AUTHOR("Alex Melnick and Alfonso Meraz");
 MODULE_DESCRIPTION("Linux driver for encoding NFC tags");
 
-static int major = 61;
+static int major; // 0: let the kernel pick
+module_param(major, int, 0444);
+MODULE_PARM_DESC(major, "Character device major number, 0 for a dynamic one");
+
+static char *key = "ffffffffffff";
+module_param(key, charp, 0444);
+MODULE_PARM_DESC(key, "MIFARE Classic key for the MAD and NDEF sectors, 12 hex digits");
+
+static bool key_b;
+module_param(key_b, bool, 0444);
+MODULE_PARM_DESC(key_b, "Authenticate with key B instead of key A (NDEF-formatted cards only allow writes with key B)");
+
+static char *ntag_pwd = "";
+module_param(ntag_pwd, charp, 0444);
+MODULE_PARM_DESC(ntag_pwd, "NTAG21x password (PWD_AUTH) for tags with protected pages, 8 hex digits; empty for none");
 
-#define GPIO_IRQ 44
+static unsigned int provision_poll_ms = 20;
+module_param(provision_poll_ms, uint, 0644);
+MODULE_PARM_DESC(provision_poll_ms, "How often provisioning mode looks for a fresh tag");
 
 static bool DEBUG = true;
 
 static ssize_t NFC_tag_read(struct file *file, char *buffer, size_t length, loff_t *offset);
 static ssize_t NFC_tag_write(struct file *file, const char *buffer, size_t length, loff_t *offset);
 static int NFC_tag_open(struct inode *inode, struct file *file);
-
-static int mfrc522_spi_init(void);
-static int mfrc522_spi_write_then_read(struct spi_device *spi, const void *txbuf, unsigned n_tx, void *rxbuf, unsigned n_rx);
-
-static int write_to_NFC_tag(struct spi_device *spi, unsigned char block_addr, const unsigned char *data, size_t data_len);
+static unsigned int NFC_tag_poll(struct file *file, poll_table *wait);
+static long NFC_tag_ioctl(struct file *file, unsigned int cmd, unsigned long arg);
+static void NFC_tag_provision_stop(void);
 
 static struct file_operations fops = {
     .owner = THIS_MODULE,
     .read = NFC_tag_read,
     .write = NFC_tag_write,
-    .open = NFC_tag_open
+    .open = NFC_tag_open,
+    .poll = NFC_tag_poll,
+    .unlocked_ioctl = NFC_tag_ioctl,
+};
+
+static DEFINE_MUTEX(tag_lock);      // One tag operation at a time; protects the buffers below
+static u8 mf_key[MFRC522_MF_KEY_SIZE];
+static u8 ul_pwd[MFRC522_UL_PWD_SIZE];
+static bool ul_pwd_set;
+static u8 tag_msg[NDEF_MAX_AREA];   // Message being written
+static u8 tag_area[NDEF_MAX_AREA];  // TLV image to write, or the data area read from the tag
+static size_t tag_msg_len;
+static size_t read_off, read_len;   // Message inside tag_area after a read
+
+// Provisioning mode
+struct provision_image {
+    size_t len;
+    u8 msg[NDEF_MAX_AREA];
+};
+
+struct provision_attempt {
+    struct nfc_tag_event event;
+    const struct provision_image *image;
 };
 
+static DEFINE_MUTEX(provision_lock);        // Mode switches and writers filling a slot; never taken by the worker
+static struct task_struct *provision_task;  // NULL when provisioning is off
+static struct provision_image *queue;       // PROVISION_QUEUE_LEN slots
+static DEFINE_SPINLOCK(queue_lock);         // queue_head, queue_tail, queue_seq
+static unsigned int queue_head, queue_tail; // Free-running; a slot is owned by the worker until tail moves past it
+static u32 queue_seq;                       // seq of the image at queue_tail
+static DECLARE_WAIT_QUEUE_HEAD(queue_wait); // Writers waiting for a free slot, the worker waiting for an image
+static DEFINE_KFIFO(events, struct nfc_tag_event, PROVISION_EVENTS);
+static DECLARE_WAIT_QUEUE_HEAD(events_wait);
+static struct mfrc522_uid done_uids[PROVISION_DONE_UIDS]; // Worker only, like the three below
+static unsigned int done_next;
+static struct mfrc522_uid failed_uid;
+static unsigned int failed_count;           // Consecutive failed attempts on failed_uid
+static u8 provision_area[NDEF_MAX_AREA];    // TLV image of the worker
+
 static int __init NFC_tag_init(void) {
     int result;
-    
+
     if (DEBUG) printk(KERN_INFO "NFC_tag: Initializing the NFC_tag module\n");
 
+    if (strlen(key) != 2 * MFRC522_MF_KEY_SIZE || hex2bin(mf_key, key, MFRC522_MF_KEY_SIZE)) {
+        printk(KERN_WARNING "NFC_tag: invalid key \"%s\"\n", key);
+        return -EINVAL;
+    }
+    ul_pwd_set = *ntag_pwd;
+    if (ul_pwd_set && (strlen(ntag_pwd) != 2 * MFRC522_UL_PWD_SIZE || hex2bin(ul_pwd, ntag_pwd, MFRC522_UL_PWD_SIZE))) {
+        printk(KERN_WARNING "NFC_tag: invalid ntag_pwd \"%s\"\n", ntag_pwd);
+        return -EINVAL;
+    }
+
     // Register the device
     result = register_chrdev(major, "NFC_tag", &fops);
     if (result < 0) {
         printk(KERN_WARNING "NFC_tag: can't get major %d\n", major);
         return result;
-    } else if (DEBUG) {
-        printk(KERN_INFO "NFC_tag: registered correctly with major number %d\n", major);
     }
+    if (!major)
+        major = result;
+    if (DEBUG) printk(KERN_INFO "NFC_tag: registered correctly with major number %d\n", major);
 
-    
+    return 0;
+}
 
-    result = gpio_request(GPIO_IRQ, "IRQ");
-    if (result < 0) {
-        printk(KERN_WARNING "NFC_tag: unable to request GPIO %d\n", GPIO_IRQ);
+static void __exit NFC_tag_exit(void) {
+    if (DEBUG) printk(KERN_INFO "NFC_tag: Exiting the NFC_tag module\n");
+
+    mutex_lock(&provision_lock);
+    NFC_tag_provision_stop();
+    mutex_unlock(&provision_lock);
+
+    // Unregister the device
+    unregister_chrdev(major, "NFC_tag");
+}
+
+// Wake the cards HALTed by the last inventory and select one of them
+static int NFC_tag_select(struct mfrc522_dev *dev, struct mfrc522_uid *uid) {
+    u8 atqa[2];
+    int result;
+
+    result = mfrc522_request_a(dev, PICC_CMD_WUPA, atqa);
+    if (result == -ETIMEDOUT)
+        return -ENODEV; // No tag in the field
+    if (!result)
+        result = mfrc522_select(dev, uid);
+    return result;
+}
+
+// Leave the tag HALTed, as the next inventory expects
+static int NFC_tag_release_card(struct mfrc522_dev *dev, int result) {
+    mfrc522_halt_a(dev);
+    mfrc522_mifare_stop_crypto1(dev);
+    return result;
+}
+
+static bool NFC_tag_is_classic(const struct mfrc522_uid *uid) {
+    return uid->sak == 0x08 || uid->sak == 0x18; // MIFARE Classic 1K / 4K
+}
+
+// Unlock the protected pages of a selected NTAG21x; the password holds until the tag is HALTed
+static int NFC_tag_ntag_auth(struct mfrc522_dev *dev) {
+    return ul_pwd_set ? mfrc522_ntag_pwd_auth(dev, ul_pwd, NULL) : 0;
+}
+
+static int NFC_tag_write_card(struct mfrc522_dev *dev, void *arg) {
+    u8 key_type = key_b ? PICC_CMD_MF_AUTH_KEY_B : PICC_CMD_MF_AUTH_KEY_A;
+    struct ndef_write_stats stats = {0};
+    struct mfrc522_uid uid;
+    int result, len;
+
+    len = ndef_tlv_encode(tag_msg, tag_msg_len, tag_area, sizeof(tag_area));
+    if (len < 0)
+        return len;
+
+    result = NFC_tag_select(dev, &uid);
+    if (result)
         return result;
-    } else if (DEBUG) {
-        printk(KERN_INFO "NFC_tag: requested GPIO %d\n", GPIO_IRQ);
-    }
-    result = gpio_direction_input(GPIO_IRQ);
-    if (result < 0) {
-        printk(KERN_WARNING "NFC_tag: unable to set GPIO %d as input\n", GPIO_IRQ);
+    if (NFC_tag_is_classic(&uid))
+        result = ndef_write_mifare(dev, &uid, key_type, mf_key, tag_area, len, &stats);
+    else if (uid.sak != PICC_SAK_ULTRALIGHT)
+        result = -EMEDIUMTYPE;
+    else if (!(result = NFC_tag_ntag_auth(dev)))
+        result = ndef_write_ultralight(dev, tag_area, len, &stats);
+    result = NFC_tag_release_card(dev, result);
+
+    if (DEBUG && !result)
+        printk(KERN_INFO "NFC_tag: %zu byte message: %u reads, %u writes, %u verified\n",
+               tag_msg_len, stats.reads, stats.writes, stats.verifies);
+    return result;
+}
+
+static int NFC_tag_read_card(struct mfrc522_dev *dev, void *arg) {
+    u8 key_type = key_b ? PICC_CMD_MF_AUTH_KEY_B : PICC_CMD_MF_AUTH_KEY_A;
+    struct mfrc522_uid uid;
+    int result;
+
+    result = NFC_tag_select(dev, &uid);
+    if (result)
         return result;
-    } else if (DEBUG) {
-        printk(KERN_INFO "NFC_tag: set GPIO %d as input\n", GPIO_IRQ);
+    if (NFC_tag_is_classic(&uid))
+        result = ndef_read_mifare(dev, &uid, key_type, mf_key, tag_area, &read_off, &read_len);
+    else if (uid.sak != PICC_SAK_ULTRALIGHT)
+        result = -EMEDIUMTYPE;
+    else if (!(result = NFC_tag_ntag_auth(dev)))
+        result = ndef_read_ultralight(dev, tag_area, &read_off, &read_len);
+    return NFC_tag_release_card(dev, result);
+}
+
+static bool NFC_tag_provisioning(void) {
+    return READ_ONCE(provision_task) != NULL;
+}
+
+static bool NFC_tag_done_uid(const struct mfrc522_uid *uid) {
+    unsigned int i;
+
+    for (i = 0; i < PROVISION_DONE_UIDS; i++)
+        if (mfrc522_uid_equal(&done_uids[i], uid))
+            return true;
+    return false;
+}
+
+// Runs under nfc_reader_run(): write the image to the tag in the field unless it already got one
+static int NFC_tag_provision_card(struct mfrc522_dev *dev, void *arg) {
+    u8 key_type = key_b ? PICC_CMD_MF_AUTH_KEY_B : PICC_CMD_MF_AUTH_KEY_A;
+    struct provision_attempt *attempt = arg;
+    struct ndef_write_stats stats = {0};
+    struct mfrc522_uid uid;
+    u64 start;
+    int result, len;
+
+    if (NFC_tag_select(dev, &uid))
+        return -ENODEV; // Empty field, or a tag still entering it: look again next round
+    if (NFC_tag_done_uid(&uid) || (failed_count >= PROVISION_RETRIES && mfrc522_uid_equal(&uid, &failed_uid)))
+        return NFC_tag_release_card(dev, -EALREADY); // Waiting for the operator to take it away
+
+    start = ktime_get_ns();
+    len = ndef_tlv_encode(attempt->image->msg, attempt->image->len, provision_area, sizeof(provision_area));
+    if (len < 0)
+        result = len;
+    else if (NFC_tag_is_classic(&uid))
+        result = ndef_write_mifare(dev, &uid, key_type, mf_key, provision_area, len, &stats);
+    else if (uid.sak != PICC_SAK_ULTRALIGHT)
+        result = -EMEDIUMTYPE;
+    else if (!(result = NFC_tag_ntag_auth(dev)))
+        result = ndef_write_ultralight(dev, provision_area, len, &stats);
+    result = NFC_tag_release_card(dev, result);
+
+    attempt->event.duration_ns = ktime_get_ns() - start;
+    attempt->event.result = result;
+    attempt->event.reads = stats.reads;
+    attempt->event.writes = stats.writes;
+    attempt->event.verifies = stats.verifies;
+    attempt->event.uid_size = uid.size;
+    memcpy(attempt->event.uid, uid.bytes, sizeof(attempt->event.uid));
+    if (!result) {
+        done_uids[done_next] = uid;
+        done_next = (done_next + 1) % PROVISION_DONE_UIDS;
+        failed_count = 0;
+    } else if (failed_count && mfrc522_uid_equal(&uid, &failed_uid)) {
+        failed_count++;
+    } else {
+        failed_uid = uid;
+        failed_count = 1;
     }
+    return 0; // The outcome is in the event
+}
 
-    // Initialize the SPI
-    result = mfrc522_spi_init();
-    if (result < 0) {
-        printk(KERN_WARNING "NFC_tag: unable to initialize SPI\n");
-        return result;
-    } else if (DEBUG) {
-        printk(KERN_INFO "NFC_tag: initialized SPI\n");
+static void NFC_tag_post_event(const struct nfc_tag_event *event) {
+    if (!kfifo_put(&events, *event)) {
+        // Nobody is reading; never hold up the next tag for it
+        printk_ratelimited(KERN_WARNING "NFC_tag: event queue full, result of tag %u dropped\n", event->seq);
+        return;
     }
+    wake_up_interruptible(&events_wait);
+}
+
+static unsigned int NFC_tag_queued(void) {
+    unsigned int n;
+
+    spin_lock(&queue_lock);
+    n = queue_head - queue_tail;
+    spin_unlock(&queue_lock);
+    return n;
+}
+
+static int NFC_tag_provision_thread(void *data) {
+    struct provision_attempt attempt;
+    int result;
+
+    while (!kthread_should_stop()) {
+        if (wait_event_interruptible(queue_wait, NFC_tag_queued() || kthread_should_stop()))
+            continue;
+        if (kthread_should_stop())
+            break;
 
+        memset(&attempt, 0, sizeof(attempt));
+        attempt.image = &queue[queue_tail % PROVISION_QUEUE_LEN];
+        attempt.event.seq = queue_seq;
+        result = nfc_reader_run(NFC_tag_provision_card, &attempt);
+        if (result || !attempt.event.uid_size) {
+            // No fresh tag yet (or the reader is busy): poll again shortly
+            schedule_timeout_interruptible(msecs_to_jiffies(provision_poll_ms));
+            continue;
+        }
+
+        NFC_tag_post_event(&attempt.event);
+        if (attempt.event.result) {
+            schedule_timeout_interruptible(msecs_to_jiffies(provision_poll_ms));
+            continue; // The image stays queued for the next tag
+        }
+        spin_lock(&queue_lock);
+        queue_tail++;
+        queue_seq++;
+        spin_unlock(&queue_lock);
+        wake_up_interruptible(&queue_wait);
+    }
     return 0;
 }
 
-static void __exit NFC_tag_exit(void) {
-    if (DEBUG) printk(KERN_INFO "NFC_tag: Exiting the NFC_tag module\n");
+// Caller holds provision_lock
+static int NFC_tag_provision_start(void) {
+    struct task_struct *task;
 
-    // Unregister the device
-    unregister_chrdev(major, "NFC_tag");
+    if (provision_task)
+        return 0;
+    queue = kcalloc(PROVISION_QUEUE_LEN, sizeof(*queue), GFP_KERNEL);
+    if (!queue)
+        return -ENOMEM;
+    queue_head = queue_tail = queue_seq = 0;
+    memset(done_uids, 0, sizeof(done_uids));
+    failed_count = 0;
+    kfifo_reset(&events);
+
+    task = kthread_run(NFC_tag_provision_thread, NULL, "nfc_provision");
+    if (IS_ERR(task)) {
+        kfree(queue);
+        queue = NULL;
+        return PTR_ERR(task);
+    }
+    WRITE_ONCE(provision_task, task);
+    if (DEBUG) printk(KERN_INFO "NFC_tag: provisioning mode on\n");
+    return 0;
+}
+
+// Caller holds provision_lock
+static void NFC_tag_provision_stop(void) {
+    struct task_struct *task = provision_task;
+
+    if (!task)
+        return;
+    WRITE_ONCE(provision_task, NULL);
+    kthread_stop(task);
+    if (NFC_tag_queued())
+        printk(KERN_INFO "NFC_tag: provisioning stopped with %u images queued\n", NFC_tag_queued());
+    kfree(queue);
+    queue = NULL;
+    wake_up_interruptible(&queue_wait);
+    wake_up_interruptible(&events_wait);
+}
+
+static long NFC_tag_ioctl(struct file *file, unsigned int cmd, unsigned long arg) {
+    int result = 0;
+
+    switch (cmd) {
+    case NFC_IOC_PROVISION:
+        mutex_lock(&provision_lock);
+        if (arg)
+            result = NFC_tag_provision_start();
+        else
+            NFC_tag_provision_stop();
+        mutex_unlock(&provision_lock);
+        return result;
+    default:
+        return -ENOTTY;
+    }
+}
+
+// Provisioning mode: queue one image, waiting for a free slot unless O_NONBLOCK
+static ssize_t NFC_tag_queue_image(struct file *file, const char *buffer, size_t length) {
+    struct provision_image *slot;
+    int result;
+
+    mutex_lock(&provision_lock);
+    while (provision_task && NFC_tag_queued() == PROVISION_QUEUE_LEN) {
+        mutex_unlock(&provision_lock);
+        if (file->f_flags & O_NONBLOCK)
+            return -EAGAIN;
+        result = wait_event_interruptible(queue_wait, !NFC_tag_provisioning() ||
+                                          NFC_tag_queued() < PROVISION_QUEUE_LEN);
+        if (result)
+            return result;
+        mutex_lock(&provision_lock);
+    }
+    if (!provision_task) {
+        mutex_unlock(&provision_lock);
+        return -EPIPE; // Switched off while waiting
+    }
 
+    slot = &queue[queue_head % PROVISION_QUEUE_LEN];
+    if (copy_from_user(slot->msg, buffer, length)) {
+        mutex_unlock(&provision_lock);
+        return -EFAULT;
+    }
+    slot->len = length;
+    spin_lock(&queue_lock);
+    queue_head++;
+    spin_unlock(&queue_lock);
+    mutex_unlock(&provision_lock);
+
+    wake_up_interruptible(&queue_wait);
+    return length;
+}
 
-   
+// Provisioning mode: whole struct nfc_tag_event records, waiting for the first unless O_NONBLOCK
+static ssize_t NFC_tag_read_events(struct file *file, char *buffer, size_t length) {
+    unsigned int copied;
+    int result;
 
-    // Free the GPIO
-    gpio_free(GPIO_RST);
+    if (length < sizeof(struct nfc_tag_event))
+        return -EINVAL;
+    while (kfifo_is_empty(&events)) {
+        if (file->f_flags & O_NONBLOCK)
+            return -EAGAIN;
+        if (!NFC_tag_provisioning())
+            return 0;
+        result = wait_event_interruptible(events_wait, !kfifo_is_empty(&events) || !NFC_tag_provisioning());
+        if (result)
+            return result;
+    }
+    // kfifo allows one reader and one writer without locking; tag_lock keeps it to one reader
+    mutex_lock(&tag_lock);
+    result = kfifo_to_user(&events, buffer, rounddown(length, sizeof(struct nfc_tag_event)), &copied);
+    mutex_unlock(&tag_lock);
+    return result ? result : copied;
+}
+
+static unsigned int NFC_tag_poll(struct file *file, poll_table *wait) {
+    unsigned int mask = 0;
+
+    poll_wait(file, &events_wait, wait);
+    poll_wait(file, &queue_wait, wait);
+    if (!kfifo_is_empty(&events))
+        mask |= POLLIN | POLLRDNORM;
+    if (!NFC_tag_provisioning() || NFC_tag_queued() < PROVISION_QUEUE_LEN)
+        mask |= POLLOUT | POLLWRNORM;
+    return mask;
 }
 
 static ssize_t NFC_tag_read(struct file *file, char *buffer, size_t length, loff_t *offset) {
-    // TODO: Implement read functionality
+    ssize_t result = 0;
 
     if (DEBUG) printk(KERN_INFO "NFC_tag: Reading from the NFC_tag kernal device\n");
 
-    return 0;
+    if (NFC_tag_provisioning())
+        return NFC_tag_read_events(file, buffer, length);
+
+    mutex_lock(&tag_lock);
+    if (*offset == 0) {
+        // A new read starts with a fresh look at the tag; the rest of the message comes from the buffer
+        read_len = 0;
+        result = nfc_reader_run(NFC_tag_read_card, NULL);
+        if (result == -ENOENT)
+            result = 0; // Formatted, but no message yet
+    }
+    if (!result)
+        result = simple_read_from_buffer(buffer, length, offset, tag_area + read_off, read_len);
+    mutex_unlock(&tag_lock);
+
+    return result;
 }
 
+/**
+ * @brief Store one complete NDEF message on the tag in the field
+ *
+ * Only the blocks or pages that differ from what the tag holds are written,
+ * and those are verified by CRC, so re-provisioning a token with a changed
+ * field costs a fraction of writing the whole message.
+*/
 static ssize_t NFC_tag_write(struct file *file, const char *buffer, size_t length, loff_t *offset) {
-    // TODO: Implement write functionality
+    int result;
 
     if (DEBUG) printk(KERN_INFO "NFC_tag: Writing to the NFC_tag kernal device\n");
 
-    return 0;
+    if (length > sizeof(tag_msg))
+        return -ENOSPC;
+    if (NFC_tag_provisioning())
+        return NFC_tag_queue_image(file, buffer, length);
+
+    mutex_lock(&tag_lock);
+    if (copy_from_user(tag_msg, buffer, length)) {
+        mutex_unlock(&tag_lock);
+        return -EFAULT;
+    }
+    tag_msg_len = length;
+    result = nfc_reader_run(NFC_tag_write_card, NULL);
+    mutex_unlock(&tag_lock);
+
+    if (result) {
+        printk(KERN_WARNING "NFC_tag: writing the tag failed: %d\n", result);
+        return result;
+    }
+    return length;
 }
 
-static int write_to_NFC_tag(struct spi_device *spi, unsigned char block_addr, const unsigned char *data, size_t data_len) {
-    // TODO - Implement writing to the NFC tag
+static int NFC_tag_open(struct inode *inode, struct file *file) {
+    return 0;
 }
 
 module_init(NFC_tag_init);
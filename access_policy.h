@@ -0,0 +1,53 @@
+/**
+ * @file access_policy.h
+ * @brief Token table and the N-of-M unlock decision
+ *
+ * Kept header-only and free of kernel calls so controller.c and the host
+ * benchmark make the exact same decision.
+*/
+
+#ifndef ACCESS_POLICY_H
+#define ACCESS_POLICY_H
+
+#include "mfrc522.h"
+
+#ifdef __KERNEL__
+#include <linux/bitops.h>
+#define access_policy_weight(x) hweight_long(x)
+#else
+#define access_policy_weight(x) __builtin_popcountl(x)
+#endif
+
+#define ACCESS_MAX_TOKENS 3
+
+struct access_policy {
+    struct mfrc522_uid tokens[ACCESS_MAX_TOKENS]; // Known tokens, bit i of a presence mask is tokens[i]
+    unsigned int num_tokens;
+    unsigned int required;                        // Tokens that must be present to unlock
+};
+
+/**
+ * @brief Look up a UID in the token table
+ * @return Token index, or -1 for an unknown card
+*/
+static inline int access_policy_match(const struct access_policy *policy, const struct mfrc522_uid *uid)
+{
+    unsigned int i;
+
+    for (i = 0; i < policy->num_tokens; i++)
+        if (mfrc522_uid_equal(&policy->tokens[i], uid))
+            return i;
+    return -1;
+}
+
+/**
+ * @brief Decide whether the tokens in the presence mask are enough to unlock
+*/
+static inline bool access_policy_decide(const struct access_policy *policy, unsigned long present)
+{
+    unsigned long known = (1UL << policy->num_tokens) - 1;
+
+    return (unsigned int)access_policy_weight(present & known) >= policy->required;
+}
+
+#endif // ACCESS_POLICY_H
@@ -5,83 +5,1377 @@
 #include <linux/gpio.h>
 #include <linux/interrupt.h>
 #include <linux/delay.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/ktime.h>
+#include <linux/string.h>
+#include <linux/kthread.h>
+#include <linux/sched.h>
+#include <linux/slab.h>
+#include <linux/mutex.h>
+#include <crypto/hash.h>
+#include <crypto/algapi.h>
+#include <linux/relay.h>
+#include <linux/atomic.h>
+#include <linux/seqlock.h>
+#include <linux/bitops.h>
+#include <linux/hrtimer.h>
+#include <linux/completion.h>
+#include <linux/workqueue.h>
+#include <linux/cpumask.h>
+#include <uapi/linux/sched/types.h>
 #include "solenoid.h"
+#include "access_policy.h"
+#include "nfc_reader.h"
+#include "latency_hist.h"
+#include "nfc_audit.h"
 
-#define SOLENOID_GPIO_PIN 50 // Need to change GPIO pin number for solenoid
 #define NUM_TOKENS_REQUIRED 2  // Number of tokens required to unlock
+#define POLL_MIN_SLEEP_MS 5    // Never poll back-to-back, even when the budget cannot be met
+
+// Signed credential: a 16 byte payload in the first block of a sector, HMAC-SHA256(UID || payload) in the next two;
+// DESFire cards hold the same 48 bytes in a file
+#define CREDENTIAL_PAYLOAD_SIZE MFRC522_MF_BLOCK_SIZE
+#define CREDENTIAL_MAC_SIZE     32
+#define CREDENTIAL_BLOCKS       3
+#define CREDENTIAL_MAX_KEY      64 // HMAC-SHA256 block size; longer keys would be hashed first
+#define CREDENTIAL_SIZE         (CREDENTIAL_PAYLOAD_SIZE + CREDENTIAL_MAC_SIZE)
+
+// Audit relay buffers per CPU: records are only written when a decision changes, so this holds hours of them
+#define AUDIT_SUBBUF_SIZE 4096
+#define AUDIT_SUBBUFS     4
 
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Alfonso Meraz");
 MODULE_DESCRIPTION("Controller Module for NFC and Solenoid Lock Interaction");
 
-static bool tokens_detected[3] = {false, false, false};  // Token presence states
+static char *tokens[ACCESS_MAX_TOKENS];
+static int num_tokens;
+module_param_array(tokens, charp, &num_tokens, 0444);
+MODULE_PARM_DESC(tokens, "UIDs of the tokens as hex strings, e.g. tokens=04a1b2c3,04a15e11,042243920e16c80");
+
+static unsigned int lock_index;
+module_param(lock_index, uint, 0444);
+MODULE_PARM_DESC(lock_index, "Solenoid lock the decisions drive, its position in lock-gpios");
+
+static unsigned int detect_budget_ms = 250;
+module_param(detect_budget_ms, uint, 0644);
+MODULE_PARM_DESC(detect_budget_ms, "Worst-case time from a token entering the field to its detection, in ms");
+
+static unsigned int rt_priority = 50;
+module_param(rt_priority, uint, 0444);
+MODULE_PARM_DESC(rt_priority, "SCHED_FIFO priority of the poll and decision threads (1-99), 0 for SCHED_NORMAL");
+
+static char *poll_cpus;
+module_param(poll_cpus, charp, 0444);
+MODULE_PARM_DESC(poll_cpus, "CPUs for the poll and decision threads as a list, e.g. 1 or 1-2; unset spreads them over all");
+
+static unsigned int arrive_confirm = 1;
+module_param(arrive_confirm, uint, 0644);
+MODULE_PARM_DESC(arrive_confirm, "Passes in a row that must see a token before it counts");
+
+static unsigned int depart_confirm = 1;
+module_param(depart_confirm, uint, 0644);
+MODULE_PARM_DESC(depart_confirm, "Passes in a row that must miss a token before it stops counting");
+
+static unsigned int depart_timeout_ms = 300;
+module_param(depart_timeout_ms, uint, 0644);
+MODULE_PARM_DESC(depart_timeout_ms, "Time since a token was last seen before it stops counting, in ms");
+
+static char *credential_key;
+module_param(credential_key, charp, 0400);
+MODULE_PARM_DESC(credential_key, "Hex HMAC-SHA256 key tokens are signed with; unset accepts bare UIDs");
+
+static char *credential_mf_key = "ffffffffffff";
+module_param(credential_mf_key, charp, 0400);
+MODULE_PARM_DESC(credential_mf_key, "MIFARE key A of the sector holding the credential, as hex");
+
+static unsigned int credential_block = 4;
+module_param(credential_block, uint, 0444);
+MODULE_PARM_DESC(credential_block, "First block of the credential, the first block of a sector");
+
+static unsigned int credential_aid;
+module_param(credential_aid, uint, 0444);
+MODULE_PARM_DESC(credential_aid, "DESFire application holding the credential file, e.g. 0x4e4643; 0 refuses DESFire tokens");
+
+static unsigned int credential_file = 1;
+module_param(credential_file, uint, 0444);
+MODULE_PARM_DESC(credential_file, "DESFire file of the credential: payload and MAC at offset 0");
+
+static unsigned int credential_key_no;
+module_param(credential_key_no, uint, 0444);
+MODULE_PARM_DESC(credential_key_no, "Application key the reader authenticates with (its desfire_key), 255 for a free-access file");
+
+static unsigned int credential_comm = DESFIRE_COMM_MAC;
+module_param(credential_comm, uint, 0444);
+MODULE_PARM_DESC(credential_comm, "Communication setting of the credential file: 0 plain, 1 MACed, 3 enciphered");
+
+// Bit i is tokens[i]; each pass stores its whole result at once, so a reader never sees a half-updated set
+static atomic_long_t tokens_present;   // Counted after the last pass: PRESENT or DEPARTING
+static atomic_long_t tokens_rejected;  // UID matched, credential failed on every reader that saw it
+static bool unlocked = false;          // Only touched by the pass holding decision_owner
+static struct access_policy policy = {
+    .num_tokens = 3,
+    .required = NUM_TOKENS_REQUIRED,
+};
+
+// Tap-to-actuation stages, timestamped with ktime_get()
+enum tap_stage {
+    STAGE_ANSWER_TO_UID,      // First REQA/WUPA answer -> last UID resolved
+    STAGE_UID_TO_DECISION,    // UID resolved -> policy decision
+    STAGE_DECISION_TO_GPIO,   // Policy decision -> solenoid GPIO set
+    STAGE_TOTAL,              // First answer -> solenoid GPIO set
+    NUM_TAP_STAGES
+};
+
+static const char * const tap_stage_names[NUM_TAP_STAGES] = {
+    "answer_to_uid", "uid_to_decision", "decision_to_gpio", "total",
+};
+
+static struct lat_hist tap_latency[NUM_TAP_STAGES];
+
+enum token_presence {
+    TOKEN_ABSENT,
+    TOKEN_ARRIVING,     // Seen by fewer than arrive_confirm passes in a row, not counted yet
+    TOKEN_PRESENT,
+    TOKEN_DEPARTING,    // Missed, still counted until depart_confirm passes and depart_timeout_ms agree
+};
+
+static const char * const token_presence_names[] = { "absent", "arriving", "present", "departing" };
+
+/*
+ * Presence hysteresis, so a token shifting on the reader does not make the
+ * solenoid chatter. Only the decision owner changes it. The timer of a token
+ * does nothing but queue depart_work at its deadline, so removal is decided
+ * depart_timeout_ms after the last sighting rather than whenever a poll
+ * interval happens to line up.
+*/
+static struct {
+    enum token_presence state[ACCESS_MAX_TOKENS];
+    unsigned int count[ACCESS_MAX_TOKENS];  // Passes in a row that saw (ARRIVING) or missed (DEPARTING) it
+    ktime_t deadline[ACCESS_MAX_TOKENS];    // Last sighting plus depart_timeout_ms
+    unsigned long seen;                     // Tokens in the last scan
+    u8 origin[ACCESS_MAX_TOKENS];           // Readers that saw each token in the last scan
+    unsigned long verified;                 // Credential checked since the token last went missing, see reader_slot_match()
+    struct hrtimer timer[ACCESS_MAX_TOKENS];
+    struct kthread_work depart_work;        // Decides again once a timer expires
+} presence;
+
+// What monitoring sees: published once per pass, read with controller_snapshot()
+struct controller_state {
+    u64 passes;                             // Scans decided on
+    unsigned long present;
+    unsigned long rejected;
+    ktime_t last_seen[ACCESS_MAX_TOKENS];   // Last pass that saw each token, 0 if never
+    u8 presence[ACCESS_MAX_TOKENS];         // enum token_presence
+    u8 origin[ACCESS_MAX_TOKENS];           // Reader slots that saw each token in the last scan
+    ktime_t decided;                        // Time of the last decision
+    enum nfc_audit_result result;           // Last decision; DENY also covers an empty field
+    bool unlocked;
+};
+
+/*
+ * Decisions never block each other: a pass claims decision_owner with a
+ * cmpxchg, and one finishing meanwhile on another reader only raises
+ * fusion.pending, which the owner picks up before letting go. The owner is
+ * then the only writer of state, so the seqcount needs no lock; readers
+ * retry instead.
+*/
+static struct {
+    seqcount_t seq;
+    struct controller_state cur;
+} state;
+static atomic_t decision_owner;
+static atomic64_t decisions_coalesced;
+
+// One per reader, each polled by its own thread so a slow bus never delays the others
+struct reader_slot {
+    struct nfc_reader *reader;  // NULL if the slot is free
+    struct task_struct *task;
+    seqcount_t seq;             // Guards scan to rejected; the slot's thread is the only writer
+    struct nfc_scan scan;       // Last completed pass
+    ktime_t done;               // When it completed, 0 before the first one
+    unsigned long present;      // Tokens it saw, credential checked through this reader
+    unsigned long rejected;     // Tokens whose credential this reader could not verify
+    // Poll scheduling: slowly decaying maxima of what one pass costs
+    u64 wake_cost_ns;           // Reader wake-up to ready
+    u64 scan_cost_ns;           // Inventory pass, wake-up excluded
+    u64 poll_sleep_ns;          // Idle time between passes chosen last
+    u64 last_start_ns;          // Start of the previous pass, 0 before the first one
+    atomic64_t misses;          // Cycles longer than detect_budget_ms
+    struct shash_desc *mac;     // HMAC state for credential_verify() on this slot's thread, NULL if credentials are off
+};
+
+static struct {
+    struct reader_slot slots[NFC_MAX_READERS];
+    struct mutex lock;          // Registration only, never taken by a pass
+    atomic_t pending;           // Passes completed since the owner last merged
+} fusion;
+static struct dentry *debugfs_dir;
+
+/*
+ * Keyed once at load; verifying a token allocates nothing. Each reader slot
+ * has its own shash_desc on the shared tfm and the counters are atomic, so
+ * the poll threads verify in parallel without a lock.
+*/
+static struct {
+    struct crypto_shash *tfm;   // hmac(sha256) holding the key schedule, NULL if credentials are off
+    u8 mf_key[MFRC522_MF_KEY_SIZE];
+    struct lat_hist cost[ACCESS_MAX_TOKENS]; // Block read from the card plus HMAC, per token
+    struct lat_hist mac_cost;                // HMAC and compare only
+    atomic64_t verified[ACCESS_MAX_TOKENS];
+    atomic64_t rejected[ACCESS_MAX_TOKENS];  // MAC mismatch: a cloned UID or a foreign credential
+    atomic64_t unreadable[ACCESS_MAX_TOKENS]; // Card left the field or refused the key
+} credential;
+
+/*
+ * Decision audit trail. relay_write() only copies into this CPU's buffer with
+ * interrupts off; userspace drains the files at its own pace. A full buffer
+ * drops the record instead of waiting, so slow storage never holds up the lock.
+*/
+static struct {
+    struct rchan *chan;             // NULL if relay could not be set up
+    atomic_t seq;
+    atomic64_t dropped;             // Records that found every sub-buffer full
+    struct nfc_audit_record last;   // Last record written, to skip repeats of the same decision
+} audit;
+
+/*
+ * Deadline-miss detection. A cycle runs from the start of one pass to the
+ * lock being driven after the next: the longest a token arriving just after
+ * a REQA waits, which detect_budget_ms bounds.
+*/
+static struct {
+    struct lat_hist cycle;      // Per slot, every cycle
+    struct lat_hist wake_late;  // Poll thread woken after the end of its sleep
+} deadline;
+
+static struct cpumask poll_mask;            // From poll_cpus, empty if unset
+static struct kthread_worker *decide_worker; // Runs depart_work at rt_priority
+
+static bool lock_ready;               // Solenoid probed and claimed by lock_claim_work
+static bool unloading;                // Tells lock_claim_work to give up waiting
+static DECLARE_COMPLETION(lock_claimed);
+static void lock_claim(struct work_struct *work);
+static DECLARE_WORK(lock_claim_work, lock_claim);
+
+static int initialize_nfc(void);
+static void cleanup_nfc(void);
+static int credential_init(void);
+static void credential_cleanup(void);
+static int sched_init(void);
+static void thread_sched(struct task_struct *task, const struct cpumask *cpus);
+static void update_tokens_detected(unsigned long present, unsigned long rejected);
+static enum hrtimer_restart presence_timer_fn(struct hrtimer *timer);
+static void presence_depart(struct kthread_work *work);
+static void fusion_decide(void);
+static void reader_slot_stop(struct reader_slot *slot);
+static void audit_init(void);
+static void audit_log(const struct nfc_scan *scan, enum nfc_audit_result result, unsigned long present,
+                      unsigned long rejected, u64 latency_ns);
+void check_token_proximity(const struct nfc_scan *scan);
+irqreturn_t nfc_irq_handler(int irq, void *dev_id);
+static int nfc_poll_thread(void *data);
+static int reader_slot_start(struct reader_slot *slot, struct nfc_reader *reader);
+
+static int latency_show(struct seq_file *m, void *v)
+{
+    int i;
+
+    lat_hist_seq_header(m);
+    for (i = 0; i < NUM_TAP_STAGES; i++)
+        lat_hist_seq_show(m, tap_stage_names[i], &tap_latency[i]);
+    return 0;
+}
+
+static int latency_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, latency_show, NULL);
+}
+
+// Any write resets every histogram
+static ssize_t latency_write(struct file *file, const char __user *buffer, size_t len, loff_t *offset)
+{
+    int i;
+
+    for (i = 0; i < NUM_TAP_STAGES; i++)
+        lat_hist_reset(&tap_latency[i]);
+    return len;
+}
+
+static const struct file_operations latency_fops = {
+    .owner = THIS_MODULE,
+    .open = latency_open,
+    .read = seq_read,
+    .write = latency_write,
+    .llseek = seq_lseek,
+    .release = single_release,
+};
+
+static int poll_show(struct seq_file *m, void *v)
+{
+    struct reader_slot *slot;
+    int i;
+
+    seq_printf(m, "detect_budget_ms: %u\n", detect_budget_ms);
+    mutex_lock(&fusion.lock);
+    for (i = 0; i < NFC_MAX_READERS; i++) {
+        slot = &fusion.slots[i];
+        if (!slot->reader)
+            continue;
+        seq_printf(m, "%d %s: cpu %d, wake_cost_us %llu, scan_cost_us %llu, sleep_us %llu\n", i,
+                   slot->reader->name, task_cpu(slot->task), div_u64(slot->wake_cost_ns, 1000),
+                   div_u64(slot->scan_cost_ns, 1000), div_u64(slot->poll_sleep_ns, 1000));
+    }
+    mutex_unlock(&fusion.lock);
+    return 0;
+}
+
+static int poll_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, poll_show, NULL);
+}
+
+static const struct file_operations poll_fops = {
+    .owner = THIS_MODULE,
+    .open = poll_open,
+    .read = seq_read,
+    .llseek = seq_lseek,
+    .release = single_release,
+};
+
+static int deadline_show(struct seq_file *m, void *v)
+{
+    struct reader_slot *slot;
+    int i;
+
+    seq_printf(m, "budget_ms: %u, %s priority %u, cpus %*pbl\n", detect_budget_ms,
+               rt_priority ? "SCHED_FIFO" : "SCHED_NORMAL", rt_priority,
+               cpumask_pr_args(cpumask_empty(&poll_mask) ? cpu_online_mask : &poll_mask));
+    mutex_lock(&fusion.lock);
+    for (i = 0; i < NFC_MAX_READERS; i++) {
+        slot = &fusion.slots[i];
+        if (!slot->reader)
+            continue;
+        seq_printf(m, "%d %s: misses %lld\n", i, slot->reader->name, (long long)atomic64_read(&slot->misses));
+    }
+    mutex_unlock(&fusion.lock);
+    lat_hist_seq_header(m);
+    lat_hist_seq_show(m, "cycle", &deadline.cycle);
+    lat_hist_seq_show(m, "wake_late", &deadline.wake_late);
+    return 0;
+}
+
+static int deadline_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, deadline_show, NULL);
+}
+
+// Any write resets the histograms and the miss counters
+static ssize_t deadline_write(struct file *file, const char __user *buffer, size_t len, loff_t *offset)
+{
+    int i;
+
+    lat_hist_reset(&deadline.cycle);
+    lat_hist_reset(&deadline.wake_late);
+    for (i = 0; i < NFC_MAX_READERS; i++)
+        atomic64_set(&fusion.slots[i].misses, 0);
+    return len;
+}
+
+static const struct file_operations deadline_fops = {
+    .owner = THIS_MODULE,
+    .open = deadline_open,
+    .read = seq_read,
+    .write = deadline_write,
+    .llseek = seq_lseek,
+    .release = single_release,
+};
+
+/**
+ * @brief Copy a consistent view of the controller state, from any context
+*/
+static void controller_snapshot(struct controller_state *out)
+{
+    unsigned int seq;
+
+    do {
+        seq = read_seqcount_begin(&state.seq);
+        *out = state.cur;
+    } while (read_seqcount_retry(&state.seq, seq));
+}
+
+static int state_show(struct seq_file *m, void *v)
+{
+    static const char * const results[] = { "deny", "grant", "hold", "relock" };
+    struct controller_state s;
+    ktime_t now = ktime_get();
+    int i;
+
+    controller_snapshot(&s);
+    seq_printf(m, "lock:     %s\n", s.unlocked ? "open" : "closed");
+    seq_printf(m, "decision: %s, %lld ms ago\n", results[s.result],
+               s.decided ? ktime_ms_delta(now, s.decided) : -1LL);
+    seq_printf(m, "passes:   %llu (%lld coalesced)\n", s.passes, (long long)atomic64_read(&decisions_coalesced));
+    for (i = 0; i < policy.num_tokens; i++) {
+        seq_printf(m, "token%d:   %s%s", i, token_presence_names[s.presence[i]],
+                   test_bit(i, &s.rejected) ? ", credential rejected" : "");
+        if (s.last_seen[i])
+            seq_printf(m, ", last seen %lld ms ago", ktime_ms_delta(now, s.last_seen[i]));
+        if (s.origin[i])
+            seq_printf(m, " by reader mask 0x%x", s.origin[i]);
+        seq_putc(m, '\n');
+    }
+    return 0;
+}
+
+static int state_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, state_show, NULL);
+}
+
+static const struct file_operations state_fops = {
+    .owner = THIS_MODULE,
+    .open = state_open,
+    .read = seq_read,
+    .llseek = seq_lseek,
+    .release = single_release,
+};
+
+static int audit_show(struct seq_file *m, void *v)
+{
+    seq_printf(m, "relay:   %s\n", audit.chan ? "on" : "off");
+    seq_printf(m, "records: %u\n", (u32)atomic_read(&audit.seq));
+    seq_printf(m, "dropped: %lld\n", (long long)atomic64_read(&audit.dropped));
+    return 0;
+}
+
+static int audit_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, audit_show, NULL);
+}
+
+static const struct file_operations audit_fops = {
+    .owner = THIS_MODULE,
+    .open = audit_open,
+    .read = seq_read,
+    .llseek = seq_lseek,
+    .release = single_release,
+};
+
+// Runs for every record that needs a fresh sub-buffer; refusing it drops the record
+static int audit_subbuf_start(struct rchan_buf *buf, void *subbuf, void *prev_subbuf, size_t prev_padding)
+{
+    if (relay_buf_full(buf)) {
+        atomic64_inc(&audit.dropped);
+        return 0;
+    }
+    return 1;
+}
+
+static struct dentry *audit_create_buf_file(const char *filename, struct dentry *parent, umode_t mode,
+                                            struct rchan_buf *buf, int *is_global)
+{
+    return debugfs_create_file(filename, 0400, parent, buf, &relay_file_operations);
+}
+
+static int audit_remove_buf_file(struct dentry *dentry)
+{
+    debugfs_remove(dentry);
+    return 0;
+}
 
+static struct rchan_callbacks audit_callbacks = {
+    .subbuf_start = audit_subbuf_start,
+    .create_buf_file = audit_create_buf_file,
+    .remove_buf_file = audit_remove_buf_file,
+};
+
+static int credential_show(struct seq_file *m, void *v)
+{
+    char name[16];
+    int i;
+
+    seq_printf(m, "signed credentials: %s\n", credential.tfm ? "required" : "off");
+    seq_printf(m, "verified in the field: 0x%lx\n", READ_ONCE(presence.verified));
+    for (i = 0; i < policy.num_tokens; i++)
+        seq_printf(m, "token%d: verified %lld, rejected %lld, unreadable %lld\n", i,
+                   (long long)atomic64_read(&credential.verified[i]),
+                   (long long)atomic64_read(&credential.rejected[i]),
+                   (long long)atomic64_read(&credential.unreadable[i]));
+    lat_hist_seq_header(m);
+    for (i = 0; i < policy.num_tokens; i++) {
+        snprintf(name, sizeof(name), "token%d", i);
+        lat_hist_seq_show(m, name, &credential.cost[i]);
+    }
+    lat_hist_seq_show(m, "hmac", &credential.mac_cost);
+    return 0;
+}
+
+static int credential_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, credential_show, NULL);
+}
+
+// Any write resets the histograms
+static ssize_t credential_write(struct file *file, const char __user *buffer, size_t len, loff_t *offset)
+{
+    int i;
+
+    for (i = 0; i < ACCESS_MAX_TOKENS; i++)
+        lat_hist_reset(&credential.cost[i]);
+    lat_hist_reset(&credential.mac_cost);
+    return len;
+}
+
+static const struct file_operations credential_fops = {
+    .owner = THIS_MODULE,
+    .open = credential_open,
+    .read = seq_read,
+    .write = credential_write,
+    .llseek = seq_lseek,
+    .release = single_release,
+};
 
 static int __init init_controller_module(void) {
+    int i, ret;
+
     printk(KERN_INFO "Initializing Controller Module\n");
     if (initialize_nfc() != 0) {
         printk(KERN_ALERT "Failed to initialize NFC module\n");
         return -EIO;
     }
-    if (initialize_solenoid(SOLENOID_GPIO_PIN) != 0) {
-        printk(KERN_ALERT "Failed to initialize solenoid lock\n");
+    ret = credential_init();
+    if (ret) {
         cleanup_nfc();
-        return -EIO;
+        return ret;
+    }
+    ret = sched_init();
+    if (ret) {
+        credential_cleanup();
+        cleanup_nfc();
+        return ret;
+    }
+    // The readers and the solenoid probe asynchronously: readers register when they are up, the lock is claimed here
+
+    for (i = 0; i < NUM_TAP_STAGES; i++)
+        lat_hist_init(&tap_latency[i]);
+    lat_hist_init(&deadline.cycle);
+    lat_hist_init(&deadline.wake_late);
+    seqcount_init(&state.seq);
+    mutex_init(&fusion.lock);
+    for (i = 0; i < NFC_MAX_READERS; i++)
+        seqcount_init(&fusion.slots[i].seq);
+    for (i = 0; i < ACCESS_MAX_TOKENS; i++) {
+        hrtimer_init(&presence.timer[i], CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+        presence.timer[i].function = presence_timer_fn;
     }
+    kthread_init_work(&presence.depart_work, presence_depart);
+    debugfs_dir = debugfs_create_dir("nfc_controller", NULL);
+    debugfs_create_file("latency", 0644, debugfs_dir, NULL, &latency_fops);
+    debugfs_create_file("poll", 0444, debugfs_dir, NULL, &poll_fops);
+    debugfs_create_file("credential", 0644, debugfs_dir, NULL, &credential_fops);
+    debugfs_create_file("audit", 0444, debugfs_dir, NULL, &audit_fops);
+    debugfs_create_file("state", 0444, debugfs_dir, NULL, &state_fops);
+    debugfs_create_file("deadline", 0644, debugfs_dir, NULL, &deadline_fops);
+    audit_init();
+
+    queue_work(system_long_wq, &lock_claim_work);
     return 0;
 }
 
 static void __exit cleanup_controller_module(void) {
+    int i;
+
     printk(KERN_INFO "Cleaning up Controller Module\n");
+    // Readers hold a reference on this module until they unregister, so every slot is free by now
+    WRITE_ONCE(unloading, true);
+    cancel_work_sync(&lock_claim_work);
+    for (i = 0; i < ACCESS_MAX_TOKENS; i++) {
+        hrtimer_cancel(&presence.timer[i]);
+    }
+    kthread_cancel_work_sync(&presence.depart_work); // With no reader left it sees no token and arms no timer
+    kthread_destroy_worker(decide_worker);
+    if (audit.chan)
+        relay_close(audit.chan); // Readers still get what was written, up to the close
+    debugfs_remove_recursive(debugfs_dir);
+    credential_cleanup();
     cleanup_nfc();
-    cleanup_solenoid(SOLENOID_GPIO_PIN);
-    
+    if (lock_ready) {
+        cleanup_solenoid(lock_index);
+    }
 }
 
-int initialize_nfc() {
-    // Setup NFC hardware interfaces, configure registers, etc.
+static int initialize_nfc(void) {
+    // Load the token table from the module parameters
+    int i, len;
+
+    for (i = 0; i < num_tokens; i++) {
+        len = strlen(tokens[i]) / 2;
+        if ((len != 4 && len != 7 && len != 10) || hex2bin(policy.tokens[i].bytes, tokens[i], len)) {
+            printk(KERN_ALERT "Token %d: invalid UID \"%s\"\n", i, tokens[i]);
+            return -EINVAL;
+        }
+        policy.tokens[i].size = len;
+    }
+    policy.num_tokens = num_tokens;
     return 0;
 }
 
-void cleanup_nfc() {
+static void cleanup_nfc(void) {
     // Disable NFC, free resources
 }
 
+/**
+ * @brief Check rt_priority and poll_cpus and start the decision worker
+*/
+static int sched_init(void) {
+    if (rt_priority >= MAX_USER_RT_PRIO) {
+        printk(KERN_ALERT "rt_priority must be 0 to %d\n", MAX_USER_RT_PRIO - 1);
+        return -EINVAL;
+    }
+    if (poll_cpus && *poll_cpus) {
+        if (cpulist_parse(poll_cpus, &poll_mask) || !cpumask_and(&poll_mask, &poll_mask, cpu_online_mask)) {
+            printk(KERN_ALERT "poll_cpus \"%s\" names no online CPU\n", poll_cpus);
+            return -EINVAL;
+        }
+    }
+    decide_worker = kthread_create_worker(0, "nfc_decide");
+    if (IS_ERR(decide_worker)) {
+        return PTR_ERR(decide_worker);
+    }
+    thread_sched(decide_worker->task, cpumask_empty(&poll_mask) ? NULL : &poll_mask);
+    return 0;
+}
+
+/**
+ * @brief Allocate and key the HMAC transform and a descriptor per reader slot once, so verification never allocates
+*/
+static int credential_init(void) {
+    struct shash_desc *desc;
+    u8 key[CREDENTIAL_MAX_KEY];
+    size_t len;
+    int i, ret;
+
+    for (i = 0; i < ACCESS_MAX_TOKENS; i++)
+        lat_hist_init(&credential.cost[i]);
+    lat_hist_init(&credential.mac_cost);
+    if (!credential_key || !*credential_key)
+        return 0;
+
+    len = strlen(credential_key) / 2;
+    if (!len || len > sizeof(key) || strlen(credential_key) % 2 || hex2bin(key, credential_key, len)) {
+        printk(KERN_ALERT "credential_key must be 1 to %d bytes of hex\n", CREDENTIAL_MAX_KEY);
+        return -EINVAL;
+    }
+    if (strlen(credential_mf_key) != 2 * MFRC522_MF_KEY_SIZE ||
+        hex2bin(credential.mf_key, credential_mf_key, MFRC522_MF_KEY_SIZE)) {
+        printk(KERN_ALERT "credential_mf_key must be %d bytes of hex\n", MFRC522_MF_KEY_SIZE);
+        ret = -EINVAL;
+        goto out;
+    }
+    if (credential_block >= 128 || credential_block % MFRC522_MF_SECTOR_BLOCKS) {
+        printk(KERN_ALERT "credential_block %u is not the first block of a 4 block sector\n", credential_block);
+        ret = -EINVAL;
+        goto out;
+    }
+    if (credential_aid > 0xFFFFFF || credential_file > 31 || (credential_key_no > 13 && credential_key_no != DESFIRE_NO_AUTH) ||
+        (credential_comm != DESFIRE_COMM_PLAIN && credential_comm != DESFIRE_COMM_MAC &&
+         credential_comm != DESFIRE_COMM_ENC)) {
+        printk(KERN_ALERT "credential_aid, credential_file, credential_key_no or credential_comm out of range\n");
+        ret = -EINVAL;
+        goto out;
+    }
+
+    credential.tfm = crypto_alloc_shash("hmac(sha256)", 0, 0);
+    if (IS_ERR(credential.tfm)) {
+        ret = PTR_ERR(credential.tfm);
+        credential.tfm = NULL;
+        printk(KERN_ALERT "hmac(sha256) unavailable: %d\n", ret);
+        goto out;
+    }
+    ret = crypto_shash_setkey(credential.tfm, key, len);
+    for (i = 0; i < NFC_MAX_READERS && !ret; i++) {
+        desc = kzalloc(sizeof(*desc) + crypto_shash_descsize(credential.tfm), GFP_KERNEL);
+        if (!desc) {
+            ret = -ENOMEM;
+            break;
+        }
+        desc->tfm = credential.tfm;
+        fusion.slots[i].mac = desc;
+    }
+    if (ret) {
+        credential_cleanup();
+        goto out;
+    }
+    printk(KERN_INFO "Tokens need a signed credential in block %u\n", credential_block);
+    if (credential_aid) {
+        printk(KERN_INFO "DESFire tokens need it in file %u of application 0x%06x\n", credential_file, credential_aid);
+    }
+out:
+    memzero_explicit(key, sizeof(key));
+    return ret;
+}
+
+static void credential_cleanup(void) {
+    int i;
+
+    if (!credential.tfm)
+        return;
+    for (i = 0; i < NFC_MAX_READERS; i++) {
+        kzfree(fusion.slots[i].mac);
+        fusion.slots[i].mac = NULL;
+    }
+    crypto_free_shash(credential.tfm);
+    credential.tfm = NULL;
+}
+
+/**
+ * @brief Read the payload and MAC of a card: from credential_block, or from the credential file of a DESFire card
+ *
+ * A reader that cannot read blocks or files (the PN532) cannot have a card prove itself.
+*/
+static int credential_read(const struct mfrc522_uid *uid, struct nfc_reader *reader, u8 *data) {
+    if (!(uid->sak & PICC_SAK_ISO14443_4)) {
+        return reader->read_blocks ? reader->read_blocks(reader, uid, PICC_CMD_MF_AUTH_KEY_A, credential.mf_key,
+                                                         credential_block, CREDENTIAL_BLOCKS, data) : -EOPNOTSUPP;
+    }
+    if (!credential_aid) {
+        return -EMEDIUMTYPE;
+    }
+    return reader->read_file ? reader->read_file(reader, uid, credential_aid, credential_key_no, credential_file, 0,
+                                                 credential_comm, data, CREDENTIAL_SIZE) : -EOPNOTSUPP;
+}
+
+/**
+ * @brief Check the credential of a card whose UID matched token, through the reader of slot that saw it
+ *
+ * The credential is read from the card itself: a card that only clones the
+ * UID must fail even right after the real token was read. Called once per
+ * arrival, see reader_slot_match(). Runs on the slot's poll thread and takes
+ * no lock.
+ * @return 0 if the MAC over UID and payload matches
+*/
+static int credential_verify(int token, const struct mfrc522_uid *uid, struct reader_slot *slot) {
+    struct nfc_reader *reader = slot->reader;
+    u8 blocks[DESFIRE_READ_SPACE(CREDENTIAL_SIZE)];
+    u8 mac[CREDENTIAL_MAC_SIZE];
+    u64 start, hmac_start;
+    int ret;
+
+    start = ktime_get_ns();
+    ret = credential_read(uid, reader, blocks);
+    if (ret) {
+        atomic64_inc(&credential.unreadable[token]);
+        return ret;
+    }
+
+    hmac_start = ktime_get_ns();
+    ret = crypto_shash_init(slot->mac);
+    if (!ret)
+        ret = crypto_shash_update(slot->mac, uid->bytes, uid->size);
+    if (!ret)
+        ret = crypto_shash_finup(slot->mac, blocks, CREDENTIAL_PAYLOAD_SIZE, mac);
+    if (!ret && crypto_memneq(mac, blocks + CREDENTIAL_PAYLOAD_SIZE, CREDENTIAL_MAC_SIZE))
+        ret = -EKEYREJECTED;
+    lat_hist_record(&credential.mac_cost, ktime_get_ns() - hmac_start);
+    if (ret) {
+        atomic64_inc(&credential.rejected[token]);
+    } else {
+        atomic64_inc(&credential.verified[token]);
+    }
+    lat_hist_record(&credential.cost[token], ktime_get_ns() - start);
+
+    if (ret) {
+        printk_ratelimited(KERN_WARNING "Token %d: credential rejected by %s (%d)\n", token, reader->name, ret);
+    }
+    return ret;
+}
+
+static enum hrtimer_restart presence_timer_fn(struct hrtimer *timer) {
+    kthread_queue_work(decide_worker, &presence.depart_work);
+    return HRTIMER_NORESTART;
+}
+
+// The decision it triggers sees the token missing once more, now past its deadline, and lets it go
+static void presence_depart(struct kthread_work *work) {
+    fusion_decide();
+}
 
-void check_token_proximity(void) {
-    int i, count = 0;
-    for (i = 0; i < 3; i++) {
-        if (tokens_detected[i]) {
-            count++;
+/**
+ * @brief Step the presence state machine of every token with what a pass saw
+ * @return The tokens that count: PRESENT or DEPARTING
+*/
+static unsigned long presence_update(unsigned long seen, ktime_t now) {
+    unsigned long counted = 0;
+    enum token_presence *st;
+    int i;
+
+    for (i = 0; i < policy.num_tokens; i++) {
+        st = &presence.state[i];
+        if (test_bit(i, &seen)) {
+            if (*st == TOKEN_ABSENT) {
+                *st = TOKEN_ARRIVING;
+                presence.count[i] = 0;
+            }
+            if (*st == TOKEN_ARRIVING && ++presence.count[i] >= arrive_confirm) {
+                *st = TOKEN_PRESENT;
+            }
+            if (*st == TOKEN_DEPARTING) {
+                *st = TOKEN_PRESENT;
+            }
+            if (*st == TOKEN_PRESENT) {
+                presence.deadline[i] = ktime_add_ms(now, depart_timeout_ms);
+                hrtimer_start(&presence.timer[i], presence.deadline[i], HRTIMER_MODE_ABS);
+            }
+        } else {
+            clear_bit(i, &presence.verified); // Missed, so whatever answers next is checked again
+            if (*st == TOKEN_ARRIVING) {
+                *st = TOKEN_ABSENT;
+            } else if (*st != TOKEN_ABSENT) {
+                if (*st == TOKEN_PRESENT) {
+                    *st = TOKEN_DEPARTING;
+                    presence.count[i] = 0;
+                }
+                if (++presence.count[i] >= depart_confirm && !ktime_before(now, presence.deadline[i])) {
+                    *st = TOKEN_ABSENT;
+                }
+            }
+        }
+        if (*st == TOKEN_PRESENT || *st == TOKEN_DEPARTING) {
+            __set_bit(i, &counted);
         }
     }
+    return counted;
+}
+
+/**
+ * @brief Match the cards of one reader's pass against the tokens
+ *
+ * A matching UID alone is not trusted once credentials are configured; the
+ * credential is read through the same reader, on its own poll thread. It is
+ * read when the token arrives and not again while every pass keeps seeing
+ * it: a credential read costs a wake-up, an authentication and three READs,
+ * far more than a pass. The first pass that misses the token clears its
+ * verified bit, so a card that takes its place is checked again.
+*/
+static void reader_slot_match(struct reader_slot *slot, const struct nfc_scan *scan, unsigned long *present,
+                              unsigned long *rejected) {
+    unsigned int i;
+    int token;
 
-    if (count >= NUM_TOKENS_REQUIRED) {
-        activate_solenoid(SOLENOID_GPIO_PIN);
+    *present = 0;
+    *rejected = 0;
+    for (i = 0; i < scan->count; i++) {
+        token = access_policy_match(&policy, &scan->uids[i]);
+        if (token < 0 || test_bit(token, present)) {
+            continue;
+        }
+        if (credential.tfm && !test_bit(token, &presence.verified)) {
+            if (credential_verify(token, &scan->uids[i], slot)) {
+                __set_bit(token, rejected);
+                continue;
+            }
+            set_bit(token, &presence.verified);
+        }
+        __set_bit(token, present);
+    }
+}
+
+static void update_tokens_detected(unsigned long present, unsigned long rejected) {
+    presence.seen = present;
+    atomic_long_set(&tokens_present, presence_update(present, ktime_get()));
+    atomic_long_set(&tokens_rejected, rejected);
+}
+
+/**
+ * @brief Make a decision visible to controller_snapshot()
+ *
+ * Only called by the owner of the decision. Preemption stays off while the
+ * write is open so a reader never spins on a preempted writer.
+*/
+static void state_publish(unsigned long present, unsigned long rejected, ktime_t now,
+                          enum nfc_audit_result result) {
+    int i;
+
+    preempt_disable();
+    write_seqcount_begin(&state.seq);
+    state.cur.passes++;
+    state.cur.present = present;
+    state.cur.rejected = rejected;
+    for_each_set_bit(i, &presence.seen, ACCESS_MAX_TOKENS) {
+        state.cur.last_seen[i] = now;
+    }
+    for (i = 0; i < ACCESS_MAX_TOKENS; i++) {
+        state.cur.presence[i] = presence.state[i];
+        state.cur.origin[i] = presence.origin[i];
+    }
+    state.cur.decided = now;
+    state.cur.result = result;
+    state.cur.unlocked = unlocked;
+    write_seqcount_end(&state.seq);
+    preempt_enable();
+}
+
+static void record_tap_latency(const struct nfc_scan *scan, ktime_t t_decision, ktime_t t_gpio) {
+    if (!scan->t_answer || !t_gpio) {
+        return;
+    }
+    lat_hist_record(&tap_latency[STAGE_ANSWER_TO_UID], ktime_to_ns(ktime_sub(scan->t_resolved, scan->t_answer)));
+    lat_hist_record(&tap_latency[STAGE_UID_TO_DECISION], ktime_to_ns(ktime_sub(t_decision, scan->t_resolved)));
+    lat_hist_record(&tap_latency[STAGE_DECISION_TO_GPIO], ktime_to_ns(ktime_sub(t_gpio, t_decision)));
+    lat_hist_record(&tap_latency[STAGE_TOTAL], ktime_to_ns(ktime_sub(t_gpio, scan->t_answer)));
+}
+
+void check_token_proximity(const struct nfc_scan *scan) {
+    unsigned long present = atomic_long_read(&tokens_present);
+    unsigned long rejected = atomic_long_read(&tokens_rejected);
+    enum nfc_audit_result result;
+    ktime_t t_decision, t_gpio;
+    bool unlock;
+
+    unlock = access_policy_decide(&policy, present);
+    t_decision = ktime_get();
+    if (unlock == unlocked) {
+        // GPIO already in the right state; an empty field with the lock closed is not recorded
+        result = unlock ? NFC_AUDIT_HOLD : NFC_AUDIT_DENY;
+        state_publish(present, rejected, t_decision, result);
+        if (scan->count) {
+            audit_log(scan, result, present, rejected,
+                      scan->t_answer ? ktime_to_ns(ktime_sub(t_decision, scan->t_answer)) : 0);
+        } else {
+            memset(&audit.last, 0, sizeof(audit.last)); // The next card presented is a new tap
+        }
+        return;
+    }
+    unlocked = unlock;
+
+    if (unlock) {
+        t_gpio = activate_solenoid(lock_index);
+        record_tap_latency(scan, t_decision, t_gpio);
     } else {
-        deactivate_solenoid(SOLENOID_GPIO_PIN);
+        t_gpio = deactivate_solenoid(lock_index);
+    }
+    result = unlock ? NFC_AUDIT_GRANT : NFC_AUDIT_RELOCK;
+    state_publish(present, rejected, t_decision, result);
+    audit_log(scan, result, present, rejected,
+              scan->t_answer && t_gpio ? ktime_to_ns(ktime_sub(t_gpio, scan->t_answer)) : 0);
+}
+
+/**
+ * @brief Merge the last pass of every reader into one scan
+ *
+ * A card seen by several readers appears once, with all of them in its
+ * origin. A token counts if any reader verified it, and is only rejected if
+ * none did; presence.origin gets the readers that verified each one. A reader
+ * whose last good pass is older than two detection budgets (stuck bus,
+ * unplugged) no longer counts, so it cannot hold the door open. The
+ * timestamps are those of the pass that completed last. Owner only.
+*/
+static void fusion_merge(struct nfc_scan *out, unsigned long *present, unsigned long *rejected) {
+    ktime_t oldest = ktime_sub_ms(ktime_get(), 2 * detect_budget_ms);
+    ktime_t done, newest = 0;
+    unsigned long slot_present, slot_rejected;
+    struct reader_slot *slot;
+    struct nfc_scan scan;
+    unsigned int i, j, seq;
+    int n, token;
+
+    memset(out, 0, sizeof(*out));
+    memset(presence.origin, 0, sizeof(presence.origin));
+    *present = 0;
+    *rejected = 0;
+    for (n = 0; n < NFC_MAX_READERS; n++) {
+        slot = &fusion.slots[n];
+        if (!READ_ONCE(slot->reader)) {
+            continue;
+        }
+        do {
+            seq = read_seqcount_begin(&slot->seq);
+            scan = slot->scan;
+            done = slot->done;
+            slot_present = slot->present;
+            slot_rejected = slot->rejected;
+        } while (read_seqcount_retry(&slot->seq, seq));
+        if (!done || ktime_before(done, oldest)) {
+            continue;
+        }
+
+        *present |= slot_present;
+        *rejected |= slot_rejected;
+        for_each_set_bit(token, &slot_present, ACCESS_MAX_TOKENS) {
+            presence.origin[token] |= BIT(n);
+        }
+
+        for (i = 0; i < scan.count; i++) {
+            for (j = 0; j < out->count; j++) {
+                if (out->uids[j].size == scan.uids[i].size &&
+                    !memcmp(out->uids[j].bytes, scan.uids[i].bytes, scan.uids[i].size)) {
+                    break;
+                }
+            }
+            if (j == out->count) {
+                if (out->count == NFC_SCAN_MAX_UIDS) {
+                    continue;
+                }
+                out->uids[out->count++] = scan.uids[i];
+            }
+            out->origin[j] |= BIT(n);
+        }
+        if (ktime_after(done, newest)) {
+            newest = done;
+            out->t_answer = scan.t_answer;
+            out->t_resolved = scan.t_resolved;
+        }
+    }
+    *rejected &= ~*present;
+}
+
+/**
+ * @brief Decide on the merged view of all readers, unless another pass is already deciding
+ *
+ * A pass that loses the race leaves its scan in its slot and raises
+ * fusion.pending; the owner merges again before giving up ownership, so the
+ * last pass of every reader is always part of a decision.
+*/
+static void fusion_decide(void) {
+    static struct nfc_scan scan; // Only the owner touches it; too big for the stack with eight readers
+    unsigned long present, rejected;
+
+    if (!smp_load_acquire(&lock_ready)) {
+        return; // Nothing to drive yet
+    }
+    atomic_inc(&fusion.pending);
+    smp_mb__after_atomic();
+    for (;;) {
+        if (!atomic_read(&fusion.pending)) {
+            return;
+        }
+        if (atomic_cmpxchg(&decision_owner, 0, 1)) {
+            atomic64_inc(&decisions_coalesced); // The owner sees pending and merges this pass too
+            return;
+        }
+        atomic_set(&fusion.pending, 0);
+        fusion_merge(&scan, &present, &rejected);
+        update_tokens_detected(present, rejected);
+        check_token_proximity(&scan);
+        atomic_set_release(&decision_owner, 0);
+        smp_mb(); // Let go before looking at pending, or a pass finishing now could be missed by both
+    }
+}
+
+/**
+ * @brief Publish a reader's pass and decide on it
+*/
+static void fusion_submit(struct reader_slot *slot, const struct nfc_scan *scan) {
+    unsigned long present, rejected;
+    unsigned int i;
+
+    reader_slot_match(slot, scan, &present, &rejected);
+
+    preempt_disable();
+    write_seqcount_begin(&slot->seq);
+    slot->scan = *scan;
+    for (i = 0; i < scan->count; i++) {
+        slot->scan.origin[i] = BIT(slot - fusion.slots);
+    }
+    slot->done = ktime_get();
+    slot->present = present;
+    slot->rejected = rejected;
+    write_seqcount_end(&slot->seq);
+    preempt_enable();
+
+    fusion_decide();
+}
+
+static void audit_init(void) {
+    audit.chan = relay_open("audit", debugfs_dir, AUDIT_SUBBUF_SIZE, AUDIT_SUBBUFS, &audit_callbacks, NULL);
+    if (!audit.chan) {
+        printk(KERN_WARNING "Audit relay unavailable, decisions are not logged\n");
+    }
+}
+
+/**
+ * @brief Append a decision to the audit trail
+ *
+ * relay_write() is safe in any context, IRQ handler included. A decision identical
+ * to the last one recorded (same result, tokens and cards, e.g. a token
+ * resting on the reader) is not written again.
+*/
+static void audit_log(const struct nfc_scan *scan, enum nfc_audit_result result, unsigned long present,
+                      unsigned long rejected, u64 latency_ns) {
+    struct nfc_audit_record rec;
+    unsigned int i;
+
+    if (!audit.chan) {
+        return;
+    }
+    memset(&rec, 0, sizeof(rec));
+    rec.result = result;
+    rec.present = present;
+    rec.rejected = rejected;
+    rec.uid_count = min_t(unsigned int, scan->count, NFC_AUDIT_MAX_UIDS);
+    for (i = 0; i < rec.uid_count; i++) {
+        rec.uid_size[i] = scan->uids[i].size;
+        memcpy(rec.uids[i], scan->uids[i].bytes, scan->uids[i].size);
     }
+    // Only the owner of the decision gets here, so last needs no lock
+    if (!memcmp(&rec.result, &audit.last.result, sizeof(rec) - offsetof(struct nfc_audit_record, result))) {
+        return;
+    }
+    audit.last = rec;
+
+    rec.time_ns = ktime_get_real_ns();
+    rec.latency_ns = min_t(u64, latency_ns, U32_MAX);
+    rec.seq = atomic_inc_return(&audit.seq) - 1;
+    relay_write(audit.chan, &rec, sizeof(rec));
+}
+
+/**
+ * @brief Give a thread of the detection path rt_priority and, if cpus is set, pin it there
+ *
+ * At SCHED_FIFO it preempts every normal task on the board (services,
+ * logging), so its latency only depends on higher real-time threads.
+*/
+static void thread_sched(struct task_struct *task, const struct cpumask *cpus) {
+    struct sched_param param = { .sched_priority = rt_priority };
+
+    if (rt_priority) {
+        sched_setscheduler_nocheck(task, SCHED_FIFO, &param);
+    }
+    if (cpus) {
+        set_cpus_allowed_ptr(task, cpus);
+    }
+}
+
+// CPU of reader slot index: the poll_cpus in turn, or the CPUs near the reader's node
+static int slot_cpu(int index) {
+    int cpu, n;
+
+    if (cpumask_empty(&poll_mask)) {
+        return cpumask_local_spread(index, NUMA_NO_NODE);
+    }
+    n = index % cpumask_weight(&poll_mask);
+    for_each_cpu(cpu, &poll_mask) {
+        if (!n--) {
+            break;
+        }
+    }
+    return cpu;
+}
+
+/**
+ * @brief Account one cycle of a slot: the previous pass started at last_start_ns, this one decided now
+*/
+static void deadline_account(struct reader_slot *slot, u64 start) {
+    u64 cycle = ktime_get_ns() - slot->last_start_ns;
+
+    if (slot->last_start_ns) {
+        lat_hist_record(&deadline.cycle, cycle);
+        if (cycle > (u64)detect_budget_ms * NSEC_PER_MSEC) {
+            atomic64_inc(&slot->misses);
+        }
+    }
+    slot->last_start_ns = start;
+}
+
+// Track a cost as a maximum that decays by 1/16 per pass, so one slow pass is not remembered forever
+static void update_cost(u64 *cost, u64 sample) {
+    *cost -= *cost >> 4;
+    if (sample > *cost) {
+        *cost = sample;
+    }
+}
+
+/**
+ * @brief Idle time before the next pass so that detection stays within detect_budget_ms
+ *
+ * A token that arrives just after a pass has sent its REQA is seen by the
+ * next one: worst case is the rest of this pass, the sleep, the wake-up and
+ * the whole next pass.
+*/
+static u64 poll_interval_ns(const struct reader_slot *slot) {
+    u64 budget = (u64)detect_budget_ms * NSEC_PER_MSEC;
+    u64 cost = slot->wake_cost_ns + 2 * slot->scan_cost_ns;
+    u64 min_sleep = (u64)POLL_MIN_SLEEP_MS * NSEC_PER_MSEC;
+
+    if (cost + min_sleep > budget) {
+        printk_ratelimited(KERN_WARNING "NFC poll %s: %u ms budget cannot be met (pass costs %llu us)\n",
+                           slot->reader->name, detect_budget_ms, div_u64(cost, 1000));
+        return min_sleep;
+    }
+    return budget - cost;
+}
+
+/**
+ * @brief Claim the solenoid once it has probed
+ *
+ * Runs once from init on system_long_wq, so loading the controller never
+ * waits for the lock; the readers poll meanwhile but decide nothing.
+*/
+static void lock_claim(struct work_struct *work) {
+    int ret;
+
+    while (!solenoid_wait_ready(msecs_to_jiffies(100))) {
+        if (READ_ONCE(unloading)) {
+            return;
+        }
+    }
+    ret = initialize_solenoid(lock_index);
+    if (ret) {
+        printk(KERN_ALERT "Failed to initialize solenoid lock %u: %d\n", lock_index, ret);
+        return;
+    }
+    smp_store_release(&lock_ready, true);
+    complete_all(&lock_claimed);
+    printk(KERN_INFO "Lock ready %lld ms after boot\n", ktime_to_ms(ktime_get_boottime()));
+}
+
+/**
+ * @brief Wait until decisions can drive the lock
+ * @return false if the thread was stopped first
+*/
+static bool wait_for_lock(void) {
+    while (!wait_for_completion_timeout(&lock_claimed, msecs_to_jiffies(100))) {
+        if (kthread_should_stop()) {
+            return false;
+        }
+    }
+    return true;
 }
 
+static int nfc_poll_thread(void *data) {
+    struct reader_slot *slot = data;
+    struct nfc_scan scan;
+    u64 start, elapsed;
+    ktime_t expires, now;
+
+    if (!wait_for_lock()) {
+        // Nothing to drive; stay around until the module is unloaded
+        while (!kthread_should_stop()) {
+            schedule_timeout_interruptible(HZ);
+        }
+        return 0;
+    }
+
+    while (!kthread_should_stop()) {
+        start = ktime_get_ns();
+        memset(&scan, 0, sizeof(scan));
+        if (slot->reader->scan(slot->reader, &scan) == 0) {
+            elapsed = ktime_get_ns() - start;
+            if (scan.wake_ns) {
+                update_cost(&slot->wake_cost_ns, scan.wake_ns);
+            }
+            update_cost(&slot->scan_cost_ns, elapsed - min(elapsed, scan.wake_ns));
+            fusion_submit(slot, &scan);
+        }
+        deadline_account(slot, start);
+
+        // An hrtimer rather than jiffies: at SCHED_FIFO the thread runs as soon as it expires
+        slot->poll_sleep_ns = poll_interval_ns(slot);
+        expires = ktime_add_ns(ktime_get(), slot->poll_sleep_ns);
+        set_current_state(TASK_INTERRUPTIBLE);
+        if (!kthread_should_stop()) {
+            schedule_hrtimeout(&expires, HRTIMER_MODE_ABS);
+        }
+        __set_current_state(TASK_RUNNING);
+        now = ktime_get();
+        if (ktime_after(now, expires)) {
+            lat_hist_record(&deadline.wake_late, ktime_to_ns(ktime_sub(now, expires)));
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Start the poll thread of a reader
+ *
+ * Slot i runs on the i-th CPU of poll_cpus (or near the reader's node), so
+ * readers on separate buses scan in parallel instead of taking turns on one
+ * CPU, at rt_priority. The scheduler still moves a thread if its CPU goes
+ * offline.
+*/
+static int reader_slot_start(struct reader_slot *slot, struct nfc_reader *reader) {
+    struct task_struct *task;
+    int index = slot - fusion.slots;
+
+    slot->done = 0;
+    slot->wake_cost_ns = 0;
+    slot->scan_cost_ns = 0;
+    slot->last_start_ns = 0;
+    atomic64_set(&slot->misses, 0);
+    WRITE_ONCE(slot->reader, reader); // Before the thread runs; fusion_merge() skips it until done is set
+    task = kthread_create(nfc_poll_thread, slot, "nfc_poll/%s", reader->name);
+    if (IS_ERR(task)) {
+        WRITE_ONCE(slot->reader, NULL);
+        return PTR_ERR(task);
+    }
+    thread_sched(task, cpumask_of(slot_cpu(index)));
+    slot->task = task;
+    wake_up_process(task);
+    return 0;
+}
+
+static void reader_slot_stop(struct reader_slot *slot) {
+    kthread_stop(slot->task); // Waits for a pass in progress
+    slot->task = NULL;
+    WRITE_ONCE(slot->reader, NULL);
+}
+
+/**
+ * @brief Have the controller poll a reader and merge its cards with the other readers'
+ *
+ * The reader gets its own poll thread, so all buses are busy at the same
+ * time and a token on any antenna counts towards the policy.
+ * @return 0, or -EBUSY if every reader slot is taken
+*/
+int nfc_reader_register(struct nfc_reader *reader) {
+    int i, ret = -EBUSY;
+
+    mutex_lock(&fusion.lock);
+    for (i = 0; i < NFC_MAX_READERS; i++) {
+        if (!fusion.slots[i].reader) {
+            ret = reader_slot_start(&fusion.slots[i], reader);
+            break;
+        }
+    }
+    mutex_unlock(&fusion.lock);
+    if (!ret) {
+        printk(KERN_INFO "Polling reader %s in slot %d on CPU %d\n", reader->name, i,
+               slot_cpu(i));
+    }
+    return ret;
+}
+EXPORT_SYMBOL_GPL(nfc_reader_register);
+
+/**
+ * @brief Stop polling a reader; returns once its last pass has finished
+*/
+void nfc_reader_unregister(struct nfc_reader *reader) {
+    int i;
+
+    mutex_lock(&fusion.lock);
+    for (i = 0; i < NFC_MAX_READERS; i++) {
+        if (fusion.slots[i].reader == reader) {
+            reader_slot_stop(&fusion.slots[i]);
+        }
+    }
+    mutex_unlock(&fusion.lock);
+    fusion_decide(); // Its cards no longer count
+}
+EXPORT_SYMBOL_GPL(nfc_reader_unregister);
+
 // Example of an interrupt handler for NFC detection
 // This is a placeholder and needs to be adapted based on actual hardware specs
 irqreturn_t nfc_irq_handler(int irq, void *dev_id) {
-    static unsigned long last_jiffies = 0;
+    struct reader_slot *slot = dev_id; // Slot of the reader raising it; free the IRQ before it unregisters
 
-    // Debounce handling (200 ms)
-    if (time_before(jiffies, last_jiffies + msecs_to_jiffies(200))) {
-        return IRQ_HANDLED;
-    }
-    last_jiffies = jiffies;
-
-    // Example token processing logic
-    read_nfc_data();  // This function would update `tokens_detected` array
-    check_token_proximity();
+    // No debounce here: the presence state machine absorbs a token flickering in and out of the field
+    // Example token processing logic: the reader's poll thread runs its next pass now instead of after its sleep
+    wake_up_process(slot->task);
 
     return IRQ_HANDLED;
 }
 
 module_init(init_controller_module);
 module_exit(cleanup_controller_module);
-
-
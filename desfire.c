@@ -0,0 +1,395 @@
+/**
+ * @file desfire.c
+ * @brief DESFire AES authentication and ReadData with EV1 secure messaging
+ *
+ * After AuthenticateEV1 (AES) every command is CMACed into the IV, and
+ * answers carry an 8 byte CMAC (plain and MACed files) or come encrypted with
+ * a CRC32 (enciphered files), all chained through the same IV. Long answers
+ * arrive as several native frames, each asked for with an additional frame
+ * command; the T=CL layer underneath may split each of those again into
+ * blocks of FSD bytes.
+*/
+
+#include "desfire.h"
+
+#ifdef __KERNEL__
+#include <linux/module.h>
+#else
+#define EXPORT_SYMBOL_GPL(sym)
+#define memzero_explicit(p, n) memset(p, 0, n)
+#endif
+
+#define DESFIRE_FRAME_MAX  MFRC522_FIFO_SIZE // Status plus data of one native frame
+#define DESFIRE_CMAC_TAG   8                 // EV1 sends the first 8 bytes of the CMAC
+
+void desfire_init(struct desfire *df, struct mfrc522_dev *dev, struct mfrc522_tcl *tcl,
+                  const struct desfire_crypto_ops *ops, void *priv)
+{
+    memset(df, 0, sizeof(*df));
+    df->dev = dev;
+    df->tcl = tcl;
+    df->ops = ops;
+    df->priv = priv;
+}
+EXPORT_SYMBOL_GPL(desfire_init);
+
+static int desfire_status(u8 status)
+{
+    switch (status) {
+    case DESFIRE_OK:
+        return 0;
+    case 0xAE: // Authentication error
+    case 0x9D: // Permission denied
+        return -EACCES;
+    case 0xA0: // Application not found
+    case 0xF0: // File not found
+        return -ENOENT;
+    case 0xBE: // Boundary error
+        return -ERANGE;
+    case 0x1E: // Integrity error
+        return -EBADMSG;
+    case 0x1C: // Illegal command code
+        return -EOPNOTSUPP;
+    default:
+        return -EIO;
+    }
+}
+
+/**
+ * @brief Exchange one native frame; the status byte goes to *status, the rest to data
+*/
+static int desfire_frame(struct desfire *df, const u8 *cmd, unsigned int cmd_len, u8 *status,
+                         u8 *data, unsigned int cap, unsigned int *len)
+{
+    u8 rx[DESFIRE_FRAME_MAX];
+    unsigned int n = sizeof(rx);
+    int ret;
+
+    ret = mfrc522_tcl_exchange(df->dev, df->tcl, cmd, cmd_len, rx, &n);
+    if (ret)
+        return ret;
+    df->frames++;
+    if (!n)
+        return -EPROTO;
+    if (n - 1 > cap)
+        return -ENOBUFS;
+    *status = rx[0];
+    memcpy(data, rx + 1, n - 1);
+    *len = n - 1;
+    return 0;
+}
+
+/**
+ * @brief Run a command whose answer may span several frames, concatenating their data
+*/
+static int desfire_command(struct desfire *df, const u8 *cmd, unsigned int cmd_len,
+                           u8 *data, unsigned int cap, unsigned int *len)
+{
+    static const u8 more = DESFIRE_ADDITIONAL_FRAME;
+    unsigned int got = 0, n;
+    u8 status;
+    int ret;
+
+    ret = desfire_frame(df, cmd, cmd_len, &status, data, cap, &n);
+    while (!ret) {
+        got += n;
+        if (status != DESFIRE_ADDITIONAL_FRAME)
+            break;
+        ret = desfire_frame(df, &more, 1, &status, data + got, cap - got, &n);
+    }
+    if (!ret)
+        ret = desfire_status(status);
+    if (ret)
+        df->authenticated = false; // The card drops the session on any error
+    *len = got;
+    return ret;
+}
+
+/**
+ * @brief Select an application by AID; this ends any authentication
+*/
+int desfire_select_application(struct desfire *df, u32 aid)
+{
+    u8 cmd[4] = { DESFIRE_CMD_SELECT_APP, aid & 0xFF, (aid >> 8) & 0xFF, (aid >> 16) & 0xFF };
+    unsigned int n;
+
+    df->authenticated = false;
+    return desfire_command(df, cmd, sizeof(cmd), NULL, 0, &n);
+}
+EXPORT_SYMBOL_GPL(desfire_select_application);
+
+static void desfire_xor(u8 *dst, const u8 *src)
+{
+    unsigned int i;
+
+    for (i = 0; i < DESFIRE_AES_BLOCK; i++)
+        dst[i] ^= src[i];
+}
+
+static int desfire_cbc_encrypt(struct desfire *df, bool session, u8 *iv, u8 *buf, unsigned int len)
+{
+    unsigned int off;
+    int ret;
+
+    for (off = 0; off < len; off += DESFIRE_AES_BLOCK) {
+        desfire_xor(buf + off, iv);
+        ret = df->ops->encrypt(df->priv, session, buf + off);
+        if (ret)
+            return ret;
+        memcpy(iv, buf + off, DESFIRE_AES_BLOCK);
+    }
+    return 0;
+}
+
+static int desfire_cbc_decrypt(struct desfire *df, bool session, u8 *iv, u8 *buf, unsigned int len)
+{
+    u8 next[DESFIRE_AES_BLOCK];
+    unsigned int off;
+    int ret;
+
+    for (off = 0; off < len; off += DESFIRE_AES_BLOCK) {
+        memcpy(next, buf + off, DESFIRE_AES_BLOCK);
+        ret = df->ops->decrypt(df->priv, session, buf + off);
+        if (ret)
+            return ret;
+        desfire_xor(buf + off, iv);
+        memcpy(iv, next, DESFIRE_AES_BLOCK);
+    }
+    return 0;
+}
+
+// Shift a block left by one bit, for the CMAC subkeys
+static void desfire_shift_left(u8 *out, const u8 *in)
+{
+    unsigned int i;
+
+    for (i = 0; i < DESFIRE_AES_BLOCK - 1; i++)
+        out[i] = (in[i] << 1) | (in[i + 1] >> 7);
+    out[DESFIRE_AES_BLOCK - 1] = in[DESFIRE_AES_BLOCK - 1] << 1;
+}
+
+// NIST SP 800-38B subkeys: L = AES(Ks, 0), K1 = L << 1, K2 = K1 << 1, each reduced by 87h
+int desfire_cmac_subkeys(struct desfire *df)
+{
+    u8 l[DESFIRE_AES_BLOCK] = {0};
+    int ret;
+
+    ret = df->ops->encrypt(df->priv, true, l);
+    if (ret)
+        return ret;
+    desfire_shift_left(df->k1, l);
+    if (l[0] & 0x80)
+        df->k1[DESFIRE_AES_BLOCK - 1] ^= 0x87;
+    desfire_shift_left(df->k2, df->k1);
+    if (df->k1[0] & 0x80)
+        df->k2[DESFIRE_AES_BLOCK - 1] ^= 0x87;
+    memzero_explicit(l, sizeof(l));
+    return 0;
+}
+
+/**
+ * @brief CMAC with the session key, chained from df->iv instead of zero; df->iv becomes the CMAC
+*/
+int desfire_cmac(struct desfire *df, const u8 *msg, unsigned int len, u8 *mac)
+{
+    unsigned int full = len ? (len - 1) / DESFIRE_AES_BLOCK : 0, rest = len - full * DESFIRE_AES_BLOCK;
+    u8 last[DESFIRE_AES_BLOCK] = {0};
+    unsigned int i;
+    int ret;
+
+    for (i = 0; i < full; i++) {
+        desfire_xor(df->iv, msg + i * DESFIRE_AES_BLOCK);
+        ret = df->ops->encrypt(df->priv, true, df->iv);
+        if (ret)
+            return ret;
+    }
+    memcpy(last, msg + full * DESFIRE_AES_BLOCK, rest);
+    if (rest == DESFIRE_AES_BLOCK) {
+        desfire_xor(last, df->k1);
+    } else {
+        last[rest] = 0x80;
+        desfire_xor(last, df->k2);
+    }
+    desfire_xor(df->iv, last);
+    ret = df->ops->encrypt(df->priv, true, df->iv);
+    if (ret)
+        return ret;
+    memcpy(mac, df->iv, DESFIRE_AES_BLOCK);
+    return 0;
+}
+
+// Compare without an early exit, so the time taken does not tell how much of a MAC was right
+static bool desfire_memneq(const u8 *a, const u8 *b, unsigned int len)
+{
+    u8 diff = 0;
+
+    while (len--)
+        diff |= *a++ ^ *b++;
+    return diff != 0;
+}
+
+// DESFire CRC32: the IEEE 802.3 polynomial, preset FFFFFFFFh, no final inversion
+static u32 desfire_crc32(const u8 *data, unsigned int len, u32 crc)
+{
+    unsigned int bit;
+
+    while (len--) {
+        crc ^= *data++;
+        for (bit = 0; bit < 8; bit++)
+            crc = crc & 1 ? (crc >> 1) ^ 0xEDB88320 : crc >> 1;
+    }
+    return crc;
+}
+
+// RndA' / RndB': rotated left by one byte
+static void desfire_rotate(u8 *out, const u8 *in)
+{
+    memcpy(out, in + 1, DESFIRE_AES_BLOCK - 1);
+    out[DESFIRE_AES_BLOCK - 1] = in[0];
+}
+
+/**
+ * @brief AuthenticateEV1 with the AES key key_no of the selected application
+ *
+ * Proves both sides hold the key the glue's contexts were set up with and
+ * derives the session key from the two random numbers.
+*/
+int desfire_authenticate_aes(struct desfire *df, u8 key_no)
+{
+    u8 cmd[1 + 2 * DESFIRE_AES_BLOCK], rnd_a[DESFIRE_AES_BLOCK], rnd_b[DESFIRE_AES_BLOCK];
+    u8 answer[DESFIRE_AES_BLOCK], iv[DESFIRE_AES_BLOCK] = {0}, session[DESFIRE_AES_BLOCK];
+    unsigned int n;
+    u8 status;
+    int ret;
+
+    if (!df->ops)
+        return -EOPNOTSUPP;
+    df->authenticated = false;
+
+    // The card sends RndB encrypted with the key
+    cmd[0] = DESFIRE_CMD_AUTH_AES;
+    cmd[1] = key_no;
+    ret = desfire_frame(df, cmd, 2, &status, rnd_b, sizeof(rnd_b), &n);
+    if (ret)
+        return ret;
+    if (status != DESFIRE_ADDITIONAL_FRAME)
+        return desfire_status(status) ? : -EPROTO;
+    if (n != DESFIRE_AES_BLOCK)
+        return -EPROTO;
+    ret = desfire_cbc_decrypt(df, false, iv, rnd_b, sizeof(rnd_b));
+    if (ret)
+        goto out;
+
+    // Answer with E(RndA || RndB'), CBC chained on from the card's block
+    df->ops->random(df->priv, rnd_a, sizeof(rnd_a));
+    cmd[0] = DESFIRE_ADDITIONAL_FRAME;
+    memcpy(cmd + 1, rnd_a, DESFIRE_AES_BLOCK);
+    desfire_rotate(cmd + 1 + DESFIRE_AES_BLOCK, rnd_b);
+    ret = desfire_cbc_encrypt(df, false, iv, cmd + 1, 2 * DESFIRE_AES_BLOCK);
+    if (ret)
+        goto out;
+    ret = desfire_frame(df, cmd, sizeof(cmd), &status, answer, sizeof(answer), &n);
+    if (ret)
+        goto out;
+    ret = desfire_status(status);
+    if (!ret && n != DESFIRE_AES_BLOCK)
+        ret = -EPROTO;
+    if (ret)
+        goto out;
+
+    // The card proves it decrypted RndA by sending back E(RndA')
+    ret = desfire_cbc_decrypt(df, false, iv, answer, sizeof(answer));
+    if (ret)
+        goto out;
+    desfire_rotate(cmd, rnd_a);
+    if (desfire_memneq(answer, cmd, DESFIRE_AES_BLOCK)) {
+        ret = -EACCES;
+        goto out;
+    }
+
+    memcpy(session, rnd_a, 4);
+    memcpy(session + 4, rnd_b, 4);
+    memcpy(session + 8, rnd_a + 12, 4);
+    memcpy(session + 12, rnd_b + 12, 4);
+    ret = df->ops->set_session_key(df->priv, session);
+    if (!ret)
+        ret = desfire_cmac_subkeys(df);
+    if (!ret) {
+        memset(df->iv, 0, sizeof(df->iv));
+        df->authenticated = true;
+    }
+out:
+    memzero_explicit(rnd_a, sizeof(rnd_a));
+    memzero_explicit(rnd_b, sizeof(rnd_b));
+    memzero_explicit(session, sizeof(session));
+    memzero_explicit(cmd, sizeof(cmd));
+    return ret;
+}
+EXPORT_SYMBOL_GPL(desfire_authenticate_aes);
+
+/**
+ * @brief ReadData from a standard or backup data file of the selected application
+ * @param comm The file's communication setting; MACed and enciphered files need desfire_authenticate_aes() first
+ * @param data DESFIRE_READ_SPACE(len) bytes; the first len hold the file content on success
+*/
+int desfire_read_data(struct desfire *df, u8 file, u32 offset, u32 len, enum desfire_comm comm, u8 *data)
+{
+    u8 cmd[8] = { DESFIRE_CMD_READ_DATA, file, offset & 0xFF, (offset >> 8) & 0xFF, (offset >> 16) & 0xFF,
+                  len & 0xFF, (len >> 8) & 0xFF, (len >> 16) & 0xFF };
+    u8 mac[DESFIRE_AES_BLOCK], tag[DESFIRE_CMAC_TAG], status = DESFIRE_OK;
+    unsigned int n, expect, i;
+    u32 crc;
+    int ret;
+
+    if (!len || len > 0xFFFFFF - 8 || offset > 0xFFFFFF)
+        return -EINVAL; // Length 0 would mean "to the end of the file", whose size is not known here
+    if (comm != DESFIRE_COMM_PLAIN && !df->authenticated)
+        return -EACCES;
+
+    if (df->authenticated) {
+        ret = desfire_cmac(df, cmd, sizeof(cmd), mac);
+        if (ret)
+            return ret;
+    }
+    ret = desfire_command(df, cmd, sizeof(cmd), data, DESFIRE_READ_SPACE(len), &n);
+    if (ret)
+        return ret;
+
+    if (!df->authenticated)
+        expect = len;
+    else if (comm == DESFIRE_COMM_ENC)
+        expect = (len + 4 + DESFIRE_AES_BLOCK - 1) / DESFIRE_AES_BLOCK * DESFIRE_AES_BLOCK;
+    else
+        expect = len + DESFIRE_CMAC_TAG;
+    if (n != expect)
+        return -EPROTO;
+    if (!df->authenticated)
+        return 0;
+
+    if (comm == DESFIRE_COMM_ENC) {
+        // data || CRC32(data || status) || zero padding
+        ret = desfire_cbc_decrypt(df, true, df->iv, data, n);
+        if (ret)
+            return ret;
+        crc = desfire_crc32(&status, 1, desfire_crc32(data, len, 0xFFFFFFFF));
+        ret = data[len] != (crc & 0xFF) || data[len + 1] != ((crc >> 8) & 0xFF) ||
+              data[len + 2] != ((crc >> 16) & 0xFF) || data[len + 3] != crc >> 24;
+        for (i = len + 4; i < n; i++)
+            ret |= data[i];
+    } else {
+        // data || CMAC(data || status)
+        memcpy(tag, data + len, sizeof(tag));
+        data[len] = status;
+        ret = desfire_cmac(df, data, len + 1, mac);
+        if (ret)
+            return ret;
+        ret = desfire_memneq(mac, tag, sizeof(tag));
+    }
+    memset(data + len, 0, n - len);
+    if (ret) {
+        df->authenticated = false;
+        return -EBADMSG;
+    }
+    return 0;
+}
+EXPORT_SYMBOL_GPL(desfire_read_data);
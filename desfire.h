@@ -0,0 +1,71 @@
+/**
+ * @file desfire.h
+ * @brief MIFARE DESFire EV1/EV2 native commands over ISO 14443-4
+ *
+ * Like ndef.c this builds into the kernel module and into the host benchmark.
+ * AES itself is not done here: the glue passes single-block AES-128 through
+ * struct desfire_crypto_ops (the kernel's "aes" cipher in the driver), and
+ * this file builds CBC, CMAC and the EV1 secure messaging on top of it.
+ * Only AES keys are supported.
+*/
+
+#ifndef DESFIRE_H
+#define DESFIRE_H
+
+#include "mfrc522.h"
+
+#define DESFIRE_CMD_AUTH_AES     0xAA
+#define DESFIRE_CMD_SELECT_APP   0x5A
+#define DESFIRE_CMD_READ_DATA    0xBD
+#define DESFIRE_ADDITIONAL_FRAME 0xAF // Command and status: more frames follow
+#define DESFIRE_OK               0x00
+
+#define DESFIRE_AES_BLOCK        16
+#define DESFIRE_NO_AUTH          0xFF // Key number for reading free-access files without authenticating
+
+// File communication settings
+enum desfire_comm {
+    DESFIRE_COMM_PLAIN = 0x00,
+    DESFIRE_COMM_MAC   = 0x01,
+    DESFIRE_COMM_ENC   = 0x03,
+};
+
+// Room desfire_read_data() needs for len bytes: the CMAC or CRC32 and padding arrive in the same buffer
+#define DESFIRE_READ_SPACE(len) (((len) + 8 + DESFIRE_AES_BLOCK - 1) / DESFIRE_AES_BLOCK * DESFIRE_AES_BLOCK)
+
+/**
+ * @brief AES-128 provided by the glue, one block in place
+ *
+ * session selects the key set by set_session_key() after authentication,
+ * otherwise the card key the contexts were set up with is used.
+*/
+struct desfire_crypto_ops {
+    int (*encrypt)(void *priv, bool session, u8 *block);
+    int (*decrypt)(void *priv, bool session, u8 *block);
+    int (*set_session_key)(void *priv, const u8 *key);
+    void (*random)(void *priv, u8 *buf, unsigned int len);
+};
+
+struct desfire {
+    struct mfrc522_dev *dev;
+    struct mfrc522_tcl *tcl;
+    const struct desfire_crypto_ops *ops; // NULL: plain, unauthenticated access only
+    void *priv;
+    bool authenticated;
+    u8 iv[DESFIRE_AES_BLOCK];   // EV1 secure messaging IV, moved on by every command and answer
+    u8 k1[DESFIRE_AES_BLOCK];   // CMAC subkeys of the session key
+    u8 k2[DESFIRE_AES_BLOCK];
+    unsigned int frames;        // Native frames exchanged, additional frames included
+};
+
+void desfire_init(struct desfire *df, struct mfrc522_dev *dev, struct mfrc522_tcl *tcl,
+                  const struct desfire_crypto_ops *ops, void *priv);
+int desfire_select_application(struct desfire *df, u32 aid);
+int desfire_authenticate_aes(struct desfire *df, u8 key_no);
+int desfire_read_data(struct desfire *df, u8 file, u32 offset, u32 len, enum desfire_comm comm, u8 *data);
+
+// CMAC with the session key, public for the known-answer checks of the host benchmark
+int desfire_cmac_subkeys(struct desfire *df);
+int desfire_cmac(struct desfire *df, const u8 *msg, unsigned int len, u8 *mac);
+
+#endif // DESFIRE_H
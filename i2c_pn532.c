@@ -11,6 +11,13 @@
 #include <linux/kernel.h>
 #include <linux/gpio.h>
 #include <linux/fs.h>
+#include <linux/debugfs.h>
+#include <linux/mutex.h>
+#include <linux/ktime.h>
+#include <linux/of.h>
+#include <linux/gpio/consumer.h>
+#include "nfc_bus_stats.h"
+#include "nfc_reader.h"
 
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Alex & Alfonso");
@@ -18,39 +25,65 @@ MODULE_DESCRIPTION("A simple Linux kernel module for interacting with the PN532
 
 static const bool DEBUG = true;
 
-#define I2C_BUS_AVAILABLE   ( 2        )            // I2C Bus
-                                                    //* must be 2 since i2cdetect fails when reset is high but succeeds when reset is low                             
+// Bus, address and reset GPIO come from the device tree, see nfc-lock-overlay.dts
 #define SLAVE_DEVICE_NAME   ( "pn532"  )            // Device and Driver Name
 #define PN532_SLAVE_ADDR    ( 0x24     )            // PN532 NFC Tag Reader/Writer Slave Address
                                                     //* must be 0x24 since i2cget fails when reset is high but succeeds when reset is low
 
-#define GPIO_RST 20
-#define GPIO_IRQ 44
-
-static int major = 61;
-static struct file_operations fops;
-
-static struct i2c_client *pn532_client;
-static struct i2c_adapter *pn532_adapter;
+// Normal information frame: 00 00 FF LEN LCS TFI DATA... DCS 00 (user manual section 6.2.1.1)
+#define PN532_HOSTTOPN532   0xD4
+#define PN532_PN532TOHOST   0xD5
+#define PN532_I2C_READY     0x01    // Status byte leading every read once the PN532 has something to send
+#define PN532_FRAME_MAX     64      // Data bytes of the longest answer we ask for
+#define PN532_ACK_TIMEOUT_MS    10
+#define PN532_CMD_TIMEOUT_MS    100 // One activation attempt at 106 kbit/s, two targets
+
+#define PN532_CMD_GETFIRMWAREVERSION    0x02
+#define PN532_CMD_SAMCONFIGURATION      0x14
+#define PN532_CMD_READREGISTER          0x06
+#define PN532_CMD_RFCONFIGURATION       0x32
+#define PN532_CMD_INLISTPASSIVETARGET   0x4A
+#define PN532_MAX_TARGETS               2   // InListPassiveTarget handles at most two at once
+#define PN532_RESET_AFTER               3   // Failed poll passes in a row before pulsing the reset line
+
+// 80C51 special function registers, at 0xFF00 + the SFR address for ReadRegister (user manual 7.2.4)
+#define PN532_SFR_BASE      0xFF80
+#define PN532_SFR_COUNT     128
+#define PN532_READREG_MAX   ((PN532_FRAME_MAX - 1) / 2) // Addresses per ReadRegister command
+
+static struct nfc_bus_stats __percpu *bus_stats; // Per-CPU, summed by debugfs
+static struct dentry *debugfs_dir;
+
+// Polled by the controller alongside the MFRC522
+static struct {
+    struct nfc_reader reader;
+    struct i2c_client *client;
+    struct gpio_desc *reset;        // NULL when the device tree has no reset-gpios
+    unsigned int failures;          // Failed poll passes in a row, under lock
+    struct mutex lock;      // One command exchange at a time: the poll thread and the register dump
+} pn532 = {
+    .lock = __MUTEX_INITIALIZER(pn532.lock),
+};
 
 static int pn532_probe(struct i2c_client *client, const struct i2c_device_id *id);
 static int pn532_remove(struct i2c_client *client);
 static int pn532_setup(struct i2c_client *client);
 static int pn532_Write(struct i2c_client *client, unsigned char *buf, unsigned int len);
-static int pn532_Read(struct i2c_client *client, unsigned char *out_buf, unsigned int len);
+static int pn532_Read(struct i2c_client *client, unsigned char *out_buf, unsigned int len, unsigned int timeout_ms);
+static int pn532_send(struct i2c_client *client, const unsigned char *buf, unsigned int len);
+static int pn532_recv(struct i2c_client *client, unsigned char *buf, unsigned int len);
+static int pn532_command(struct i2c_client *client, unsigned char *cmd, unsigned int cmd_len,
+                         unsigned char *resp, unsigned int resp_len, unsigned int timeout_ms);
+static int pn532_scan(struct nfc_reader *reader, struct nfc_scan *scan);
 static int pn532_self_test(struct i2c_client *client);
 static int pn532_get_version(struct i2c_client *client);
 //static int pn532_send_command(struct i2c_client *client, const u8 *command, size_t command_len);
 //static int pn532_read_response(struct i2c_client *client, u8 *response, size_t response_len);
 
-static int hard_reset(void);
-
-static int __init pn532_driver_init(void);
-static void __exit pn532_driver_exit(void);
-
-static struct i2c_board_info info = {
-        I2C_BOARD_INFO("pn532", PN532_SLAVE_ADDR)
-};
+static int hard_reset(struct gpio_desc *reset);
+static const struct file_operations bus_stats_fops;
+static const struct file_operations registers_fops;
+static const struct file_operations registers_bin_fops;
 
 static const struct i2c_device_id pn532_id[] = {
     { SLAVE_DEVICE_NAME, 0 },
@@ -58,10 +91,19 @@ static const struct i2c_device_id pn532_id[] = {
 };
 MODULE_DEVICE_TABLE(i2c, pn532_id);
 
+// Not "nxp,pn532": that one belongs to the in-tree pn533 driver
+static const struct of_device_id pn532_of_match[] = {
+    { .compatible = "ec535,pn532" },
+    { }
+};
+MODULE_DEVICE_TABLE(of, pn532_of_match);
+
 static struct i2c_driver pn532_driver = {
     .driver = {
         .name = SLAVE_DEVICE_NAME,
         .owner = THIS_MODULE,
+        .of_match_table = pn532_of_match,
+        .probe_type = PROBE_PREFER_ASYNCHRONOUS,
     },
     .probe = pn532_probe,
     .remove = pn532_remove,
@@ -113,9 +155,7 @@ static struct i2c_driver pn532_driver = {
 
 static int pn532_probe(struct i2c_client *client, const struct i2c_device_id *id) {
     
-    int err;
     int result;
-    char slave_addr_reg = 0xdb;
 
     if (client == NULL) {
         printk(KERN_WARNING "PN532 probe: client is NULL\n");
@@ -126,165 +166,467 @@ static int pn532_probe(struct i2c_client *client, const struct i2c_device_id *id
 
     printk(KERN_INFO "PN532 (%s) Probed at I2C address 0x%02x on adapter %d\n", client->name, client->addr, client->adapter->nr);
 
-    // Initialize the PN532
-    // result = pn532_setup(client);
-    // if (result < 0) {
-    //     printk(KERN_ERR "PN532 setup failed\n");
-    //     return result;
-    // } else if (DEBUG) {
-    //     printk(KERN_INFO "PN532 setup successful\n");
-    // }
+    // Not pulsed at probe (see hard_reset.sh); pn532_scan() uses it when the chip stops answering
+    pn532.reset = devm_gpiod_get_optional(&client->dev, "reset", GPIOD_OUT_LOW);
+    if (IS_ERR(pn532.reset))
+        return PTR_ERR(pn532.reset);
 
-    // Get the PN532 firmware version
-    result = pn532_Read(client, &slave_addr_reg, 1);
-    printk(KERN_INFO "PN532 Slave Address: 0x%02x\n", slave_addr_reg);
+    bus_stats = nfc_bus_stats_alloc();
+    if (!bus_stats)
+        return -ENOMEM;
+
+    debugfs_dir = debugfs_create_dir("pn532", NULL);
+    debugfs_create_file("bus_stats", 0644, debugfs_dir, NULL, &bus_stats_fops);
+
+    // Initialize the PN532
+    result = pn532_setup(client);
+    if (result < 0) {
+        printk(KERN_ERR "PN532 setup failed: %d\n", result);
+        goto err;
+    }
 
-    //printk(KERN_INFO "MFRC522 test read/write successful, data: 0x%02x\n", err);
+    // The controller polls it on its own thread, in parallel with the MFRC522
+    pn532.client = client;
+    pn532.reader.name = SLAVE_DEVICE_NAME;
+    pn532.reader.scan = pn532_scan;
+    debugfs_create_file("registers", 0444, debugfs_dir, NULL, &registers_fops);
+    debugfs_create_file("registers.bin", 0444, debugfs_dir, NULL, &registers_bin_fops);
+    result = nfc_reader_register(&pn532.reader);
+    if (result) {
+        printk(KERN_ERR "PN532: controller has no free reader slot: %d\n", result);
+        goto err;
+    }
 
     printk(KERN_INFO "PN532 device initialized successfully\n");
     return 0;
+
+err:
+    debugfs_remove_recursive(debugfs_dir);
+    free_percpu(bus_stats);
+    return result;
 }
 
 static int pn532_remove(struct i2c_client *client) {
-    // Free the adapter
-    kfree(client->adapter);
+    // The adapter belongs to the I2C core; only our own state goes
+    nfc_reader_unregister(&pn532.reader); // Waits for a pass in progress
+    debugfs_remove_recursive(debugfs_dir);
+    free_percpu(bus_stats);
 
     printk(KERN_INFO "PN532 (%s) Removed\n", client->name);
     return 0;
 }
 
+/**
+ * @brief Check the firmware version and configure the PN532 for polling
+ *
+ * Run at probe and again after a pulse on the reset line, which puts every
+ * setting back to its power-on value.
+*/
+static int pn532_setup(struct i2c_client *client) {
+    // Normal mode, no virtual card timeout, no IRQ line; one passive activation attempt per InListPassiveTarget
+    unsigned char sam_config[] = { PN532_CMD_SAMCONFIGURATION, 0x01, 0x00, 0x00 };
+    unsigned char max_retries[] = { PN532_CMD_RFCONFIGURATION, 0x05, 0xff, 0x01, 0x01 };
+    unsigned char resp[2];
+    int result;
+
+    // Get the PN532 firmware version
+    result = pn532_get_version(client);
+    if (result >= 0)
+        result = pn532_command(client, sam_config, sizeof(sam_config), resp, sizeof(resp), PN532_CMD_TIMEOUT_MS);
+    if (result >= 0)
+        result = pn532_command(client, max_retries, sizeof(max_retries), resp, sizeof(resp), PN532_CMD_TIMEOUT_MS);
+    return result < 0 ? result : 0;
+}
+
+/**
+ * @brief Send a command as a normal information frame
+ * @param buf Command code followed by its parameters
+*/
 static int pn532_Write(struct i2c_client *client, unsigned char *buf, unsigned int len) {
-    // Write data to the PN532
+    unsigned char frame[PN532_FRAME_MAX + 8];
+    unsigned char sum = PN532_HOSTTOPN532;
+    unsigned int i;
     int result;
-    u8 general_Call = (PN532_SLAVE_ADDR << 1) | 0x01; // General Call address
 
-    /**
-     * First set PN532 to Slave Receiver mode (section 8.3.2.4)
-     * "To initiate the Slave receiver mode, I2CADR must be loaded with 
-     * the 7-bit Slave address to which the I2C interface will respond when addressed by a Master. 
-     * Also the least significant bit of I2CADR should be set to logic 1 if the interface should 
-     * respond to the general call address (00h)"
-    */ 
-    result = i2c_master_send(client, &general_Call, 1);
+    if (len > PN532_FRAME_MAX)
+        return -EMSGSIZE;
+
+    frame[0] = 0x00;                // Preamble
+    frame[1] = 0x00;                // Start code
+    frame[2] = 0xff;
+    frame[3] = len + 1;             // LEN counts TFI and data
+    frame[4] = -frame[3];           // LCS: LEN + LCS = 0
+    frame[5] = PN532_HOSTTOPN532;
+    for (i = 0; i < len; i++) {
+        frame[6 + i] = buf[i];
+        sum += buf[i];
+    }
+    frame[6 + len] = -sum;          // DCS: TFI + data + DCS = 0
+    frame[7 + len] = 0x00;          // Postamble
 
-    /**
-     * "The control register, I2CCON, should be initialized with ENS1 and AA set to logic 1
-     *  and STA, STO, and SI set to logic 0 in order to enter the Slave receiver mode. 
-     * Setting the AA bit will enable the logic to acknowledge its own Slave address 
-     * or the general call address and ENS1 will enable the interface."
-    */
+    result = pn532_send(client, frame, len + 8);
+    return result < 0 ? result : 0;
+}
 
+/**
+ * @brief Wait until the status byte says the PN532 has an answer ready
+*/
+static int pn532_wait_ready(struct i2c_client *client, unsigned int timeout_ms) {
+    unsigned long timeout = jiffies + msecs_to_jiffies(timeout_ms) + 1;
+    unsigned char status;
+    int result;
 
-    return 0;
+    for (;;) {
+        result = pn532_recv(client, &status, 1);
+        if (result < 0)
+            return result;
+        if (status & PN532_I2C_READY)
+            return 0;
+        if (time_after(jiffies, timeout))
+            return -ETIMEDOUT;
+        usleep_range(500, 1000);
+    }
 }
 
-static int pn532_Read(struct i2c_client *client, unsigned char *out_buf, unsigned int len) {
-    // Read data from the PN532
+/**
+ * @brief Read the answer to the last command
+ * @param out_buf Receives the data after TFI: the response code (command + 1) and its parameters
+ * @return Number of bytes stored in out_buf
+*/
+static int pn532_Read(struct i2c_client *client, unsigned char *out_buf, unsigned int len, unsigned int timeout_ms) {
+    unsigned char frame[1 + PN532_FRAME_MAX + 8];
+    unsigned char sum;
+    unsigned int n, i;
+    int result;
 
-    // First set PN532 to Slave Transmitter mode (section 8.3.2.5)
+    result = pn532_wait_ready(client, timeout_ms);
+    if (result)
+        return result;
 
+    // Every read restarts with the status byte; reading past the end of the frame is harmless
+    result = pn532_recv(client, frame, sizeof(frame));
+    if (result < 0)
+        return result;
 
+    if (frame[1] != 0x00 || frame[2] != 0x00 || frame[3] != 0xff || (u8)(frame[4] + frame[5]))
+        return -EBADMSG;
+    n = frame[4];
+    if (n == 1 && frame[6] == 0x7f)
+        return -EIO;                // Syntax error frame
+    if (n < 2 || n > PN532_FRAME_MAX || frame[6] != PN532_PN532TOHOST)
+        return -EBADMSG;
+    for (sum = 0, i = 0; i <= n; i++)
+        sum += frame[6 + i];        // TFI, data and DCS
+    if (sum)
+        return -EBADMSG;
+
+    n--;                            // Without TFI
+    if (n > len)
+        n = len;
+    memcpy(out_buf, frame + 7, n);
+    return n;
+}
 
-    return 0;
+static int pn532_send(struct i2c_client *client, const unsigned char *buf, unsigned int len) {
+    // i2c_master_send() plus the bus statistics
+    struct nfc_bus_stats *stats;
+    u64 start;
+    int result;
+
+    start = ktime_get_ns();
+    result = i2c_master_send(client, buf, len);
+
+    stats = nfc_bus_stats_begin(bus_stats);
+    stats->c.messages++;
+    stats->c.bytes_out += len;
+    stats->c.busy_ns += ktime_get_ns() - start;
+    if (result < 0)
+        stats->c.xfer_errors++;
+    nfc_bus_stats_end(bus_stats, stats);
+
+    return result;
 }
 
-static int hard_reset(void)
-{
-    // Reset the PN532 using the GPIO
+static int pn532_recv(struct i2c_client *client, unsigned char *buf, unsigned int len) {
+    // i2c_master_recv() plus the bus statistics
+    struct nfc_bus_stats *stats;
+    u64 start;
     int result;
 
-    if (DEBUG) { printk(KERN_INFO "Resetting the PN532.\n"); }
+    start = ktime_get_ns();
+    result = i2c_master_recv(client, buf, len);
 
-    // Set up the GPIO
-    result = gpio_request(GPIO_RST, "RST");  // Request the GPIO
-    if (result < 0) {
-        printk(KERN_WARNING "pn532: unable to request GPIO %d\n", GPIO_RST);
+    stats = nfc_bus_stats_begin(bus_stats);
+    stats->c.messages++;
+    stats->c.bytes_out++;           // Address byte
+    if (result > 0)
+        stats->c.bytes_in += result;
+    stats->c.busy_ns += ktime_get_ns() - start;
+    if (result < 0)
+        stats->c.xfer_errors++;
+    nfc_bus_stats_end(bus_stats, stats);
+
+    return result;
+}
+
+/**
+ * @brief Send a command, take its ACK frame and read the answer
+ * @return Bytes of the answer after the response code, or a negative errno
+*/
+static int pn532_command(struct i2c_client *client, unsigned char *cmd, unsigned int cmd_len,
+                         unsigned char *resp, unsigned int resp_len, unsigned int timeout_ms) {
+    static const unsigned char ack[] = { 0x00, 0x00, 0xff, 0x00, 0xff, 0x00 };
+    unsigned char frame[1 + sizeof(ack)];
+    int result;
+
+    result = pn532_Write(client, cmd, cmd_len);
+    if (result)
         return result;
-    } else if (DEBUG) {
-        printk(KERN_INFO "pn532: requested GPIO %d\n", GPIO_RST);
-    }
-    result = gpio_direction_output(GPIO_RST, 1); // Set the GPIO as an output
-    if (result < 0) {
-        printk(KERN_WARNING "pn532: unable to set GPIO %d as output\n", GPIO_RST);
+
+    result = pn532_wait_ready(client, PN532_ACK_TIMEOUT_MS);
+    if (!result)
+        result = pn532_recv(client, frame, sizeof(frame));
+    if (result < 0)
         return result;
-    } else if (DEBUG) {
-        printk(KERN_INFO "pn532: set GPIO %d as output\n", GPIO_RST);
-    }
+    if (memcmp(frame + 1, ack, sizeof(ack)))
+        return -EBADMSG;
 
-    // Reset the pn532
-    gpio_set_value(GPIO_RST, 0); // Set the GPIO low
+    result = pn532_Read(client, resp, resp_len, timeout_ms);
+    if (result < 0)
+        return result;
+    if (result < 1 || resp[0] != cmd[0] + 1)
+        return -EBADMSG;
+    return result - 1;
+}
 
-    // Wait for a short period
-    msleep(200); // Wait for 200 ms - cannot find on the datasheet so leaving low for a long period
+/**
+ * @brief Pulse the reset line and configure the PN532 again, called with pn532.lock held
+*/
+static void pn532_recover(struct i2c_client *client) {
+    int result;
 
-    // Release the reset
-    gpio_set_value(GPIO_RST, 1);
+    pn532.failures = 0;
+    result = hard_reset(pn532.reset);
+    if (result)
+        return;                     // No reset line, keep polling and hope the bus comes back
+    msleep(10);                     // Oscillator start-up before the first I2C command
+    result = pn532_setup(client);
+    printk(KERN_WARNING "PN532: %d failed passes, reset: %d\n", PN532_RESET_AFTER, result);
+}
 
-    // Free the GPIO
-    gpio_free(GPIO_RST);
+/**
+ * @brief One inventory pass for the controller: list up to two ISO 14443A targets
+ *
+ * The PN532 runs REQA, anticollision and SELECT itself, so the UIDs arrive
+ * in a single answer. The field is dropped afterwards, which returns the
+ * cards to IDLE for the next pass; InListPassiveTarget switches it back on.
+ * PN532_RESET_AFTER failed passes in a row pulse the reset line.
+*/
+static int pn532_scan(struct nfc_reader *reader, struct nfc_scan *scan) {
+    unsigned char list[] = { PN532_CMD_INLISTPASSIVETARGET, PN532_MAX_TARGETS, 0x00 }; // 106 kbit/s type A
+    unsigned char field_off[] = { PN532_CMD_RFCONFIGURATION, 0x01, 0x00 };
+    unsigned char resp[PN532_FRAME_MAX];
+    struct i2c_client *client = pn532.client;
+    struct mfrc522_uid *uid;
+    unsigned int i, pos, targets;
+    int result;
 
+    memset(scan, 0, sizeof(*scan));
+    mutex_lock(&pn532.lock);
+    result = pn532_command(client, list, sizeof(list), resp, sizeof(resp), PN532_CMD_TIMEOUT_MS);
+    if (result < 1) {
+        if (++pn532.failures >= PN532_RESET_AFTER)
+            pn532_recover(client);
+        mutex_unlock(&pn532.lock);
+        return result < 0 ? result : -EBADMSG;
+    }
+    pn532.failures = 0;
+
+    // Tg, SENS_RES (2), SEL_RES, NFCIDLength, NFCID1, and ATS if the target speaks ISO 14443-4
+    targets = resp[1];
+    for (i = 0, pos = 2; i < targets && i < PN532_MAX_TARGETS && pos + 5 <= result + 1; i++) {
+        uid = &scan->uids[scan->count];
+        uid->sak = resp[pos + 3];
+        uid->size = resp[pos + 4];
+        pos += 5;
+        if (uid->size > sizeof(uid->bytes) || pos + uid->size > result + 1)
+            break;
+        memcpy(uid->bytes, resp + pos, uid->size);
+        pos += uid->size;
+        if ((uid->sak & 0x20) && pos < result + 1)
+            pos += resp[pos];       // ATS length counts itself
+        scan->count++;
+    }
+    if (scan->count)
+        scan->t_answer = scan->t_resolved = ktime_get(); // Resolved inside the PN532, no finer stamps
+
+    pn532_command(client, field_off, sizeof(field_off), resp, sizeof(resp), PN532_CMD_TIMEOUT_MS);
+    mutex_unlock(&pn532.lock);
     return 0;
 }
 
-static int pn532_get_version(struct i2c_client *client) {
-    uint8_t VersionReg[2] = {0x27, 0x63}; // Get Firmware Version command
-    uint8_t RegData = 0;
+/**
+ * @brief Read the whole SFR space with as few ReadRegister commands as fit in a frame
+ * @param regs PN532_SFR_COUNT bytes, SFR 0x80 first
+ *
+ * Holds pn532.lock throughout, so the dump never lands between the command
+ * and the answer of a poll pass, and the registers all come from the same
+ * idle moment between passes.
+*/
+static int pn532_snapshot(u8 *regs)
+{
+    unsigned char cmd[1 + 2 * PN532_READREG_MAX];
+    unsigned char resp[1 + PN532_READREG_MAX];
+    unsigned int done, n, i;
+    int result = 0;
+
+    cmd[0] = PN532_CMD_READREGISTER;
+    mutex_lock(&pn532.lock);
+    for (done = 0; done < PN532_SFR_COUNT; done += n) {
+        n = min_t(unsigned int, PN532_SFR_COUNT - done, PN532_READREG_MAX);
+        for (i = 0; i < n; i++) {
+            cmd[1 + 2 * i] = (PN532_SFR_BASE + done + i) >> 8;
+            cmd[2 + 2 * i] = (PN532_SFR_BASE + done + i) & 0xFF;
+        }
+        result = pn532_command(pn532.client, cmd, 1 + 2 * n, resp, 1 + n, PN532_CMD_TIMEOUT_MS);
+        if (result >= 0 && result != n)
+            result = -EBADMSG;
+        if (result < 0)
+            break;
+        memcpy(regs + done, resp + 1, n);
+    }
+    mutex_unlock(&pn532.lock);
+    return result < 0 ? result : 0;
+}
+
+// Names as in the PN532 user manual and libnfc; the rest are 80C51 SFRs the host has no use for
+static const char *const pn532_sfr_names[PN532_SFR_COUNT] = {
+    [0x87 - 0x80] = "PCON", [0x9A - 0x80] = "RWL", [0x9B - 0x80] = "TWL", [0x9C - 0x80] = "FIFOFS",
+    [0x9D - 0x80] = "FIFOFF", [0x9E - 0x80] = "SFF", [0x9F - 0x80] = "FIT", [0xA1 - 0x80] = "FITEN",
+    [0xA2 - 0x80] = "FDATA", [0xA3 - 0x80] = "FSIZE", [0xA8 - 0x80] = "IE0", [0xA9 - 0x80] = "SPIcontrol",
+    [0xAA - 0x80] = "SPIstatus", [0xAB - 0x80] = "HSU_STA", [0xAC - 0x80] = "HSU_CTR", [0xAD - 0x80] = "HSU_PRE",
+    [0xAE - 0x80] = "HSU_CNT", [0xB0 - 0x80] = "P3", [0xB8 - 0x80] = "IP0", [0xD1 - 0x80] = "CIU_COMMAND",
+    [0xE8 - 0x80] = "IEN1", [0xF4 - 0x80] = "P7CFGA", [0xF5 - 0x80] = "P7CFGB", [0xF7 - 0x80] = "P7",
+    [0xF8 - 0x80] = "IP1", [0xFC - 0x80] = "P3CFGA", [0xFD - 0x80] = "P3CFGB",
+};
+
+static int registers_show(struct seq_file *m, void *v)
+{
+    u8 regs[PN532_SFR_COUNT];
+    u64 start, end;
+    unsigned int i;
     int result;
 
-    result = pn532_Write(client, VersionReg, 2);
-    result = pn532_Read(client, &RegData, 1);
+    start = ktime_get_ns();
+    result = pn532_snapshot(regs);
+    end = ktime_get_ns();
+    if (result)
+        return result;
 
-    printk(KERN_INFO "PN532 Firmware Version: 0x%02x\n", RegData);
+    seq_printf(m, "# pn532 SFRs at %llu ns, read in %llu us\n", start, div_u64(end - start, 1000));
+    for (i = 0; i < PN532_SFR_COUNT; i++)
+        seq_printf(m, "0x%04x %-12s 0x%02x\n", PN532_SFR_BASE + i, pn532_sfr_names[i] ?: "", regs[i]);
+    return 0;
+}
 
-    return RegData;
+static int registers_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, registers_show, NULL);
 }
 
-static int __init pn532_driver_init(void) {
+static const struct file_operations registers_fops = {
+    .owner = THIS_MODULE,
+    .open = registers_open,
+    .read = seq_read,
+    .llseek = seq_lseek,
+    .release = single_release,
+};
+
+// The same snapshot as 128 raw bytes, SFR 0x80 (address 0xFF80) first
+static int registers_bin_show(struct seq_file *m, void *v)
+{
+    u8 regs[PN532_SFR_COUNT];
     int result;
 
-    printk(KERN_INFO "Initializing the PN532 module\n");
+    result = pn532_snapshot(regs);
+    if (result)
+        return result;
+    seq_write(m, regs, sizeof(regs));
+    return 0;
+}
 
-    // Register the I2C device
-    pn532_adapter = i2c_get_adapter(I2C_BUS_AVAILABLE);
-    if (!pn532_adapter) {
-        printk(KERN_WARNING "Cannot get the I2C adapter\n");
-        return -ENODEV;
-    } else if (DEBUG) {
-        printk(KERN_INFO "Got the I2C adapter\n");
-    }
+static int registers_bin_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, registers_bin_show, NULL);
+}
+
+static const struct file_operations registers_bin_fops = {
+    .owner = THIS_MODULE,
+    .open = registers_bin_open,
+    .read = seq_read,
+    .llseek = seq_lseek,
+    .release = single_release,
+};
 
-    // Create the I2C device
-    pn532_client = i2c_new_device(pn532_adapter, &info);
-    if (!pn532_client) {
-        i2c_put_adapter(pn532_adapter); // Release the adapter if the device cannot be created
-        printk(KERN_WARNING "Cannot register the I2C device\n");
+static int bus_stats_show(struct seq_file *m, void *v)
+{
+    nfc_bus_stats_seq_show(m, bus_stats);
+    return 0;
+}
+
+static int bus_stats_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, bus_stats_show, NULL);
+}
+
+// Any write resets the counters
+static ssize_t bus_stats_write(struct file *file, const char __user *buffer, size_t len, loff_t *offset)
+{
+    nfc_bus_stats_reset(bus_stats);
+    return len;
+}
+
+static const struct file_operations bus_stats_fops = {
+    .owner = THIS_MODULE,
+    .open = bus_stats_open,
+    .read = seq_read,
+    .write = bus_stats_write,
+    .llseek = seq_lseek,
+    .release = single_release,
+};
+
+static int hard_reset(struct gpio_desc *reset)
+{
+    // Reset the PN532 using the reset-gpios line of the device tree node (active low)
+    if (!reset)
         return -ENODEV;
-    } else if (DEBUG) {
-        printk(KERN_INFO "Registered the I2C device\n");
-    }
 
-    // Register the I2C driver
-    // result = i2c_add_driver(&pn532_driver);
-    // if (result < 0) {
-    //     printk(KERN_WARNING "Cannot register the PN532 driver\n");
-    //     return result;
-    // } else if (DEBUG) {
-    //     printk(KERN_INFO "Registered the PN532 driver\n");
-    // }
+    if (DEBUG) { printk(KERN_INFO "Resetting the PN532.\n"); }
+
+    // Reset the pn532
+    gpiod_set_value_cansleep(reset, 1); // Assert reset, the pin goes low
+
+    // Wait for a short period
+    msleep(200); // Wait for 200 ms - cannot find on the datasheet so leaving low for a long period
+
+    // Release the reset
+    gpiod_set_value_cansleep(reset, 0);
 
-    printk(KERN_INFO "PN532 device is initialized\n");
     return 0;
 }
 
-static void __exit pn532_driver_exit(void) {
-    if(pn532_client) {
-        i2c_unregister_device(pn532_client);
-        printk(KERN_INFO "PN532 device is unregistered\n");
-    }
-    if (pn532_adapter){
-        i2c_put_adapter(pn532_adapter);
-    }
+static int pn532_get_version(struct i2c_client *client) {
+    uint8_t VersionReg[1] = { PN532_CMD_GETFIRMWAREVERSION };
+    uint8_t RegData[5];   // Response code, IC (0x32), Ver, Rev, Support
+    int result;
+
+    result = pn532_command(client, VersionReg, sizeof(VersionReg), RegData, sizeof(RegData), PN532_CMD_TIMEOUT_MS);
+    if (result < 4)
+        return result < 0 ? result : -EBADMSG;
+
+    printk(KERN_INFO "PN5%02x Firmware Version: %d.%d\n", RegData[1], RegData[2], RegData[3]);
+
+    return RegData[2];
 }
 
-module_init(pn532_driver_init);
-module_exit(pn532_driver_exit);
\ No newline at end of file
+module_i2c_driver(pn532_driver);
@@ -0,0 +1,119 @@
+/**
+ * @file latency_hist.h
+ * @brief Log-scale latency histogram with percentile estimates
+ *
+ * Buckets are spaced four per power of two (each at most 25% wide) from 1 ns
+ * to about 68 s. Header-only so each module keeps its own histograms.
+*/
+
+#ifndef LATENCY_HIST_H
+#define LATENCY_HIST_H
+
+#include <linux/types.h>
+#include <linux/spinlock.h>
+#include <linux/bitops.h>
+#include <linux/seq_file.h>
+#include <linux/string.h>
+#include <linux/math64.h>
+
+#define LAT_HIST_SUB     4
+#define LAT_HIST_OCTAVES 36
+#define LAT_HIST_BUCKETS (LAT_HIST_OCTAVES * LAT_HIST_SUB)
+
+struct lat_hist {
+    raw_spinlock_t lock; // Raw so recording stays non-sleeping on PREEMPT_RT
+    u64 count;
+    u64 sum_ns;
+    u64 max_ns;
+    u32 buckets[LAT_HIST_BUCKETS];
+};
+
+static inline void lat_hist_init(struct lat_hist *h)
+{
+    memset(h, 0, sizeof(*h));
+    raw_spin_lock_init(&h->lock);
+}
+
+static inline unsigned int lat_hist_bucket(u64 ns)
+{
+    unsigned int msb, idx;
+
+    if (ns < LAT_HIST_SUB)
+        return ns;
+    msb = fls64(ns) - 1;
+    idx = msb * LAT_HIST_SUB + ((ns >> (msb - 2)) & (LAT_HIST_SUB - 1));
+    return min_t(unsigned int, idx, LAT_HIST_BUCKETS - 1);
+}
+
+// Largest value that falls into bucket idx
+static inline u64 lat_hist_upper(unsigned int idx)
+{
+    unsigned int msb = idx / LAT_HIST_SUB, sub = idx % LAT_HIST_SUB;
+
+    if (idx < 2 * LAT_HIST_SUB)
+        return idx;
+    return ((u64)(LAT_HIST_SUB + sub + 1) << (msb - 2)) - 1;
+}
+
+static inline void lat_hist_record(struct lat_hist *h, u64 ns)
+{
+    unsigned long flags;
+
+    raw_spin_lock_irqsave(&h->lock, flags);
+    h->count++;
+    h->sum_ns += ns;
+    if (ns > h->max_ns)
+        h->max_ns = ns;
+    h->buckets[lat_hist_bucket(ns)]++;
+    raw_spin_unlock_irqrestore(&h->lock, flags);
+}
+
+static inline void lat_hist_reset(struct lat_hist *h)
+{
+    unsigned long flags;
+
+    raw_spin_lock_irqsave(&h->lock, flags);
+    h->count = 0;
+    h->sum_ns = 0;
+    h->max_ns = 0;
+    memset(h->buckets, 0, sizeof(h->buckets));
+    raw_spin_unlock_irqrestore(&h->lock, flags);
+}
+
+// Upper bound of the bucket holding the pct-th percentile of a snapshot
+static inline u64 lat_hist_percentile(const struct lat_hist *h, unsigned int pct)
+{
+    u64 target = div_u64(h->count * pct + 99, 100), seen = 0;
+    unsigned int i;
+
+    if (!h->count)
+        return 0;
+    for (i = 0; i < LAT_HIST_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen >= target)
+            return min(lat_hist_upper(i), h->max_ns);
+    }
+    return h->max_ns;
+}
+
+static inline void lat_hist_seq_header(struct seq_file *m)
+{
+    seq_printf(m, "%-16s %10s %10s %10s %10s %10s\n", "stage", "count", "mean_us", "p50_us", "p99_us", "max_us");
+}
+
+static inline void lat_hist_seq_show(struct seq_file *m, const char *name, struct lat_hist *h)
+{
+    struct lat_hist snap;
+    unsigned long flags;
+
+    raw_spin_lock_irqsave(&h->lock, flags);
+    snap = *h;
+    raw_spin_unlock_irqrestore(&h->lock, flags);
+
+    seq_printf(m, "%-16s %10llu %10llu %10llu %10llu %10llu\n", name, snap.count,
+               snap.count ? div64_u64(snap.sum_ns, snap.count) / 1000 : 0,
+               lat_hist_percentile(&snap, 50) / 1000, lat_hist_percentile(&snap, 99) / 1000,
+               snap.max_ns / 1000);
+}
+
+#endif // LATENCY_HIST_H
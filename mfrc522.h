@@ -0,0 +1,399 @@
+/**
+ * @file mfrc522.h
+ * @brief MFRC522 register map and the bus-independent reader core
+ *
+ * The core (mfrc522_core.c) holds the protocol logic: register sequencing,
+ * ISO 14443A anticollision and MIFARE Classic read/write. It only talks to the
+ * chip through struct mfrc522_bus_ops, so the same code is linked into the SPI
+ * kernel driver and into the host simulator/benchmark (mfrc522_sim.c).
+*/
+
+#ifndef MFRC522_H
+#define MFRC522_H
+
+#ifdef __KERNEL__
+#include <linux/types.h>
+#include <linux/errno.h>
+#include <linux/string.h>
+#include <linux/kernel.h>
+#else
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+typedef uint8_t  u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+typedef uint64_t u64;
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+#endif
+
+// MFRC522 registers (datasheet section 9.2, names as in the datasheet)
+enum mfrc522_reg {
+    // Page 0: command and status
+    CommandReg      = 0x01,
+    ComIEnReg       = 0x02,
+    DivIEnReg       = 0x03,
+    ComIrqReg       = 0x04,
+    DivIrqReg       = 0x05,
+    ErrorReg        = 0x06,
+    Status1Reg      = 0x07,
+    Status2Reg      = 0x08,
+    FIFODataReg     = 0x09,
+    FIFOLevelReg    = 0x0A,
+    WaterLevelReg   = 0x0B,
+    ControlReg      = 0x0C,
+    BitFramingReg   = 0x0D,
+    CollReg         = 0x0E,
+    // Page 1: command
+    ModeReg         = 0x11,
+    TxModeReg       = 0x12,
+    RxModeReg       = 0x13,
+    TxControlReg    = 0x14,
+    TxASKReg        = 0x15,
+    TxSelReg        = 0x16,
+    RxSelReg        = 0x17,
+    RxThresholdReg  = 0x18,
+    DemodReg        = 0x19,
+    MfTxReg         = 0x1C,
+    MfRxReg         = 0x1D,
+    SerialSpeedReg  = 0x1F,
+    // Page 2: configuration
+    CRCResultRegH   = 0x21,
+    CRCResultRegL   = 0x22,
+    ModWidthReg     = 0x24,
+    RFCfgReg        = 0x26,
+    GsNReg          = 0x27,
+    CWGsPReg        = 0x28,
+    ModGsPReg       = 0x29,
+    TModeReg        = 0x2A,
+    TPrescalerReg   = 0x2B,
+    TReloadRegH     = 0x2C,
+    TReloadRegL     = 0x2D,
+    TCounterValRegH = 0x2E,
+    TCounterValRegL = 0x2F,
+    // Page 3: test
+    TestSel1Reg     = 0x31,
+    TestSel2Reg     = 0x32,
+    TestPinEnReg    = 0x33,
+    TestPinValueReg = 0x34,
+    TestBusReg      = 0x35,
+    AutoTestReg     = 0x36,
+    VersionReg      = 0x37,
+    AnalogTestReg   = 0x38,
+    TestDAC1Reg     = 0x39,
+    TestDAC2Reg     = 0x3A,
+    TestADCReg      = 0x3B,
+};
+
+#define MFRC522_NUM_REGS 0x40
+#define MFRC522_FIFO_SIZE 64
+
+// CommandReg commands (datasheet section 10.3)
+#define MFRC522_CMD_IDLE         0x00
+#define MFRC522_CMD_MEM          0x01
+#define MFRC522_CMD_GEN_RAND_ID  0x02
+#define MFRC522_CMD_CALC_CRC     0x03
+#define MFRC522_CMD_TRANSMIT     0x04
+#define MFRC522_CMD_NO_CHANGE    0x07
+#define MFRC522_CMD_RECEIVE      0x08
+#define MFRC522_CMD_TRANSCEIVE   0x0C
+#define MFRC522_CMD_MF_AUTHENT   0x0E
+#define MFRC522_CMD_SOFT_RESET   0x0F
+
+// Register bits used by the core
+#define MFRC522_POWER_DOWN       0x10 // CommandReg
+#define MFRC522_RCV_OFF          0x20 // CommandReg
+#define MFRC522_IRQ_TIMER        0x01 // ComIrqReg
+#define MFRC522_IRQ_ERR          0x02
+#define MFRC522_IRQ_LO_ALERT     0x04
+#define MFRC522_IRQ_HI_ALERT     0x08
+#define MFRC522_IRQ_IDLE         0x10
+#define MFRC522_IRQ_RX           0x20
+#define MFRC522_IRQ_TX           0x40
+#define MFRC522_IRQ_CRC          0x04 // DivIrqReg
+#define MFRC522_ERR_PROTOCOL     0x01 // ErrorReg
+#define MFRC522_ERR_PARITY       0x02
+#define MFRC522_ERR_CRC          0x04
+#define MFRC522_ERR_COLL         0x08
+#define MFRC522_ERR_BUFFER_OVFL  0x10
+#define MFRC522_ERR_TEMP         0x40
+#define MFRC522_ERR_WR           0x80
+#define MFRC522_COLL_POS_INVALID 0x20 // CollReg
+#define MFRC522_COLL_POS_MASK    0x1F
+#define MFRC522_VALUES_AFTER_COLL 0x80
+#define MFRC522_CRYPTO1_ON       0x08 // Status2Reg
+#define MFRC522_START_SEND       0x80 // BitFramingReg
+#define MFRC522_FLUSH_FIFO       0x80 // FIFOLevelReg
+#define MFRC522_CRC_EN           0x80 // TxModeReg / RxModeReg
+#define MFRC522_TX_ANTENNA       0x03 // TxControlReg Tx1RFEn | Tx2RFEn
+#define MFRC522_FORCE_100ASK     0x40 // TxASKReg
+#define MFRC522_RX_GAIN_MASK     0x70 // RFCfgReg, 18 dB (0) to 48 dB (7)
+#define MFRC522_RX_GAIN_SHIFT    4
+#define MFRC522_MOD_WIDTH_RESET  0x26 // ModWidthReg reset value
+#define MFRC522_MODE_CONFIG      0x3D // ModeReg as programmed by mfrc522_configure(); the reset value is 0x3F
+#define MFRC522_TAUTO            0x80 // TModeReg: the timer starts at the end of every transmission
+#define MFRC522_TPRESCALER_HI    0x0F // TModeReg TPrescaler[11:8]
+
+// PICC commands (ISO 14443-3 and MIFARE Classic)
+#define PICC_CMD_REQA            0x26
+#define PICC_CMD_WUPA            0x52
+#define PICC_CMD_CT              0x88 // Cascade tag
+#define PICC_CMD_SEL_CL1         0x93
+#define PICC_CMD_SEL_CL2         0x95
+#define PICC_CMD_SEL_CL3         0x97
+#define PICC_CMD_HLTA            0x50
+#define PICC_CMD_MF_AUTH_KEY_A   0x60
+#define PICC_CMD_MF_AUTH_KEY_B   0x61
+#define PICC_CMD_MF_READ         0x30
+#define PICC_CMD_MF_WRITE        0xA0
+#define PICC_MF_ACK              0x0A
+#define PICC_CMD_UL_WRITE        0xA2 // NTAG/Ultralight WRITE of one 4 byte page
+#define PICC_CMD_UL_FAST_READ    0x3A // NTAG21x FAST_READ of a page range
+#define PICC_CMD_UL_PWD_AUTH     0x1B // NTAG21x password authentication
+#define PICC_SAK_ULTRALIGHT      0x00 // NTAG21x and MIFARE Ultralight set no SAK bits
+#define PICC_SAK_CASCADE         0x04
+#define PICC_SAK_ISO14443_4      0x20 // SAK bit: the card speaks ISO 14443-4 (e.g. DESFire)
+#define PICC_CMD_RATS            0xE0 // Request for answer to select
+
+#define MFRC522_MAX_CARDS        4  // Cards tracked by one inventory pass
+#define MFRC522_MF_BLOCK_SIZE    16
+#define MFRC522_MF_KEY_SIZE      6
+#define MFRC522_UL_PAGE_SIZE     4
+#define MFRC522_UL_PWD_SIZE      4
+#define MFRC522_UL_PACK_SIZE     2
+#define MFRC522_UL_FAST_READ_MAX 63 // Pages per streamed FAST_READ; the answer stays within the u8 frame lengths
+#define MFRC522_STREAM_MIN_HZ    1000000 // SPI clock that empties the FIFO well ahead of a 106 kbit/s answer (dev->stream_rx)
+#define MFRC522_MF_SECTOR_BLOCKS 4  // Blocks per sector below block 128 (MIFARE Classic 1K and the 4K low sectors)
+#define MFRC522_TCL_FSD_MAX      64 // Largest frame the FIFO takes in one piece (FSDI 5)
+#define MFRC522_TCL_ATS_MAX      20
+
+// Errors that mean "the RF exchange went wrong" as opposed to "the bus failed"
+#define MFRC522_RF_ERROR(ret) ((ret) == -ETIMEDOUT || (ret) == -EPROTO || (ret) == -EBADMSG || (ret) == -EAGAIN)
+
+// Flags for mfrc522_transceive()
+#define MFRC522_TX_CRC           0x01 // Chip appends CRC_A to the transmitted frame
+#define MFRC522_RX_CRC           0x02 // Chip checks and strips CRC_A from the response
+
+/**
+ * @brief Bus access used by the core
+ *
+ * read() and write() move len bytes to or from the same register, which is
+ * how the FIFO is streamed. now_ns() is a monotonic clock used for timeouts
+ * and stage timestamps; the simulator returns its modelled time. event() is
+ * optional and lets the glue count what the chip reported. capture() is
+ * optional too and sees every transceived frame while dev->capture is set.
+ * hard_reset() is optional: it pulses NRSTPD, for mfrc522_recover().
+*/
+enum mfrc522_event {
+    MFRC522_EVENT_ERROR,        // Command finished with ErrorReg = value
+    MFRC522_EVENT_RETRY,        // RF exchange retried after an error
+};
+
+/**
+ * @brief One mfrc522_transceive() as handed to capture()
+ *
+ * Only valid during the call. rx is NULL when nothing was read back
+ * (timeout, protocol error, no receive buffer); coll is CollReg, read only
+ * when ErrorReg reports a collision.
+*/
+struct mfrc522_frame {
+    u64 start_ns, end_ns;       // now_ns() before the FIFO is loaded and after the answer is read
+    const u8 *tx;
+    const u8 *rx;
+    u8 tx_len, rx_len;
+    u8 tx_last_bits, rx_last_bits; // Valid bits in the last byte, 0 means 8
+    u8 flags;                   // MFRC522_TX_CRC / MFRC522_RX_CRC
+    u8 error;                   // ErrorReg, 0 after a timeout
+    u8 coll;
+    int result;                 // What mfrc522_transceive() returned
+};
+
+struct mfrc522_bus_ops {
+    int (*read)(void *priv, u8 reg, u8 *data, unsigned int len);
+    int (*write)(void *priv, u8 reg, const u8 *data, unsigned int len);
+    u64 (*now_ns)(void *priv);
+    void (*event)(void *priv, enum mfrc522_event event, u8 value);
+    void (*capture)(void *priv, const struct mfrc522_frame *frame);
+    int (*hard_reset)(void *priv);
+    void (*delay)(void *priv, u32 us);  // Sleep without touching the bus; NULL polls the chip until then
+};
+
+/**
+ * @brief Step of mfrc522_recover() that brought the chip back
+ *
+ * Retrying a failed bus message is the transport's job and comes before all
+ * of these.
+*/
+enum mfrc522_recovery {
+    MFRC522_RECOVER_IDLE,       // Command cancelled, IRQs cleared and FIFO flushed
+    MFRC522_RECOVER_SOFT_RESET, // SoftReset command, then mfrc522_configure()
+    MFRC522_RECOVER_HARD_RESET, // ops->hard_reset(), then mfrc522_configure()
+    MFRC522_RECOVER_FAILED,     // Still not healthy after every step
+    MFRC522_RECOVERY_TIERS,
+};
+
+// Receiver and modulation settings programmed by mfrc522_configure()
+struct mfrc522_rf_config {
+    u8 rx_gain;                 // RFCfgReg RxGain, 0..7
+    u8 mod_width;               // ModWidthReg
+    bool force_100ask;          // TxASKReg Force100ASK
+};
+
+struct mfrc522_dev {
+    const struct mfrc522_bus_ops *ops;
+    void *priv;
+    struct mfrc522_rf_config rf;
+    u8 crc_flags;               // TxModeReg/RxModeReg CRC bits currently programmed
+    u8 error;                   // ErrorReg after the last transceive
+    u32 fwt_us;                 // Frame waiting time of the next transceive, counted down by the chip's timer
+    u16 timer_prescaler;        // TPrescaler and TReloadReg currently programmed
+    u16 timer_reload;
+    u32 timeout_us;             // Software backstop on top of fwt_us, in case the timer never fires
+    bool stream_rx;             // The bus drains the FIFO faster than a card fills it: answers may exceed the FIFO
+    bool capture;               // Pass every transceived frame to ops->capture()
+    u64 frames;                 // RF frames sent since the device was set up
+    u64 rf_errors;              // Frames that ended with a CRC, parity, protocol or overflow error
+};
+
+// How one RF configuration did during mfrc522_rf_tune()
+struct mfrc522_tune_result {
+    struct mfrc522_rf_config rf;
+    unsigned int trials;
+    unsigned int first_try;     // Trials where WUPA and SELECT worked without a retry
+    unsigned int errors;        // Frames with ErrorReg errors
+};
+
+struct mfrc522_uid {
+    u8 size;                    // 4, 7 or 10 bytes
+    u8 bytes[10];
+    u8 sak;
+};
+
+/**
+ * @brief Result of one inventory pass
+ *
+ * On entry uids[] holds the cards found by the previous pass; those are
+ * re-confirmed by a direct SELECT instead of a full anticollision loop.
+ * t_answer and t_resolved are now_ns() stamps of the first answer to
+ * REQA/WUPA and of the last UID being resolved (0 if nothing answered).
+*/
+struct mfrc522_inventory {
+    struct mfrc522_uid uids[MFRC522_MAX_CARDS];
+    unsigned int count;
+    unsigned int frames;        // RF frames used by the last pass
+    u64 t_answer;
+    u64 t_resolved;
+};
+
+/**
+ * @brief Low-power card detection state
+ *
+ * The MFRC522 has no LPCD block of its own, so a probe switches the field on
+ * for a moment with the receiver running and reads the I/Q ADC values from
+ * TestADCReg. A card in the field loads the antenna and shifts them away from
+ * the baseline. Baselines are kept in 1/16 ADC steps so they can track slow
+ * drift between probes.
+*/
+struct mfrc522_lpcd {
+    u16 base_i;                 // Baseline I channel, x16
+    u16 base_q;                 // Baseline Q channel, x16
+    u8 threshold;               // Deviation in ADC steps that counts as a card
+    u8 last_i;                  // ADC values of the last probe
+    u8 last_q;
+    u64 probes;
+    u64 wakes;                  // Probes that escalated to a full inventory
+    u64 false_wakes;            // ...where the inventory found nothing
+};
+
+/**
+ * @brief ISO 14443-4 (T=CL) session with one card, set up by mfrc522_tcl_activate()
+ *
+ * No CID or NAD, so one card at a time. Frame sizes count PCB, INF and CRC_A.
+ * The counters add up over the session.
+*/
+struct mfrc522_tcl {
+    u16 fsd;                    // Largest frame the PCD accepts, as announced in RATS
+    u16 fsc;                    // Largest frame the PICC accepts, from the ATS
+    u32 fwt_us;                 // Frame waiting time from the ATS
+    u8 block_num;               // PCD block number
+    u8 ats[MFRC522_TCL_ATS_MAX];
+    u8 ats_len;
+    u32 i_blocks;               // I-blocks sent and received
+    u32 r_blocks;               // R(ACK)s sent to continue a chain
+    u32 wtx;                    // S(WTX) requests granted
+    u32 recoveries;             // R(NAK)/R(ACK) sent after a timeout or a garbled block
+};
+
+extern const u8 mfrc522_selftest_v2[64];
+
+// Register access
+int mfrc522_read_reg(struct mfrc522_dev *dev, u8 reg, u8 *val);
+int mfrc522_write_reg(struct mfrc522_dev *dev, u8 reg, u8 val);
+int mfrc522_set_bits(struct mfrc522_dev *dev, u8 reg, u8 mask);
+int mfrc522_clear_bits(struct mfrc522_dev *dev, u8 reg, u8 mask);
+int mfrc522_send_command(struct mfrc522_dev *dev, u8 rcv_off, u8 power_down, u8 command);
+
+// Chip setup
+void mfrc522_dev_init(struct mfrc522_dev *dev, const struct mfrc522_bus_ops *ops, void *priv);
+int mfrc522_read_version(struct mfrc522_dev *dev, u8 *version);
+int mfrc522_soft_reset(struct mfrc522_dev *dev);
+int mfrc522_configure(struct mfrc522_dev *dev);
+int mfrc522_antenna_on(struct mfrc522_dev *dev);
+int mfrc522_antenna_off(struct mfrc522_dev *dev);
+int mfrc522_power_down(struct mfrc522_dev *dev);
+int mfrc522_power_up(struct mfrc522_dev *dev);
+int mfrc522_set_rf_config(struct mfrc522_dev *dev, const struct mfrc522_rf_config *rf);
+int mfrc522_rf_tune(struct mfrc522_dev *dev, unsigned int trials, struct mfrc522_tune_result *best);
+int mfrc522_self_test(struct mfrc522_dev *dev);
+
+// Fault handling
+int mfrc522_idle(struct mfrc522_dev *dev);
+int mfrc522_check_health(struct mfrc522_dev *dev);
+int mfrc522_recover(struct mfrc522_dev *dev, enum mfrc522_recovery *tier);
+
+// ISO 14443A
+int mfrc522_transceive(struct mfrc522_dev *dev, const u8 *tx, unsigned int tx_len, u8 tx_last_bits,
+                       u8 rx_align, u8 *rx, unsigned int *rx_len, u8 *rx_last_bits, u8 flags);
+int mfrc522_request_a(struct mfrc522_dev *dev, u8 command, u8 atqa[2]);
+int mfrc522_select(struct mfrc522_dev *dev, struct mfrc522_uid *uid);
+int mfrc522_reselect(struct mfrc522_dev *dev, struct mfrc522_uid *uid);
+int mfrc522_halt_a(struct mfrc522_dev *dev);
+int mfrc522_inventory(struct mfrc522_dev *dev, struct mfrc522_inventory *inv);
+bool mfrc522_uid_equal(const struct mfrc522_uid *a, const struct mfrc522_uid *b);
+
+// ISO 14443-4 block transport
+int mfrc522_tcl_activate(struct mfrc522_dev *dev, struct mfrc522_tcl *tcl, u16 fsd);
+int mfrc522_tcl_exchange(struct mfrc522_dev *dev, struct mfrc522_tcl *tcl, const u8 *tx, unsigned int tx_len,
+                         u8 *rx, unsigned int *rx_len);
+int mfrc522_tcl_deselect(struct mfrc522_dev *dev, struct mfrc522_tcl *tcl);
+
+// Low-power card detection
+int mfrc522_lpcd_calibrate(struct mfrc522_dev *dev, struct mfrc522_lpcd *lpcd, unsigned int samples);
+int mfrc522_lpcd_probe(struct mfrc522_dev *dev, struct mfrc522_lpcd *lpcd, bool *detected);
+void mfrc522_lpcd_result(struct mfrc522_lpcd *lpcd, unsigned int cards_found);
+
+// MIFARE Classic
+int mfrc522_mifare_auth(struct mfrc522_dev *dev, u8 key_type, u8 block, const u8 *key, const struct mfrc522_uid *uid);
+int mfrc522_mifare_stop_crypto1(struct mfrc522_dev *dev);
+int mfrc522_mifare_read(struct mfrc522_dev *dev, u8 block, u8 *data);
+int mfrc522_mifare_write(struct mfrc522_dev *dev, u8 block, const u8 *data);
+int mfrc522_ultralight_write(struct mfrc522_dev *dev, u8 page, const u8 *data);
+u16 mfrc522_crc_a(const u8 *data, unsigned int len);
+int mfrc522_read_crc(struct mfrc522_dev *dev, u8 addr, u16 *crc);
+
+// NTAG21x / Ultralight
+unsigned int mfrc522_ntag_frame_pages(const struct mfrc522_dev *dev);
+int mfrc522_ntag_read(struct mfrc522_dev *dev, u8 page, unsigned int count, u8 *data);
+int mfrc522_ntag_pwd_auth(struct mfrc522_dev *dev, const u8 *pwd, u8 *pack);
+int mfrc522_ntag_read_card(struct mfrc522_dev *dev, const struct mfrc522_uid *uid, const u8 *pwd, u8 page,
+                           unsigned int count, u8 *data);
+
+// MIFARE Classic card, woken from HALT and HALTed again
+int mfrc522_mifare_read_card(struct mfrc522_dev *dev, const struct mfrc522_uid *uid, u8 key_type, const u8 *key,
+                             u8 block, unsigned int count, u8 *data);
+int mfrc522_mifare_write_card(struct mfrc522_dev *dev, const struct mfrc522_uid *uid, u8 key_type, const u8 *key,
+                              u8 block, const u8 *data);
+
+#endif // MFRC522_H
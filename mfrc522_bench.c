@@ -0,0 +1,933 @@
+/**
+ * @file mfrc522_bench.c
+ * @brief Host benchmark for the reader core against the simulated MFRC522
+ *
+ * Build with `make bench` and run ./mfrc522_bench on any Linux machine.
+ * All times are modelled by mfrc522_sim.c (SPI clock, per-message overhead,
+ * ISO 14443A frame timing), so results are deterministic and comparable
+ * between commits.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "mfrc522.h"
+#include "mfrc522_sim.h"
+#include "access_policy.h"
+#include "ndef.h"
+#include "desfire.h"
+#include "nfc_capture.h"
+
+#define DEFAULT_SPI_HZ  9600 // SPEED in spi_mfrc522_driver.c
+#define DEFAULT_POLL_MS 200
+#define DEFAULT_TAPS    50
+#define LPCD_PROBES     1000
+#define TUNE_TRIALS     8    // WUPA/SELECT rounds per configuration
+#define TUNE_CHECK      100  // Rounds used to compare before and after tuning
+#define RF_RING_SIZE    4096 // Capture records kept by bench_capture_frame()
+
+static const u8 token_uids[ACCESS_MAX_TOKENS][7] = {
+    { 0x04, 0xA1, 0xB2, 0xC3 },
+    { 0x04, 0xA1, 0x5E, 0x11 },
+    { 0x04, 0x22, 0x43, 0x92, 0xE1, 0x6C, 0x80 },
+};
+static const u8 token_sizes[ACCESS_MAX_TOKENS] = { 4, 4, 7 };
+
+struct bench_sample {
+    struct mfrc522_sim_stats stats;
+    u64 ns;
+};
+
+static struct mfrc522_sim sim;
+static struct mfrc522_dev dev;
+static struct mfrc522_sim_card *cards[ACCESS_MAX_TOKENS];
+static struct access_policy policy;
+static u32 spi_hz = DEFAULT_SPI_HZ;
+static unsigned int failures; // Rows that printed FAILED; any makes the exit status non-zero
+
+static void bench_setup(void)
+{
+    unsigned int i;
+
+    mfrc522_sim_init(&sim, spi_hz);
+    mfrc522_dev_init(&dev, &mfrc522_sim_ops, &sim);
+    dev.stream_rx = spi_hz >= MFRC522_STREAM_MIN_HZ;
+    memset(&policy, 0, sizeof(policy));
+    for (i = 0; i < ACCESS_MAX_TOKENS; i++) {
+        cards[i] = mfrc522_sim_add_card(&sim, token_uids[i], token_sizes[i]);
+        policy.tokens[i] = cards[i]->uid;
+    }
+    policy.num_tokens = ACCESS_MAX_TOKENS;
+    policy.required = 2;
+
+    if (mfrc522_configure(&dev)) {
+        fprintf(stderr, "mfrc522_configure failed\n");
+        exit(1);
+    }
+}
+
+static void bench_begin(struct bench_sample *s)
+{
+    s->stats = sim.stats;
+    s->ns = sim.now_ns;
+}
+
+static void bench_end(const char *name, const struct bench_sample *s, int ret)
+{
+    if (ret)
+        failures++;
+    printf("%-28s %6llu %9llu %10llu %12.1f %s\n", name,
+           (unsigned long long)(sim.stats.rf_frames - s->stats.rf_frames),
+           (unsigned long long)(sim.stats.spi_messages - s->stats.spi_messages),
+           (unsigned long long)(sim.stats.spi_bytes - s->stats.spi_bytes),
+           (sim.now_ns - s->ns) / 1000.0, ret ? "FAILED" : "");
+}
+
+static void bench_fields(unsigned int mask)
+{
+    unsigned int i;
+
+    for (i = 0; i < ACCESS_MAX_TOKENS; i++)
+        mfrc522_sim_set_in_field(cards[i], mask & (1 << i));
+}
+
+static void bench_operations(void)
+{
+    static const u8 key[MFRC522_MF_KEY_SIZE] = { 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF };
+    struct mfrc522_inventory inv = {0};
+    struct bench_sample s;
+    u8 block[MFRC522_MF_BLOCK_SIZE] = { 0xEC, 0x53, 0x05 };
+    u8 credential[3 * MFRC522_MF_BLOCK_SIZE];
+    int ret;
+
+    printf("%-28s %6s %9s %10s %12s\n", "operation", "frames", "spi_msgs", "spi_bytes", "time_us");
+
+    bench_setup();
+    bench_begin(&s);
+    ret = mfrc522_self_test(&dev);
+    bench_end("self test", &s, ret);
+
+    bench_setup();
+    bench_begin(&s);
+    ret = mfrc522_inventory(&dev, &inv);
+    bench_end("inventory, empty field", &s, ret || inv.count != 0);
+
+    bench_fields(0x1);
+    bench_begin(&s);
+    ret = mfrc522_inventory(&dev, &inv);
+    bench_end("inventory, 1 new card", &s, ret || inv.count != 1);
+
+    bench_begin(&s);
+    ret = mfrc522_inventory(&dev, &inv);
+    bench_end("inventory, 1 known card", &s, ret || inv.count != 1);
+
+    bench_setup();
+    inv.count = 0;
+    bench_fields(0x7);
+    bench_begin(&s);
+    ret = mfrc522_inventory(&dev, &inv);
+    bench_end("inventory, 3 new cards", &s, ret || inv.count != 3);
+
+    bench_begin(&s);
+    ret = mfrc522_inventory(&dev, &inv);
+    bench_end("inventory, 3 known cards", &s, ret || inv.count != 3);
+
+    // Runtime PM between polls: the field drops, so the known cards come back from IDLE
+    mfrc522_power_down(&dev);
+    mfrc522_sim_advance(&sim, 100000000);
+    bench_begin(&s);
+    ret = mfrc522_power_up(&dev);
+    bench_end("wake from soft power-down", &s, ret);
+
+    bench_begin(&s);
+    ret = mfrc522_inventory(&dev, &inv);
+    bench_end("inventory after wake", &s, ret || inv.count != 3);
+
+    // MIFARE operations on a selected card
+    bench_setup();
+    bench_fields(0x1);
+    inv.count = 0;
+    mfrc522_inventory(&dev, &inv);
+    mfrc522_request_a(&dev, PICC_CMD_WUPA, block);
+    mfrc522_reselect(&dev, &inv.uids[0]);
+
+    bench_begin(&s);
+    ret = mfrc522_mifare_auth(&dev, PICC_CMD_MF_AUTH_KEY_A, 4, key, &inv.uids[0]);
+    bench_end("mifare auth", &s, ret);
+
+    bench_begin(&s);
+    ret = mfrc522_mifare_read(&dev, 4, block);
+    bench_end("mifare read block", &s, ret);
+
+    bench_begin(&s);
+    ret = mfrc522_mifare_write(&dev, 5, block);
+    bench_end("mifare write block", &s, ret);
+
+    // The card acknowledges HLTA by staying silent, so this is one frame waiting time
+    bench_begin(&s);
+    ret = mfrc522_halt_a(&dev);
+    bench_end("halt", &s, ret);
+
+    // Signed credential (payload and HMAC, three blocks) on a HALTed card, as the controller reads it
+    mfrc522_mifare_stop_crypto1(&dev);
+    bench_begin(&s);
+    ret = mfrc522_mifare_read_card(&dev, &inv.uids[0], PICC_CMD_MF_AUTH_KEY_A, key, 4, 3, credential);
+    bench_end("credential read", &s, ret);
+
+    bench_begin(&s);
+    ret = mfrc522_mifare_write_card(&dev, &inv.uids[0], PICC_CMD_MF_AUTH_KEY_A, key, 5, block);
+    bench_end("write, HALTed card", &s, ret);
+}
+
+// A staff credential as a single MIME record; serial is the field that changes between provisionings
+static size_t bench_ndef_message(u8 *msg, u8 serial)
+{
+    static const char type[] = "application/vnd.door-token";
+    size_t len = 0, i;
+
+    msg[len++] = 0xD2; // MB, ME, SR, TNF media type
+    msg[len++] = sizeof(type) - 1;
+    msg[len++] = 96;   // Payload length
+    memcpy(msg + len, type, sizeof(type) - 1);
+    len += sizeof(type) - 1;
+    for (i = 0; i < 96; i++)
+        msg[len + i] = i == 40 ? serial : (u8)(i * 7);
+    return len + 96;
+}
+
+// Wake the one card in the field and select it
+static int bench_ndef_select(struct mfrc522_uid *uid)
+{
+    u8 atqa[2];
+    int ret;
+
+    ret = mfrc522_request_a(&dev, PICC_CMD_WUPA, atqa);
+    if (!ret)
+        ret = mfrc522_select(&dev, uid);
+    return ret;
+}
+
+static int bench_ndef_done(int ret)
+{
+    mfrc522_halt_a(&dev);
+    mfrc522_mifare_stop_crypto1(&dev);
+    return ret;
+}
+
+// What provisioning did before: write every block of the image and read it back
+static int bench_ndef_full_rewrite(const struct mfrc522_uid *uid, const u8 *key, const u8 *tlv, size_t len)
+{
+    u8 image[2 * MFRC522_MF_BLOCK_SIZE + NDEF_MF_AREA_SIZE] = {0}, back[MFRC522_MF_BLOCK_SIZE];
+    unsigned int i, n, block;
+    int ret;
+
+    ndef_mad_build(image);
+    memcpy(image + 2 * MFRC522_MF_BLOCK_SIZE, tlv, len);
+    n = 2 + (len + MFRC522_MF_BLOCK_SIZE - 1) / MFRC522_MF_BLOCK_SIZE;
+    for (i = 0; i < n; i++) {
+        block = i < 2 ? 1 + i : 4 + (i - 2) / 3 * 4 + (i - 2) % 3;
+        if (i < 3 || block % 4 == 0) {
+            ret = mfrc522_mifare_auth(&dev, PICC_CMD_MF_AUTH_KEY_A, block, key, uid);
+            if (ret)
+                return ret;
+        }
+        ret = mfrc522_mifare_write(&dev, block, image + i * MFRC522_MF_BLOCK_SIZE);
+        if (!ret)
+            ret = mfrc522_mifare_read(&dev, block, back);
+        if (ret)
+            return ret;
+        if (memcmp(back, image + i * MFRC522_MF_BLOCK_SIZE, sizeof(back)))
+            return -EIO;
+    }
+    return 0;
+}
+
+static int bench_ndef_check(const struct mfrc522_uid *uid, const u8 *key, const u8 *msg, size_t len)
+{
+    static u8 area[NDEF_MAX_AREA];
+    size_t off, got;
+    int ret;
+
+    ret = bench_ndef_select((struct mfrc522_uid *)uid);
+    if (!ret)
+        ret = uid->sak ? ndef_read_mifare(&dev, uid, PICC_CMD_MF_AUTH_KEY_A, key, area, &off, &got)
+                       : ndef_read_ultralight(&dev, area, &off, &got);
+    bench_ndef_done(0);
+    if (!ret && (got != len || memcmp(area + off, msg, len)))
+        ret = -EIO;
+    return ret;
+}
+
+/**
+ * @brief Provisioning a credential: first write, re-provisioning with one changed byte, and the old full rewrite
+*/
+static void bench_ndef(void)
+{
+    static const u8 key[MFRC522_MF_KEY_SIZE] = { 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF };
+    static const u8 ntag_uid[7] = { 0x04, 0x5A, 0x17, 0x2B, 0x9C, 0x40, 0x80 };
+    u8 msg[128], tlv[NDEF_MAX_AREA];
+    struct mfrc522_sim_card *ntag;
+    struct ndef_write_stats st;
+    struct mfrc522_uid uid;
+    struct bench_sample s;
+    size_t len;
+    int ret, n;
+
+    bench_setup();
+    bench_fields(0x1);
+
+    len = bench_ndef_message(msg, 1);
+    n = ndef_tlv_encode(msg, len, tlv, sizeof(tlv));
+    bench_begin(&s);
+    ret = bench_ndef_select(&uid);
+    if (!ret)
+        ret = ndef_write_mifare(&dev, &uid, PICC_CMD_MF_AUTH_KEY_A, key, tlv, n, &st);
+    ret = bench_ndef_done(ret);
+    bench_end("ndef write, blank classic", &s, ret || bench_ndef_check(&uid, key, msg, len));
+
+    len = bench_ndef_message(msg, 2);
+    n = ndef_tlv_encode(msg, len, tlv, sizeof(tlv));
+    bench_begin(&s);
+    ret = bench_ndef_select(&uid);
+    if (!ret)
+        ret = bench_ndef_full_rewrite(&uid, key, tlv, n);
+    ret = bench_ndef_done(ret);
+    bench_end("ndef full rewrite, classic", &s, ret || bench_ndef_check(&uid, key, msg, len));
+
+    len = bench_ndef_message(msg, 3);
+    n = ndef_tlv_encode(msg, len, tlv, sizeof(tlv));
+    bench_begin(&s);
+    ret = bench_ndef_select(&uid);
+    if (!ret)
+        ret = ndef_write_mifare(&dev, &uid, PICC_CMD_MF_AUTH_KEY_A, key, tlv, n, &st);
+    ret = bench_ndef_done(ret);
+    bench_end("ndef update, classic", &s, ret || st.writes != 1 || bench_ndef_check(&uid, key, msg, len));
+
+    ntag = mfrc522_sim_add_ntag(&sim, ntag_uid, 135);
+    bench_fields(0);
+    mfrc522_sim_set_in_field(ntag, true);
+
+    len = bench_ndef_message(msg, 1);
+    n = ndef_tlv_encode(msg, len, tlv, sizeof(tlv));
+    bench_begin(&s);
+    ret = bench_ndef_select(&uid);
+    if (!ret)
+        ret = ndef_write_ultralight(&dev, tlv, n, &st);
+    ret = bench_ndef_done(ret);
+    bench_end("ndef write, blank ntag215", &s, ret || bench_ndef_check(&uid, key, msg, len));
+
+    len = bench_ndef_message(msg, 2);
+    n = ndef_tlv_encode(msg, len, tlv, sizeof(tlv));
+    bench_begin(&s);
+    ret = bench_ndef_select(&uid);
+    if (!ret)
+        ret = ndef_write_ultralight(&dev, tlv, n, &st);
+    ret = bench_ndef_done(ret);
+    bench_end("ndef update, ntag215", &s, ret || st.writes != 1 || bench_ndef_check(&uid, key, msg, len));
+}
+
+/**
+ * @brief An NTAG215 token: its signed credential (12 pages from page 16) page by page and with FAST_READ,
+ *        behind a password, and the whole user area
+*/
+static void bench_ntag(void)
+{
+    static const u8 ntag_uid[7] = { 0x04, 0x3C, 0x51, 0x8E, 0x22, 0x61, 0x80 };
+    static const u8 pwd[MFRC522_UL_PWD_SIZE] = { 0x5E, 0xC5, 0x35, 0x01 }, bad_pwd[MFRC522_UL_PWD_SIZE] = {0};
+    static const u8 pack[MFRC522_UL_PACK_SIZE] = { 0xEC, 0x53 };
+    u8 credential[3 * MFRC522_MF_BLOCK_SIZE], area[126 * MFRC522_UL_PAGE_SIZE];
+    struct mfrc522_inventory inv = {0};
+    struct mfrc522_sim_card *ntag;
+    struct mfrc522_uid uid;
+    struct bench_sample s;
+    unsigned int i;
+    int ret;
+
+    bench_setup();
+    bench_fields(0);
+    ntag = mfrc522_sim_add_ntag(&sim, ntag_uid, 135);
+    for (i = 0; i < sizeof(credential); i++)
+        ntag->mem[16 * MFRC522_UL_PAGE_SIZE + i] = (u8)(i * 13);
+    mfrc522_sim_set_in_field(ntag, true);
+    mfrc522_inventory(&dev, &inv);
+
+    // What a MIFARE-style reader does: one 4 page READ per block
+    bench_begin(&s);
+    uid = inv.uids[0];
+    ret = bench_ndef_select(&uid);
+    for (i = 0; i < 3 && !ret; i++)
+        ret = mfrc522_mifare_read(&dev, 16 + 4 * i, credential + i * MFRC522_MF_BLOCK_SIZE);
+    ret = bench_ndef_done(ret);
+    bench_end("ntag credential, READ", &s, ret || credential[47] != (u8)(47 * 13));
+
+    memset(credential, 0, sizeof(credential));
+    bench_begin(&s);
+    ret = mfrc522_ntag_read_card(&dev, &inv.uids[0], NULL, 16, 12, credential);
+    bench_end("ntag credential, FAST_READ", &s, ret || credential[47] != (u8)(47 * 13));
+
+    mfrc522_sim_ntag_protect(ntag, pwd, pack, 16, true);
+    memset(credential, 0, sizeof(credential));
+    bench_begin(&s);
+    ret = mfrc522_ntag_read_card(&dev, &inv.uids[0], pwd, 16, 12, credential);
+    bench_end("ntag credential, PWD_AUTH", &s, ret || credential[47] != (u8)(47 * 13));
+
+    bench_begin(&s);
+    ret = mfrc522_ntag_read_card(&dev, &inv.uids[0], bad_pwd, 16, 12, credential);
+    bench_end("ntag credential, wrong pwd", &s, ret != -EACCES);
+    mfrc522_sim_ntag_protect(ntag, pwd, pack, 0xFF, false);
+
+    // Pages 4-129: 63 pages per streamed frame, or 16 per frame while the SPI clock is too slow to stream
+    bench_begin(&s);
+    ret = mfrc522_ntag_read_card(&dev, &inv.uids[0], NULL, 4, 126, area);
+    bench_end("ntag read 504 B", &s, ret || area[12 * MFRC522_UL_PAGE_SIZE] != 0);
+
+    // Streaming on a bus that cannot keep up: the FIFO overflows and the frame is read again in pieces
+    dev.stream_rx = true;
+    bench_begin(&s);
+    ret = mfrc522_ntag_read_card(&dev, &inv.uids[0], NULL, 4, 126, area);
+    bench_end("ntag read 504 B, streamed", &s, ret);
+    dev.stream_rx = spi_hz >= MFRC522_STREAM_MIN_HZ;
+}
+
+// Wake the DESFire, select it and switch it to ISO 14443-4 with the given FSD
+static int bench_desfire_open(struct mfrc522_tcl *tcl, u16 fsd)
+{
+    struct mfrc522_uid uid;
+    int ret;
+
+    ret = bench_ndef_select(&uid);
+    if (!ret)
+        ret = mfrc522_tcl_activate(&dev, tcl, fsd);
+    return ret;
+}
+
+// AES for desfire.c from the simulator, standing in for the kernel cipher behind desfire_aes_ops
+struct bench_aes {
+    u8 card[DESFIRE_AES_BLOCK];
+    u8 session[DESFIRE_AES_BLOCK];
+    u32 seed;
+};
+
+static int bench_aes_encrypt(void *priv, bool session, u8 *block)
+{
+    struct bench_aes *aes = priv;
+
+    mfrc522_sim_aes_encrypt(session ? aes->session : aes->card, block);
+    return 0;
+}
+
+static int bench_aes_decrypt(void *priv, bool session, u8 *block)
+{
+    struct bench_aes *aes = priv;
+
+    mfrc522_sim_aes_decrypt(session ? aes->session : aes->card, block);
+    return 0;
+}
+
+static int bench_aes_set_session_key(void *priv, const u8 *key)
+{
+    struct bench_aes *aes = priv;
+
+    memcpy(aes->session, key, DESFIRE_AES_BLOCK);
+    return 0;
+}
+
+static void bench_aes_random(void *priv, u8 *buf, unsigned int len)
+{
+    struct bench_aes *aes = priv;
+
+    while (len--) {
+        aes->seed = aes->seed * 1103515245 + 12345;
+        *buf++ = aes->seed >> 16;
+    }
+}
+
+static const struct desfire_crypto_ops bench_aes_ops = {
+    .encrypt = bench_aes_encrypt,
+    .decrypt = bench_aes_decrypt,
+    .set_session_key = bench_aes_set_session_key,
+    .random = bench_aes_random,
+};
+
+static bool bench_check(const char *name, const u8 *got, const u8 *want, unsigned int len)
+{
+    bool ok = !memcmp(got, want, len);
+
+    printf("  %-26s %s\n", name, ok ? "ok" : "FAILED");
+    failures += !ok;
+    return ok;
+}
+
+/**
+ * @brief Known-answer checks of the AES the bench uses and of desfire.c's CMAC (FIPS-197, SP 800-38A/B)
+*/
+static void bench_desfire_kat(void)
+{
+    static const u8 fips_key[16] = { 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
+                                     0x08, 0x09, 0x0A, 0x0B, 0x0C, 0x0D, 0x0E, 0x0F };
+    static const u8 fips_pt[16] = { 0x00, 0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77,
+                                    0x88, 0x99, 0xAA, 0xBB, 0xCC, 0xDD, 0xEE, 0xFF };
+    static const u8 fips_ct[16] = { 0x69, 0xC4, 0xE0, 0xD8, 0x6A, 0x7B, 0x04, 0x30,
+                                    0xD8, 0xCD, 0xB7, 0x80, 0x70, 0xB4, 0xC5, 0x5A };
+    static const u8 key[16] = { 0x2B, 0x7E, 0x15, 0x16, 0x28, 0xAE, 0xD2, 0xA6,
+                                0xAB, 0xF7, 0x15, 0x88, 0x09, 0xCF, 0x4F, 0x3C };
+    static const u8 ecb_ct[16] = { 0x3A, 0xD7, 0x7B, 0xB4, 0x0D, 0x7A, 0x36, 0x60,
+                                   0xA8, 0x9E, 0xCA, 0xF3, 0x24, 0x66, 0xEF, 0x97 };
+    static const u8 k1[16] = { 0xFB, 0xEE, 0xD6, 0x18, 0x35, 0x71, 0x33, 0x66,
+                               0x7C, 0x85, 0xE0, 0x8F, 0x72, 0x36, 0xA8, 0xDE };
+    static const u8 k2[16] = { 0xF7, 0xDD, 0xAC, 0x30, 0x6A, 0xE2, 0x66, 0xCC,
+                               0xF9, 0x0B, 0xC1, 0x1E, 0xE4, 0x6D, 0x51, 0x3B };
+    static const u8 msg[64] = {
+        0x6B, 0xC1, 0xBE, 0xE2, 0x2E, 0x40, 0x9F, 0x96, 0xE9, 0x3D, 0x7E, 0x11, 0x73, 0x93, 0x17, 0x2A,
+        0xAE, 0x2D, 0x8A, 0x57, 0x1E, 0x03, 0xAC, 0x9C, 0x9E, 0xB7, 0x6F, 0xAC, 0x45, 0xAF, 0x8E, 0x51,
+        0x30, 0xC8, 0x1C, 0x46, 0xA3, 0x5C, 0xE4, 0x11, 0xE5, 0xFB, 0xC1, 0x19, 0x1A, 0x0A, 0x52, 0xEF,
+        0xF6, 0x9F, 0x24, 0x45, 0xDF, 0x4F, 0x9B, 0x17, 0xAD, 0x2B, 0x41, 0x7B, 0xE6, 0x6C, 0x37, 0x10,
+    };
+    static const struct {
+        unsigned int len;
+        u8 tag[16];
+    } cmac[] = {
+        { 0, { 0xBB, 0x1D, 0x69, 0x29, 0xE9, 0x59, 0x37, 0x28, 0x7F, 0xA3, 0x7D, 0x12, 0x9B, 0x75, 0x67, 0x46 } },
+        { 16, { 0x07, 0x0A, 0x16, 0xB4, 0x6B, 0x4D, 0x41, 0x44, 0xF7, 0x9B, 0xDD, 0x9D, 0xD0, 0x4A, 0x28, 0x7C } },
+        { 40, { 0xDF, 0xA6, 0x67, 0x47, 0xDE, 0x9A, 0xE6, 0x30, 0x30, 0xCA, 0x32, 0x61, 0x14, 0x97, 0xC8, 0x27 } },
+        { 64, { 0x51, 0xF0, 0xBE, 0xBF, 0x7E, 0x3B, 0x9D, 0x92, 0xFC, 0x49, 0x74, 0x17, 0x79, 0x36, 0x3C, 0xFE } },
+    };
+    struct bench_aes aes = {0};
+    struct desfire df;
+    u8 block[16], mac[16];
+    char name[32];
+    unsigned int i;
+
+    printf("\ndesfire crypto, known-answer checks:\n");
+    memcpy(block, fips_pt, sizeof(block));
+    mfrc522_sim_aes_encrypt(fips_key, block);
+    bench_check("AES-128 encrypt, FIPS-197", block, fips_ct, sizeof(block));
+    mfrc522_sim_aes_decrypt(fips_key, block);
+    bench_check("AES-128 decrypt, FIPS-197", block, fips_pt, sizeof(block));
+    memcpy(block, msg, sizeof(block));
+    mfrc522_sim_aes_encrypt(key, block);
+    bench_check("AES-128 ECB, SP 800-38A", block, ecb_ct, sizeof(block));
+
+    desfire_init(&df, &dev, NULL, &bench_aes_ops, &aes);
+    bench_aes_set_session_key(&aes, key);
+    if (desfire_cmac_subkeys(&df))
+        memset(df.k1, 0, sizeof(df.k1));
+    bench_check("CMAC subkey K1, SP 800-38B", df.k1, k1, sizeof(k1));
+    bench_check("CMAC subkey K2, SP 800-38B", df.k2, k2, sizeof(k2));
+    for (i = 0; i < ARRAY_SIZE(cmac); i++) {
+        memset(df.iv, 0, sizeof(df.iv));
+        if (desfire_cmac(&df, msg, cmac[i].len, mac))
+            memset(mac, 0, sizeof(mac));
+        snprintf(name, sizeof(name), "CMAC %u bytes, SP 800-38B", cmac[i].len);
+        bench_check(name, mac, cmac[i].tag, sizeof(mac));
+    }
+}
+
+/**
+ * @brief Read a file of application 1 in one session; with aes set, AuthenticateEV1 with key 0 first
+*/
+static int bench_desfire_read(struct mfrc522_tcl *tcl, struct bench_aes *aes, enum desfire_comm comm,
+                              const u8 *file, unsigned int len)
+{
+    static u8 data[DESFIRE_READ_SPACE(MFRC522_SIM_MEM_SIZE)];
+    struct desfire df;
+    int ret;
+
+    desfire_init(&df, &dev, tcl, aes ? &bench_aes_ops : NULL, aes);
+    ret = desfire_select_application(&df, 0x000001);
+    if (!ret && aes)
+        ret = desfire_authenticate_aes(&df, 0);
+    if (!ret)
+        ret = desfire_read_data(&df, 1, 0, len, comm, data);
+    if (!ret && memcmp(data, file, len))
+        ret = -EIO;
+    mfrc522_tcl_deselect(&dev, tcl);
+    return ret;
+}
+
+/**
+ * @brief Reading a credential file from a DESFire: the FSD asked for in RATS decides how many blocks that takes
+ *
+ * Then the same file MACed and enciphered behind an AES key, which exercises
+ * AuthenticateEV1 and the EV1 secure messaging of desfire.c end to end.
+*/
+static void bench_desfire(void)
+{
+    static const u8 uid[7] = { 0x04, 0x3C, 0x61, 0x2A, 0xD2, 0x58, 0x80 };
+    static const u16 fsds[] = { 32, 64 };
+    static const u8 df_key[DESFIRE_AES_BLOCK] = { 0x4E, 0x46, 0x43, 0x2D, 0x6C, 0x6F, 0x63, 0x6B };
+    static const struct {
+        enum desfire_comm comm;
+        const char *name;
+    } comms[] = {
+        { DESFIRE_COMM_PLAIN, "plain" },
+        { DESFIRE_COMM_MAC, "MACed" },
+        { DESFIRE_COMM_ENC, "enciphered" },
+    };
+    struct bench_aes aes = { .seed = 1 };
+    struct mfrc522_sim_card *card;
+    struct mfrc522_tcl tcl;
+    struct bench_sample s;
+    char name[32];
+    unsigned int i;
+    int ret;
+
+    bench_setup();
+    bench_fields(0);
+    card = mfrc522_sim_add_desfire(&sim, uid);
+    for (i = 0; i < MFRC522_SIM_MEM_SIZE; i++)
+        card->mem[i] = i * 13;
+    mfrc522_sim_set_in_field(card, true);
+
+    bench_begin(&s);
+    ret = bench_desfire_open(&tcl, MFRC522_TCL_FSD_MAX);
+    bench_end("desfire activate (RATS)", &s, ret || tcl.fsc != 64);
+    mfrc522_tcl_deselect(&dev, &tcl);
+
+    for (i = 0; i < ARRAY_SIZE(fsds); i++) {
+        ret = bench_desfire_open(&tcl, fsds[i]);
+        bench_begin(&s);
+        if (!ret)
+            ret = bench_desfire_read(&tcl, NULL, DESFIRE_COMM_PLAIN, card->mem, MFRC522_SIM_MEM_SIZE);
+        snprintf(name, sizeof(name), "desfire read 1 KB, FSD %u", fsds[i]);
+        bench_end(name, &s, ret);
+    }
+
+    card->wtx = 1;
+    ret = bench_desfire_open(&tcl, MFRC522_TCL_FSD_MAX);
+    bench_begin(&s);
+    if (!ret)
+        ret = bench_desfire_read(&tcl, NULL, DESFIRE_COMM_PLAIN, card->mem, 32);
+    bench_end("desfire read 32 B with WTX", &s, ret || tcl.wtx != 1);
+
+    // The same file behind AES key 0: AuthenticateEV1, then the answer with a CMAC or enciphered with a CRC32
+    card->wtx = 0;
+    memcpy(aes.card, df_key, sizeof(aes.card));
+    for (i = 0; i < ARRAY_SIZE(comms); i++) {
+        mfrc522_sim_desfire_protect(card, 0, df_key, comms[i].comm);
+        ret = bench_desfire_open(&tcl, MFRC522_TCL_FSD_MAX);
+        bench_begin(&s);
+        if (!ret)
+            ret = bench_desfire_read(&tcl, &aes, comms[i].comm, card->mem, MFRC522_SIM_MEM_SIZE);
+        snprintf(name, sizeof(name), "desfire AES 1 KB, %s", comms[i].name);
+        bench_end(name, &s, ret);
+    }
+
+    ret = bench_desfire_open(&tcl, MFRC522_TCL_FSD_MAX);
+    bench_begin(&s);
+    if (!ret)
+        ret = bench_desfire_read(&tcl, NULL, DESFIRE_COMM_PLAIN, card->mem, 32);
+    bench_end("desfire enciphered, no auth", &s, ret != -EACCES);
+
+    memset(aes.card, 0x5A, sizeof(aes.card));
+    ret = bench_desfire_open(&tcl, MFRC522_TCL_FSD_MAX);
+    bench_begin(&s);
+    if (!ret)
+        ret = bench_desfire_read(&tcl, &aes, DESFIRE_COMM_ENC, card->mem, 32);
+    bench_end("desfire AES auth, wrong key", &s, ret != -EACCES);
+}
+
+static struct mfrc522_bus_ops capture_ops; // The simulator plus a capture hook
+static u64 captured_frames, captured_bytes;
+
+// What spi_mfrc522_driver.c does with a frame, minus the relay: build the record in a ring
+static void bench_capture_frame(void *priv, const struct mfrc522_frame *frame)
+{
+    static u8 ring[RF_RING_SIZE];
+    static unsigned int pos;
+    unsigned int len = sizeof(struct nfc_rf_frame) + frame->tx_len + frame->rx_len;
+    unsigned int size = (len + NFC_RF_FRAME_ALIGN - 1) / NFC_RF_FRAME_ALIGN * NFC_RF_FRAME_ALIGN;
+    struct nfc_rf_frame *rec;
+
+    if (pos + size > sizeof(ring))
+        pos = 0;
+    rec = (struct nfc_rf_frame *)(ring + pos);
+    memset(rec, 0, size);
+    rec->time_ns = frame->start_ns;
+    rec->duration_ns = frame->end_ns - frame->start_ns;
+    rec->result = frame->result;
+    rec->size = size;
+    rec->tx_len = frame->tx_len;
+    rec->rx_len = frame->rx_len;
+    rec->error = frame->error;
+    rec->coll = frame->coll;
+    memcpy(rec + 1, frame->tx, frame->tx_len);
+    if (frame->rx_len)
+        memcpy((u8 *)(rec + 1) + frame->tx_len, frame->rx, frame->rx_len);
+    pos += size;
+    captured_frames++;
+    captured_bytes += size;
+}
+
+/**
+ * @brief Inventory with RF capture on: compare against the rows without it above
+*/
+static void bench_capture(void)
+{
+    struct mfrc522_inventory inv = {0};
+    struct bench_sample s;
+    int ret;
+
+    capture_ops = mfrc522_sim_ops;
+    capture_ops.capture = bench_capture_frame;
+    bench_setup();
+    dev.ops = &capture_ops;
+    dev.capture = true;
+
+    bench_begin(&s);
+    ret = mfrc522_inventory(&dev, &inv);
+    bench_end("inventory, empty, capture", &s, ret || inv.count != 0);
+
+    bench_fields(0x7);
+    bench_begin(&s);
+    ret = mfrc522_inventory(&dev, &inv);
+    bench_end("inventory, 3 new, capture", &s, ret || inv.count != 3);
+
+    bench_begin(&s);
+    ret = mfrc522_inventory(&dev, &inv);
+    bench_end("inventory, 3 known, capture", &s, ret || inv.count != 3 || !captured_frames);
+}
+
+/**
+ * @brief The health probe and one fault for each step of the recovery ladder
+ *
+ * A bus error abandons an inventory, a brownout resets the registers
+ * behind the driver's back, and a wedged SPI interface only answers 0xFF.
+*/
+static void bench_recovery(void)
+{
+    struct mfrc522_inventory inv = {0};
+    enum mfrc522_recovery tier;
+    struct bench_sample s;
+    int ret;
+
+    bench_setup();
+    bench_fields(0x1);
+    bench_begin(&s);
+    ret = mfrc522_check_health(&dev);
+    bench_end("health check", &s, ret);
+
+    sim.bus_faults = 1;
+    ret = mfrc522_inventory(&dev, &inv);
+    bench_begin(&s);
+    ret = ret != -EIO || mfrc522_recover(&dev, &tier) || tier != MFRC522_RECOVER_IDLE;
+    bench_end("recover, bus error", &s, ret);
+
+    mfrc522_sim_brownout(&sim);
+    bench_begin(&s);
+    ret = mfrc522_check_health(&dev) != -ESTALE || mfrc522_recover(&dev, &tier) ||
+          tier != MFRC522_RECOVER_SOFT_RESET;
+    bench_end("recover, brownout", &s, ret);
+
+    sim.wedged = true;
+    bench_begin(&s);
+    ret = mfrc522_check_health(&dev) != -ENODEV || mfrc522_recover(&dev, &tier) ||
+          tier != MFRC522_RECOVER_HARD_RESET;
+    bench_end("recover, wedged SPI", &s, ret);
+
+    // The ladder leaves the field off
+    inv.count = 0;
+    bench_begin(&s);
+    ret = mfrc522_antenna_on(&dev);
+    if (!ret)
+        ret = mfrc522_inventory(&dev, &inv);
+    bench_end("inventory after recovery", &s, ret || inv.count != 1);
+}
+
+static void bench_lpcd_calibrate(struct mfrc522_lpcd *lpcd, u8 noise)
+{
+    bench_setup();
+    mfrc522_antenna_off(&dev);
+    sim.adc_noise = noise;
+    if (mfrc522_lpcd_calibrate(&dev, lpcd, 8)) {
+        fprintf(stderr, "mfrc522_lpcd_calibrate failed\n");
+        exit(1);
+    }
+}
+
+/**
+ * @brief Cost of a low-power probe, then false wakes and misses over many probes with ADC noise
+*/
+static void bench_lpcd(void)
+{
+    struct mfrc522_lpcd lpcd;
+    struct bench_sample s;
+    unsigned int i, missed;
+    bool detected = false;
+    u8 noise;
+    int ret;
+
+    bench_lpcd_calibrate(&lpcd, 0);
+    bench_begin(&s);
+    ret = mfrc522_lpcd_probe(&dev, &lpcd, &detected);
+    bench_end("lpcd probe, empty field", &s, ret || detected);
+
+    bench_fields(0x1);
+    bench_begin(&s);
+    ret = mfrc522_lpcd_probe(&dev, &lpcd, &detected);
+    bench_end("lpcd probe, 1 card", &s, ret || !detected);
+
+    printf("\nlow-power card detection, %u probes without and %u with a card:\n", LPCD_PROBES, LPCD_PROBES);
+    for (noise = 0; noise <= 2; noise++) {
+        bench_lpcd_calibrate(&lpcd, noise);
+        for (i = 0; i < LPCD_PROBES; i++) {
+            mfrc522_lpcd_probe(&dev, &lpcd, &detected);
+            if (detected)
+                mfrc522_lpcd_result(&lpcd, 0);
+        }
+        bench_fields(0x1);
+        for (i = 0, missed = 0; i < LPCD_PROBES; i++) {
+            mfrc522_lpcd_probe(&dev, &lpcd, &detected);
+            missed += !detected;
+        }
+        printf("  ADC noise +/-%u, threshold %u: false wakes %4.1f%%, missed cards %4.1f%%\n",
+               noise, lpcd.threshold, 100.0 * lpcd.false_wakes / LPCD_PROBES, 100.0 * missed / LPCD_PROBES);
+    }
+}
+
+// WUPA + SELECT + HLTA rounds that worked without a retry
+static unsigned int bench_first_try(unsigned int rounds)
+{
+    struct mfrc522_uid uid;
+    unsigned int ok = 0;
+    u8 atqa[2];
+
+    while (rounds--) {
+        if (!mfrc522_request_a(&dev, PICC_CMD_WUPA, atqa) && !mfrc522_select(&dev, &uid))
+            ok++;
+        mfrc522_halt_a(&dev);
+    }
+    return ok;
+}
+
+/**
+ * @brief A card at the edge of the range only reads cleanly at high RxGain; tune and compare
+*/
+static void bench_rf_tune(void)
+{
+    struct mfrc522_tune_result best;
+    struct bench_sample s;
+    unsigned int before, after;
+    u64 frames, ns;
+    int ret;
+
+    bench_setup();
+    cards[0]->gain_lo = 6;
+    bench_fields(0x1);
+    before = bench_first_try(TUNE_CHECK);
+
+    bench_begin(&s);
+    ret = mfrc522_rf_tune(&dev, TUNE_TRIALS, &best);
+    frames = sim.stats.rf_frames - s.stats.rf_frames;
+    ns = sim.now_ns - s.ns;
+    after = bench_first_try(TUNE_CHECK);
+
+    printf("\nrf tuning, card at the edge of the range, %u rounds per configuration:\n", TUNE_TRIALS);
+    if (ret) {
+        printf("  FAILED: %d\n", ret);
+        failures++;
+        return;
+    }
+    printf("  %llu frames, %.1f ms\n", (unsigned long long)frames, ns / 1e6);
+    printf("  picked RxGain %u, ModWidth 0x%02x, Force100ASK %u (%u/%u first try, %u errors)\n",
+           best.rf.rx_gain, best.rf.mod_width, best.rf.force_100ask, best.first_try, best.trials, best.errors);
+    printf("  first-try success over %u rounds: %u before, %u after\n", TUNE_CHECK, before, after);
+}
+
+/**
+ * @brief Two tokens enter the field at a random point of the poll cycle; measure until the policy unlocks
+*/
+static void bench_tap_latency(unsigned int poll_ms, unsigned int taps)
+{
+    struct mfrc522_inventory inv;
+    u64 poll_ns = (u64)poll_ms * 1000000, enter, next_poll, latency, sum = 0, max = 0;
+    unsigned long present;
+    unsigned int tap, i, polls, frames = 0, total_polls = 0;
+    u32 seed = 12345;
+
+    for (tap = 0; tap < taps; tap++) {
+        bench_setup();
+        memset(&inv, 0, sizeof(inv));
+        seed = seed * 1103515245 + 12345;
+        enter = sim.now_ns + (((u64)seed * poll_ns) >> 32);
+        next_poll = sim.now_ns;
+
+        for (polls = 0; polls < 100; polls++) {
+            if (sim.now_ns < next_poll)
+                mfrc522_sim_advance(&sim, next_poll - sim.now_ns);
+            next_poll = sim.now_ns + poll_ns;
+            if (sim.now_ns >= enter)
+                bench_fields(0x3);
+
+            if (mfrc522_inventory(&dev, &inv))
+                break;
+            frames += inv.frames;
+            total_polls++;
+
+            present = 0;
+            for (i = 0; i < inv.count; i++) {
+                int token = access_policy_match(&policy, &inv.uids[i]);
+
+                if (token >= 0)
+                    present |= 1UL << token;
+            }
+            if (access_policy_decide(&policy, present))
+                break;
+        }
+
+        latency = sim.now_ns - enter;
+        sum += latency;
+        if (latency > max)
+            max = latency;
+    }
+
+    printf("\ntap-to-decision, 2 of 3 tokens, poll every %u ms, %u taps:\n", poll_ms, taps);
+    printf("  mean %.1f us, max %.1f us, %.1f frames per inventory\n",
+           sum / 1000.0 / taps, max / 1000.0, total_polls ? (double)frames / total_polls : 0.0);
+}
+
+int main(int argc, char **argv)
+{
+    unsigned int poll_ms = DEFAULT_POLL_MS, taps = DEFAULT_TAPS;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "s:p:n:h")) != -1) {
+        switch (opt) {
+        case 's':
+            spi_hz = strtoul(optarg, NULL, 0);
+            break;
+        case 'p':
+            poll_ms = strtoul(optarg, NULL, 0);
+            break;
+        case 'n':
+            taps = strtoul(optarg, NULL, 0);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-s spi_hz] [-p poll_ms] [-n taps]\n", argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (!spi_hz || !poll_ms || !taps) {
+        fprintf(stderr, "spi_hz, poll_ms and taps must be non-zero\n");
+        return 1;
+    }
+
+    bench_setup();
+    printf("MFRC522 model: SPI %u Hz, %u ns per message\n\n", spi_hz, sim.spi_overhead_ns);
+    bench_operations();
+    bench_ndef();
+    bench_ntag();
+    bench_desfire();
+    bench_capture();
+    bench_recovery();
+    bench_lpcd();
+    bench_rf_tune();
+    bench_desfire_kat();
+    bench_tap_latency(poll_ms, taps);
+    if (failures) {
+        fprintf(stderr, "%u operations FAILED\n", failures);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,1799 @@
+/**
+ * @file mfrc522_core.c
+ * @brief Bus-independent MFRC522 protocol logic
+ *
+ * Everything in here goes through dev->ops, so this file builds both as part
+ * of the SPI kernel driver and as a host library for the simulator. Keep it
+ * free of kernel-only calls (no printk, no sleeping, no allocation).
+*/
+
+#include "mfrc522.h"
+
+#ifdef __KERNEL__
+#include <linux/module.h>
+#include "mfrc522_trace.h"
+#else
+#define EXPORT_SYMBOL_GPL(sym)
+#define trace_mfrc522_cmd_issue(cmd, tx_len, bit_framing) do { } while (0)
+#define trace_mfrc522_cmd_complete(cmd, irq, error, ret) do { } while (0)
+#endif
+
+#define MFRC522_DEFAULT_TIMEOUT_US 10000 // Software backstop behind the chip's timer (10 ms)
+#define MFRC522_FWT_US             1000  // ISO 14443-3 answers start 1172/fc (86 us) after the frame; 1 ms is ample
+#define MFRC522_FWT_ACTIVATION_US  4833  // ATS after RATS: 65536/fc (ISO 14443-4 5.2)
+#define MFRC522_FWT_WRITE_US       10000 // MIFARE Classic and NTAG ACK after the EEPROM is programmed
+#define MFRC522_FWT_DELTA_US       3625  // ISO 14443-4 7.2: the PCD waits FWT plus 49152/fc
+#define MFRC522_TIMER_FINE         169   // TPrescaler for a 25 us tick: (2 * 169 + 1) / 13.56 MHz
+#define MFRC522_TIMER_FINE_US      25    // Up to 1.6 s with the 16 bit reload
+#define MFRC522_TIMER_COARSE       3898  // 575 us tick, up to 37 s
+#define MFRC522_TIMER_COARSE_US    575
+#define MFRC522_RX_BYTE_US         85    // One byte and its parity bit at 106 kbit/s: 9 * 128/fc
+#define MFRC522_WATER_LEVEL        32    // HiAlert once the FIFO is half full: 32 bytes (2.7 ms at 106 kbit/s) to drain it
+#define MFRC522_RESET_TIMEOUT_US   50000 // Oscillator start-up after a soft reset
+#define MFRC522_LPCD_SETTLE_US     30    // Field and receiver settling before the ADC is read
+#define MFRC522_LPCD_THRESHOLD     2     // Default deviation in ADC steps that counts as a card
+
+// Self-test result for MFRC522 version 2.0 (datasheet section 16.1.1)
+const u8 mfrc522_selftest_v2[64] = {
+    0x00, 0xEB, 0x66, 0xBA, 0x57, 0xBF, 0x23, 0x95,
+    0xD0, 0xE3, 0x0D, 0x3D, 0x27, 0x89, 0x5C, 0xDE,
+    0x9D, 0x3B, 0xA7, 0x00, 0x21, 0x5B, 0x89, 0x82,
+    0x51, 0x3A, 0xEB, 0x02, 0x0C, 0xA5, 0x00, 0x49,
+    0x7C, 0x84, 0x4D, 0xB3, 0xCC, 0xD2, 0x1B, 0x81,
+    0x5D, 0x48, 0x76, 0xD5, 0x71, 0x61, 0x21, 0xA9,
+    0x86, 0x96, 0x83, 0x38, 0xCF, 0x9D, 0x5B, 0x6D,
+    0xDC, 0x15, 0xBA, 0x3E, 0x7D, 0x95, 0x3B, 0x2F
+};
+EXPORT_SYMBOL_GPL(mfrc522_selftest_v2);
+
+static const u8 mfrc522_sel_cmds[3] = { PICC_CMD_SEL_CL1, PICC_CMD_SEL_CL2, PICC_CMD_SEL_CL3 };
+
+// Candidates swept by mfrc522_rf_tune(), around the ModWidthReg reset value
+static const u8 mfrc522_tune_mod_widths[] = { MFRC522_MOD_WIDTH_RESET, 0x1E, 0x2E };
+
+static u64 mfrc522_deadline(struct mfrc522_dev *dev, u32 timeout_us)
+{
+    return dev->ops->now_ns(dev->priv) + (u64)timeout_us * 1000;
+}
+
+static bool mfrc522_expired(struct mfrc522_dev *dev, u64 deadline)
+{
+    return dev->ops->now_ns(dev->priv) > deadline;
+}
+
+static void mfrc522_event(struct mfrc522_dev *dev, enum mfrc522_event event, u8 value)
+{
+    if (dev->ops->event)
+        dev->ops->event(dev->priv, event, value);
+}
+
+int mfrc522_read_reg(struct mfrc522_dev *dev, u8 reg, u8 *val)
+{
+    return dev->ops->read(dev->priv, reg, val, 1);
+}
+EXPORT_SYMBOL_GPL(mfrc522_read_reg);
+
+int mfrc522_write_reg(struct mfrc522_dev *dev, u8 reg, u8 val)
+{
+    return dev->ops->write(dev->priv, reg, &val, 1);
+}
+EXPORT_SYMBOL_GPL(mfrc522_write_reg);
+
+int mfrc522_set_bits(struct mfrc522_dev *dev, u8 reg, u8 mask)
+{
+    u8 val;
+    int ret = mfrc522_read_reg(dev, reg, &val);
+
+    if (ret)
+        return ret;
+    if ((val & mask) == mask)
+        return 0; // Already set, save the write
+    return mfrc522_write_reg(dev, reg, val | mask);
+}
+EXPORT_SYMBOL_GPL(mfrc522_set_bits);
+
+int mfrc522_clear_bits(struct mfrc522_dev *dev, u8 reg, u8 mask)
+{
+    u8 val;
+    int ret = mfrc522_read_reg(dev, reg, &val);
+
+    if (ret)
+        return ret;
+    if (!(val & mask))
+        return 0;
+    return mfrc522_write_reg(dev, reg, val & ~mask);
+}
+EXPORT_SYMBOL_GPL(mfrc522_clear_bits);
+
+/**
+ * @brief Send a command to the MFRC522 command register
+ * @param dev Reader
+ * @param rcv_off Analogue part of the receiver is switched off
+ * @param power_down High: Soft power-down mode entered; Low: Wake up procedure begins
+ * @param command Command to send
+*/
+int mfrc522_send_command(struct mfrc522_dev *dev, u8 rcv_off, u8 power_down, u8 command)
+{
+    // From MFRC522 datasheet 9.3.1.2 CommandReg register (page 38)
+    // Bit  7   6     5       4         3..0
+    //      0   0  RcvOff  PowerDown  Command[3:0]
+    u8 data = (rcv_off ? MFRC522_RCV_OFF : 0) | (power_down ? MFRC522_POWER_DOWN : 0) | (command & 0x0F);
+
+    return mfrc522_write_reg(dev, CommandReg, data);
+}
+EXPORT_SYMBOL_GPL(mfrc522_send_command);
+
+void mfrc522_dev_init(struct mfrc522_dev *dev, const struct mfrc522_bus_ops *ops, void *priv)
+{
+    memset(dev, 0, sizeof(*dev));
+    dev->ops = ops;
+    dev->priv = priv;
+    dev->fwt_us = MFRC522_FWT_US;
+    dev->timeout_us = MFRC522_DEFAULT_TIMEOUT_US;
+    dev->rf.rx_gain = 4; // 33 dB, the RFCfgReg reset value
+    dev->rf.mod_width = MFRC522_MOD_WIDTH_RESET;
+    dev->rf.force_100ask = true; // 100% ASK is mandatory for ISO 14443A
+}
+EXPORT_SYMBOL_GPL(mfrc522_dev_init);
+
+int mfrc522_read_version(struct mfrc522_dev *dev, u8 *version)
+{
+    int ret = mfrc522_read_reg(dev, VersionReg, version);
+
+    if (ret)
+        return ret;
+    // 0x91 is version 1.0, 0x92 is version 2.0
+    if (*version != 0x91 && *version != 0x92)
+        return -ENODEV;
+    return 0;
+}
+EXPORT_SYMBOL_GPL(mfrc522_read_version);
+
+// The chip clears PowerDown once the oscillator is running again
+static int mfrc522_wait_oscillator(struct mfrc522_dev *dev)
+{
+    u64 deadline;
+    u8 val;
+    int ret;
+
+    deadline = mfrc522_deadline(dev, MFRC522_RESET_TIMEOUT_US);
+    do {
+        ret = mfrc522_read_reg(dev, CommandReg, &val);
+        if (ret)
+            return ret;
+        if (!(val & MFRC522_POWER_DOWN))
+            return 0;
+        if (mfrc522_expired(dev, deadline))
+            return -ETIMEDOUT;
+    } while (1);
+}
+
+int mfrc522_soft_reset(struct mfrc522_dev *dev)
+{
+    int ret;
+
+    ret = mfrc522_send_command(dev, 0, 0, MFRC522_CMD_SOFT_RESET);
+    if (ret)
+        return ret;
+    ret = mfrc522_wait_oscillator(dev);
+    if (ret)
+        return ret;
+
+    // TxModeReg, RxModeReg and the timer registers are back to their reset values
+    dev->crc_flags = 0;
+    dev->timer_prescaler = 0;
+    dev->timer_reload = 0;
+    return 0;
+}
+EXPORT_SYMBOL_GPL(mfrc522_soft_reset);
+
+/**
+ * @brief Enter soft power-down (datasheet 8.6.2)
+ *
+ * The oscillator and the antenna drivers stop, so every card in the field
+ * loses power. Registers keep their contents.
+*/
+int mfrc522_power_down(struct mfrc522_dev *dev)
+{
+    return mfrc522_send_command(dev, 0, 1, MFRC522_CMD_IDLE);
+}
+EXPORT_SYMBOL_GPL(mfrc522_power_down);
+
+/**
+ * @brief Leave soft power-down and wait until the oscillator is stable
+ *
+ * The antenna comes back with the TxControlReg setting it had before.
+*/
+int mfrc522_power_up(struct mfrc522_dev *dev)
+{
+    int ret;
+
+    ret = mfrc522_send_command(dev, 0, 0, MFRC522_CMD_IDLE);
+    if (ret)
+        return ret;
+    return mfrc522_wait_oscillator(dev);
+}
+EXPORT_SYMBOL_GPL(mfrc522_power_up);
+
+int mfrc522_antenna_on(struct mfrc522_dev *dev)
+{
+    return mfrc522_set_bits(dev, TxControlReg, MFRC522_TX_ANTENNA);
+}
+EXPORT_SYMBOL_GPL(mfrc522_antenna_on);
+
+int mfrc522_antenna_off(struct mfrc522_dev *dev)
+{
+    return mfrc522_clear_bits(dev, TxControlReg, MFRC522_TX_ANTENNA);
+}
+EXPORT_SYMBOL_GPL(mfrc522_antenna_off);
+
+/**
+ * @brief Program receiver gain and modulation and remember them for mfrc522_configure()
+*/
+int mfrc522_set_rf_config(struct mfrc522_dev *dev, const struct mfrc522_rf_config *rf)
+{
+    u8 rfcfg;
+    int ret;
+
+    if (rf->rx_gain > (MFRC522_RX_GAIN_MASK >> MFRC522_RX_GAIN_SHIFT))
+        return -EINVAL;
+
+    ret = mfrc522_read_reg(dev, RFCfgReg, &rfcfg);
+    if (ret)
+        return ret;
+    rfcfg = (rfcfg & ~MFRC522_RX_GAIN_MASK) | (rf->rx_gain << MFRC522_RX_GAIN_SHIFT);
+    ret = mfrc522_write_reg(dev, RFCfgReg, rfcfg);
+    if (ret)
+        return ret;
+    ret = mfrc522_write_reg(dev, ModWidthReg, rf->mod_width);
+    if (ret)
+        return ret;
+    ret = mfrc522_write_reg(dev, TxASKReg, rf->force_100ask ? MFRC522_FORCE_100ASK : 0);
+    if (ret)
+        return ret;
+
+    dev->rf = *rf;
+    return 0;
+}
+EXPORT_SYMBOL_GPL(mfrc522_set_rf_config);
+
+/**
+ * @brief Program the chip's timer to fire fwt_us after the end of the next transmission
+ *
+ * With TAuto the timer starts when the last bit is sent and stops once an
+ * answer begins, so TimerIRq means nothing answered within fwt_us. The finest
+ * tick whose 16 bit reload still covers fwt_us is used; longer waits are
+ * clamped to 37 s. Registers that already hold the value are not written.
+*/
+static int mfrc522_set_timer(struct mfrc522_dev *dev, u32 fwt_us)
+{
+    u16 prescaler = MFRC522_TIMER_FINE;
+    u32 ticks = (fwt_us + MFRC522_TIMER_FINE_US - 1) / MFRC522_TIMER_FINE_US;
+    u16 reload;
+    int ret;
+
+    if (ticks > 0x10000) {
+        prescaler = MFRC522_TIMER_COARSE;
+        ticks = (fwt_us + MFRC522_TIMER_COARSE_US - 1) / MFRC522_TIMER_COARSE_US;
+        if (ticks > 0x10000)
+            ticks = 0x10000;
+    }
+    reload = ticks ? ticks - 1 : 0; // The timer fires one tick after it counts down to 0
+
+    if (prescaler != dev->timer_prescaler) {
+        ret = mfrc522_write_reg(dev, TModeReg, MFRC522_TAUTO | ((prescaler >> 8) & MFRC522_TPRESCALER_HI));
+        if (!ret)
+            ret = mfrc522_write_reg(dev, TPrescalerReg, prescaler & 0xFF);
+        if (ret)
+            return ret;
+        dev->timer_prescaler = prescaler;
+    }
+    if (reload != dev->timer_reload) {
+        ret = mfrc522_write_reg(dev, TReloadRegH, reload >> 8);
+        if (!ret)
+            ret = mfrc522_write_reg(dev, TReloadRegL, reload & 0xFF);
+        if (ret)
+            return ret;
+        dev->timer_reload = reload;
+    }
+    return 0;
+}
+
+/**
+ * @brief Put a freshly reset chip into ISO 14443A reader mode and enable the antenna
+*/
+int mfrc522_configure(struct mfrc522_dev *dev)
+{
+    struct mfrc522_rf_config rf = dev->rf;
+    int ret;
+
+    ret = mfrc522_soft_reset(dev);
+    if (ret)
+        return ret;
+
+    ret = mfrc522_set_rf_config(dev, &rf);
+    if (ret)
+        return ret;
+
+    // CRC coprocessor preset 6363h (CRC_A), transmitter waits for the RF field
+    ret = mfrc522_write_reg(dev, ModeReg, MFRC522_MODE_CONFIG);
+    if (ret)
+        return ret;
+
+    // Clear ValuesAfterColl so bits received after a collision read back as 0
+    ret = mfrc522_write_reg(dev, CollReg, 0x00);
+    if (ret)
+        return ret;
+
+    ret = mfrc522_set_timer(dev, dev->fwt_us);
+    if (ret)
+        return ret;
+
+    ret = mfrc522_write_reg(dev, WaterLevelReg, MFRC522_WATER_LEVEL);
+    if (ret)
+        return ret;
+
+    return mfrc522_antenna_on(dev);
+}
+EXPORT_SYMBOL_GPL(mfrc522_configure);
+
+/**
+ * @brief Cancel whatever command is running, clear the IRQ bits and flush the FIFO
+ *
+ * What every command starts with, and the first step of mfrc522_recover(): it
+ * is enough after an exchange that was abandoned halfway.
+*/
+int mfrc522_idle(struct mfrc522_dev *dev)
+{
+    int ret;
+
+    ret = mfrc522_send_command(dev, 0, 0, MFRC522_CMD_IDLE);
+    if (ret)
+        return ret;
+    ret = mfrc522_write_reg(dev, ComIrqReg, 0x7F); // Clear all IRQ bits
+    if (ret)
+        return ret;
+    return mfrc522_write_reg(dev, FIFOLevelReg, MFRC522_FLUSH_FIFO);
+}
+EXPORT_SYMBOL_GPL(mfrc522_idle);
+
+/**
+ * @brief Cheap check that a configured chip is still there and still configured
+ * @return 0, -ENODEV if VersionReg reads wrong (chip gone or its SPI interface stuck),
+ *         -ESTALE if ModeReg is back at its reset value (a supply glitch reset the chip),
+ *         or the bus error
+ *
+ * Two register reads, so it can run every second. Only meaningful after mfrc522_configure().
+*/
+int mfrc522_check_health(struct mfrc522_dev *dev)
+{
+    u8 val;
+    int ret;
+
+    ret = mfrc522_read_version(dev, &val);
+    if (ret)
+        return ret;
+    ret = mfrc522_read_reg(dev, ModeReg, &val);
+    if (ret)
+        return ret;
+    return val == MFRC522_MODE_CONFIG ? 0 : -ESTALE;
+}
+EXPORT_SYMBOL_GPL(mfrc522_check_health);
+
+// Reconfigure after a reset; mfrc522_recover() hands the chip back with the field off
+static int mfrc522_recover_configure(struct mfrc522_dev *dev)
+{
+    int ret;
+
+    ret = mfrc522_configure(dev);
+    if (ret)
+        return ret;
+    ret = mfrc522_antenna_off(dev);
+    if (ret)
+        return ret;
+    return mfrc522_check_health(dev);
+}
+
+/**
+ * @brief Bring a chip that stopped behaving back, cheapest step first
+ * @param tier Set to the step that worked, or MFRC522_RECOVER_FAILED
+ * @return 0 once mfrc522_check_health() passes, else the last error
+ *
+ * Idle and flush, then soft reset, then ops->hard_reset() if there is one.
+ * A chip whose VersionReg reads wrong cannot take a SoftReset command over
+ * the bus either, so it goes straight to the hard reset. Both resets reapply
+ * dev->rf. The antenna is left off: cards lost power anyway, and the caller
+ * knows how long they need before the next REQA.
+*/
+int mfrc522_recover(struct mfrc522_dev *dev, enum mfrc522_recovery *tier)
+{
+    int ret;
+
+    *tier = MFRC522_RECOVER_IDLE;
+    ret = mfrc522_idle(dev);
+    if (!ret)
+        ret = mfrc522_check_health(dev);
+    if (!ret)
+        return 0;
+
+    if (ret != -ENODEV) {
+        *tier = MFRC522_RECOVER_SOFT_RESET;
+        ret = mfrc522_recover_configure(dev);
+        if (!ret)
+            return 0;
+    }
+
+    if (dev->ops->hard_reset) {
+        *tier = MFRC522_RECOVER_HARD_RESET;
+        ret = dev->ops->hard_reset(dev->priv);
+        if (!ret)
+            ret = mfrc522_recover_configure(dev);
+        if (!ret)
+            return 0;
+    }
+
+    *tier = MFRC522_RECOVER_FAILED;
+    return ret;
+}
+EXPORT_SYMBOL_GPL(mfrc522_recover);
+
+// Where an answer longer than the FIFO is collected while it arrives
+struct mfrc522_stream {
+    u8 *buf;
+    unsigned int len, cap;
+};
+
+// Move what the FIFO holds into the stream and rearm HiAlertIRq
+static int mfrc522_stream_drain(struct mfrc522_dev *dev, struct mfrc522_stream *stream)
+{
+    u8 level;
+    int ret;
+
+    ret = mfrc522_read_reg(dev, FIFOLevelReg, &level);
+    if (ret)
+        return ret;
+    level &= 0x7F;
+    if (stream->len + level > stream->cap)
+        return -ENOBUFS;
+    if (level) {
+        ret = dev->ops->read(dev->priv, FIFODataReg, stream->buf + stream->len, level);
+        if (ret)
+            return ret;
+        stream->len += level;
+    }
+    return mfrc522_write_reg(dev, ComIrqReg, MFRC522_IRQ_HI_ALERT); // Set1 clear: the bit is cleared
+}
+
+/**
+ * @brief Load the FIFO, start a command and wait for one of the IRQ bits in wait_irq
+ * @param stream NULL, or where the FIFO is emptied to on every HiAlertIRq while the command runs
+ *
+ * Transceive and MFAuthent wait for the card at most dev->fwt_us, counted by
+ * the chip's timer: TimerIRq ends them with -ETIMEDOUT. The software deadline
+ * only catches a chip that stopped responding altogether.
+*/
+static int mfrc522_run_command(struct mfrc522_dev *dev, u8 command, const u8 *tx, unsigned int tx_len,
+                               u8 bit_framing, u8 wait_irq, struct mfrc522_stream *stream)
+{
+    bool timed = command == MFRC522_CMD_TRANSCEIVE || command == MFRC522_CMD_MF_AUTHENT;
+    u32 timeout_us = dev->timeout_us;
+    u64 deadline;
+    u8 irq;
+    int ret;
+
+    if (tx_len > MFRC522_FIFO_SIZE)
+        return -EINVAL;
+
+    ret = mfrc522_idle(dev);
+    if (ret)
+        return ret;
+    if (timed) {
+        ret = mfrc522_set_timer(dev, dev->fwt_us);
+        if (ret)
+            return ret;
+        timeout_us += dev->fwt_us;
+    }
+    if (stream)
+        timeout_us += stream->cap * MFRC522_RX_BYTE_US; // A streamed answer may outlast the backstop by itself
+    if (tx_len) {
+        ret = dev->ops->write(dev->priv, FIFODataReg, tx, tx_len);
+        if (ret)
+            return ret;
+    }
+    ret = mfrc522_write_reg(dev, BitFramingReg, bit_framing);
+    if (ret)
+        return ret;
+    ret = mfrc522_send_command(dev, 0, 0, command);
+    if (ret)
+        return ret;
+    if (command == MFRC522_CMD_TRANSCEIVE) {
+        ret = mfrc522_write_reg(dev, BitFramingReg, bit_framing | MFRC522_START_SEND);
+        if (ret)
+            return ret;
+    }
+    dev->frames++;
+    trace_mfrc522_cmd_issue(command, tx_len, bit_framing);
+
+    deadline = mfrc522_deadline(dev, timeout_us);
+    do {
+        ret = mfrc522_read_reg(dev, ComIrqReg, &irq);
+        if (ret)
+            return ret;
+        if (irq & wait_irq)
+            break;
+        if (stream && (irq & MFRC522_IRQ_HI_ALERT)) {
+            ret = mfrc522_stream_drain(dev, stream);
+            if (ret) {
+                mfrc522_send_command(dev, 0, 0, MFRC522_CMD_IDLE);
+                return ret;
+            }
+            continue;
+        }
+        if ((timed && (irq & MFRC522_IRQ_TIMER)) || mfrc522_expired(dev, deadline)) {
+            mfrc522_send_command(dev, 0, 0, MFRC522_CMD_IDLE);
+            trace_mfrc522_cmd_complete(command, irq, 0, -ETIMEDOUT);
+            return -ETIMEDOUT;
+        }
+    } while (1);
+
+    ret = mfrc522_read_reg(dev, ErrorReg, &dev->error);
+    if (ret)
+        return ret;
+    if (dev->error)
+        mfrc522_event(dev, MFRC522_EVENT_ERROR, dev->error);
+    if (dev->error & (MFRC522_ERR_BUFFER_OVFL | MFRC522_ERR_PARITY | MFRC522_ERR_PROTOCOL | MFRC522_ERR_CRC))
+        dev->rf_errors++;
+    if (dev->error & (MFRC522_ERR_BUFFER_OVFL | MFRC522_ERR_PARITY | MFRC522_ERR_PROTOCOL))
+        ret = -EPROTO;
+    trace_mfrc522_cmd_complete(command, irq, dev->error, ret);
+    return ret;
+}
+
+/**
+ * @brief Program the CRC enables in TxModeReg/RxModeReg, skipping writes that would not change anything
+*/
+static int mfrc522_set_crc(struct mfrc522_dev *dev, u8 flags)
+{
+    u8 changed = (dev->crc_flags ^ flags) & (MFRC522_TX_CRC | MFRC522_RX_CRC);
+    int ret;
+
+    if (changed & MFRC522_TX_CRC) {
+        ret = mfrc522_write_reg(dev, TxModeReg, (flags & MFRC522_TX_CRC) ? MFRC522_CRC_EN : 0);
+        if (ret)
+            return ret;
+    }
+    if (changed & MFRC522_RX_CRC) {
+        ret = mfrc522_write_reg(dev, RxModeReg, (flags & MFRC522_RX_CRC) ? MFRC522_CRC_EN : 0);
+        if (ret)
+            return ret;
+    }
+    dev->crc_flags = flags & (MFRC522_TX_CRC | MFRC522_RX_CRC);
+    return 0;
+}
+
+// mfrc522_transceive() without the capture hook
+static int mfrc522_transceive_frame(struct mfrc522_dev *dev, const u8 *tx, unsigned int tx_len, u8 tx_last_bits,
+                                   u8 rx_align, u8 *rx, unsigned int *rx_len, u8 *rx_last_bits, u8 flags)
+{
+    struct mfrc522_stream stream = { .buf = rx, .cap = rx ? *rx_len : 0 };
+    u8 level, control;
+    int ret;
+
+    ret = mfrc522_set_crc(dev, flags);
+    if (ret)
+        return ret;
+
+    ret = mfrc522_run_command(dev, MFRC522_CMD_TRANSCEIVE, tx, tx_len, (rx_align << 4) | (tx_last_bits & 0x07),
+                              MFRC522_IRQ_RX | MFRC522_IRQ_IDLE, stream.cap > MFRC522_FIFO_SIZE ? &stream : NULL);
+    if (ret)
+        return ret;
+
+    if (rx) {
+        ret = mfrc522_read_reg(dev, FIFOLevelReg, &level);
+        if (ret)
+            return ret;
+        level &= 0x7F;
+        if (stream.len + level > stream.cap)
+            return -ENOBUFS;
+        if (level) {
+            ret = dev->ops->read(dev->priv, FIFODataReg, rx + stream.len, level);
+            if (ret)
+                return ret;
+        }
+        *rx_len = stream.len + level;
+
+        if (rx_last_bits) {
+            ret = mfrc522_read_reg(dev, ControlReg, &control);
+            if (ret)
+                return ret;
+            *rx_last_bits = control & 0x07;
+        }
+    }
+
+    if (dev->error & MFRC522_ERR_COLL)
+        return -EAGAIN;
+    if ((flags & MFRC522_RX_CRC) && (dev->error & MFRC522_ERR_CRC))
+        return -EBADMSG;
+    return 0;
+}
+
+/**
+ * @brief Hand a finished frame to ops->capture()
+ *
+ * Clean frames cost no extra bus traffic: the received bit count is only read
+ * from ControlReg when the caller did not ask for it and no CRC implies whole
+ * bytes, and CollReg only after a collision.
+*/
+static void mfrc522_capture(struct mfrc522_dev *dev, u64 start_ns, int ret, const u8 *tx, unsigned int tx_len,
+                            u8 tx_last_bits, const u8 *rx, unsigned int rx_len, const u8 *rx_last_bits, u8 flags)
+{
+    struct mfrc522_frame frame = {
+        .start_ns = start_ns,
+        .tx = tx,
+        .tx_len = tx_len,
+        .tx_last_bits = tx_last_bits & 0x07,
+        .flags = flags,
+        .result = ret,
+    };
+    u8 control;
+
+    // The FIFO was only read back on these paths
+    if (rx && (!ret || ret == -EAGAIN || ret == -EBADMSG)) {
+        frame.rx = rx;
+        frame.rx_len = rx_len;
+        if (rx_last_bits)
+            frame.rx_last_bits = *rx_last_bits;
+        else if (!(flags & MFRC522_RX_CRC) && !mfrc522_read_reg(dev, ControlReg, &control))
+            frame.rx_last_bits = control & 0x07;
+    }
+    if (ret != -ETIMEDOUT)
+        frame.error = dev->error;
+    if (frame.error & MFRC522_ERR_COLL)
+        mfrc522_read_reg(dev, CollReg, &frame.coll);
+    frame.end_ns = dev->ops->now_ns(dev->priv);
+    dev->ops->capture(dev->priv, &frame);
+}
+
+/**
+ * @brief Send a frame to the PICC and receive its answer
+ * @param tx Frame to send (without CRC, see flags)
+ * @param tx_last_bits Number of valid bits in the last transmitted byte (0 means 8)
+ * @param rx_align Bit position in the first received byte where the first received bit is stored
+ * @param rx Buffer for the answer, may be NULL if the answer is not needed. If it is larger than the FIFO, the
+ *           answer is streamed out of the FIFO while it arrives (see dev->stream_rx)
+ * @param rx_len In: size of rx. Out: number of bytes received
+ * @param rx_last_bits Out: number of valid bits in the last received byte (0 means 8), may be NULL
+ * @param flags MFRC522_TX_CRC / MFRC522_RX_CRC
+ * @return 0, -ETIMEDOUT if nothing answered, -EAGAIN on a bit collision (rx is still filled in),
+ *         -EBADMSG on a CRC error, -EPROTO on other RF errors or a negative bus error
+*/
+int mfrc522_transceive(struct mfrc522_dev *dev, const u8 *tx, unsigned int tx_len, u8 tx_last_bits,
+                       u8 rx_align, u8 *rx, unsigned int *rx_len, u8 *rx_last_bits, u8 flags)
+{
+    u64 start_ns;
+    int ret;
+
+    if (!dev->capture || !dev->ops->capture)
+        return mfrc522_transceive_frame(dev, tx, tx_len, tx_last_bits, rx_align, rx, rx_len, rx_last_bits, flags);
+
+    start_ns = dev->ops->now_ns(dev->priv);
+    ret = mfrc522_transceive_frame(dev, tx, tx_len, tx_last_bits, rx_align, rx, rx_len, rx_last_bits, flags);
+    mfrc522_capture(dev, start_ns, ret, tx, tx_len, tx_last_bits, rx, rx ? *rx_len : 0, rx_last_bits, flags);
+    return ret;
+}
+EXPORT_SYMBOL_GPL(mfrc522_transceive);
+
+/**
+ * @brief Send REQA or WUPA (short frame, 7 bits)
+ * @return 0 if at least one card answered; a collision in the ATQA still counts as an answer
+*/
+int mfrc522_request_a(struct mfrc522_dev *dev, u8 command, u8 atqa[2])
+{
+    unsigned int rx_len = 2;
+    u8 last_bits;
+    int ret;
+
+    ret = mfrc522_transceive(dev, &command, 1, 7, 0, atqa, &rx_len, &last_bits, 0);
+    if (ret == -EAGAIN)
+        return 0;
+    if (ret)
+        return ret;
+    if (rx_len != 2 || last_bits != 0)
+        return -EPROTO;
+    return 0;
+}
+EXPORT_SYMBOL_GPL(mfrc522_request_a);
+
+static int mfrc522_select_level(struct mfrc522_dev *dev, u8 sel, const u8 *cl_uid, u8 *sak)
+{
+    u8 buf[7] = { sel, 0x70, cl_uid[0], cl_uid[1], cl_uid[2], cl_uid[3] };
+    unsigned int rx_len = 1;
+    int ret;
+
+    buf[6] = cl_uid[0] ^ cl_uid[1] ^ cl_uid[2] ^ cl_uid[3]; // BCC
+    ret = mfrc522_transceive(dev, buf, sizeof(buf), 0, 0, sak, &rx_len, NULL, MFRC522_TX_CRC | MFRC522_RX_CRC);
+    if (ret)
+        return ret;
+    if (rx_len != 1)
+        return -EPROTO;
+    return 0;
+}
+
+/**
+ * @brief Resolve the 4 UID bytes of one cascade level with the bit-oriented anticollision loop
+*/
+static int mfrc522_anticoll_level(struct mfrc522_dev *dev, u8 sel, u8 *cl_uid)
+{
+    u8 buf[7] = { sel }; // SEL NVB UID0..3 BCC
+    u8 rx[5], last_bits, coll, mask;
+    unsigned int known = 0, bytes, bits, rx_len, i, pos;
+    int ret;
+
+    while (known < 32) {
+        bytes = known / 8;
+        bits = known % 8;
+        buf[1] = ((2 + bytes) << 4) | bits; // NVB: number of valid bits sent
+        rx_len = sizeof(rx);
+
+        ret = mfrc522_transceive(dev, buf, 2 + bytes + (bits ? 1 : 0), bits, bits, rx, &rx_len, &last_bits, 0);
+        if (ret && ret != -EAGAIN)
+            return ret;
+        if (!rx_len || 2 + bytes + rx_len > sizeof(buf))
+            return -EPROTO;
+
+        // Merge the answer behind the bits we already know
+        mask = (1 << bits) - 1;
+        buf[2 + bytes] = (buf[2 + bytes] & mask) | (rx[0] & ~mask);
+        for (i = 1; i < rx_len; i++)
+            buf[2 + bytes + i] = rx[i];
+
+        if (!ret)
+            break;
+
+        // Collision: take the bits up to the collision and choose the 1 branch
+        ret = mfrc522_read_reg(dev, CollReg, &coll);
+        if (ret)
+            return ret;
+        if (coll & MFRC522_COLL_POS_INVALID)
+            return -EPROTO;
+        pos = coll & MFRC522_COLL_POS_MASK;
+        if (!pos)
+            pos = 32;
+        if (pos <= known)
+            return -EPROTO;
+        known = pos;
+        buf[2 + (pos - 1) / 8] |= 1 << ((pos - 1) % 8);
+    }
+
+    if ((buf[2] ^ buf[3] ^ buf[4] ^ buf[5]) != buf[6])
+        return -EBADMSG;
+    memcpy(cl_uid, buf + 2, 4);
+    return 0;
+}
+
+/**
+ * @brief Run anticollision and SELECT on every cascade level of one card
+*/
+int mfrc522_select(struct mfrc522_dev *dev, struct mfrc522_uid *uid)
+{
+    u8 cl_uid[4], sak;
+    int level, ret;
+
+    uid->size = 0;
+    for (level = 0; level < 3; level++) {
+        ret = mfrc522_anticoll_level(dev, mfrc522_sel_cmds[level], cl_uid);
+        if (ret)
+            return ret;
+        ret = mfrc522_select_level(dev, mfrc522_sel_cmds[level], cl_uid, &sak);
+        if (ret)
+            return ret;
+
+        if (!(sak & PICC_SAK_CASCADE)) {
+            memcpy(uid->bytes + uid->size, cl_uid, 4);
+            uid->size += 4;
+            uid->sak = sak;
+            return 0;
+        }
+        if (cl_uid[0] != PICC_CMD_CT)
+            return -EPROTO;
+        memcpy(uid->bytes + uid->size, cl_uid + 1, 3);
+        uid->size += 3;
+    }
+    return -EPROTO;
+}
+EXPORT_SYMBOL_GPL(mfrc522_select);
+
+/**
+ * @brief SELECT a card whose UID is already known, skipping anticollision
+ *
+ * Only the card with this UID goes ACTIVE; other READY cards drop back to IDLE/HALT.
+*/
+int mfrc522_reselect(struct mfrc522_dev *dev, struct mfrc522_uid *uid)
+{
+    const u8 *p = uid->bytes;
+    unsigned int left = uid->size;
+    u8 cl_uid[4], sak;
+    int level, ret;
+
+    for (level = 0; level < 3; level++) {
+        if (left > 4) {
+            cl_uid[0] = PICC_CMD_CT;
+            memcpy(cl_uid + 1, p, 3);
+            p += 3;
+            left -= 3;
+        } else if (left == 4) {
+            memcpy(cl_uid, p, 4);
+            left = 0;
+        } else {
+            return -EINVAL;
+        }
+
+        ret = mfrc522_select_level(dev, mfrc522_sel_cmds[level], cl_uid, &sak);
+        if (ret)
+            return ret;
+        if (!left) {
+            if (sak & PICC_SAK_CASCADE)
+                return -EPROTO;
+            uid->sak = sak;
+            return 0;
+        }
+        if (!(sak & PICC_SAK_CASCADE))
+            return -EPROTO;
+    }
+    return -EINVAL;
+}
+EXPORT_SYMBOL_GPL(mfrc522_reselect);
+
+/**
+ * @brief Send HLTA; the card acknowledges by staying silent
+*/
+int mfrc522_halt_a(struct mfrc522_dev *dev)
+{
+    u8 buf[2] = { PICC_CMD_HLTA, 0x00 };
+    int ret;
+
+    ret = mfrc522_transceive(dev, buf, sizeof(buf), 0, 0, NULL, NULL, NULL, MFRC522_TX_CRC);
+    if (ret == -ETIMEDOUT)
+        return 0;
+    if (ret)
+        return ret;
+    return -EPROTO; // Any answer to HLTA is a NAK
+}
+EXPORT_SYMBOL_GPL(mfrc522_halt_a);
+
+bool mfrc522_uid_equal(const struct mfrc522_uid *a, const struct mfrc522_uid *b)
+{
+    return a->size == b->size && !memcmp(a->bytes, b->bytes, a->size);
+}
+EXPORT_SYMBOL_GPL(mfrc522_uid_equal);
+
+/**
+ * @brief Find every card in the field
+ *
+ * Cards found by the previous pass were left HALTed, so a plain REQA only
+ * wakes cards that arrived since. The known cards are confirmed with WUPA and
+ * a direct SELECT on their UID, which costs 2-4 frames instead of a full
+ * anticollision loop. Every card that answers is HALTed again.
+*/
+int mfrc522_inventory(struct mfrc522_dev *dev, struct mfrc522_inventory *inv)
+{
+    struct mfrc522_uid found[MFRC522_MAX_CARDS];
+    u64 frames = dev->frames;
+    unsigned int n = 0, i, failures = 0;
+    u8 atqa[2];
+    int ret = 0;
+
+    inv->t_answer = 0;
+    inv->t_resolved = 0;
+
+    for (i = 0; i < inv->count; i++) {
+        ret = mfrc522_request_a(dev, PICC_CMD_WUPA, atqa);
+        if (ret == -ETIMEDOUT)
+            goto done; // Field is empty, no need to look for new cards either
+        if (MFRC522_RF_ERROR(ret))
+            continue;
+        if (ret)
+            return ret;
+        if (!inv->t_answer)
+            inv->t_answer = dev->ops->now_ns(dev->priv);
+
+        found[n] = inv->uids[i];
+        ret = mfrc522_reselect(dev, &found[n]);
+        if (MFRC522_RF_ERROR(ret))
+            continue; // Gone, or too weak to answer this time
+        if (ret)
+            return ret;
+        inv->t_resolved = dev->ops->now_ns(dev->priv);
+        ret = mfrc522_halt_a(dev);
+        if (ret && !MFRC522_RF_ERROR(ret))
+            return ret;
+        n++;
+    }
+
+    while (n < MFRC522_MAX_CARDS && failures < 2) {
+        ret = mfrc522_request_a(dev, PICC_CMD_REQA, atqa);
+        if (ret == -ETIMEDOUT)
+            break;
+        if (MFRC522_RF_ERROR(ret)) {
+            if (++failures < 2)
+                mfrc522_event(dev, MFRC522_EVENT_RETRY, 0);
+            continue;
+        }
+        if (ret)
+            return ret;
+        if (!inv->t_answer)
+            inv->t_answer = dev->ops->now_ns(dev->priv);
+
+        ret = mfrc522_select(dev, &found[n]);
+        if (MFRC522_RF_ERROR(ret)) {
+            if (++failures < 2)
+                mfrc522_event(dev, MFRC522_EVENT_RETRY, 0);
+            continue;
+        }
+        if (ret)
+            return ret;
+        inv->t_resolved = dev->ops->now_ns(dev->priv);
+        ret = mfrc522_halt_a(dev);
+        if (ret && !MFRC522_RF_ERROR(ret))
+            return ret;
+        n++;
+    }
+
+done:
+    memcpy(inv->uids, found, n * sizeof(found[0]));
+    inv->count = n;
+    inv->frames = dev->frames - frames;
+    return 0;
+}
+EXPORT_SYMBOL_GPL(mfrc522_inventory);
+
+/**
+ * @brief Run trials WUPA + SELECT + HLTA rounds against the first card that answers
+*/
+static int mfrc522_tune_trials(struct mfrc522_dev *dev, unsigned int trials, struct mfrc522_tune_result *res)
+{
+    struct mfrc522_uid uid;
+    u64 errors = dev->rf_errors;
+    u8 atqa[2];
+    int ret;
+
+    res->rf = dev->rf;
+    res->trials = trials;
+    res->first_try = 0;
+    while (trials--) {
+        ret = mfrc522_request_a(dev, PICC_CMD_WUPA, atqa);
+        if (!ret)
+            ret = mfrc522_select(dev, &uid);
+        if (!ret)
+            res->first_try++;
+        else if (!MFRC522_RF_ERROR(ret))
+            return ret;
+        ret = mfrc522_halt_a(dev);
+        if (ret && !MFRC522_RF_ERROR(ret))
+            return ret;
+    }
+    res->errors = dev->rf_errors - errors;
+    return 0;
+}
+
+static bool mfrc522_tune_better(const struct mfrc522_tune_result *a, const struct mfrc522_tune_result *b)
+{
+    if (a->first_try != b->first_try)
+        return a->first_try > b->first_try;
+    return a->errors < b->errors;
+}
+
+/**
+ * @brief Sweep RxGain, ModWidth and Force100ASK against the cards in the field
+ * @param trials WUPA/SELECT rounds per configuration
+ * @param best Winning configuration and its score
+ *
+ * Ranks configurations by first-try success, then by frames with errors;
+ * ties keep the configuration tried first, which is the current one. The
+ * winner is programmed and becomes dev->rf. Returns -ENODEV if no card
+ * answered at all, leaving the previous configuration in place.
+*/
+int mfrc522_rf_tune(struct mfrc522_dev *dev, unsigned int trials, struct mfrc522_tune_result *best)
+{
+    struct mfrc522_rf_config orig = dev->rf, rf;
+    struct mfrc522_tune_result res;
+    unsigned int gain, width, ask;
+    int ret;
+
+    if (!trials)
+        return -EINVAL;
+
+    ret = mfrc522_tune_trials(dev, trials, best);
+    if (ret)
+        return ret;
+
+    for (ask = 0; ask < 2; ask++) {
+        for (width = 0; width < ARRAY_SIZE(mfrc522_tune_mod_widths); width++) {
+            for (gain = 0; gain <= (MFRC522_RX_GAIN_MASK >> MFRC522_RX_GAIN_SHIFT); gain++) {
+                rf.rx_gain = gain;
+                rf.mod_width = mfrc522_tune_mod_widths[width];
+                rf.force_100ask = !ask;
+                if (rf.rx_gain == orig.rx_gain && rf.mod_width == orig.mod_width &&
+                    rf.force_100ask == orig.force_100ask)
+                    continue; // Already scored
+                ret = mfrc522_set_rf_config(dev, &rf);
+                if (!ret)
+                    ret = mfrc522_tune_trials(dev, trials, &res);
+                if (ret)
+                    goto restore;
+                if (mfrc522_tune_better(&res, best))
+                    *best = res;
+            }
+        }
+    }
+
+    if (!best->first_try) {
+        ret = -ENODEV;
+        goto restore;
+    }
+    return mfrc522_set_rf_config(dev, &best->rf);
+
+restore:
+    mfrc522_set_rf_config(dev, &orig);
+    return ret;
+}
+EXPORT_SYMBOL_GPL(mfrc522_rf_tune);
+
+/**
+ * @brief Field on, receiver running, one TestADCReg sample, field off
+*/
+static int mfrc522_lpcd_sample(struct mfrc522_dev *dev, u8 *adc_i, u8 *adc_q)
+{
+    u64 deadline;
+    u8 val;
+    int ret;
+
+    ret = mfrc522_antenna_on(dev);
+    if (ret)
+        return ret;
+    ret = mfrc522_send_command(dev, 0, 0, MFRC522_CMD_RECEIVE);
+    if (ret)
+        goto out;
+    // Keep sampling until the field has settled; the last value counts
+    deadline = mfrc522_deadline(dev, MFRC522_LPCD_SETTLE_US);
+    do {
+        ret = mfrc522_read_reg(dev, TestADCReg, &val);
+    } while (!ret && !mfrc522_expired(dev, deadline));
+    if (!ret) {
+        *adc_i = val >> 4;
+        *adc_q = val & 0x0F;
+    }
+    mfrc522_send_command(dev, 0, 0, MFRC522_CMD_IDLE);
+out:
+    mfrc522_antenna_off(dev);
+    return ret;
+}
+
+/**
+ * @brief Average samples probes with the field empty to set the baseline
+*/
+int mfrc522_lpcd_calibrate(struct mfrc522_dev *dev, struct mfrc522_lpcd *lpcd, unsigned int samples)
+{
+    u32 sum_i = 0, sum_q = 0;
+    unsigned int n;
+    u8 adc_i, adc_q;
+    int ret;
+
+    if (!samples)
+        return -EINVAL;
+    for (n = 0; n < samples; n++) {
+        ret = mfrc522_lpcd_sample(dev, &adc_i, &adc_q);
+        if (ret)
+            return ret;
+        sum_i += adc_i;
+        sum_q += adc_q;
+    }
+    memset(lpcd, 0, sizeof(*lpcd));
+    lpcd->base_i = sum_i * 16 / samples;
+    lpcd->base_q = sum_q * 16 / samples;
+    lpcd->threshold = MFRC522_LPCD_THRESHOLD;
+    return 0;
+}
+EXPORT_SYMBOL_GPL(mfrc522_lpcd_calibrate);
+
+static unsigned int mfrc522_lpcd_deviation(u16 base, u8 sample)
+{
+    int diff = (int)sample * 16 - base;
+
+    return (diff < 0 ? -diff : diff) / 16;
+}
+
+/**
+ * @brief Probe for a card without sending any frame
+ *
+ * Leaves the antenna off. Samples within one ADC step of the baseline pull
+ * it by 1/8, which absorbs temperature and supply drift; anything further
+ * out is left alone so a card held at the edge of the range is not learned.
+*/
+int mfrc522_lpcd_probe(struct mfrc522_dev *dev, struct mfrc522_lpcd *lpcd, bool *detected)
+{
+    unsigned int dev_i, dev_q;
+    u8 adc_i, adc_q;
+    int ret;
+
+    ret = mfrc522_lpcd_sample(dev, &adc_i, &adc_q);
+    if (ret)
+        return ret;
+
+    lpcd->probes++;
+    lpcd->last_i = adc_i;
+    lpcd->last_q = adc_q;
+    dev_i = mfrc522_lpcd_deviation(lpcd->base_i, adc_i);
+    dev_q = mfrc522_lpcd_deviation(lpcd->base_q, adc_q);
+    *detected = dev_i >= lpcd->threshold || dev_q >= lpcd->threshold;
+    if (*detected) {
+        lpcd->wakes++;
+    } else if (!dev_i && !dev_q) {
+        lpcd->base_i += ((int)adc_i * 16 - (int)lpcd->base_i) / 8;
+        lpcd->base_q += ((int)adc_q * 16 - (int)lpcd->base_q) / 8;
+    }
+    return 0;
+}
+EXPORT_SYMBOL_GPL(mfrc522_lpcd_probe);
+
+/**
+ * @brief Report how many cards the inventory after a detection found
+*/
+void mfrc522_lpcd_result(struct mfrc522_lpcd *lpcd, unsigned int cards_found)
+{
+    if (!cards_found)
+        lpcd->false_wakes++;
+}
+EXPORT_SYMBOL_GPL(mfrc522_lpcd_result);
+
+// ISO 14443-4 block control bytes, without CID or NAD
+#define TCL_PCB_I          0x02
+#define TCL_PCB_CHAIN      0x10
+#define TCL_PCB_R_ACK      0xA2
+#define TCL_PCB_R_NAK      0xB2
+#define TCL_PCB_S_DESELECT 0xC2
+#define TCL_PCB_S_WTX      0xF2
+#define TCL_IS_I(pcb)      (((pcb) & 0xE2) == TCL_PCB_I)
+#define TCL_IS_R_ACK(pcb)  (((pcb) & 0xF6) == TCL_PCB_R_ACK)
+#define TCL_IS_S_WTX(pcb)  (((pcb) & 0xF7) == TCL_PCB_S_WTX)
+#define TCL_RECOVERIES     2 // Per block, ISO 14443-4 allows the PCD to give up after that
+
+// FSDI/FSCI to frame size (ISO 14443-4 table 1); higher codes mean 256
+static const u16 mfrc522_tcl_frame_sizes[] = { 16, 24, 32, 40, 48, 64, 96, 128, 256 };
+
+// (256 * 16 / fc) * 2^fwi, the FWT and SFGT formula, in us
+static u32 mfrc522_tcl_time_us(u8 fwi)
+{
+    return (u32)(((u64)4096 << fwi) * 100 / 1356);
+}
+
+// Let us pass, asleep through ops->delay() if the bus has one; SFGI 14 is almost 5 s
+static int mfrc522_tcl_wait(struct mfrc522_dev *dev, u32 us)
+{
+    u64 deadline;
+    u8 status;
+    int ret;
+
+    if (dev->ops->delay) {
+        dev->ops->delay(dev->priv, us);
+        return 0;
+    }
+    deadline = mfrc522_deadline(dev, us);
+    do {
+        ret = mfrc522_read_reg(dev, Status1Reg, &status);
+        if (ret)
+            return ret;
+    } while (!mfrc522_expired(dev, deadline));
+    return 0;
+}
+
+/**
+ * @brief Send RATS to the selected card and take the frame sizes and waiting time from its ATS
+ * @param fsd Largest frame to ask for; rounded down to a valid FSD and to MFRC522_TCL_FSD_MAX
+*/
+int mfrc522_tcl_activate(struct mfrc522_dev *dev, struct mfrc522_tcl *tcl, u16 fsd)
+{
+    unsigned int len = sizeof(tcl->ats), i, fsdi = 0;
+    u32 fwt = dev->fwt_us;
+    u8 rats[2], t0, fwi = 4, sfgi = 0;
+    int ret;
+
+    for (i = 0; i < ARRAY_SIZE(mfrc522_tcl_frame_sizes); i++)
+        if (mfrc522_tcl_frame_sizes[i] <= fsd && mfrc522_tcl_frame_sizes[i] <= MFRC522_TCL_FSD_MAX)
+            fsdi = i;
+
+    memset(tcl, 0, sizeof(*tcl));
+    tcl->fsd = mfrc522_tcl_frame_sizes[fsdi];
+    rats[0] = PICC_CMD_RATS;
+    rats[1] = fsdi << 4; // CID 0
+    dev->fwt_us = MFRC522_FWT_ACTIVATION_US;
+    ret = mfrc522_transceive(dev, rats, sizeof(rats), 0, 0, tcl->ats, &len, NULL, MFRC522_TX_CRC | MFRC522_RX_CRC);
+    dev->fwt_us = fwt;
+    if (ret)
+        return ret;
+    if (!len || tcl->ats[0] != len)
+        return -EPROTO;
+    tcl->ats_len = len;
+
+    // T0 announces TA (bit rates, only 106 kbit/s is used), TB (FWI, SFGI) and TC; FSCI defaults to 2
+    t0 = len > 1 ? tcl->ats[1] : 0x02;
+    i = t0 & 0x0F;
+    tcl->fsc = mfrc522_tcl_frame_sizes[i < ARRAY_SIZE(mfrc522_tcl_frame_sizes) ? i : ARRAY_SIZE(mfrc522_tcl_frame_sizes) - 1];
+    i = 2 + !!(t0 & 0x10);
+    if ((t0 & 0x20) && i < len) {
+        fwi = tcl->ats[i] >> 4;
+        sfgi = tcl->ats[i] & 0x0F;
+    }
+    if (fwi == 15)
+        fwi = 4;
+    tcl->fwt_us = mfrc522_tcl_time_us(fwi);
+
+    // The card may need a guard time after the ATS before it takes the first block
+    if (sfgi && sfgi != 15)
+        return mfrc522_tcl_wait(dev, mfrc522_tcl_time_us(sfgi));
+    return 0;
+}
+EXPORT_SYMBOL_GPL(mfrc522_tcl_activate);
+
+/**
+ * @brief Send one block and receive the answer, granting any S(WTX) requests on the way
+*/
+static int mfrc522_tcl_block(struct mfrc522_dev *dev, struct mfrc522_tcl *tcl, const u8 *tx, unsigned int tx_len,
+                             u8 *rx, unsigned int *rx_len)
+{
+    unsigned int cap = *rx_len;
+    u32 fwt = dev->fwt_us;
+    u8 wtx[2];
+    int ret;
+
+    dev->fwt_us = tcl->fwt_us + MFRC522_FWT_DELTA_US;
+    for (;;) {
+        *rx_len = cap;
+        ret = mfrc522_transceive(dev, tx, tx_len, 0, 0, rx, rx_len, NULL, MFRC522_TX_CRC | MFRC522_RX_CRC);
+        if (ret || !*rx_len || !TCL_IS_S_WTX(rx[0]))
+            break;
+        // The card needs WTXM times the FWT for this answer: confirm with the same WTXM
+        if (*rx_len < 2 || !(rx[1] & 0x3F)) {
+            ret = -EPROTO;
+            break;
+        }
+        wtx[0] = TCL_PCB_S_WTX;
+        wtx[1] = rx[1] & 0x3F;
+        tx = wtx;
+        tx_len = sizeof(wtx);
+        dev->fwt_us = tcl->fwt_us * wtx[1] + MFRC522_FWT_DELTA_US;
+        tcl->wtx++;
+    }
+    dev->fwt_us = fwt;
+    return ret;
+}
+
+/**
+ * @brief mfrc522_tcl_block() with the ISO 14443-4 error recovery
+ * @param chaining The card is sending a chain: recover with R(ACK) instead of R(NAK)
+ *
+ * After a timeout or a garbled answer the card is asked for its last block
+ * again. A card that never got ours answers R(NAK) with an R(ACK) carrying
+ * the other block number, and ours is sent again.
+*/
+static int mfrc522_tcl_send(struct mfrc522_dev *dev, struct mfrc522_tcl *tcl, const u8 *tx, unsigned int tx_len,
+                            u8 *rx, unsigned int *rx_len, bool chaining)
+{
+    u8 recover = (chaining ? TCL_PCB_R_ACK : TCL_PCB_R_NAK) | tcl->block_num;
+    unsigned int cap = *rx_len, tries;
+    int ret;
+
+    ret = mfrc522_tcl_block(dev, tcl, tx, tx_len, rx, rx_len);
+    for (tries = 0; MFRC522_RF_ERROR(ret) && tries < TCL_RECOVERIES; tries++) {
+        mfrc522_event(dev, MFRC522_EVENT_RETRY, 0);
+        tcl->recoveries++;
+        *rx_len = cap;
+        ret = mfrc522_tcl_block(dev, tcl, &recover, 1, rx, rx_len);
+        if (!ret && !chaining && *rx_len == 1 && TCL_IS_R_ACK(rx[0]) && (rx[0] & 0x01) != tcl->block_num) {
+            *rx_len = cap;
+            ret = mfrc522_tcl_block(dev, tcl, tx, tx_len, rx, rx_len);
+        }
+    }
+    return ret;
+}
+
+/**
+ * @brief Send a command (INF field) to the card and receive its answer, chaining both ways as needed
+ * @param rx_len In: size of rx. Out: bytes of answer
+ *
+ * Commands are cut into blocks of at most FSC bytes and answers arrive in
+ * blocks of at most FSD bytes, so a larger FSD means fewer I-blocks and
+ * fewer R(ACK) round trips for long answers.
+*/
+int mfrc522_tcl_exchange(struct mfrc522_dev *dev, struct mfrc522_tcl *tcl, const u8 *tx, unsigned int tx_len,
+                         u8 *rx, unsigned int *rx_len)
+{
+    unsigned int max_inf = (tcl->fsc < MFRC522_FIFO_SIZE ? tcl->fsc : MFRC522_FIFO_SIZE) - 3; // PCB and CRC_A
+    u8 frame[MFRC522_FIFO_SIZE], resp[MFRC522_FIFO_SIZE];
+    unsigned int off = 0, chunk, n, got = 0, resends = 0;
+    bool more;
+    int ret;
+
+    // Send, waiting for an R(ACK) after every block but the last
+    for (;;) {
+        chunk = tx_len - off < max_inf ? tx_len - off : max_inf;
+        more = off + chunk < tx_len;
+        frame[0] = TCL_PCB_I | (more ? TCL_PCB_CHAIN : 0) | tcl->block_num;
+        memcpy(frame + 1, tx + off, chunk);
+        n = sizeof(resp);
+        ret = mfrc522_tcl_send(dev, tcl, frame, chunk + 1, resp, &n, false);
+        if (ret)
+            return ret;
+        tcl->i_blocks++;
+        if (!n)
+            return -EPROTO;
+        if (!more)
+            break;
+        if (!TCL_IS_R_ACK(resp[0]))
+            return -EPROTO;
+        if ((resp[0] & 0x01) != tcl->block_num) {
+            if (++resends > TCL_RECOVERIES)
+                return -EPROTO;
+            continue; // Not acknowledged: send the same block again
+        }
+        tcl->block_num ^= 1;
+        off += chunk;
+    }
+
+    // Receive, acknowledging every chained block
+    for (;;) {
+        if (!TCL_IS_I(resp[0]) || (resp[0] & 0x01) != tcl->block_num)
+            return -EPROTO;
+        tcl->i_blocks++;
+        tcl->block_num ^= 1;
+        if (n - 1 > *rx_len - got)
+            return -ENOBUFS;
+        memcpy(rx + got, resp + 1, n - 1);
+        got += n - 1;
+        if (!(resp[0] & TCL_PCB_CHAIN))
+            break;
+
+        frame[0] = TCL_PCB_R_ACK | tcl->block_num;
+        n = sizeof(resp);
+        ret = mfrc522_tcl_send(dev, tcl, frame, 1, resp, &n, true);
+        if (ret)
+            return ret;
+        tcl->r_blocks++;
+        if (!n)
+            return -EPROTO;
+    }
+    *rx_len = got;
+    return 0;
+}
+EXPORT_SYMBOL_GPL(mfrc522_tcl_exchange);
+
+/**
+ * @brief Send S(DESELECT); the card goes to HALT as after HLTA
+*/
+int mfrc522_tcl_deselect(struct mfrc522_dev *dev, struct mfrc522_tcl *tcl)
+{
+    u8 deselect = TCL_PCB_S_DESELECT, resp[MFRC522_FIFO_SIZE];
+    unsigned int n = sizeof(resp);
+    int ret;
+
+    ret = mfrc522_tcl_block(dev, tcl, &deselect, 1, resp, &n);
+    if (ret)
+        return ret;
+    return n == 1 && resp[0] == TCL_PCB_S_DESELECT ? 0 : -EPROTO;
+}
+EXPORT_SYMBOL_GPL(mfrc522_tcl_deselect);
+
+/**
+ * @brief Three-pass MIFARE Classic authentication (MFAuthent command)
+ * @param key_type PICC_CMD_MF_AUTH_KEY_A or PICC_CMD_MF_AUTH_KEY_B
+ * @param uid Selected card; the last 4 UID bytes take part in the authentication
+*/
+int mfrc522_mifare_auth(struct mfrc522_dev *dev, u8 key_type, u8 block, const u8 *key, const struct mfrc522_uid *uid)
+{
+    u8 buf[2 + MFRC522_MF_KEY_SIZE + 4];
+    u8 status2;
+    int ret;
+
+    if (uid->size < 4)
+        return -EINVAL;
+
+    buf[0] = key_type;
+    buf[1] = block;
+    memcpy(buf + 2, key, MFRC522_MF_KEY_SIZE);
+    memcpy(buf + 2 + MFRC522_MF_KEY_SIZE, uid->bytes + uid->size - 4, 4);
+
+    ret = mfrc522_run_command(dev, MFRC522_CMD_MF_AUTHENT, buf, sizeof(buf), 0, MFRC522_IRQ_IDLE, NULL);
+    if (ret)
+        return ret;
+
+    ret = mfrc522_read_reg(dev, Status2Reg, &status2);
+    if (ret)
+        return ret;
+    if (!(status2 & MFRC522_CRYPTO1_ON))
+        return -EACCES;
+    return 0;
+}
+EXPORT_SYMBOL_GPL(mfrc522_mifare_auth);
+
+int mfrc522_mifare_stop_crypto1(struct mfrc522_dev *dev)
+{
+    return mfrc522_clear_bits(dev, Status2Reg, MFRC522_CRYPTO1_ON);
+}
+EXPORT_SYMBOL_GPL(mfrc522_mifare_stop_crypto1);
+
+int mfrc522_mifare_read(struct mfrc522_dev *dev, u8 block, u8 *data)
+{
+    u8 cmd[2] = { PICC_CMD_MF_READ, block };
+    unsigned int rx_len = MFRC522_MF_BLOCK_SIZE;
+    int ret;
+
+    ret = mfrc522_transceive(dev, cmd, sizeof(cmd), 0, 0, data, &rx_len, NULL, MFRC522_TX_CRC | MFRC522_RX_CRC);
+    if (ret)
+        return ret;
+    if (rx_len != MFRC522_MF_BLOCK_SIZE)
+        return -EPROTO;
+    return 0;
+}
+EXPORT_SYMBOL_GPL(mfrc522_mifare_read);
+
+// Send a frame the card answers with a 4 bit ACK, waiting up to fwt_us for it
+static int mfrc522_mifare_ack(struct mfrc522_dev *dev, const u8 *tx, unsigned int tx_len, u32 fwt_us)
+{
+    unsigned int rx_len = 1;
+    u32 fwt = dev->fwt_us;
+    u8 ack, last_bits;
+    int ret;
+
+    dev->fwt_us = fwt_us;
+    ret = mfrc522_transceive(dev, tx, tx_len, 0, 0, &ack, &rx_len, &last_bits, MFRC522_TX_CRC);
+    dev->fwt_us = fwt;
+    if (ret)
+        return ret;
+    if (rx_len != 1 || last_bits != 4 || (ack & 0x0F) != PICC_MF_ACK)
+        return -EPROTO;
+    return 0;
+}
+
+/**
+ * @brief Two-phase MIFARE Classic write of one 16 byte block
+*/
+int mfrc522_mifare_write(struct mfrc522_dev *dev, u8 block, const u8 *data)
+{
+    u8 cmd[2] = { PICC_CMD_MF_WRITE, block };
+    int ret;
+
+    ret = mfrc522_mifare_ack(dev, cmd, sizeof(cmd), dev->fwt_us);
+    if (ret)
+        return ret;
+    return mfrc522_mifare_ack(dev, data, MFRC522_MF_BLOCK_SIZE, MFRC522_FWT_WRITE_US);
+}
+EXPORT_SYMBOL_GPL(mfrc522_mifare_write);
+
+/**
+ * @brief NTAG/Ultralight WRITE of one 4 byte page (single phase, same ACK as MIFARE)
+*/
+int mfrc522_ultralight_write(struct mfrc522_dev *dev, u8 page, const u8 *data)
+{
+    u8 cmd[2 + MFRC522_UL_PAGE_SIZE] = { PICC_CMD_UL_WRITE, page };
+
+    memcpy(cmd + 2, data, MFRC522_UL_PAGE_SIZE);
+    return mfrc522_mifare_ack(dev, cmd, sizeof(cmd), MFRC522_FWT_WRITE_US);
+}
+EXPORT_SYMBOL_GPL(mfrc522_ultralight_write);
+
+/**
+ * @brief Pages mfrc522_ntag_read() asks for in one FAST_READ
+ *
+ * What fits the FIFO, unless the bus is fast enough to empty it while a
+ * longer answer is still arriving (dev->stream_rx).
+*/
+unsigned int mfrc522_ntag_frame_pages(const struct mfrc522_dev *dev)
+{
+    return dev->stream_rx ? MFRC522_UL_FAST_READ_MAX : MFRC522_FIFO_SIZE / MFRC522_UL_PAGE_SIZE;
+}
+EXPORT_SYMBOL_GPL(mfrc522_ntag_frame_pages);
+
+// FAST_READ of pages start to end, both included
+static int mfrc522_ntag_fast_read(struct mfrc522_dev *dev, u8 start, u8 end, u8 *data)
+{
+    u8 cmd[3] = { PICC_CMD_UL_FAST_READ, start, end };
+    unsigned int len = (end - start + 1) * MFRC522_UL_PAGE_SIZE, rx_len = len;
+    int ret;
+
+    ret = mfrc522_transceive(dev, cmd, sizeof(cmd), 0, 0, data, &rx_len, NULL, MFRC522_TX_CRC | MFRC522_RX_CRC);
+    if (ret)
+        return ret;
+    return rx_len == len ? 0 : -EPROTO;
+}
+
+/**
+ * @brief Read count pages of an NTAG21x from page on, mfrc522_ntag_frame_pages() per FAST_READ
+ *
+ * A streamed answer that overflowed the FIFO anyway (the host was held up
+ * too long) is read again in FIFO-sized pieces.
+ * @return 0, -EINVAL past page 255, or an error of mfrc522_transceive(); a NAK
+ *         (address out of range or read-protected) is -EBADMSG
+*/
+int mfrc522_ntag_read(struct mfrc522_dev *dev, u8 page, unsigned int count, u8 *data)
+{
+    unsigned int max = mfrc522_ntag_frame_pages(dev), n;
+    int ret;
+
+    if (!count || page + count > 256)
+        return -EINVAL;
+
+    while (count) {
+        n = count < max ? count : max;
+        ret = mfrc522_ntag_fast_read(dev, page, page + n - 1, data);
+        if (ret == -EPROTO && (dev->error & MFRC522_ERR_BUFFER_OVFL) && n * MFRC522_UL_PAGE_SIZE > MFRC522_FIFO_SIZE) {
+            max = MFRC522_FIFO_SIZE / MFRC522_UL_PAGE_SIZE;
+            continue;
+        }
+        if (ret)
+            return ret;
+        page += n;
+        data += n * MFRC522_UL_PAGE_SIZE;
+        count -= n;
+    }
+    return 0;
+}
+EXPORT_SYMBOL_GPL(mfrc522_ntag_read);
+
+/**
+ * @brief NTAG21x PWD_AUTH: unlock the pages from AUTH0 on until the card is halted or leaves the field
+ * @param pwd MFRC522_UL_PWD_SIZE bytes
+ * @param pack Out: MFRC522_UL_PACK_SIZE byte password acknowledge the card answers with, may be NULL
+ * @return 0, -EACCES if the card NAKs the password (it then drops back to IDLE)
+*/
+int mfrc522_ntag_pwd_auth(struct mfrc522_dev *dev, const u8 *pwd, u8 *pack)
+{
+    u8 cmd[1 + MFRC522_UL_PWD_SIZE] = { PICC_CMD_UL_PWD_AUTH };
+    u8 rx[MFRC522_UL_PACK_SIZE];
+    unsigned int rx_len = sizeof(rx);
+    int ret;
+
+    memcpy(cmd + 1, pwd, MFRC522_UL_PWD_SIZE);
+    ret = mfrc522_transceive(dev, cmd, sizeof(cmd), 0, 0, rx, &rx_len, NULL, MFRC522_TX_CRC | MFRC522_RX_CRC);
+    if (ret == -EBADMSG && rx_len == 1)
+        return -EACCES; // A 4 bit NAK carries no CRC
+    if (ret)
+        return ret;
+    if (rx_len != sizeof(rx))
+        return -EPROTO;
+    if (pack)
+        memcpy(pack, rx, sizeof(rx));
+    return 0;
+}
+EXPORT_SYMBOL_GPL(mfrc522_ntag_pwd_auth);
+
+/**
+ * @brief mfrc522_ntag_read() of a card found by mfrc522_inventory()
+ * @param pwd Password for mfrc522_ntag_pwd_auth() first, NULL for none
+ *
+ * Wakes and selects the card, reads the pages and HALTs the card again.
+*/
+int mfrc522_ntag_read_card(struct mfrc522_dev *dev, const struct mfrc522_uid *uid, const u8 *pwd, u8 page,
+                           unsigned int count, u8 *data)
+{
+    struct mfrc522_uid selected = *uid;
+    u8 atqa[2];
+    int ret, halt;
+
+    ret = mfrc522_request_a(dev, PICC_CMD_WUPA, atqa);
+    if (!ret)
+        ret = mfrc522_reselect(dev, &selected);
+    if (!ret && pwd)
+        ret = mfrc522_ntag_pwd_auth(dev, pwd, NULL);
+    if (!ret)
+        ret = mfrc522_ntag_read(dev, page, count, data);
+    halt = mfrc522_halt_a(dev);
+    if (!ret && !MFRC522_RF_ERROR(halt))
+        ret = halt;
+    return ret;
+}
+EXPORT_SYMBOL_GPL(mfrc522_ntag_read_card);
+
+/**
+ * @brief CRC_A (ISO 14443-3), as computed by the CalcCRC command with the ModeReg preset of 6363h
+*/
+u16 mfrc522_crc_a(const u8 *data, unsigned int len)
+{
+    u16 crc = 0x6363;
+    u8 ch;
+
+    while (len--) {
+        ch = *data++ ^ (u8)(crc & 0xFF);
+        ch ^= (u8)(ch << 4);
+        crc = (crc >> 8) ^ ((u16)ch << 8) ^ ((u16)ch << 3) ^ ((u16)ch >> 4);
+    }
+    return crc;
+}
+EXPORT_SYMBOL_GPL(mfrc522_crc_a);
+
+/**
+ * @brief READ 16 bytes at addr and return their CRC_A instead of the data
+ *
+ * The answer is left in the FIFO and the chip's CRC coprocessor runs over it,
+ * so verifying a block costs two register reads on the bus instead of a 16
+ * byte FIFO burst. Works for MIFARE Classic blocks and NTAG/Ultralight pages.
+*/
+int mfrc522_read_crc(struct mfrc522_dev *dev, u8 addr, u16 *crc)
+{
+    u8 cmd[2] = { PICC_CMD_MF_READ, addr };
+    u8 level, irq, lo, hi;
+    u64 deadline;
+    int ret;
+
+    ret = mfrc522_transceive(dev, cmd, sizeof(cmd), 0, 0, NULL, NULL, NULL, MFRC522_TX_CRC | MFRC522_RX_CRC);
+    if (ret)
+        return ret;
+    ret = mfrc522_read_reg(dev, FIFOLevelReg, &level);
+    if (ret)
+        return ret;
+    if ((level & 0x7F) != MFRC522_MF_BLOCK_SIZE)
+        return -EPROTO; // A NAK, not a block
+
+    ret = mfrc522_write_reg(dev, DivIrqReg, MFRC522_IRQ_CRC);
+    if (!ret)
+        ret = mfrc522_send_command(dev, 0, 0, MFRC522_CMD_CALC_CRC);
+    if (ret)
+        return ret;
+    deadline = mfrc522_deadline(dev, dev->timeout_us);
+    do {
+        ret = mfrc522_read_reg(dev, DivIrqReg, &irq);
+        if (ret)
+            return ret;
+        if (irq & MFRC522_IRQ_CRC)
+            break;
+        if (mfrc522_expired(dev, deadline))
+            return -ETIMEDOUT;
+    } while (1);
+
+    ret = mfrc522_read_reg(dev, CRCResultRegL, &lo);
+    if (!ret)
+        ret = mfrc522_read_reg(dev, CRCResultRegH, &hi);
+    if (!ret)
+        *crc = (u16)hi << 8 | lo;
+    return ret;
+}
+EXPORT_SYMBOL_GPL(mfrc522_read_crc);
+
+// Wake a HALTed card, select it by UID and authenticate the sector holding block
+static int mfrc522_mifare_open(struct mfrc522_dev *dev, const struct mfrc522_uid *uid, u8 key_type, const u8 *key, u8 block)
+{
+    struct mfrc522_uid selected = *uid;
+    u8 atqa[2];
+    int ret;
+
+    ret = mfrc522_request_a(dev, PICC_CMD_WUPA, atqa);
+    if (!ret)
+        ret = mfrc522_reselect(dev, &selected);
+    if (!ret)
+        ret = mfrc522_mifare_auth(dev, key_type, block, key, uid);
+    return ret;
+}
+
+// HLTA goes out still encrypted, then Crypto1 is switched off for the next card
+static int mfrc522_mifare_close(struct mfrc522_dev *dev, int ret)
+{
+    int halt;
+
+    halt = mfrc522_halt_a(dev);
+    if (!ret && !MFRC522_RF_ERROR(halt))
+        ret = halt;
+    halt = mfrc522_mifare_stop_crypto1(dev);
+    return ret ? ret : halt;
+}
+
+/**
+ * @brief Read count consecutive blocks of one sector of a HALTed card
+ * @param uid Card as found by mfrc522_inventory(), which leaves it HALTed
+ * @param data count * MFRC522_MF_BLOCK_SIZE bytes
+ *
+ * Wakes and selects the card, authenticates once, reads the blocks and HALTs
+ * the card again.
+*/
+int mfrc522_mifare_read_card(struct mfrc522_dev *dev, const struct mfrc522_uid *uid, u8 key_type, const u8 *key,
+                             u8 block, unsigned int count, u8 *data)
+{
+    unsigned int i;
+    int ret;
+
+    if (!count || block / MFRC522_MF_SECTOR_BLOCKS != (block + count - 1) / MFRC522_MF_SECTOR_BLOCKS)
+        return -EINVAL;
+
+    ret = mfrc522_mifare_open(dev, uid, key_type, key, block);
+    for (i = 0; i < count && !ret; i++)
+        ret = mfrc522_mifare_read(dev, block + i, data + i * MFRC522_MF_BLOCK_SIZE);
+    return mfrc522_mifare_close(dev, ret);
+}
+EXPORT_SYMBOL_GPL(mfrc522_mifare_read_card);
+
+/**
+ * @brief Write one block of a HALTed card, waking, selecting and authenticating it first
+*/
+int mfrc522_mifare_write_card(struct mfrc522_dev *dev, const struct mfrc522_uid *uid, u8 key_type, const u8 *key,
+                              u8 block, const u8 *data)
+{
+    int ret;
+
+    ret = mfrc522_mifare_open(dev, uid, key_type, key, block);
+    if (!ret)
+        ret = mfrc522_mifare_write(dev, block, data);
+    return mfrc522_mifare_close(dev, ret);
+}
+EXPORT_SYMBOL_GPL(mfrc522_mifare_write_card);
+
+int mfrc522_self_test(struct mfrc522_dev *dev)
+{
+    /*
+        Procedure to perform a self-test on the MFRC522 (datasheet section 16.1.1):
+        1. Perform a soft reset.
+        2. Clear the internal buffer by writing 25 bytes of 00h and implement the Config command.
+        3. Enable the self test by writing 09h to the AutoTestReg register.
+        4. Write 00h to the FIFO buffer.
+        5. Start the self test with the CalcCRC command.
+        6. The self test is initiated.
+        7. When the self test has completed, the FIFO buffer contains the 64 bytes in mfrc522_selftest_v2.
+    */
+    u8 zeros[25] = {0};
+    u8 zero = 0;
+    u8 result[64];
+    u8 level;
+    u64 deadline;
+    int ret;
+
+    // 1. Perform a soft reset
+    ret = mfrc522_soft_reset(dev);
+    if (ret)
+        return ret;
+
+    // 2. Clear the internal buffer by writing 25 bytes of 00h and implement the Config command
+    ret = mfrc522_write_reg(dev, FIFOLevelReg, MFRC522_FLUSH_FIFO);
+    if (!ret)
+        ret = dev->ops->write(dev->priv, FIFODataReg, zeros, sizeof(zeros));
+    if (!ret)
+        ret = mfrc522_send_command(dev, 0, 0, MFRC522_CMD_MEM);
+
+    // 3. Enable the self test by writing 09h to the AutoTestReg register
+    if (!ret)
+        ret = mfrc522_write_reg(dev, AutoTestReg, 0x09);
+
+    // 4. Write 00h to the FIFO buffer
+    if (!ret)
+        ret = dev->ops->write(dev->priv, FIFODataReg, &zero, 1);
+
+    // 5. Start the self test with the CalcCRC command
+    if (!ret)
+        ret = mfrc522_send_command(dev, 0, 0, MFRC522_CMD_CALC_CRC);
+    if (ret)
+        return ret;
+
+    // 6. The self test is done once the FIFO holds 64 bytes
+    deadline = mfrc522_deadline(dev, dev->timeout_us);
+    do {
+        ret = mfrc522_read_reg(dev, FIFOLevelReg, &level);
+        if (ret)
+            return ret;
+        if ((level & 0x7F) >= 64)
+            break;
+        if (mfrc522_expired(dev, deadline))
+            return -ETIMEDOUT;
+    } while (1);
+    ret = mfrc522_send_command(dev, 0, 0, MFRC522_CMD_IDLE);
+    if (ret)
+        return ret;
+
+    // 7. Read the data from the FIFO buffer and disable the self test
+    ret = dev->ops->read(dev->priv, FIFODataReg, result, sizeof(result));
+    if (ret)
+        return ret;
+    ret = mfrc522_write_reg(dev, AutoTestReg, 0x00);
+    if (ret)
+        return ret;
+
+    if (memcmp(result, mfrc522_selftest_v2, sizeof(result)))
+        return -ENODEV;
+    return 0;
+}
+EXPORT_SYMBOL_GPL(mfrc522_self_test);
@@ -0,0 +1,1422 @@
+/**
+ * @file mfrc522_sim.c
+ * @brief Host-side model of the MFRC522 and the ISO 14443A cards in its field
+ *
+ * Only what the core uses is modelled: the register file, the FIFO, the
+ * Transceive/MFAuthent/CalcCRC/Mem/SoftReset commands and the card side of
+ * REQA/WUPA, anticollision, SELECT, HLTA, MIFARE Classic READ/WRITE,
+ * NTAG/Ultralight READ/WRITE and, for DESFire, ISO 14443-4 with
+ * SelectApplication, AuthenticateEV1 (AES) and ReadData on a plain, MACed or
+ * enciphered file. Crypto1 is not modelled; MIFARE Classic traffic is
+ * exchanged in the clear.
+*/
+
+#include "mfrc522_sim.h"
+
+#define SIM_BIT_NS        9440    // 128 / fc at 106 kbit/s
+#define SIM_FDT_NS        86400   // 1172 / fc, PICC frame delay time
+#define SIM_RESET_NS      50000   // Soft reset until PowerDown clears
+#define SIM_WAKE_NS       100000  // Leaving soft power-down: 1024 clocks plus crystal start-up
+#define SIM_HARD_RESET_NS 10000   // NRSTPD low pulse as driven by spi_mfrc522
+#define SIM_MF_WRITE_NS   2500000 // EEPROM programming before the second ACK
+#define SIM_UL_WRITE_NS   4100000 // NTAG21x page programming time
+#define SIM_DF_CMD_NS     500000  // DESFire command processing, EEPROM access included
+#define SIM_DF_FRAME_DATA 59      // File bytes per native DESFire answer frame
+#define SIM_ADC_I         9       // TestADCReg with the field on and nothing near the antenna
+#define SIM_ADC_Q         6
+#define SIM_CARD_LOAD_I   3       // How far one card detunes the antenna
+#define SIM_CARD_LOAD_Q   1
+#define SIM_MOD_WIDTH_TOL 6       // ModWidthReg distance from the reset value cards still decode reliably
+
+static const u8 sim_reset_values[MFRC522_NUM_REGS] = {
+    [CommandReg] = 0x20, [ComIEnReg] = 0x80, [ComIrqReg] = 0x14, [Status1Reg] = 0x21,
+    [WaterLevelReg] = 0x08, [ControlReg] = 0x10, [CollReg] = 0xA0, [ModeReg] = 0x3F,
+    [TxControlReg] = 0x80, [TxSelReg] = 0x10, [RxSelReg] = 0x84, [RxThresholdReg] = 0x84,
+    [DemodReg] = 0x4D, [MfTxReg] = 0x62, [SerialSpeedReg] = 0xEB, [CRCResultRegH] = 0xFF,
+    [CRCResultRegL] = 0xFF, [ModWidthReg] = 0x26, [RFCfgReg] = 0x48, [GsNReg] = 0x88,
+    [CWGsPReg] = 0x20, [ModGsPReg] = 0x20, [VersionReg] = 0x92,
+};
+
+static u16 sim_crc_a(const u8 *data, unsigned int len)
+{
+    u16 crc = 0x6363;
+    u8 ch;
+
+    while (len--) {
+        ch = *data++ ^ (u8)(crc & 0xFF);
+        ch ^= (u8)(ch << 4);
+        crc = (crc >> 8) ^ ((u16)ch << 8) ^ ((u16)ch << 3) ^ ((u16)ch >> 4);
+    }
+    return crc;
+}
+
+// Duration of a standard frame with `bits` data bits: SOF, parity per byte, EOF
+static u64 sim_frame_ns(unsigned int bits)
+{
+    return (u64)(bits + bits / 8 + 2) * SIM_BIT_NS;
+}
+
+static bool sim_field_on(struct mfrc522_sim *sim)
+{
+    return !sim->powered_down && (sim->regs[TxControlReg] & MFRC522_TX_ANTENNA) != 0;
+}
+
+static void sim_card_reset(struct mfrc522_sim_card *card)
+{
+    card->state = SIM_CARD_IDLE;
+    card->from_halt = false;
+    card->level = 0;
+    card->auth_sector = -1;
+    card->write_block = -1;
+    card->pwd_auth = false;
+    card->tcl = false;
+    card->df_aid = 0;
+    card->df_left = 0;
+    card->df_auth = 0;
+}
+
+static unsigned int sim_card_levels(const struct mfrc522_sim_card *card)
+{
+    return card->uid.size == 4 ? 1 : card->uid.size == 7 ? 2 : 3;
+}
+
+// The 4 UID bytes plus BCC a card answers with on one cascade level
+static void sim_card_level_uid(const struct mfrc522_sim_card *card, unsigned int level, u8 *out)
+{
+    const u8 *p = card->uid.bytes;
+
+    if (level + 1 == sim_card_levels(card)) {
+        memcpy(out, p + level * 3, 4);
+    } else {
+        out[0] = PICC_CMD_CT;
+        memcpy(out + 1, p + level * 3, 3);
+    }
+    out[4] = out[0] ^ out[1] ^ out[2] ^ out[3];
+}
+
+static bool sim_card_responds(struct mfrc522_sim *sim, const struct mfrc522_sim_card *card)
+{
+    return card->in_field && card->hears && sim_field_on(sim);
+}
+
+static u32 sim_random(struct mfrc522_sim *sim)
+{
+    sim->seed = sim->seed * 1103515245 + 12345;
+    return sim->seed >> 16;
+}
+
+// Whether a card decodes the next frame: needs 100% ASK and a pause width close to nominal
+static bool sim_card_decodes(struct mfrc522_sim *sim)
+{
+    int width = sim->regs[ModWidthReg];
+
+    if (!(sim->regs[TxASKReg] & MFRC522_FORCE_100ASK))
+        return false;
+    if (width < MFRC522_MOD_WIDTH_RESET - SIM_MOD_WIDTH_TOL || width > MFRC522_MOD_WIDTH_RESET + SIM_MOD_WIDTH_TOL)
+        return sim_random(sim) & 1;
+    return true;
+}
+
+// Decide per frame who hears it and whether the answer arrives intact at the programmed RxGain
+static void sim_frame_start(struct mfrc522_sim *sim)
+{
+    u8 gain = (sim->regs[RFCfgReg] & MFRC522_RX_GAIN_MASK) >> MFRC522_RX_GAIN_SHIFT;
+    struct mfrc522_sim_card *card;
+    unsigned int i, off;
+
+    sim->rx_corrupt = false;
+    for (i = 0; i < sim->num_cards; i++) {
+        card = &sim->cards[i];
+        if (!card->in_field)
+            continue;
+        card->hears = sim_card_decodes(sim);
+        off = gain < card->gain_lo ? card->gain_lo - gain : gain > card->gain_hi ? gain - card->gain_hi : 0;
+        if (off > 1 || (off == 1 && (sim_random(sim) & 1)))
+            sim->rx_corrupt = true;
+    }
+}
+
+static struct mfrc522_sim_card *sim_active_card(struct mfrc522_sim *sim)
+{
+    unsigned int i;
+
+    for (i = 0; i < sim->num_cards; i++)
+        if (sim_card_responds(sim, &sim->cards[i]) && sim->cards[i].state == SIM_CARD_ACTIVE)
+            return &sim->cards[i];
+    return NULL;
+}
+
+static void sim_answer(struct mfrc522_sim *sim, const u8 *data, unsigned int len, unsigned int bits, bool with_crc)
+{
+    u16 crc;
+
+    memcpy(sim->rx, data, len);
+    sim->rx_len = len;
+    sim->rx_last_bits = bits % 8;
+    if (with_crc) {
+        if (sim->regs[RxModeReg] & MFRC522_CRC_EN) {
+            // The chip checks and strips the CRC
+        } else {
+            crc = sim_crc_a(data, len);
+            sim->rx[len] = crc & 0xFF;
+            sim->rx[len + 1] = crc >> 8;
+            sim->rx_len += 2;
+        }
+        bits += 16;
+    } else if (sim->regs[RxModeReg] & MFRC522_CRC_EN) {
+        sim->rx_error |= MFRC522_ERR_CRC; // Frame too short to carry a CRC
+    }
+    if (sim->rx_corrupt)
+        sim->rx_error |= MFRC522_ERR_PARITY | (with_crc ? MFRC522_ERR_CRC : 0);
+    sim->answered = true;
+    sim->rx_start_ns = sim->done_ns + SIM_FDT_NS;
+    sim->done_ns = sim->rx_start_ns + sim_frame_ns(bits);
+}
+
+static void sim_request(struct mfrc522_sim *sim, u8 command)
+{
+    struct mfrc522_sim_card *card;
+    bool first = true;
+    u8 atqa[2] = {0};
+    unsigned int i;
+
+    for (i = 0; i < sim->num_cards; i++) {
+        card = &sim->cards[i];
+        if (!sim_card_responds(sim, card))
+            continue;
+        // Anything but READY/IDLE/HALT falls back to where it came from first
+        if (card->state == SIM_CARD_READY || card->state == SIM_CARD_ACTIVE) {
+            card->state = card->from_halt ? SIM_CARD_HALT : SIM_CARD_IDLE;
+            card->auth_sector = -1;
+            card->pwd_auth = false;
+            card->tcl = false;
+        }
+        if (card->state == SIM_CARD_IDLE || (card->state == SIM_CARD_HALT && command == PICC_CMD_WUPA)) {
+            card->from_halt = card->state == SIM_CARD_HALT;
+            card->state = SIM_CARD_READY;
+            card->level = 0;
+            if (!first && (atqa[0] != card->atqa[0] || atqa[1] != card->atqa[1]))
+                sim->rx_error |= MFRC522_ERR_COLL;
+            atqa[0] |= card->atqa[0];
+            atqa[1] |= card->atqa[1];
+            first = false;
+        }
+    }
+    if (!first)
+        sim_answer(sim, atqa, 2, 16, false);
+}
+
+static int sim_get_bit(const u8 *buf, unsigned int bit)
+{
+    return (buf[bit / 8] >> (bit % 8)) & 1;
+}
+
+static void sim_anticoll(struct mfrc522_sim *sim, const u8 *frame, unsigned int bits)
+{
+    struct mfrc522_sim_card *card, *responders[MFRC522_SIM_MAX_CARDS];
+    unsigned int known = ((frame[1] >> 4) - 2) * 8 + (frame[1] & 0x0F);
+    unsigned int align = (sim->regs[BitFramingReg] >> 4) & 0x07;
+    unsigned int n = 0, i, j, bit, coll = 40;
+    u8 cl[MFRC522_SIM_MAX_CARDS][5], out[5];
+
+    if (known > 32 || bits != 16 + known)
+        return;
+
+    for (i = 0; i < sim->num_cards; i++) {
+        card = &sim->cards[i];
+        if (!sim_card_responds(sim, card) || card->state != SIM_CARD_READY || card->level >= sim_card_levels(card))
+            continue;
+        if (frame[0] != PICC_CMD_SEL_CL1 + 2 * card->level)
+            continue;
+        sim_card_level_uid(card, card->level, cl[n]);
+        for (bit = 0; bit < known; bit++)
+            if (sim_get_bit(cl[n], bit) != sim_get_bit(frame + 2, bit))
+                break;
+        if (bit == known)
+            responders[n++] = card;
+    }
+    if (!n)
+        return;
+
+    // Find the first bit the responders disagree on
+    memcpy(out, cl[0], sizeof(out));
+    for (bit = known; bit < 40 && coll == 40; bit++)
+        for (j = 1; j < n; j++)
+            if (sim_get_bit(cl[j], bit) != sim_get_bit(cl[0], bit)) {
+                coll = bit;
+                break;
+            }
+    // ValuesAfterColl is cleared: everything from the collision on reads as 0
+    for (bit = coll; bit < 40; bit++)
+        out[bit / 8] &= ~(1 << (bit % 8));
+    if (coll < 40) {
+        sim->rx_error |= MFRC522_ERR_COLL;
+        sim->rx_coll = coll + 1 <= 32 ? ((coll + 1) & MFRC522_COLL_POS_MASK) : MFRC522_COLL_POS_INVALID;
+    }
+    out[known / 8] &= ~((1 << align) - 1);
+    (void)responders;
+    sim_answer(sim, out + known / 8, 5 - known / 8, 40 - known, false);
+    sim->rx_last_bits = 0;
+}
+
+static void sim_select(struct mfrc522_sim *sim, const u8 *frame)
+{
+    struct mfrc522_sim_card *card, *selected = NULL;
+    unsigned int i;
+    u8 cl[5], sak;
+
+    for (i = 0; i < sim->num_cards; i++) {
+        card = &sim->cards[i];
+        if (!sim_card_responds(sim, card) || card->state != SIM_CARD_READY || card->level >= sim_card_levels(card))
+            continue;
+        if (frame[0] != PICC_CMD_SEL_CL1 + 2 * card->level)
+            continue;
+        sim_card_level_uid(card, card->level, cl);
+        if (!memcmp(cl, frame + 2, 5) && !selected) {
+            selected = card;
+        } else {
+            card->state = card->from_halt ? SIM_CARD_HALT : SIM_CARD_IDLE;
+        }
+    }
+    if (!selected)
+        return;
+
+    if (++selected->level == sim_card_levels(selected)) {
+        selected->state = SIM_CARD_ACTIVE;
+        sak = selected->uid.sak;
+    } else {
+        sak = PICC_SAK_CASCADE;
+    }
+    sim_answer(sim, &sak, 1, 8, true);
+}
+
+static void sim_nak(struct mfrc522_sim *sim)
+{
+    u8 nak = 0x04;
+
+    sim_answer(sim, &nak, 1, 4, false);
+}
+
+static void sim_ack(struct mfrc522_sim *sim)
+{
+    u8 ack = PICC_MF_ACK;
+
+    sim_answer(sim, &ack, 1, 4, false);
+}
+
+static bool sim_card_authenticated(const struct mfrc522_sim_card *card, u8 block)
+{
+    return card->auth_sector == block / 4;
+}
+
+// NTAG21x configuration pages, counted from the end of the memory
+#define SIM_NTAG_CFG0(card) ((card)->pages - 4)   // Byte 3: AUTH0, first protected page
+#define SIM_NTAG_CFG1(card) ((card)->pages - 3)   // Byte 0: ACCESS, bit 7 PROT also protects reads
+#define SIM_NTAG_PWD(card)  ((card)->pages - 2)
+#define SIM_NTAG_PACK(card) ((card)->pages - 1)
+#define SIM_NTAG_PROT       0x80
+
+static bool sim_ntag_protected(const struct mfrc522_sim_card *card, unsigned int page, bool write)
+{
+    if (card->pwd_auth || page < card->mem[SIM_NTAG_CFG0(card) * MFRC522_UL_PAGE_SIZE + 3])
+        return false;
+    return write || (card->mem[SIM_NTAG_CFG1(card) * MFRC522_UL_PAGE_SIZE] & SIM_NTAG_PROT);
+}
+
+// Copy count pages from page on, wrapping at the end; PWD and PACK always read as zeros
+static void sim_ntag_pages(const struct mfrc522_sim_card *card, unsigned int page, unsigned int count, u8 *buf)
+{
+    unsigned int i, p;
+
+    for (i = 0; i < count; i++) {
+        p = (page + i) % card->pages;
+        if (p == SIM_NTAG_PWD(card) || p == SIM_NTAG_PACK(card))
+            memset(buf + i * MFRC522_UL_PAGE_SIZE, 0, MFRC522_UL_PAGE_SIZE);
+        else
+            memcpy(buf + i * MFRC522_UL_PAGE_SIZE, card->mem + p * MFRC522_UL_PAGE_SIZE, MFRC522_UL_PAGE_SIZE);
+    }
+}
+
+// NTAG/Ultralight: 4 byte pages, READ returns 4 pages and wraps at the end, FAST_READ a range; PWD_AUTH unlocks
+// the pages from AUTH0 on
+static void sim_ultralight(struct mfrc522_sim *sim, struct mfrc522_sim_card *card, const u8 *frame, unsigned int len)
+{
+    u8 buf[MFRC522_SIM_MEM_SIZE];
+    u8 page = frame[1];
+    unsigned int i;
+
+    if (frame[0] == PICC_CMD_UL_PWD_AUTH && len == 1 + MFRC522_UL_PWD_SIZE) {
+        if (memcmp(frame + 1, card->mem + SIM_NTAG_PWD(card) * MFRC522_UL_PAGE_SIZE, MFRC522_UL_PWD_SIZE)) {
+            card->state = SIM_CARD_IDLE;
+            card->from_halt = false;
+            sim_nak(sim);
+            return;
+        }
+        card->pwd_auth = true;
+        sim_answer(sim, card->mem + SIM_NTAG_PACK(card) * MFRC522_UL_PAGE_SIZE, MFRC522_UL_PACK_SIZE,
+                   8 * MFRC522_UL_PACK_SIZE, true);
+        return;
+    }
+    if (len < 2 || page >= card->pages) {
+        sim_nak(sim);
+        return;
+    }
+
+    if (frame[0] == PICC_CMD_MF_READ && len == 2) {
+        if (sim_ntag_protected(card, page, false)) {
+            sim_nak(sim);
+            return;
+        }
+        sim_ntag_pages(card, page, MFRC522_MF_BLOCK_SIZE / MFRC522_UL_PAGE_SIZE, buf);
+        sim_answer(sim, buf, MFRC522_MF_BLOCK_SIZE, 128, true);
+    } else if (frame[0] == PICC_CMD_UL_FAST_READ && len == 3 && frame[2] >= page && frame[2] < card->pages) {
+        for (i = page; i <= frame[2]; i++) {
+            if (sim_ntag_protected(card, i, false)) {
+                sim_nak(sim);
+                return;
+            }
+        }
+        i = frame[2] - page + 1;
+        sim_ntag_pages(card, page, i, buf);
+        sim_answer(sim, buf, i * MFRC522_UL_PAGE_SIZE, i * MFRC522_UL_PAGE_SIZE * 8, true);
+    } else if (frame[0] == PICC_CMD_UL_WRITE && len == 2 + MFRC522_UL_PAGE_SIZE && page >= 3 &&
+               !sim_ntag_protected(card, page, true)) {
+        for (i = 0; i < MFRC522_UL_PAGE_SIZE; i++) {
+            if (page == 3)
+                card->mem[page * MFRC522_UL_PAGE_SIZE + i] |= frame[2 + i]; // The CC is OTP
+            else
+                card->mem[page * MFRC522_UL_PAGE_SIZE + i] = frame[2 + i];
+        }
+        sim->done_ns += SIM_UL_WRITE_NS;
+        sim_ack(sim);
+    } else {
+        sim_nak(sim);
+    }
+}
+
+static void sim_mifare(struct mfrc522_sim *sim, const u8 *frame, unsigned int len)
+{
+    struct mfrc522_sim_card *card = sim_active_card(sim);
+    u8 block;
+
+    if (!card)
+        return;
+    if (card->pages) {
+        sim_ultralight(sim, card, frame, len);
+        return;
+    }
+
+    if (card->write_block >= 0) {
+        // Second phase of a write
+        block = card->write_block;
+        card->write_block = -1;
+        if (len != MFRC522_MF_BLOCK_SIZE) {
+            sim_nak(sim);
+            return;
+        }
+        memcpy(card->mem + block * MFRC522_MF_BLOCK_SIZE, frame, MFRC522_MF_BLOCK_SIZE);
+        sim->done_ns += SIM_MF_WRITE_NS;
+        sim_ack(sim);
+        return;
+    }
+
+    if (len != 2)
+        return;
+    block = frame[1];
+    if ((unsigned int)block * MFRC522_MF_BLOCK_SIZE >= MFRC522_SIM_MEM_SIZE || !sim_card_authenticated(card, block)) {
+        sim_nak(sim);
+        return;
+    }
+
+    switch (frame[0]) {
+    case PICC_CMD_MF_READ:
+        sim_answer(sim, card->mem + block * MFRC522_MF_BLOCK_SIZE, MFRC522_MF_BLOCK_SIZE, 128, true);
+        break;
+    case PICC_CMD_MF_WRITE:
+        card->write_block = block;
+        sim_ack(sim);
+        break;
+    }
+}
+
+// ATS of a DESFire EV1: FSCI 5 (64 bytes), 106 kbit/s only, FWI 8, SFGI 1
+static void sim_rats(struct mfrc522_sim *sim, struct mfrc522_sim_card *card, const u8 *frame)
+{
+    static const u16 frame_sizes[] = { 16, 24, 32, 40, 48, 64, 96, 128, 256 };
+    static const u8 ats[] = { 0x06, 0x75, 0x77, 0x81, 0x02, 0x80 };
+    unsigned int fsdi = frame[1] >> 4;
+
+    card->tcl = true;
+    card->tcl_bn = 1;
+    card->tcl_fsd = frame_sizes[fsdi < ARRAY_SIZE(frame_sizes) ? fsdi : ARRAY_SIZE(frame_sizes) - 1];
+    card->tcl_in_len = 0;
+    card->tcl_out_len = 0;
+    card->tcl_out_off = 0;
+    sim_answer(sim, ats, sizeof(ats), sizeof(ats) * 8, true);
+}
+
+static void sim_tcl_send(struct mfrc522_sim *sim, struct mfrc522_sim_card *card, const u8 *block, unsigned int len)
+{
+    if (block != card->tcl_last) {
+        memcpy(card->tcl_last, block, len);
+        card->tcl_last_len = len;
+    }
+    sim_answer(sim, block, len, len * 8, true);
+}
+
+// Next block of the pending answer: an S(WTX) first if one is due, then I-blocks of at most FSD bytes
+static void sim_tcl_next(struct mfrc522_sim *sim, struct mfrc522_sim_card *card)
+{
+    unsigned int n = card->tcl_out_len - card->tcl_out_off, max = card->tcl_fsd - 3;
+    u8 block[MFRC522_FIFO_SIZE];
+
+    if (card->tcl_out_off >= card->tcl_out_len)
+        return;
+    if (card->wtx && !card->tcl_out_off) {
+        card->wtx--;
+        block[0] = 0xF2;
+        block[1] = 1; // WTXM
+        sim_tcl_send(sim, card, block, 2);
+        return;
+    }
+    if (n > max)
+        n = max;
+    block[0] = 0x02 | card->tcl_bn | (card->tcl_out_off + n < card->tcl_out_len ? 0x10 : 0);
+    memcpy(block + 1, card->tcl_out + card->tcl_out_off, n);
+    card->tcl_out_off += n;
+    sim_tcl_send(sim, card, block, n + 1);
+}
+
+static u8 sim_sbox[256], sim_inv_sbox[256];
+
+static u8 sim_gmul(u8 a, u8 b)
+{
+    u8 p = 0;
+
+    while (b) {
+        if (b & 1)
+            p ^= a;
+        a = (a << 1) ^ (a & 0x80 ? 0x1B : 0);
+        b >>= 1;
+    }
+    return p;
+}
+
+static u8 sim_rotl8(u8 v, unsigned int n)
+{
+    return (v << n) | (v >> (8 - n));
+}
+
+// S-box from its definition, on first use: the inverse in GF(2^8), then the affine map
+static void sim_aes_tables(void)
+{
+    unsigned int x, y;
+    u8 inv, s;
+
+    if (sim_sbox[0])
+        return;
+    for (x = 0; x < 256; x++) {
+        for (inv = 0, y = 1; x && y < 256; y++) {
+            if (sim_gmul(x, y) == 1) {
+                inv = y;
+                break;
+            }
+        }
+        s = inv ^ sim_rotl8(inv, 1) ^ sim_rotl8(inv, 2) ^ sim_rotl8(inv, 3) ^ sim_rotl8(inv, 4) ^ 0x63;
+        sim_sbox[x] = s;
+        sim_inv_sbox[s] = x;
+    }
+}
+
+static void sim_aes_expand(const u8 *key, u8 *rk)
+{
+    unsigned int i, j;
+    u8 rcon = 1, t[4], first;
+
+    memcpy(rk, key, 16);
+    for (i = 16; i < 176; i += 4) {
+        memcpy(t, rk + i - 4, 4);
+        if (i % 16 == 0) {
+            first = t[0];
+            t[0] = sim_sbox[t[1]] ^ rcon;
+            t[1] = sim_sbox[t[2]];
+            t[2] = sim_sbox[t[3]];
+            t[3] = sim_sbox[first];
+            rcon = sim_gmul(rcon, 2);
+        }
+        for (j = 0; j < 4; j++)
+            rk[i + j] = rk[i - 16 + j] ^ t[j];
+    }
+}
+
+/**
+ * @brief AES-128 on one block in place, for the DESFire model and the benchmark's desfire_crypto_ops
+ *
+ * Byte i of the block is row i % 4, column i / 4 of the state. Plain table
+ * lookups: fine for a model, not constant time.
+*/
+void mfrc522_sim_aes_encrypt(const u8 *key, u8 *block)
+{
+    u8 rk[176], t[16], a0, a1, a2, a3, *a;
+    unsigned int round, i, c;
+
+    sim_aes_tables();
+    sim_aes_expand(key, rk);
+    for (i = 0; i < 16; i++)
+        block[i] ^= rk[i];
+    for (round = 1; round <= 10; round++) {
+        for (i = 0; i < 16; i++)
+            t[i] = sim_sbox[block[(i + 4 * (i % 4)) % 16]]; // SubBytes, ShiftRows
+        for (c = 0; round < 10 && c < 4; c++) {
+            a = t + 4 * c;
+            a0 = a[0];
+            a1 = a[1];
+            a2 = a[2];
+            a3 = a[3];
+            a[0] = sim_gmul(a0, 2) ^ sim_gmul(a1, 3) ^ a2 ^ a3;
+            a[1] = a0 ^ sim_gmul(a1, 2) ^ sim_gmul(a2, 3) ^ a3;
+            a[2] = a0 ^ a1 ^ sim_gmul(a2, 2) ^ sim_gmul(a3, 3);
+            a[3] = sim_gmul(a0, 3) ^ a1 ^ a2 ^ sim_gmul(a3, 2);
+        }
+        for (i = 0; i < 16; i++)
+            block[i] = t[i] ^ rk[16 * round + i];
+    }
+}
+
+void mfrc522_sim_aes_decrypt(const u8 *key, u8 *block)
+{
+    u8 rk[176], t[16], a0, a1, a2, a3, *a;
+    unsigned int round, i, c;
+
+    sim_aes_tables();
+    sim_aes_expand(key, rk);
+    for (i = 0; i < 16; i++)
+        block[i] ^= rk[160 + i];
+    for (round = 10; round-- > 0;) {
+        for (i = 0; i < 16; i++)
+            t[(i + 4 * (i % 4)) % 16] = sim_inv_sbox[block[i]]; // InvShiftRows, InvSubBytes
+        for (i = 0; i < 16; i++)
+            block[i] = t[i] ^ rk[16 * round + i];
+        for (c = 0; round && c < 4; c++) {
+            a = block + 4 * c;
+            a0 = a[0];
+            a1 = a[1];
+            a2 = a[2];
+            a3 = a[3];
+            a[0] = sim_gmul(a0, 14) ^ sim_gmul(a1, 11) ^ sim_gmul(a2, 13) ^ sim_gmul(a3, 9);
+            a[1] = sim_gmul(a0, 9) ^ sim_gmul(a1, 14) ^ sim_gmul(a2, 11) ^ sim_gmul(a3, 13);
+            a[2] = sim_gmul(a0, 13) ^ sim_gmul(a1, 9) ^ sim_gmul(a2, 14) ^ sim_gmul(a3, 11);
+            a[3] = sim_gmul(a0, 11) ^ sim_gmul(a1, 13) ^ sim_gmul(a2, 9) ^ sim_gmul(a3, 14);
+        }
+    }
+}
+
+static void sim_cbc_encrypt(const u8 *key, u8 *iv, u8 *buf, unsigned int len)
+{
+    unsigned int off, i;
+
+    for (off = 0; off < len; off += 16) {
+        for (i = 0; i < 16; i++)
+            buf[off + i] ^= iv[i];
+        mfrc522_sim_aes_encrypt(key, buf + off);
+        memcpy(iv, buf + off, 16);
+    }
+}
+
+static void sim_cbc_decrypt(const u8 *key, u8 *iv, u8 *buf, unsigned int len)
+{
+    unsigned int off, i;
+    u8 next[16];
+
+    for (off = 0; off < len; off += 16) {
+        memcpy(next, buf + off, 16);
+        mfrc522_sim_aes_decrypt(key, buf + off);
+        for (i = 0; i < 16; i++)
+            buf[off + i] ^= iv[i];
+        memcpy(iv, next, 16);
+    }
+}
+
+// One bit left, reduced by 87h: the CMAC subkey step
+static void sim_cmac_double(u8 *out, const u8 *in)
+{
+    unsigned int i;
+
+    for (i = 0; i < 15; i++)
+        out[i] = (in[i] << 1) | (in[i + 1] >> 7);
+    out[15] = (in[15] << 1) ^ (in[0] & 0x80 ? 0x87 : 0);
+}
+
+// CMAC under the session key, chained from the card's IV as in EV1 secure messaging; the IV becomes the CMAC
+static void sim_desfire_cmac(struct mfrc522_sim_card *card, const u8 *msg, unsigned int len, u8 *mac)
+{
+    unsigned int off = 0, i;
+    u8 last[16] = {0};
+
+    for (; len - off > 16; off += 16) {
+        for (i = 0; i < 16; i++)
+            card->df_iv[i] ^= msg[off + i];
+        mfrc522_sim_aes_encrypt(card->df_session, card->df_iv);
+    }
+    memcpy(last, msg + off, len - off);
+    if (len && len - off == 16) {
+        for (i = 0; i < 16; i++)
+            last[i] ^= card->df_k1[i];
+    } else {
+        last[len - off] = 0x80;
+        for (i = 0; i < 16; i++)
+            last[i] ^= card->df_k2[i];
+    }
+    for (i = 0; i < 16; i++)
+        card->df_iv[i] ^= last[i];
+    mfrc522_sim_aes_encrypt(card->df_session, card->df_iv);
+    memcpy(mac, card->df_iv, 16);
+}
+
+static u32 sim_crc32(const u8 *data, unsigned int len, u32 crc)
+{
+    unsigned int bit;
+
+    while (len--) {
+        crc ^= *data++;
+        for (bit = 0; bit < 8; bit++)
+            crc = crc & 1 ? (crc >> 1) ^ 0xEDB88320 : crc >> 1;
+    }
+    return crc;
+}
+
+static void sim_desfire_rotate(u8 *out, const u8 *in)
+{
+    memcpy(out, in + 1, 15);
+    out[15] = in[0];
+}
+
+// AuthenticateEV1, first step: E(K, RndB) with a zero IV
+static unsigned int sim_desfire_auth(struct mfrc522_sim_card *card, u8 key_no)
+{
+    unsigned int i;
+
+    if (!card->df_aid || key_no != card->df_key_no) {
+        card->tcl_out[0] = 0x40; // No such key
+        return 1;
+    }
+    card->df_nonce++;
+    for (i = 0; i < 16; i++)
+        card->df_rnd_b[i] = (u8)(card->df_nonce * 131 + i * 29);
+    memset(card->df_iv, 0, sizeof(card->df_iv));
+    memcpy(card->tcl_out + 1, card->df_rnd_b, 16);
+    sim_cbc_encrypt(card->df_key, card->df_iv, card->tcl_out + 1, 16);
+    card->tcl_out[0] = 0xAF;
+    card->df_auth = 1;
+    return 17;
+}
+
+// Second step: check RndB' in E(K, RndA || RndB'), answer E(K, RndA') and derive the session key
+static unsigned int sim_desfire_auth_answer(struct mfrc522_sim_card *card, const u8 *cmd)
+{
+    u8 buf[32], rot[16], rnd_a[16];
+
+    memcpy(buf, cmd + 1, sizeof(buf));
+    sim_cbc_decrypt(card->df_key, card->df_iv, buf, sizeof(buf));
+    sim_desfire_rotate(rot, card->df_rnd_b);
+    if (memcmp(buf + 16, rot, 16)) {
+        card->tcl_out[0] = 0xAE; // Authentication error
+        return 1;
+    }
+    memcpy(rnd_a, buf, 16);
+    sim_desfire_rotate(card->tcl_out + 1, rnd_a);
+    sim_cbc_encrypt(card->df_key, card->df_iv, card->tcl_out + 1, 16);
+
+    memcpy(card->df_session, rnd_a, 4);
+    memcpy(card->df_session + 4, card->df_rnd_b, 4);
+    memcpy(card->df_session + 8, rnd_a + 12, 4);
+    memcpy(card->df_session + 12, card->df_rnd_b + 12, 4);
+    memset(buf, 0, 16);
+    mfrc522_sim_aes_encrypt(card->df_session, buf);
+    sim_cmac_double(card->df_k1, buf);
+    sim_cmac_double(card->df_k2, card->df_k1);
+    memset(card->df_iv, 0, sizeof(card->df_iv));
+    card->df_auth = 2;
+    card->tcl_out[0] = 0x00;
+    return 17;
+}
+
+/**
+ * @brief Put the ReadData answer together: the file bytes, and once authenticated their CMAC, or the
+ * bytes and their CRC32 enciphered
+*/
+static void sim_desfire_read(struct mfrc522_sim_card *card, u32 off, u32 n)
+{
+    u8 mac[16], status = 0x00;
+    u32 crc, total = n;
+
+    memcpy(card->df_resp, card->mem + off, n);
+    if (card->df_auth == 2 && card->df_comm == 0x03) {
+        crc = sim_crc32(&status, 1, sim_crc32(card->df_resp, n, 0xFFFFFFFF));
+        card->df_resp[n] = crc & 0xFF;
+        card->df_resp[n + 1] = (crc >> 8) & 0xFF;
+        card->df_resp[n + 2] = (crc >> 16) & 0xFF;
+        card->df_resp[n + 3] = crc >> 24;
+        total = (n + 4 + 15) / 16 * 16;
+        memset(card->df_resp + n + 4, 0, total - n - 4);
+        sim_cbc_encrypt(card->df_session, card->df_iv, card->df_resp, total);
+    } else if (card->df_auth == 2) {
+        card->df_resp[n] = status;
+        sim_desfire_cmac(card, card->df_resp, n + 1, mac);
+        memcpy(card->df_resp + n, mac, 8);
+        total = n + 8;
+    }
+    card->df_off = 0;
+    card->df_left = total;
+}
+
+// One native frame of ReadData: status (AF while more follows) and up to 59 bytes of the answer
+static unsigned int sim_desfire_data(struct mfrc522_sim_card *card)
+{
+    unsigned int n = card->df_left < SIM_DF_FRAME_DATA ? card->df_left : SIM_DF_FRAME_DATA;
+
+    card->tcl_out[0] = card->df_left > n ? 0xAF : 0x00;
+    memcpy(card->tcl_out + 1, card->df_resp + card->df_off, n);
+    card->df_off += n;
+    card->df_left -= n;
+    return n + 1;
+}
+
+// DESFire native commands: SelectApplication, AuthenticateEV1 (AES) and ReadData
+static unsigned int sim_desfire(struct mfrc522_sim_card *card, const u8 *cmd, unsigned int len)
+{
+    unsigned int out = 1;
+    u8 mac[16];
+    u32 off, n;
+
+    if (cmd[0] == 0xAF && card->df_left)
+        return sim_desfire_data(card);
+    card->df_left = 0; // Anything else aborts a pending answer
+
+    card->tcl_out[0] = 0x1C; // Illegal command code
+    if (cmd[0] == 0xAF && len == 33 && card->df_auth == 1) {
+        out = sim_desfire_auth_answer(card, cmd);
+    } else if (cmd[0] == 0x5A && len == 4) {
+        card->df_aid = cmd[1] | cmd[2] << 8 | (u32)cmd[3] << 16;
+        card->df_auth = 0;
+        card->tcl_out[0] = 0x00;
+    } else if (cmd[0] == 0xAA && len == 2) {
+        out = sim_desfire_auth(card, cmd[1]);
+    } else if (cmd[0] == 0xBD && len == 8) {
+        off = cmd[2] | cmd[3] << 8 | (u32)cmd[4] << 16;
+        n = cmd[5] | cmd[6] << 8 | (u32)cmd[7] << 16;
+        if (card->df_auth == 2)
+            sim_desfire_cmac(card, cmd, len, mac); // The command moves the IV on
+        if (!card->df_aid) {
+            card->tcl_out[0] = 0xF0; // The PICC level has no files
+        } else if (!n || off + n > MFRC522_SIM_MEM_SIZE) {
+            card->tcl_out[0] = 0xBE;
+        } else if (card->df_comm && card->df_auth != 2) {
+            card->tcl_out[0] = 0x9D; // Permission denied
+        } else {
+            sim_desfire_read(card, off, n);
+            return sim_desfire_data(card);
+        }
+    }
+    if (card->tcl_out[0] != 0x00 && card->tcl_out[0] != 0xAF)
+        card->df_auth = 0; // Any error ends the session
+    else if (card->df_auth == 1 && cmd[0] != 0xAA)
+        card->df_auth = 0;
+    return out;
+}
+
+// ISO 14443-4 PICC side: block numbering, chaining both ways, R(NAK) recovery, WTX and DESELECT
+static void sim_tcl(struct mfrc522_sim *sim, struct mfrc522_sim_card *card, const u8 *frame, unsigned int len)
+{
+    u8 pcb = frame[0], block[1];
+
+    if ((pcb & 0xE2) == 0x02) {
+        if (card->tcl_in_len + len - 1 > sizeof(card->tcl_in)) {
+            card->tcl_in_len = 0;
+            return;
+        }
+        memcpy(card->tcl_in + card->tcl_in_len, frame + 1, len - 1);
+        card->tcl_in_len += len - 1;
+        card->tcl_bn ^= 1;
+        if (pcb & 0x10) {
+            block[0] = 0xA2 | card->tcl_bn;
+            sim_tcl_send(sim, card, block, 1);
+            return;
+        }
+        card->tcl_out_len = sim_desfire(card, card->tcl_in, card->tcl_in_len);
+        card->tcl_out_off = 0;
+        card->tcl_in_len = 0;
+        sim->done_ns += SIM_DF_CMD_NS;
+        sim_tcl_next(sim, card);
+    } else if ((pcb & 0xE6) == 0xA2 && len == 1) {
+        if ((pcb & 0x01) == card->tcl_bn) {
+            sim_tcl_send(sim, card, card->tcl_last, card->tcl_last_len);
+        } else if (pcb & 0x10) {
+            block[0] = 0xA2 | card->tcl_bn; // R(NAK) for a block we never got
+            sim_tcl_send(sim, card, block, 1);
+        } else {
+            card->tcl_bn ^= 1;
+            sim_tcl_next(sim, card);
+        }
+    } else if (pcb == 0xC2 && len == 1) {
+        sim_tcl_send(sim, card, &pcb, 1);
+        card->state = SIM_CARD_HALT;
+        card->from_halt = false;
+        card->tcl = false;
+    } else if ((pcb & 0xF7) == 0xF2 && len == 2) {
+        sim->done_ns += SIM_DF_CMD_NS;
+        sim_tcl_next(sim, card);
+    }
+}
+
+// Hand a frame to whichever card state it addresses
+static void sim_dispatch(struct mfrc522_sim *sim, const u8 *frame, unsigned int len, unsigned int bits, bool tx_crc)
+{
+    struct mfrc522_sim_card *card;
+
+    if (bits == 7 && (frame[0] == PICC_CMD_REQA || frame[0] == PICC_CMD_WUPA)) {
+        sim_request(sim, frame[0]);
+    } else if (frame[0] == PICC_CMD_SEL_CL1 || frame[0] == PICC_CMD_SEL_CL2 || frame[0] == PICC_CMD_SEL_CL3) {
+        if (len == 7 && frame[1] == 0x70 && tx_crc)
+            sim_select(sim, frame);
+        else if (!tx_crc)
+            sim_anticoll(sim, frame, bits);
+    } else if ((card = sim_active_card(sim)) && card->tcl) {
+        if (tx_crc)
+            sim_tcl(sim, card, frame, len);
+    } else if (card && card->desfire && frame[0] == PICC_CMD_RATS && len == 2 && tx_crc) {
+        sim_rats(sim, card, frame);
+    } else if (frame[0] == PICC_CMD_HLTA && len == 2 && tx_crc) {
+        card = sim_active_card(sim);
+        if (card) {
+            card->state = SIM_CARD_HALT;
+            card->from_halt = false;
+            card->auth_sector = -1;
+            card->pwd_auth = false;
+        }
+    } else if (tx_crc) {
+        sim_mifare(sim, frame, len);
+    }
+}
+
+/**
+ * @brief Start the timer at tx_end_ns if TAuto is set (datasheet 8.5)
+ *
+ * The timer runs (TReloadReg + 1) ticks of (2 * TPrescaler + 1) / 13.56 MHz.
+ * An answer that starts in time stops it before TimerIRq.
+*/
+static void sim_timer_start(struct mfrc522_sim *sim, u64 tx_end_ns)
+{
+    u32 prescaler = (sim->regs[TModeReg] & MFRC522_TPRESCALER_HI) << 8 | sim->regs[TPrescalerReg];
+    u32 reload = sim->regs[TReloadRegH] << 8 | sim->regs[TReloadRegL];
+    u64 due;
+
+    sim->timer_ns = 0;
+    if (!(sim->regs[TModeReg] & MFRC522_TAUTO))
+        return;
+    due = tx_end_ns + (u64)(reload + 1) * (2 * prescaler + 1) * 100000 / 1356;
+    if (!sim->answered || sim->rx_start_ns > due)
+        sim->timer_ns = due;
+}
+
+// A frame was started with StartSend: work out who answers what, and when
+static void sim_transceive(struct mfrc522_sim *sim)
+{
+    u8 frame[MFRC522_FIFO_SIZE];
+    unsigned int len = sim->fifo_len, last = sim->regs[BitFramingReg] & 0x07, bits;
+    bool tx_crc = sim->regs[TxModeReg] & MFRC522_CRC_EN;
+    u64 tx_end_ns;
+
+    memcpy(frame, sim->fifo, len);
+    sim->fifo_len = 0;
+    bits = len ? (len - 1) * 8 + (last ? last : 8) : 0;
+
+    sim->busy = true;
+    sim->answered = false;
+    sim->rx_len = 0;
+    sim->rx_pos = 0;
+    sim->rx_error = 0;
+    sim->rx_coll = MFRC522_COLL_POS_INVALID;
+    sim->done_irq = MFRC522_IRQ_RX | MFRC522_IRQ_TX;
+    sim->done_ns = sim->now_ns + sim_frame_ns(bits + (tx_crc ? 16 : 0));
+    sim->stats.rf_frames++;
+    tx_end_ns = sim->done_ns;
+
+    if (len && sim_field_on(sim)) {
+        sim_frame_start(sim);
+        sim_dispatch(sim, frame, len, bits, tx_crc);
+    }
+    sim_timer_start(sim, tx_end_ns);
+}
+
+static void sim_mf_authent(struct mfrc522_sim *sim)
+{
+    struct mfrc522_sim_card *card = sim_active_card(sim);
+    const u8 *trailer, *key;
+    u8 block;
+
+    sim->busy = true;
+    sim->answered = false;
+    sim->rx_len = 0;
+    sim->rx_error = 0;
+    sim->done_irq = MFRC522_IRQ_IDLE;
+    // Auth command, card nonce, reader token, card token
+    sim->done_ns = sim->now_ns + sim_frame_ns(32) + 3 * SIM_FDT_NS + sim_frame_ns(32) + sim_frame_ns(64) + sim_frame_ns(32);
+    sim->stats.rf_frames += 2;
+
+    // Without a nonce the timer runs out after the auth command, without a card token after the reader token
+    if (!card || sim->fifo_len < 12 || !sim_card_decodes(sim)) {
+        sim_timer_start(sim, sim->now_ns + sim_frame_ns(32));
+        return;
+    }
+    block = sim->fifo[1];
+    if ((unsigned int)block * MFRC522_MF_BLOCK_SIZE >= MFRC522_SIM_MEM_SIZE) {
+        sim_timer_start(sim, sim->now_ns + sim_frame_ns(32));
+        return;
+    }
+    trailer = card->mem + ((block / 4) * 4 + 3) * MFRC522_MF_BLOCK_SIZE;
+    key = sim->fifo[0] == PICC_CMD_MF_AUTH_KEY_A ? trailer : trailer + 10;
+    if (memcmp(key, sim->fifo + 2, MFRC522_MF_KEY_SIZE) || memcmp(card->uid.bytes + card->uid.size - 4, sim->fifo + 8, 4)) {
+        // No answer to the reader token: the command hangs until the timer or the host stops it
+        sim_timer_start(sim, sim->now_ns + sim_frame_ns(32) + 2 * SIM_FDT_NS + sim_frame_ns(32) + sim_frame_ns(64));
+        return;
+    }
+
+    card->auth_sector = block / 4;
+    sim->answered = true;
+    sim->rx_status2 = MFRC522_CRYPTO1_ON;
+    sim->timer_ns = 0;
+}
+
+static void sim_calc_crc(struct mfrc522_sim *sim)
+{
+    u16 crc;
+
+    if (sim->regs[AutoTestReg] == 0x09) {
+        memcpy(sim->fifo, mfrc522_selftest_v2, sizeof(mfrc522_selftest_v2));
+        sim->fifo_len = sizeof(mfrc522_selftest_v2);
+        return;
+    }
+    crc = sim_crc_a(sim->fifo, sim->fifo_len);
+    sim->fifo_len = 0;
+    sim->regs[CRCResultRegL] = crc & 0xFF;
+    sim->regs[CRCResultRegH] = crc >> 8;
+    sim->regs[DivIrqReg] |= MFRC522_IRQ_CRC;
+}
+
+static void sim_soft_reset(struct mfrc522_sim *sim)
+{
+    unsigned int i;
+
+    memcpy(sim->regs, sim_reset_values, sizeof(sim->regs));
+    sim->fifo_len = 0;
+    sim->busy = false;
+    sim->timer_ns = 0;
+    sim->powered_down = false;
+    sim->reset_done_ns = sim->now_ns + SIM_RESET_NS;
+    // The antenna drivers are off after reset, which also resets every card
+    for (i = 0; i < sim->num_cards; i++)
+        sim_card_reset(&sim->cards[i]);
+}
+
+// Move the bytes of the answer that have arrived by now into the FIFO; what does not fit is lost
+static void sim_receive(struct mfrc522_sim *sim)
+{
+    unsigned int arrived = sim->rx_len;
+
+    if (sim->now_ns < sim->done_ns) {
+        arrived = sim->now_ns < sim->rx_start_ns ? 0 : (sim->now_ns - sim->rx_start_ns) / (9 * SIM_BIT_NS);
+        if (arrived > sim->rx_len)
+            arrived = sim->rx_len;
+    }
+    for (; sim->rx_pos < arrived; sim->rx_pos++) {
+        if (sim->fifo_len == MFRC522_FIFO_SIZE)
+            sim->rx_error |= MFRC522_ERR_BUFFER_OVFL;
+        else
+            sim->fifo[sim->fifo_len++] = sim->rx[sim->rx_pos];
+    }
+    if (MFRC522_FIFO_SIZE - sim->fifo_len <= (sim->regs[WaterLevelReg] & 0x3F))
+        sim->regs[ComIrqReg] |= MFRC522_IRQ_HI_ALERT;
+}
+
+// Stream the answer of the frame in flight into the FIFO and finish it once its last bit has been received
+static void sim_update(struct mfrc522_sim *sim)
+{
+    if (sim->timer_ns && sim->now_ns >= sim->timer_ns) {
+        sim->regs[ComIrqReg] |= MFRC522_IRQ_TIMER;
+        sim->timer_ns = 0;
+    }
+    if (!sim->busy || !sim->answered)
+        return;
+    sim_receive(sim);
+    if (sim->now_ns < sim->done_ns)
+        return;
+
+    sim->busy = false;
+    sim->regs[ErrorReg] = sim->rx_error;
+    sim->regs[CollReg] = (sim->regs[CollReg] & MFRC522_VALUES_AFTER_COLL) | sim->rx_coll;
+    sim->regs[ControlReg] = (sim->regs[ControlReg] & ~0x07) | sim->rx_last_bits;
+    sim->regs[Status2Reg] |= sim->rx_status2;
+    sim->regs[ComIrqReg] |= sim->done_irq | (sim->rx_error ? MFRC522_IRQ_ERR : 0);
+    sim->rx_status2 = 0;
+}
+
+static int sim_clamp_adc(int val)
+{
+    return val < 0 ? 0 : val > 15 ? 15 : val;
+}
+
+// I/Q ADC values while the receiver runs; each card in the field pulls them away from the empty baseline
+static u8 sim_test_adc(struct mfrc522_sim *sim)
+{
+    int adc_i = SIM_ADC_I, adc_q = SIM_ADC_Q;
+    u8 cmd = sim->regs[CommandReg] & 0x0F;
+    unsigned int i;
+
+    if (!sim_field_on(sim) || (cmd != MFRC522_CMD_RECEIVE && cmd != MFRC522_CMD_TRANSCEIVE))
+        return 0;
+    for (i = 0; i < sim->num_cards; i++) {
+        if (sim->cards[i].in_field) {
+            adc_i -= SIM_CARD_LOAD_I;
+            adc_q += SIM_CARD_LOAD_Q;
+        }
+    }
+    if (sim->adc_noise) {
+        adc_i += (int)(sim_random(sim) % (2 * sim->adc_noise + 1)) - sim->adc_noise;
+        adc_q += (int)(sim_random(sim) % (2 * sim->adc_noise + 1)) - sim->adc_noise;
+    }
+    return sim_clamp_adc(adc_i) << 4 | sim_clamp_adc(adc_q);
+}
+
+static u8 sim_read_reg(struct mfrc522_sim *sim, u8 reg)
+{
+    u8 val;
+
+    sim_update(sim);
+    switch (reg) {
+    case FIFODataReg:
+        if (!sim->fifo_len)
+            return 0;
+        val = sim->fifo[0];
+        memmove(sim->fifo, sim->fifo + 1, --sim->fifo_len);
+        return val;
+    case FIFOLevelReg:
+        return sim->fifo_len;
+    case CommandReg:
+        if (sim->powered_down || sim->now_ns < sim->reset_done_ns)
+            return sim->regs[CommandReg] | MFRC522_POWER_DOWN;
+        return sim->regs[CommandReg];
+    case TestADCReg:
+        return sim_test_adc(sim);
+    default:
+        return sim->regs[reg & 0x3F];
+    }
+}
+
+static void sim_write_reg(struct mfrc522_sim *sim, u8 reg, u8 val)
+{
+    unsigned int i;
+
+    sim_update(sim);
+    switch (reg) {
+    case CommandReg:
+        sim->regs[CommandReg] = val & ~MFRC522_POWER_DOWN;
+        sim->busy = false;
+        if (val & MFRC522_POWER_DOWN) {
+            // Soft power-down drops the field, which resets every card
+            if (sim_field_on(sim))
+                for (i = 0; i < sim->num_cards; i++)
+                    sim_card_reset(&sim->cards[i]);
+            sim->powered_down = true;
+            break;
+        }
+        if (sim->powered_down) {
+            sim->powered_down = false;
+            sim->reset_done_ns = sim->now_ns + SIM_WAKE_NS;
+        }
+        switch (val & 0x0F) {
+        case MFRC522_CMD_SOFT_RESET:
+            sim_soft_reset(sim);
+            break;
+        case MFRC522_CMD_MEM:
+            memcpy(sim->mem_buf, sim->fifo, sizeof(sim->mem_buf));
+            sim->fifo_len = 0;
+            break;
+        case MFRC522_CMD_CALC_CRC:
+            sim_calc_crc(sim);
+            break;
+        case MFRC522_CMD_MF_AUTHENT:
+            sim_mf_authent(sim);
+            break;
+        }
+        break;
+    case ComIrqReg:
+    case DivIrqReg:
+        if (val & 0x80)
+            sim->regs[reg] |= val & 0x7F;
+        else
+            sim->regs[reg] &= ~val;
+        break;
+    case FIFODataReg:
+        if (sim->fifo_len < MFRC522_FIFO_SIZE)
+            sim->fifo[sim->fifo_len++] = val;
+        else
+            sim->regs[ErrorReg] |= MFRC522_ERR_BUFFER_OVFL;
+        break;
+    case FIFOLevelReg:
+        if (val & MFRC522_FLUSH_FIFO) {
+            sim->fifo_len = 0;
+            sim->regs[ErrorReg] &= ~MFRC522_ERR_BUFFER_OVFL;
+        }
+        break;
+    case BitFramingReg:
+        sim->regs[BitFramingReg] = val & ~MFRC522_START_SEND;
+        if ((val & MFRC522_START_SEND) && (sim->regs[CommandReg] & 0x0F) == MFRC522_CMD_TRANSCEIVE)
+            sim_transceive(sim);
+        break;
+    case CollReg:
+        sim->regs[CollReg] = (sim->regs[CollReg] & ~MFRC522_VALUES_AFTER_COLL) | (val & MFRC522_VALUES_AFTER_COLL);
+        break;
+    case Status2Reg:
+        sim->regs[Status2Reg] = (sim->regs[Status2Reg] & 0x37) | (val & 0xC8);
+        break;
+    case TxControlReg:
+        // Dropping the field powers every card down
+        if (sim_field_on(sim) && !(val & MFRC522_TX_ANTENNA))
+            for (i = 0; i < sim->num_cards; i++)
+                sim_card_reset(&sim->cards[i]);
+        sim->regs[TxControlReg] = val;
+        break;
+    case ErrorReg:
+    case Status1Reg:
+    case VersionReg:
+        break; // Read only
+    default:
+        sim->regs[reg & 0x3F] = val;
+        break;
+    }
+}
+
+// Every message costs its bytes at the bus clock plus a fixed overhead
+static void sim_bus_cost(struct mfrc522_sim *sim, unsigned int bytes)
+{
+    sim->now_ns += sim->spi_overhead_ns + (u64)bytes * 8 * 1000000000ULL / sim->spi_hz;
+    sim->stats.spi_messages++;
+    sim->stats.spi_bytes += bytes;
+}
+
+static int sim_read(void *priv, u8 reg, u8 *data, unsigned int len)
+{
+    struct mfrc522_sim *sim = priv;
+    unsigned int i;
+
+    sim_bus_cost(sim, len + 1);
+    if (sim->bus_faults) {
+        sim->bus_faults--;
+        return -EIO;
+    }
+    if (sim->wedged) {
+        memset(data, 0xFF, len);
+        return 0;
+    }
+    for (i = 0; i < len; i++)
+        data[i] = sim_read_reg(sim, reg);
+    return 0;
+}
+
+static int sim_write(void *priv, u8 reg, const u8 *data, unsigned int len)
+{
+    struct mfrc522_sim *sim = priv;
+    unsigned int i;
+
+    sim_bus_cost(sim, len + 1);
+    if (sim->bus_faults) {
+        sim->bus_faults--;
+        return -EIO;
+    }
+    if (sim->wedged)
+        return 0;
+    for (i = 0; i < len; i++)
+        sim_write_reg(sim, reg, data[i]);
+    return 0;
+}
+
+static u64 sim_now_ns(void *priv)
+{
+    struct mfrc522_sim *sim = priv;
+
+    return sim->now_ns;
+}
+
+// Hard power-down and back: everything resets, the crystal has to start again
+static int sim_hard_reset(void *priv)
+{
+    struct mfrc522_sim *sim = priv;
+
+    sim->now_ns += SIM_HARD_RESET_NS;
+    sim->wedged = false;
+    sim_soft_reset(sim);
+    sim->reset_done_ns = sim->now_ns + SIM_WAKE_NS;
+    return 0;
+}
+
+// Nothing happens on the bus meanwhile, so the clock just moves on
+static void sim_delay(void *priv, u32 us)
+{
+    struct mfrc522_sim *sim = priv;
+
+    sim->now_ns += (u64)us * 1000;
+}
+
+const struct mfrc522_bus_ops mfrc522_sim_ops = {
+    .read = sim_read,
+    .write = sim_write,
+    .now_ns = sim_now_ns,
+    .hard_reset = sim_hard_reset,
+    .delay = sim_delay,
+};
+
+void mfrc522_sim_init(struct mfrc522_sim *sim, u32 spi_hz)
+{
+    memset(sim, 0, sizeof(*sim));
+    memcpy(sim->regs, sim_reset_values, sizeof(sim->regs));
+    sim->spi_hz = spi_hz;
+    sim->spi_overhead_ns = 20000; // spi_sync() round trip on the BeagleBone
+    sim->seed = 1;
+}
+
+/**
+ * @brief Add a MIFARE Classic 1K card with transport keys, initially out of the field
+*/
+struct mfrc522_sim_card *mfrc522_sim_add_card(struct mfrc522_sim *sim, const u8 *uid, u8 uid_size)
+{
+    static const u8 trailer[MFRC522_MF_BLOCK_SIZE] = {
+        0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0x07, 0x80, 0x69, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF
+    };
+    struct mfrc522_sim_card *card;
+    unsigned int block;
+
+    if (sim->num_cards == MFRC522_SIM_MAX_CARDS || (uid_size != 4 && uid_size != 7 && uid_size != 10))
+        return NULL;
+
+    card = &sim->cards[sim->num_cards++];
+    memset(card, 0, sizeof(*card));
+    memcpy(card->uid.bytes, uid, uid_size);
+    card->uid.size = uid_size;
+    card->uid.sak = 0x08;
+    card->gain_lo = 1;
+    card->gain_hi = 7;
+    card->hears = true;
+    card->atqa[0] = uid_size == 4 ? 0x04 : 0x44;
+    memcpy(card->mem, uid, uid_size < 4 ? uid_size : 4);
+    card->mem[4] = uid[0] ^ uid[1] ^ uid[2] ^ uid[3];
+    for (block = 3; block < MFRC522_SIM_MEM_SIZE / MFRC522_MF_BLOCK_SIZE; block += 4)
+        memcpy(card->mem + block * MFRC522_MF_BLOCK_SIZE, trailer, sizeof(trailer));
+    sim_card_reset(card);
+    return card;
+}
+
+/**
+ * @brief Add an NTAG21x with a 7 byte UID and an empty NDEF capability container, initially out of the field
+ * @param pages 45 for NTAG213, 135 for NTAG215, 231 for NTAG216
+*/
+struct mfrc522_sim_card *mfrc522_sim_add_ntag(struct mfrc522_sim *sim, const u8 *uid, u8 pages)
+{
+    struct mfrc522_sim_card *card;
+    u8 *mem;
+
+    if (sim->num_cards == MFRC522_SIM_MAX_CARDS || (unsigned int)pages * MFRC522_UL_PAGE_SIZE > MFRC522_SIM_MEM_SIZE)
+        return NULL;
+
+    card = &sim->cards[sim->num_cards++];
+    memset(card, 0, sizeof(*card));
+    memcpy(card->uid.bytes, uid, 7);
+    card->uid.size = 7;
+    card->uid.sak = 0x00;
+    card->pages = pages;
+    card->gain_lo = 1;
+    card->gain_hi = 7;
+    card->hears = true;
+    card->atqa[0] = 0x44;
+
+    mem = card->mem;
+    memcpy(mem, uid, 3);
+    mem[3] = PICC_CMD_CT ^ uid[0] ^ uid[1] ^ uid[2];
+    memcpy(mem + 4, uid + 3, 4);
+    mem[8] = uid[3] ^ uid[4] ^ uid[5] ^ uid[6];
+    mem[12] = 0xE1; // CC: NDEF magic, version 1.0, data area size / 8, read/write access
+    mem[13] = 0x10;
+    mem[14] = ((pages - 9) * MFRC522_UL_PAGE_SIZE) / 8; // Pages 4 up to the 5 configuration pages
+    mem[16] = 0x03; // Empty NDEF message TLV, as shipped
+    mem[18] = 0xFE;
+    mem[SIM_NTAG_CFG0(card) * MFRC522_UL_PAGE_SIZE + 3] = 0xFF; // AUTH0 past the end: no protection
+    sim_card_reset(card);
+    return card;
+}
+
+// Set the password and PACK and protect the pages from auth0 on against writes, or also reads
+void mfrc522_sim_ntag_protect(struct mfrc522_sim_card *card, const u8 *pwd, const u8 *pack, u8 auth0, bool read)
+{
+    memcpy(card->mem + SIM_NTAG_PWD(card) * MFRC522_UL_PAGE_SIZE, pwd, MFRC522_UL_PWD_SIZE);
+    memcpy(card->mem + SIM_NTAG_PACK(card) * MFRC522_UL_PAGE_SIZE, pack, MFRC522_UL_PACK_SIZE);
+    card->mem[SIM_NTAG_CFG0(card) * MFRC522_UL_PAGE_SIZE + 3] = auth0;
+    card->mem[SIM_NTAG_CFG1(card) * MFRC522_UL_PAGE_SIZE] = read ? SIM_NTAG_PROT : 0;
+}
+
+/**
+ * @brief Add a DESFire EV1 with a 7 byte UID whose applications all hold one plain data file, initially out of the field
+ *
+ * The file (any file number) is card->mem.
+*/
+struct mfrc522_sim_card *mfrc522_sim_add_desfire(struct mfrc522_sim *sim, const u8 *uid)
+{
+    struct mfrc522_sim_card *card;
+
+    if (sim->num_cards == MFRC522_SIM_MAX_CARDS)
+        return NULL;
+
+    card = &sim->cards[sim->num_cards++];
+    memset(card, 0, sizeof(*card));
+    memcpy(card->uid.bytes, uid, 7);
+    card->uid.size = 7;
+    card->uid.sak = PICC_SAK_ISO14443_4;
+    card->desfire = true;
+    card->gain_lo = 1;
+    card->gain_hi = 7;
+    card->hears = true;
+    card->atqa[0] = 0x44;
+    card->atqa[1] = 0x03;
+    sim_card_reset(card);
+    return card;
+}
+
+// Make the data file MACed (comm 1) or enciphered (comm 3) behind AES key key_no; comm 0 leaves it free to read
+void mfrc522_sim_desfire_protect(struct mfrc522_sim_card *card, u8 key_no, const u8 *key, u8 comm)
+{
+    card->df_key_no = key_no;
+    memcpy(card->df_key, key, sizeof(card->df_key));
+    card->df_comm = comm;
+}
+
+void mfrc522_sim_set_in_field(struct mfrc522_sim_card *card, bool in_field)
+{
+    if (!in_field || !card->in_field)
+        sim_card_reset(card); // Entering the field is a fresh power-up
+    card->in_field = in_field;
+}
+
+void mfrc522_sim_advance(struct mfrc522_sim *sim, u64 ns)
+{
+    sim->now_ns += ns;
+}
+
+void mfrc522_sim_reset_stats(struct mfrc522_sim *sim)
+{
+    memset(&sim->stats, 0, sizeof(sim->stats));
+}
+
+// A dip in the supply: the chip comes back on its own, with every register at its reset value
+void mfrc522_sim_brownout(struct mfrc522_sim *sim)
+{
+    sim_soft_reset(sim);
+}
@@ -0,0 +1,129 @@
+/**
+ * @file mfrc522_sim.h
+ * @brief Host-side model of the MFRC522 and the ISO 14443A cards in its field
+ *
+ * The simulator implements struct mfrc522_bus_ops on top of a register file
+ * and a 64 byte FIFO. Time is modelled, not measured: every bus access costs
+ * the bytes it clocks at spi_hz plus a fixed per-message overhead, and every
+ * RF frame costs its duration at 106 kbit/s plus the PICC frame delay time.
+ * Card responses only become visible once the modelled clock passes the end
+ * of the answer, so polling loops in the core behave as on hardware.
+*/
+
+#ifndef MFRC522_SIM_H
+#define MFRC522_SIM_H
+
+#include "mfrc522.h"
+
+#define MFRC522_SIM_MAX_CARDS 8
+#define MFRC522_SIM_MEM_SIZE  1024 // MIFARE Classic 1K, or the data file of a DESFire
+
+enum mfrc522_sim_card_state {
+    SIM_CARD_IDLE,
+    SIM_CARD_READY,
+    SIM_CARD_ACTIVE,
+    SIM_CARD_HALT,
+};
+
+struct mfrc522_sim_card {
+    struct mfrc522_uid uid;
+    u8 atqa[2];
+    u8 mem[MFRC522_SIM_MEM_SIZE];
+    bool in_field;
+    u8 pages;                   // NTAG/Ultralight: number of 4 byte pages, 0 for MIFARE Classic
+    bool desfire;               // DESFire: mem is one plain data file of the application
+    u8 wtx;                     // S(WTX) requests to send before the next answer
+    u8 gain_lo, gain_hi;        // RxGain range that receives this card cleanly (distance to the antenna)
+    bool hears;                 // Decoded the frame in flight
+    // Protocol state
+    enum mfrc522_sim_card_state state;
+    bool from_halt;             // READY*/ACTIVE* reached through WUPA from HALT
+    unsigned int level;         // Cascade level being resolved
+    int auth_sector;            // Sector authenticated with Crypto1, -1 if none
+    int write_block;            // Block armed by the first phase of a write, -1 if none
+    bool pwd_auth;              // NTAG21x: PWD_AUTH succeeded since the card was selected
+    // ISO 14443-4 state after RATS
+    bool tcl;
+    u8 tcl_bn;                  // PICC block number
+    u16 tcl_fsd;
+    u8 tcl_in[MFRC522_FIFO_SIZE];   // Chained command being assembled
+    unsigned int tcl_in_len;
+    u8 tcl_out[MFRC522_FIFO_SIZE];  // Native answer being sent, possibly chained
+    unsigned int tcl_out_len, tcl_out_off;
+    u8 tcl_last[MFRC522_FIFO_SIZE]; // Last block sent, repeated on R(NAK)
+    unsigned int tcl_last_len;
+    u32 df_aid;                 // Selected application
+    u32 df_off, df_left;        // ReadData answer still to be sent in additional frames
+    u8 df_comm;                 // Communication setting of the file: 0 plain, 1 MACed, 3 enciphered
+    u8 df_key_no;               // The one AES application key AuthenticateEV1 accepts
+    u8 df_key[16];
+    u8 df_auth;                 // 0, 1 after sending E(RndB), 2 once authenticated
+    u8 df_rnd_b[16];
+    u8 df_session[16];
+    u8 df_iv[16];               // EV1 secure messaging IV
+    u8 df_k1[16], df_k2[16];    // CMAC subkeys of the session key
+    u32 df_nonce;               // RndB generator
+    u8 df_resp[MFRC522_SIM_MEM_SIZE + 16]; // ReadData answer: file bytes, then their CMAC or CRC32 and padding
+};
+
+struct mfrc522_sim_stats {
+    u64 spi_messages;
+    u64 spi_bytes;              // Bytes clocked on the bus (address bytes included)
+    u64 rf_frames;              // Frames sent by the PCD
+    u64 rf_ns;                  // Time the RF interface was busy
+};
+
+struct mfrc522_sim {
+    u8 regs[MFRC522_NUM_REGS];
+    u8 fifo[MFRC522_FIFO_SIZE];
+    unsigned int fifo_len;
+    u8 mem_buf[25];             // Internal buffer loaded by the Mem command
+
+    u64 now_ns;
+    u32 spi_hz;
+    u32 spi_overhead_ns;        // Per message: chip select, controller setup, scheduling
+
+    // Answer of the frame in flight
+    bool busy;
+    bool answered;
+    u64 done_ns;
+    u8 rx[MFRC522_SIM_MEM_SIZE + 2]; // Up to a FAST_READ of the whole card and its CRC
+    unsigned int rx_len;
+    unsigned int rx_pos;        // Bytes of rx that reached the FIFO (or were lost to an overflow)
+    u8 rx_last_bits;
+    u8 rx_error;
+    u8 rx_coll;
+    u8 rx_status2;
+    u8 done_irq;                // ComIrqReg bits raised when the answer is complete
+    u64 rx_start_ns;            // First bit of the answer, which stops the timer
+    u64 timer_ns;               // TimerIRq due, 0 while the timer is stopped
+    u64 reset_done_ns;          // Oscillator stable again after a reset or wake-up
+    bool powered_down;          // Soft power-down: oscillator and antenna drivers off
+    bool rx_corrupt;            // Answer to the frame in flight arrives with errors
+    u8 adc_noise;               // TestADCReg noise, +/- this many steps
+    unsigned int bus_faults;    // Bus accesses still to fail with -EIO, like a marginal connector
+    bool wedged;                // SPI interface stuck: reads return 0xFF, writes are lost until a hard reset
+    u32 seed;                   // Noise generator state
+
+    struct mfrc522_sim_card cards[MFRC522_SIM_MAX_CARDS];
+    unsigned int num_cards;
+
+    struct mfrc522_sim_stats stats;
+};
+
+extern const struct mfrc522_bus_ops mfrc522_sim_ops;
+
+void mfrc522_sim_init(struct mfrc522_sim *sim, u32 spi_hz);
+struct mfrc522_sim_card *mfrc522_sim_add_card(struct mfrc522_sim *sim, const u8 *uid, u8 uid_size);
+struct mfrc522_sim_card *mfrc522_sim_add_ntag(struct mfrc522_sim *sim, const u8 *uid, u8 pages);
+void mfrc522_sim_ntag_protect(struct mfrc522_sim_card *card, const u8 *pwd, const u8 *pack, u8 auth0, bool read);
+struct mfrc522_sim_card *mfrc522_sim_add_desfire(struct mfrc522_sim *sim, const u8 *uid);
+void mfrc522_sim_desfire_protect(struct mfrc522_sim_card *card, u8 key_no, const u8 *key, u8 comm);
+void mfrc522_sim_aes_encrypt(const u8 *key, u8 *block);
+void mfrc522_sim_aes_decrypt(const u8 *key, u8 *block);
+void mfrc522_sim_set_in_field(struct mfrc522_sim_card *card, bool in_field);
+void mfrc522_sim_advance(struct mfrc522_sim *sim, u64 ns);
+void mfrc522_sim_reset_stats(struct mfrc522_sim *sim);
+void mfrc522_sim_brownout(struct mfrc522_sim *sim);
+
+#endif // MFRC522_SIM_H
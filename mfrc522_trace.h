@@ -0,0 +1,111 @@
+/**
+ * @file mfrc522_trace.h
+ * @brief Tracepoints for the MFRC522 driver
+ *
+ * Enable with e.g. `echo 1 > /sys/kernel/debug/tracing/events/mfrc522/enable`
+ * or `perf record -e 'mfrc522:*'`. Disabled tracepoints are a patched-out
+ * branch, so these stay compiled in.
+*/
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM mfrc522
+
+#if !defined(MFRC522_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define MFRC522_TRACE_H
+
+#include <linux/tracepoint.h>
+
+DECLARE_EVENT_CLASS(mfrc522_reg,
+    TP_PROTO(u8 reg, u8 val, int ret),
+    TP_ARGS(reg, val, ret),
+    TP_STRUCT__entry(
+        __field(u8, reg)
+        __field(u8, val)
+        __field(int, ret)
+    ),
+    TP_fast_assign(
+        __entry->reg = reg;
+        __entry->val = val;
+        __entry->ret = ret;
+    ),
+    TP_printk("reg=0x%02x val=0x%02x ret=%d", __entry->reg, __entry->val, __entry->ret)
+);
+
+DEFINE_EVENT(mfrc522_reg, mfrc522_reg_read,
+    TP_PROTO(u8 reg, u8 val, int ret),
+    TP_ARGS(reg, val, ret)
+);
+
+DEFINE_EVENT(mfrc522_reg, mfrc522_reg_write,
+    TP_PROTO(u8 reg, u8 val, int ret),
+    TP_ARGS(reg, val, ret)
+);
+
+DECLARE_EVENT_CLASS(mfrc522_fifo,
+    TP_PROTO(const u8 *data, unsigned int len, int ret),
+    TP_ARGS(data, len, ret),
+    TP_STRUCT__entry(
+        __field(unsigned int, len)
+        __field(int, ret)
+        __dynamic_array(u8, data, len)
+    ),
+    TP_fast_assign(
+        __entry->len = len;
+        __entry->ret = ret;
+        memcpy(__get_dynamic_array(data), data, len);
+    ),
+    TP_printk("len=%u ret=%d data=%s", __entry->len, __entry->ret,
+              __print_hex(__get_dynamic_array(data), __entry->len))
+);
+
+DEFINE_EVENT(mfrc522_fifo, mfrc522_fifo_read,
+    TP_PROTO(const u8 *data, unsigned int len, int ret),
+    TP_ARGS(data, len, ret)
+);
+
+DEFINE_EVENT(mfrc522_fifo, mfrc522_fifo_write,
+    TP_PROTO(const u8 *data, unsigned int len, int ret),
+    TP_ARGS(data, len, ret)
+);
+
+TRACE_EVENT(mfrc522_cmd_issue,
+    TP_PROTO(u8 cmd, unsigned int tx_len, u8 bit_framing),
+    TP_ARGS(cmd, tx_len, bit_framing),
+    TP_STRUCT__entry(
+        __field(u8, cmd)
+        __field(u8, bit_framing)
+        __field(unsigned int, tx_len)
+    ),
+    TP_fast_assign(
+        __entry->cmd = cmd;
+        __entry->bit_framing = bit_framing;
+        __entry->tx_len = tx_len;
+    ),
+    TP_printk("cmd=0x%x tx_len=%u bit_framing=0x%02x", __entry->cmd, __entry->tx_len, __entry->bit_framing)
+);
+
+TRACE_EVENT(mfrc522_cmd_complete,
+    TP_PROTO(u8 cmd, u8 irq, u8 error, int ret),
+    TP_ARGS(cmd, irq, error, ret),
+    TP_STRUCT__entry(
+        __field(u8, cmd)
+        __field(u8, irq)
+        __field(u8, error)
+        __field(int, ret)
+    ),
+    TP_fast_assign(
+        __entry->cmd = cmd;
+        __entry->irq = irq;
+        __entry->error = error;
+        __entry->ret = ret;
+    ),
+    TP_printk("cmd=0x%x com_irq=0x%02x error=0x%02x ret=%d", __entry->cmd, __entry->irq, __entry->error, __entry->ret)
+);
+
+#endif // MFRC522_TRACE_H
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE mfrc522_trace
+#include <trace/define_trace.h>
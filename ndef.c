@@ -0,0 +1,311 @@
+/**
+ * @file ndef.c
+ * @brief NDEF TLV encoding and incremental writes to MIFARE Classic and NTAG21x tags
+ *
+ * Writes are differential: every block (MIFARE) or page (NTAG) of the target
+ * image is compared with what the tag holds and only the ones that differ are
+ * written. Written blocks are verified by having the MFRC522 compute the
+ * CRC_A of a fresh READ (mfrc522_read_crc()) instead of reading them back.
+*/
+
+#include "ndef.h"
+
+// Bytes of a len byte image that fall into unit i of size unit
+static size_t ndef_chunk(size_t len, size_t i, size_t unit)
+{
+    return len - i * unit < unit ? len - i * unit : unit;
+}
+
+/**
+ * @brief Wrap an NDEF message into a message TLV followed by a terminator TLV
+ * @return Number of bytes written to out, or -ENOSPC
+*/
+int ndef_tlv_encode(const u8 *msg, size_t len, u8 *out, size_t cap)
+{
+    size_t hdr = len < 0xFF ? 2 : 4;
+
+    if (len > 0xFFFE || hdr + len + 1 > cap)
+        return -ENOSPC;
+
+    out[0] = NDEF_TLV_MESSAGE;
+    if (hdr == 2) {
+        out[1] = len;
+    } else {
+        out[1] = 0xFF;
+        out[2] = len >> 8;
+        out[3] = len & 0xFF;
+    }
+    memcpy(out + hdr, msg, len);
+    out[hdr + len] = NDEF_TLV_TERMINATOR;
+    return hdr + len + 1;
+}
+
+/**
+ * @brief Find the first NDEF message TLV in a data area, skipping NULL, lock and memory control TLVs
+ * @return 0, -ENOENT if the area holds no message, -EMSGSIZE if more of the area is needed
+*/
+int ndef_tlv_decode(const u8 *area, size_t len, size_t *msg_off, size_t *msg_len)
+{
+    size_t i = 0, hdr, l;
+
+    while (i < len) {
+        if (area[i] == NDEF_TLV_NULL) {
+            i++;
+            continue;
+        }
+        if (area[i] == NDEF_TLV_TERMINATOR)
+            return -ENOENT;
+        if (i + 1 >= len)
+            return -EMSGSIZE;
+        l = area[i + 1];
+        hdr = 2;
+        if (l == 0xFF) {
+            if (i + 3 >= len)
+                return -EMSGSIZE;
+            l = (size_t)area[i + 2] << 8 | area[i + 3];
+            hdr = 4;
+        }
+        if (i + hdr + l > len)
+            return -EMSGSIZE;
+        if (area[i] == NDEF_TLV_MESSAGE) {
+            *msg_off = i + hdr;
+            *msg_len = l;
+            return 0;
+        }
+        i += hdr + l;
+    }
+    return -EMSGSIZE;
+}
+
+// MAD CRC-8: polynomial 1Dh, preset C7h, over the info byte and the AIDs
+static u8 ndef_mad_crc(const u8 *mad)
+{
+    u8 crc = 0xC7;
+    unsigned int i, bit;
+
+    for (i = 1; i < 2 * MFRC522_MF_BLOCK_SIZE; i++) {
+        crc ^= mad[i];
+        for (bit = 0; bit < 8; bit++)
+            crc = crc & 0x80 ? (crc << 1) ^ 0x1D : crc << 1;
+    }
+    return crc;
+}
+
+/**
+ * @brief Blocks 1 and 2 of sector 0: a MAD1 marking sectors 1-15 as NDEF
+ *
+ * The whole card is claimed whatever the message length, so the MAD does not
+ * change when a token is re-provisioned with a longer or shorter message.
+*/
+void ndef_mad_build(u8 *mad)
+{
+    unsigned int s;
+
+    mad[1] = 0x00; // Info byte: no card publisher sector
+    for (s = 1; s <= NDEF_MF_SECTORS; s++) {
+        mad[2 * s] = NDEF_MAD_AID & 0xFF;
+        mad[2 * s + 1] = NDEF_MAD_AID >> 8;
+    }
+    mad[0] = ndef_mad_crc(mad);
+}
+
+/**
+ * @brief Bring len bytes starting at block first (all in one sector) to want, writing only the blocks that differ
+*/
+static int ndef_mifare_sync(struct mfrc522_dev *dev, const struct mfrc522_uid *uid, u8 key_type, const u8 *key,
+                            u8 first, const u8 *want, size_t len, struct ndef_write_stats *stats)
+{
+    u8 cur[MFRC522_MF_SECTOR_BLOCKS - 1][MFRC522_MF_BLOCK_SIZE];
+    unsigned int i, n = (len + MFRC522_MF_BLOCK_SIZE - 1) / MFRC522_MF_BLOCK_SIZE, dirty = 0;
+    size_t chunk;
+    u16 crc;
+    int ret;
+
+    ret = mfrc522_mifare_auth(dev, key_type, first, key, uid);
+    if (ret)
+        return ret;
+
+    for (i = 0; i < n; i++) {
+        ret = mfrc522_mifare_read(dev, first + i, cur[i]);
+        if (ret)
+            return ret;
+        stats->reads++;
+
+        // Bytes past the end of the image keep what the tag has
+        chunk = ndef_chunk(len, i, MFRC522_MF_BLOCK_SIZE);
+        if (!memcmp(cur[i], want + i * MFRC522_MF_BLOCK_SIZE, chunk))
+            continue;
+        memcpy(cur[i], want + i * MFRC522_MF_BLOCK_SIZE, chunk);
+        ret = mfrc522_mifare_write(dev, first + i, cur[i]);
+        if (ret)
+            return ret;
+        stats->writes++;
+        dirty |= 1 << i;
+    }
+
+    for (i = 0; i < n; i++) {
+        if (!(dirty & (1 << i)))
+            continue;
+        ret = mfrc522_read_crc(dev, first + i, &crc);
+        if (ret)
+            return ret;
+        stats->verifies++;
+        if (crc != mfrc522_crc_a(cur[i], MFRC522_MF_BLOCK_SIZE))
+            return -EIO;
+    }
+    return 0;
+}
+
+/**
+ * @brief Write an encoded message TLV (ndef_tlv_encode()) and the MAD to a formatted MIFARE Classic tag
+*/
+int ndef_write_mifare(struct mfrc522_dev *dev, const struct mfrc522_uid *uid, u8 key_type, const u8 *key,
+                      const u8 *tlv, size_t tlv_len, struct ndef_write_stats *stats)
+{
+    u8 mad[2 * MFRC522_MF_BLOCK_SIZE];
+    unsigned int sector;
+    size_t off;
+    int ret;
+
+    if (tlv_len > NDEF_MF_AREA_SIZE)
+        return -ENOSPC;
+
+    memset(stats, 0, sizeof(*stats));
+    ndef_mad_build(mad);
+    ret = ndef_mifare_sync(dev, uid, key_type, key, 1, mad, sizeof(mad), stats);
+    if (ret)
+        return ret;
+
+    for (sector = 1, off = 0; off < tlv_len; sector++, off += NDEF_MF_SECTOR_DATA) {
+        ret = ndef_mifare_sync(dev, uid, key_type, key, sector * MFRC522_MF_SECTOR_BLOCKS, tlv + off,
+                               ndef_chunk(tlv_len - off, 0, NDEF_MF_SECTOR_DATA), stats);
+        if (ret)
+            return ret;
+    }
+    return 0;
+}
+
+/**
+ * @brief Read the NDEF area of a MIFARE Classic tag until its message TLV is complete
+ * @param area At least NDEF_MF_AREA_SIZE bytes; the message is at area + *msg_off
+*/
+int ndef_read_mifare(struct mfrc522_dev *dev, const struct mfrc522_uid *uid, u8 key_type, const u8 *key,
+                     u8 *area, size_t *msg_off, size_t *msg_len)
+{
+    unsigned int sector, i;
+    size_t got = 0;
+    int ret;
+
+    for (sector = 1; sector <= NDEF_MF_SECTORS; sector++) {
+        ret = mfrc522_mifare_auth(dev, key_type, sector * MFRC522_MF_SECTOR_BLOCKS, key, uid);
+        if (ret)
+            return ret;
+        for (i = 0; i < MFRC522_MF_SECTOR_BLOCKS - 1; i++) {
+            ret = mfrc522_mifare_read(dev, sector * MFRC522_MF_SECTOR_BLOCKS + i, area + got);
+            if (ret)
+                return ret;
+            got += MFRC522_MF_BLOCK_SIZE;
+            ret = ndef_tlv_decode(area, got, msg_off, msg_len);
+            if (ret != -EMSGSIZE)
+                return ret;
+        }
+    }
+    return -EBADMSG;
+}
+
+// Size of the data area from the capability container
+static int ndef_ultralight_capacity(struct mfrc522_dev *dev, size_t *cap)
+{
+    u8 cc[MFRC522_MF_BLOCK_SIZE];
+    int ret;
+
+    ret = mfrc522_mifare_read(dev, NDEF_UL_CC_PAGE, cc);
+    if (ret)
+        return ret;
+    if (cc[0] != NDEF_CC_MAGIC)
+        return -EMEDIUMTYPE; // Not NDEF formatted; the CC is OTP, so it is not written here
+    *cap = (size_t)cc[2] * 8;
+    if (*cap > NDEF_MAX_AREA)
+        *cap = NDEF_MAX_AREA;
+    return 0;
+}
+
+/**
+ * @brief Write an encoded message TLV to an NTAG21x, four pages (one READ) at a time
+*/
+int ndef_write_ultralight(struct mfrc522_dev *dev, const u8 *tlv, size_t tlv_len, struct ndef_write_stats *stats)
+{
+    u8 cur[MFRC522_MF_BLOCK_SIZE];
+    size_t cap, off, chunk, n;
+    unsigned int p;
+    bool dirty;
+    u8 page;
+    u16 crc;
+    int ret;
+
+    memset(stats, 0, sizeof(*stats));
+    ret = ndef_ultralight_capacity(dev, &cap);
+    if (ret)
+        return ret;
+    if (tlv_len > cap)
+        return -ENOSPC;
+
+    for (off = 0; off < tlv_len; off += sizeof(cur)) {
+        page = NDEF_UL_DATA_PAGE + off / MFRC522_UL_PAGE_SIZE;
+        ret = mfrc522_mifare_read(dev, page, cur);
+        if (ret)
+            return ret;
+        stats->reads++;
+
+        chunk = ndef_chunk(tlv_len - off, 0, sizeof(cur));
+        dirty = false;
+        for (p = 0; p * MFRC522_UL_PAGE_SIZE < chunk; p++) {
+            n = ndef_chunk(chunk, p, MFRC522_UL_PAGE_SIZE);
+            if (!memcmp(cur + p * MFRC522_UL_PAGE_SIZE, tlv + off + p * MFRC522_UL_PAGE_SIZE, n))
+                continue;
+            memcpy(cur + p * MFRC522_UL_PAGE_SIZE, tlv + off + p * MFRC522_UL_PAGE_SIZE, n);
+            ret = mfrc522_ultralight_write(dev, page + p, cur + p * MFRC522_UL_PAGE_SIZE);
+            if (ret)
+                return ret;
+            stats->writes++;
+            dirty = true;
+        }
+
+        if (!dirty)
+            continue;
+        ret = mfrc522_read_crc(dev, page, &crc);
+        if (ret)
+            return ret;
+        stats->verifies++;
+        if (crc != mfrc522_crc_a(cur, sizeof(cur)))
+            return -EIO;
+    }
+    return 0;
+}
+
+/**
+ * @brief Read the data area of an NTAG21x with FAST_READ until its message TLV is complete
+ * @param area At least NDEF_MAX_AREA bytes; the message is at area + *msg_off
+*/
+int ndef_read_ultralight(struct mfrc522_dev *dev, u8 *area, size_t *msg_off, size_t *msg_len)
+{
+    size_t cap, got, n, step = mfrc522_ntag_frame_pages(dev) * MFRC522_UL_PAGE_SIZE;
+    int ret;
+
+    ret = ndef_ultralight_capacity(dev, &cap);
+    if (ret)
+        return ret;
+
+    // The data area is a whole number of pages (the CC counts it in 8 byte units)
+    for (got = 0; got < cap; got += n) {
+        n = ndef_chunk(cap - got, 0, step);
+        ret = mfrc522_ntag_read(dev, NDEF_UL_DATA_PAGE + got / MFRC522_UL_PAGE_SIZE, n / MFRC522_UL_PAGE_SIZE,
+                                area + got);
+        if (ret)
+            return ret;
+        ret = ndef_tlv_decode(area, got + n, msg_off, msg_len);
+        if (ret != -EMSGSIZE)
+            return ret;
+    }
+    return -EBADMSG;
+}
@@ -0,0 +1,55 @@
+/**
+ * @file ndef.h
+ * @brief NDEF TLV encoding and the tag layouts NFC_tag.c provisions
+ *
+ * Like the reader core this only talks to the chip through mfrc522_core.c,
+ * so it builds into the kernel module and into the host benchmark.
+ *
+ * MIFARE Classic (NFC Forum application note AN1304): sector 0 holds the MAD,
+ * whose AIDs mark sectors 1-15 as NDEF (03E1h); the message TLV runs through
+ * the three data blocks of sectors 1-15. The tag must already be formatted:
+ * sector trailers are never written, and every sector, the MAD included, is
+ * authenticated with the key given by the caller.
+ *
+ * NTAG21x (NFC Forum Type 2): the capability container in page 3 gives the
+ * size of the data area, which starts at page 4.
+*/
+
+#ifndef NDEF_H
+#define NDEF_H
+
+#include "mfrc522.h"
+
+#define NDEF_TLV_NULL        0x00
+#define NDEF_TLV_MESSAGE     0x03
+#define NDEF_TLV_TERMINATOR  0xFE
+#define NDEF_MAD_AID         0x03E1 // NFC Forum NDEF application in the MAD
+#define NDEF_CC_MAGIC        0xE1   // First byte of a Type 2 capability container
+#define NDEF_UL_CC_PAGE      3
+#define NDEF_UL_DATA_PAGE    4
+
+#define NDEF_MF_SECTORS      15     // Sectors 1-15 of a 1K card (also used on 4K cards)
+#define NDEF_MF_SECTOR_DATA  ((MFRC522_MF_SECTOR_BLOCKS - 1) * MFRC522_MF_BLOCK_SIZE)
+#define NDEF_MF_AREA_SIZE    (NDEF_MF_SECTORS * NDEF_MF_SECTOR_DATA)
+#define NDEF_MAX_AREA        888    // NTAG216 data area, the largest supported
+
+// RF operations one ndef_write_*() call needed
+struct ndef_write_stats {
+    unsigned int reads;         // 16 byte READs of the current content
+    unsigned int writes;        // Blocks (MIFARE) or pages (NTAG) written
+    unsigned int verifies;      // CRC_A compares after writing
+};
+
+int ndef_tlv_encode(const u8 *msg, size_t len, u8 *out, size_t cap);
+int ndef_tlv_decode(const u8 *area, size_t len, size_t *msg_off, size_t *msg_len);
+void ndef_mad_build(u8 *mad);
+
+// The card is selected (ACTIVE); it is left selected, with Crypto1 still on for MIFARE
+int ndef_write_mifare(struct mfrc522_dev *dev, const struct mfrc522_uid *uid, u8 key_type, const u8 *key,
+                      const u8 *tlv, size_t tlv_len, struct ndef_write_stats *stats);
+int ndef_read_mifare(struct mfrc522_dev *dev, const struct mfrc522_uid *uid, u8 key_type, const u8 *key,
+                     u8 *area, size_t *msg_off, size_t *msg_len);
+int ndef_write_ultralight(struct mfrc522_dev *dev, const u8 *tlv, size_t tlv_len, struct ndef_write_stats *stats);
+int ndef_read_ultralight(struct mfrc522_dev *dev, u8 *area, size_t *msg_off, size_t *msg_len);
+
+#endif // NDEF_H
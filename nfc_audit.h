@@ -0,0 +1,38 @@
+/**
+ * @file nfc_audit.h
+ * @brief Binary audit records of the lock decisions, as read from the relay files
+ *
+ * controller.c writes one record per decision into per-CPU relay buffers
+ * (/sys/kernel/debug/nfc_controller/audit0, audit1, ...). Records are packed
+ * back to back with no padding between them; merge the files by seq. Like
+ * nfc_ioctl.h only fixed-size fields are used, so a dump copied off the board
+ * parses the same on a 64-bit machine.
+*/
+
+#ifndef NFC_AUDIT_H
+#define NFC_AUDIT_H
+
+#include <linux/types.h>
+
+#define NFC_AUDIT_MAX_UIDS 4 // MFRC522_MAX_CARDS
+
+enum nfc_audit_result {
+    NFC_AUDIT_DENY   = 0,   // Cards presented, not enough valid tokens; the lock stays closed
+    NFC_AUDIT_GRANT  = 1,   // The lock was opened
+    NFC_AUDIT_HOLD   = 2,   // Still open, the tokens in the field changed
+    NFC_AUDIT_RELOCK = 3,   // The lock was closed again
+};
+
+struct nfc_audit_record {
+    __u64 time_ns;          // CLOCK_REALTIME of the decision
+    __u32 seq;              // Counts every record; a gap means records were dropped
+    __u32 latency_ns;       // First card answer to the solenoid GPIO, or to the decision if the lock did not move
+    __u8 result;            // enum nfc_audit_result
+    __u8 present;           // Tokens counted, bit i is tokens[i]
+    __u8 rejected;          // Tokens whose UID matched but whose credential failed
+    __u8 uid_count;         // Entries of uid_size/uids in use
+    __u8 uid_size[NFC_AUDIT_MAX_UIDS];
+    __u8 uids[NFC_AUDIT_MAX_UIDS][10];
+};
+
+#endif // NFC_AUDIT_H
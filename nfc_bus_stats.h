@@ -0,0 +1,128 @@
+/**
+ * @file nfc_bus_stats.h
+ * @brief Per-CPU bus transaction counters for the reader drivers
+ *
+ * Writers only touch their own CPU's copy, so counting costs a few adds and
+ * no shared cache line. Readers sum all CPUs; u64_stats_sync keeps the 64-bit
+ * counters consistent on 32-bit ARM. A reset never writes the counters, which
+ * another CPU may be updating: it records them as a baseline that the sums
+ * subtract.
+*/
+
+#ifndef NFC_BUS_STATS_H
+#define NFC_BUS_STATS_H
+
+#include <linux/percpu.h>
+#include <linux/u64_stats_sync.h>
+#include <linux/spinlock.h>
+#include <linux/seq_file.h>
+#include "nfc_ioctl.h"
+
+struct nfc_bus_stats {
+    struct nfc_bus_counters c;
+    struct u64_stats_sync syncp;
+    struct nfc_bus_counters base;   // c at the last reset, under nfc_bus_stats_lock
+};
+
+static DEFINE_SPINLOCK(nfc_bus_stats_lock); // Resets against sums; the writers never take it
+
+#define NFC_BUS_COUNTERS (sizeof(struct nfc_bus_counters) / sizeof(__u64))
+
+static inline struct nfc_bus_stats __percpu *nfc_bus_stats_alloc(void)
+{
+    struct nfc_bus_stats __percpu *stats = alloc_percpu(struct nfc_bus_stats);
+    int cpu;
+
+    if (stats)
+        for_each_possible_cpu(cpu)
+            u64_stats_init(&per_cpu_ptr(stats, cpu)->syncp);
+    return stats;
+}
+
+// Open an update of this CPU's counters; pair with nfc_bus_stats_end()
+static inline struct nfc_bus_stats *nfc_bus_stats_begin(struct nfc_bus_stats __percpu *stats)
+{
+    struct nfc_bus_stats *s = get_cpu_ptr(stats);
+
+    u64_stats_update_begin(&s->syncp);
+    return s;
+}
+
+static inline void nfc_bus_stats_end(struct nfc_bus_stats __percpu *stats, struct nfc_bus_stats *s)
+{
+    u64_stats_update_end(&s->syncp);
+    put_cpu_ptr(stats);
+}
+
+#define nfc_bus_stats_inc(stats, field) do {                    \
+        struct nfc_bus_stats *__s = nfc_bus_stats_begin(stats); \
+        __s->c.field++;                                         \
+        nfc_bus_stats_end(stats, __s);                          \
+    } while (0)
+
+// One CPU's counters as its writer last left them
+static inline void nfc_bus_stats_fetch(const struct nfc_bus_stats *s, struct nfc_bus_counters *snap)
+{
+    unsigned int start;
+
+    do {
+        start = u64_stats_fetch_begin(&s->syncp);
+        *snap = s->c;
+    } while (u64_stats_fetch_retry(&s->syncp, start));
+}
+
+static inline void nfc_bus_stats_sum(struct nfc_bus_stats __percpu *stats, struct nfc_bus_counters *out)
+{
+    const struct nfc_bus_stats *s;
+    struct nfc_bus_counters snap;
+    const __u64 *src = (const __u64 *)&snap;
+    const __u64 *base;
+    __u64 *dst = (__u64 *)out;
+    unsigned int i;
+    int cpu;
+
+    memset(out, 0, sizeof(*out));
+    spin_lock(&nfc_bus_stats_lock);
+    for_each_possible_cpu(cpu) {
+        s = per_cpu_ptr(stats, cpu);
+        base = (const __u64 *)&s->base;
+        nfc_bus_stats_fetch(s, &snap);
+        for (i = 0; i < NFC_BUS_COUNTERS; i++)
+            dst[i] += src[i] - base[i];
+    }
+    spin_unlock(&nfc_bus_stats_lock);
+}
+
+// Counts from here on only; the per-CPU counters keep running
+static inline void nfc_bus_stats_reset(struct nfc_bus_stats __percpu *stats)
+{
+    struct nfc_bus_stats *s;
+    int cpu;
+
+    spin_lock(&nfc_bus_stats_lock);
+    for_each_possible_cpu(cpu) {
+        s = per_cpu_ptr(stats, cpu);
+        nfc_bus_stats_fetch(s, &s->base);
+    }
+    spin_unlock(&nfc_bus_stats_lock);
+}
+
+static inline void nfc_bus_stats_seq_show(struct seq_file *m, struct nfc_bus_stats __percpu *stats)
+{
+    struct nfc_bus_counters c;
+
+    nfc_bus_stats_sum(stats, &c);
+    seq_printf(m, "messages:        %llu\n", c.messages);
+    seq_printf(m, "bytes_out:       %llu\n", c.bytes_out);
+    seq_printf(m, "bytes_in:        %llu\n", c.bytes_in);
+    seq_printf(m, "xfer_errors:     %llu\n", c.xfer_errors);
+    seq_printf(m, "retries:         %llu\n", c.retries);
+    seq_printf(m, "crc_errors:      %llu\n", c.crc_errors);
+    seq_printf(m, "parity_errors:   %llu\n", c.parity_errors);
+    seq_printf(m, "protocol_errors: %llu\n", c.protocol_errors);
+    seq_printf(m, "collisions:      %llu\n", c.collisions);
+    seq_printf(m, "fifo_overflows:  %llu\n", c.fifo_overflows);
+    seq_printf(m, "busy_us:         %llu\n", div_u64(c.busy_ns, 1000));
+}
+
+#endif // NFC_BUS_STATS_H
@@ -0,0 +1,35 @@
+/**
+ * @file nfc_capture.h
+ * @brief Raw RF frame records, as read from the MFRC522 capture relay files
+ *
+ * With capture on, spi_mfrc522 writes one record per transceived frame into
+ * per-CPU relay buffers (/sys/kernel/debug/mfrc522/<n>/rf0, rf1, ...). Each record
+ * is this header followed by tx_len sent and rx_len received bytes, zero
+ * padded to size. Records never straddle a sub-buffer; the end of a
+ * sub-buffer is padding the relay file skips. Fixed-size fields only, like
+ * nfc_ioctl.h.
+*/
+
+#ifndef NFC_CAPTURE_H
+#define NFC_CAPTURE_H
+
+#include <linux/types.h>
+
+#define NFC_RF_FRAME_ALIGN 8
+
+struct nfc_rf_frame {
+    __u64 time_ns;          // CLOCK_MONOTONIC before the FIFO was loaded
+    __u32 duration_ns;      // Until the answer was read back
+    __s16 result;           // 0 or the negative errno of the exchange (-ETIMEDOUT: no answer)
+    __u16 size;             // Whole record, header and padding included, a multiple of NFC_RF_FRAME_ALIGN
+    __u8 tx_len;
+    __u8 rx_len;
+    __u8 tx_last_bits;      // Valid bits in the last byte, 0 means 8
+    __u8 rx_last_bits;
+    __u8 flags;             // Bit 0: CRC appended on send, bit 1: CRC checked and stripped on receive
+    __u8 error;             // ErrorReg
+    __u8 coll;              // CollReg, 0 unless ErrorReg has CollErr
+    __u8 reserved;
+};
+
+#endif // NFC_CAPTURE_H
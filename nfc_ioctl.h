@@ -0,0 +1,56 @@
+/**
+ * @file nfc_ioctl.h
+ * @brief ioctl ABI shared by the NFC lock drivers and userspace tools
+ *
+ * Only fixed-size __u64/__u32 fields so the layout is the same for 32-bit
+ * ARM userspace and a 64-bit build machine reading a dump.
+*/
+
+#ifndef NFC_IOCTL_H
+#define NFC_IOCTL_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+#define NFC_IOC_MAGIC 'N'
+
+// Bus transaction counters of one reader, summed over all CPUs
+struct nfc_bus_counters {
+    __u64 messages;         // SPI messages / I2C transfers
+    __u64 bytes_out;        // Bytes clocked out, address bytes included
+    __u64 bytes_in;         // Payload bytes read back
+    __u64 xfer_errors;      // Failed transfers
+    __u64 retries;          // Protocol-level retries
+    __u64 crc_errors;       // ErrorReg CRCErr
+    __u64 parity_errors;    // ErrorReg ParityErr
+    __u64 protocol_errors;  // ErrorReg ProtocolErr
+    __u64 collisions;       // ErrorReg CollErr
+    __u64 fifo_overflows;   // ErrorReg BufferOvfl
+    __u64 busy_ns;          // Time spent inside the transfer functions
+};
+
+#define NFC_IOC_GET_BUS_STATS   _IOR(NFC_IOC_MAGIC, 1, struct nfc_bus_counters)
+#define NFC_IOC_RESET_BUS_STATS _IO(NFC_IOC_MAGIC, 2)
+
+/**
+ * @brief Result of one tag in provisioning mode, read() from the NFC_tag device
+ *
+ * seq counts the images written to the device, from 0 when provisioning was
+ * switched on. A failed attempt keeps its image queued for the next tag.
+*/
+struct nfc_tag_event {
+    __u64 duration_ns;      // Tag selected to tag HALTed
+    __u32 seq;
+    __s32 result;           // 0 or a negative errno
+    __u16 reads;            // See struct ndef_write_stats
+    __u16 writes;
+    __u16 verifies;
+    __u8 uid_size;
+    __u8 uid[10];
+    __u8 reserved[7];
+};
+
+// Switch provisioning mode on (arg 1) or off (arg 0); switching it off drops the images still queued
+#define NFC_IOC_PROVISION       _IO(NFC_IOC_MAGIC, 3)
+
+#endif // NFC_IOCTL_H
@@ -0,0 +1,56 @@
+/**
+ * @file nfc_reader.h
+ * @brief What the reader drivers hand to controller.c
+ *
+ * Every reader (each MFRC522 bound by spi_mfrc522, the PN532) registers a
+ * struct nfc_reader with the controller, which polls each on its own thread
+ * and merges what they see. nfc_reader_run() is exported by spi_mfrc522
+ * and lends the first MFRC522 probed to modules that drive cards directly.
+*/
+
+#ifndef NFC_READER_H
+#define NFC_READER_H
+
+#include <linux/ktime.h>
+#include "mfrc522.h"
+#include "desfire.h"
+
+#define NFC_MAX_READERS   8 // Bits of nfc_scan.origin
+#define NFC_SCAN_MAX_UIDS (NFC_MAX_READERS * MFRC522_MAX_CARDS)
+
+struct nfc_scan {
+    struct mfrc522_uid uids[NFC_SCAN_MAX_UIDS]; // One reader fills at most MFRC522_MAX_CARDS
+    u8 origin[NFC_SCAN_MAX_UIDS];   // Bit i: seen by reader slot i, set by the controller
+    unsigned int count;
+    ktime_t t_answer;   // First REQA/WUPA answer of this pass, 0 if the field was empty
+    ktime_t t_resolved; // Last UID of this pass resolved
+    u64 wake_ns;        // Reader wake-up to ready before this pass, 0 if it was already awake
+};
+
+int nfc_reader_run(int (*fn)(struct mfrc522_dev *dev, void *arg), void *arg);
+
+/**
+ * @brief A reader the controller polls
+ *
+ * scan() runs one inventory pass and may sleep. read_blocks() reads the
+ * 16-byte blocks of a card the last pass reported, for signed credentials:
+ * MIFARE Classic blocks, or pages 4b..4b+3 of an NTAG21x for block b (the
+ * key is then unused), always from the card itself; readers without it
+ * (NULL) only count bare UIDs. read_file() reads a file of a DESFire
+ * application, authenticated with the reader's AES key as key_no (see
+ * desfire.h), or is NULL if the reader cannot. All are only ever called from
+ * the reader's own poll thread. Exported by controller.ko.
+*/
+struct nfc_reader {
+    const char *name;
+    int (*scan)(struct nfc_reader *reader, struct nfc_scan *scan);
+    int (*read_blocks)(struct nfc_reader *reader, const struct mfrc522_uid *uid, u8 key_type, const u8 *key,
+                       u8 block, unsigned int count, u8 *data);
+    int (*read_file)(struct nfc_reader *reader, const struct mfrc522_uid *uid, u32 aid, u8 key_no, u8 file,
+                     u32 offset, enum desfire_comm comm, u8 *data, unsigned int len);
+};
+
+int nfc_reader_register(struct nfc_reader *reader);
+void nfc_reader_unregister(struct nfc_reader *reader);
+
+#endif // NFC_READER_H
@@ -1,5 +1,10 @@
 /**
  * This module is used to operate the solenoid lock
+ *
+ * Bound from the device tree (compatible "ec535,solenoid", see
+ * nfc-lock-overlay.dts); lock i is the i-th GPIO of its lock-gpios property
+ * and the character device minor i. Minor SOLENOID_GROUP_MINOR switches many
+ * locks at once, e.g. to release every door on a fire alarm.
 */
 
 #include <linux/module.h>
@@ -14,15 +19,33 @@
 #include <linux/cdev.h>
 #include <linux/types.h>
 #include <linux/uaccess.h>
+#include <linux/ktime.h>
+#include <linux/platform_device.h>
+#include <linux/gpio/consumer.h>
+#include <linux/gpio/driver.h>
+#include <linux/of.h>
+#include <linux/completion.h>
+#include <linux/spinlock.h>
+#include <linux/bitops.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+
+#include "solenoid.h"
+#include "latency_hist.h"
+
+#define CREATE_TRACE_POINTS
+#include "solenoid_trace.h"
 
 MODULE_LICENSE("Dual BSD/GPL");
 MODULE_AUTHOR("Alfonso Meraz & Alex Melnick");
 MODULE_DESCRIPTION("Linux driver for traffic light.");
 
-static int major = 61;  //? May change later
+static int major; // 0: let the kernel pick
+module_param(major, int, 0444);
+MODULE_PARM_DESC(major, "Character device major number, 0 for a dynamic one");
 
-#define SOLENOID_GPIO 26
 #define DEVICE_NAME "solenoid"
+#define SOLENOID_GROUP_MINOR 255 // Writes apply to a mask of locks, all of them by default
 
 const static bool DEBUG = true;
 
@@ -31,8 +54,9 @@ static ssize_t solenoid_write(struct file *file, const char *buffer, size_t leng
 static int solenoid_open(struct inode *inode, struct file *file);
 static int solenoid_release(struct inode *inode, struct file *file);
 
-static int __init solenoid_init(void);
-static void __exit solenoid_exit(void);
+static int solenoid_probe(struct platform_device *pdev);
+static const struct file_operations group_stats_fops;
+static int solenoid_remove(struct platform_device *pdev);
 
 static const struct file_operations fops = {
     .owner = THIS_MODULE,
@@ -42,72 +66,271 @@ static const struct file_operations fops = {
     .write = solenoid_write
 };
 
-static bool locked = false; 
+static const struct of_device_id solenoid_of_match[] = {
+    { .compatible = "ec535,solenoid" },
+    { }
+};
+MODULE_DEVICE_TABLE(of, solenoid_of_match);
+
+// Probed asynchronously, in parallel with the readers
+static struct platform_driver solenoid_driver = {
+    .driver = {
+        .name = DEVICE_NAME,
+        .of_match_table = solenoid_of_match,
+        .probe_type = PROBE_PREFER_ASYNCHRONOUS,
+        .suppress_bind_attrs = true, // The exported functions assume the lock stays bound
+    },
+    .probe = solenoid_probe,
+    .remove = solenoid_remove,
+};
+
+static struct gpio_descs *lock_gpios;           // NULL until probed
+static int lock_gpio_num[SOLENOID_MAX_LOCKS];   // Legacy GPIO numbers, for the tracepoint
+static u8 lock_bank[SOLENOID_MAX_LOCKS];        // First lock on the same GPIO controller, written together
+static DECLARE_COMPLETION(solenoid_ready);
+static unsigned long locked;                    // Bit i: lock i driven high
+static DEFINE_SPINLOCK(locked_lock);            // Orders GPIO writes with the bits in locked
+static struct dentry *debugfs_dir;
+
+// Group operations: time between the first and the last GPIO controller written
+static struct {
+    u64 ops;
+    u64 last_ns;
+    unsigned int last_locks;
+    unsigned int last_banks;
+    struct lat_hist hist;
+} group_skew;
+
+static ktime_t solenoid_set(unsigned int lock, bool value)
+{
+    ktime_t now;
+
+    spin_lock(&locked_lock);
+    gpiod_set_value(lock_gpios->desc[lock], value);
+    now = ktime_get(); // Stamp right after the pin changes, for the tap-to-actuation latency
+    if (value)
+        __set_bit(lock, &locked);
+    else
+        __clear_bit(lock, &locked);
+    spin_unlock(&locked_lock);
+    trace_solenoid_set(lock_gpio_num[lock], value);
+    return now;
+}
+
+/**
+ * @brief Drive every lock in mask to value with one array write per GPIO controller
+ *
+ * Locks on the same controller (the same AM335x GPIO bank) switch in a single
+ * register write; the skew is the time from the first controller written to
+ * the last, 0 when the group sits on one bank.
+ * @return When the last lock of the group was driven
+*/
+static ktime_t solenoid_set_mask(unsigned long mask, bool value)
+{
+    struct gpio_desc *descs[SOLENOID_MAX_LOCKS];
+    int values[SOLENOID_MAX_LOCKS];
+    unsigned long done = 0;
+    unsigned int i, count, banks = 0;
+    ktime_t first = 0, last = 0;
+    u8 bank;
+
+    mask &= GENMASK(lock_gpios->ndescs - 1, 0);
+    if (!mask)
+        return 0;
+
+    spin_lock(&locked_lock);
+    while (done != mask) {
+        bank = lock_bank[__ffs(mask & ~done)];
+        count = 0;
+        for_each_set_bit(i, &mask, lock_gpios->ndescs) {
+            if (lock_bank[i] == bank) {
+                descs[count] = lock_gpios->desc[i];
+                values[count++] = value;
+                __set_bit(i, &done);
+            }
+        }
+        gpiod_set_array_value(count, descs, values);
+        last = ktime_get();
+        if (!banks++)
+            first = last;
+    }
+    if (value)
+        locked |= mask;
+    else
+        locked &= ~mask;
+    group_skew.ops++;
+    group_skew.last_ns = ktime_to_ns(ktime_sub(last, first));
+    group_skew.last_locks = hweight_long(mask);
+    group_skew.last_banks = banks;
+    spin_unlock(&locked_lock);
+
+    lat_hist_record(&group_skew.hist, ktime_to_ns(ktime_sub(last, first)));
+    trace_solenoid_set_group(mask, value, banks, ktime_to_ns(ktime_sub(last, first)));
+    return last;
+}
 
-static int __init solenoid_init(void) {
+/**
+ * @brief Wait up to timeout jiffies for the lock to be probed
+ * @return true once the solenoid can be driven
+*/
+bool solenoid_wait_ready(unsigned long timeout)
+{
+    return wait_for_completion_timeout(&solenoid_ready, timeout) > 0;
+}
+EXPORT_SYMBOL_GPL(solenoid_wait_ready);
+
+// Number of locks bound, 0 before the probe
+unsigned int solenoid_count(void)
+{
+    return lock_gpios ? lock_gpios->ndescs : 0;
+}
+EXPORT_SYMBOL_GPL(solenoid_count);
+
+int initialize_solenoid(unsigned int lock)
+{
+    if (!lock_gpios)
+        return -ENODEV;
+    if (lock >= lock_gpios->ndescs) {
+        printk(KERN_WARNING "%s: no lock %u (%u bound)\n", DEVICE_NAME, lock, lock_gpios->ndescs);
+        return -EINVAL;
+    }
+    return 0;
+}
+EXPORT_SYMBOL_GPL(initialize_solenoid);
+
+void cleanup_solenoid(unsigned int lock)
+{
+    if (lock_gpios && lock < lock_gpios->ndescs)
+        solenoid_set(lock, false);
+}
+EXPORT_SYMBOL_GPL(cleanup_solenoid);
+
+ktime_t activate_solenoid(unsigned int lock)
+{
+    if (!lock_gpios || lock >= lock_gpios->ndescs)
+        return 0;
+    return solenoid_set(lock, true);
+}
+EXPORT_SYMBOL_GPL(activate_solenoid);
+
+ktime_t deactivate_solenoid(unsigned int lock)
+{
+    if (!lock_gpios || lock >= lock_gpios->ndescs)
+        return 0;
+    return solenoid_set(lock, false);
+}
+EXPORT_SYMBOL_GPL(deactivate_solenoid);
+
+/**
+ * @brief Drive a group of locks at once, see solenoid_set_mask()
+ * @param mask Bit i is lock i; locks that are not bound are ignored
+ * @return When the last lock was driven, 0 if none was
+*/
+ktime_t solenoid_set_group(unsigned long mask, bool value)
+{
+    if (!lock_gpios)
+        return 0;
+    return solenoid_set_mask(mask, value);
+}
+EXPORT_SYMBOL_GPL(solenoid_set_group);
+
+static int solenoid_probe(struct platform_device *pdev) {
+    struct gpio_descs *gpios;
+    unsigned int i, j;
     int result;
 
     printk(KERN_INFO "Initializing the Solenoid module\n");
 
-    // Register the device
-    result = register_chrdev(major, "solenoid", &fops);
-    if (result < 0) {
-        printk(KERN_WARNING "Cannot get major number %d\n", major);
+    // Requesting the GPIOs, driven low (solenoid off) from the start
+    gpios = devm_gpiod_get_array(&pdev->dev, "lock", GPIOD_OUT_LOW);
+    if (IS_ERR(gpios)) {
+        result = PTR_ERR(gpios);
+        if (result != -EPROBE_DEFER)
+            printk(KERN_ALERT "Cannot request the lock GPIOs: %d\n", result);
         return result;
-    } else if (DEBUG) {
-        printk(KERN_INFO "Registered correctly with major number %d\n", major);
     }
-
-    // Requesting the GPIO
-    result = gpio_request(SOLENOID_GPIO, "solenoid_gpio");
-    if (result) {
-        printk(KERN_ALERT "Cannot request GPIO %d: %d\n", SOLENOID_GPIO, result);
-        return result;
-    } else if (DEBUG) {
-        printk(KERN_INFO "Requested GPIO %d\n", SOLENOID_GPIO);
+    if (gpios->ndescs > SOLENOID_MAX_LOCKS) {
+        printk(KERN_ALERT "%u lock GPIOs, at most %d are supported\n", gpios->ndescs, SOLENOID_MAX_LOCKS);
+        return -EINVAL;
+    }
+    for (i = 0; i < gpios->ndescs; i++) {
+        lock_gpio_num[i] = desc_to_gpio(gpios->desc[i]);
+        for (j = 0; gpiod_to_chip(gpios->desc[j]) != gpiod_to_chip(gpios->desc[i]); j++)
+            ;
+        lock_bank[i] = j;
+        if (DEBUG) {
+            printk(KERN_INFO "Lock %u: requested GPIO %d as output\n", i, lock_gpio_num[i]);
+        }
     }
+    // Set before the chrdev and debugfs files appear, their handlers read it
+    lock_gpios = gpios;
 
-    // Setting the GPIO as output
-    result = gpio_direction_output(SOLENOID_GPIO, 0);
-    if (result) {
-        printk(KERN_ALERT "Cannot set GPIO %d as output: %d\n", SOLENOID_GPIO, result);
+    // Register the device
+    result = register_chrdev(major, DEVICE_NAME, &fops);
+    if (result < 0) {
+        printk(KERN_WARNING "Cannot get major number %d\n", major);
+        lock_gpios = NULL;
         return result;
-    } else if (DEBUG) {
-        printk(KERN_INFO "Set GPIO %d as output\n", SOLENOID_GPIO);
+    }
+    if (!major)
+        major = result;
+    if (DEBUG) {
+        printk(KERN_INFO "Registered correctly with major number %d\n", major);
     }
 
-    // Set the GPIO to 0
-    gpio_set_value(SOLENOID_GPIO, 0);
+    lat_hist_init(&group_skew.hist);
+    debugfs_dir = debugfs_create_dir(DEVICE_NAME, NULL);
+    debugfs_create_file("group", 0644, debugfs_dir, NULL, &group_stats_fops);
 
+    complete_all(&solenoid_ready);
     return 0;
+}
 
+// "on" or "off", followed on the group minor by an optional hex mask of the locks
+static ssize_t solenoid_write_group(const char *message, size_t len){
+   unsigned long mask = ~0UL;
+   bool value = strncmp(message, "on", 2) == 0;
+   const char *arg = message + (value ? 2 : 3);
 
+   if (!value && strncmp(message, "off", 3) != 0) {
+       return len;
+   }
+   arg = skip_spaces(arg);
+   if (*arg && kstrtoul(arg, 16, &mask)) {
+       return -EINVAL;
+   }
+   solenoid_set_mask(mask, value);
+   printk(KERN_INFO "%s: Locks 0x%lx turned %s\n", DEVICE_NAME, mask & GENMASK(lock_gpios->ndescs - 1, 0),
+          value ? "ON" : "OFF");
+   return len;
 }
 
 static ssize_t solenoid_write(struct file *filep, const char *buffer, size_t len, loff_t *offset){
+   unsigned int lock = (uintptr_t)filep->private_data;
    char message[256] = {0};
    if (len > 255) len = 255;
    if (copy_from_user(message, buffer, len)) {
        return -EFAULT;
    }
 
+   if (lock == SOLENOID_GROUP_MINOR) {
+       return solenoid_write_group(message, len);
+   }
    if (strncmp(message, "on", 2) == 0) {
-        if (locked) {
-            printk(KERN_INFO "%s: Solenoid is already locked\n", DEVICE_NAME);
+        if (test_bit(lock, &locked)) {
+            printk(KERN_INFO "%s%u: Solenoid is already locked\n", DEVICE_NAME, lock);
             return len;
         } else {
-            gpio_set_value(SOLENOID_GPIO, 1);
-            locked = true;
-            printk(KERN_INFO "%s: Solenoid turned ON\n", DEVICE_NAME);
+            solenoid_set(lock, true);
+            printk(KERN_INFO "%s%u: Solenoid turned ON\n", DEVICE_NAME, lock);
         }
    } else if (strncmp(message, "off", 3) == 0) {
-        if (!locked) {
-            printk(KERN_INFO "%s: Solenoid is already unlocked\n", DEVICE_NAME);
+        if (!test_bit(lock, &locked)) {
+            printk(KERN_INFO "%s%u: Solenoid is already unlocked\n", DEVICE_NAME, lock);
             return len;
         } else {
-            gpio_set_value(SOLENOID_GPIO, 0);
-            locked = false;
-            printk(KERN_INFO "%s: Solenoid turned OFF\n", DEVICE_NAME);
+            solenoid_set(lock, false);
+            printk(KERN_INFO "%s%u: Solenoid turned OFF\n", DEVICE_NAME, lock);
         }
    }
 
@@ -115,14 +338,24 @@ static ssize_t solenoid_write(struct file *filep, const char *buffer, size_t len
 }
 
 static ssize_t solenoid_read(struct file *filep, char *buffer, size_t len, loff_t *offset){
+   unsigned int i, lock = (uintptr_t)filep->private_data;
    char message[256] = {0};
    int message_len = 0;
 
-   if (locked) {
+   if (lock == SOLENOID_GROUP_MINOR) {
+       // One line per lock
+       for (i = 0; i < lock_gpios->ndescs; i++) {
+           message_len += sprintf(message + message_len, "%u %s\n", i,
+                                  test_bit(i, &locked) ? "locked" : "unlocked");
+       }
+   } else if (test_bit(lock, &locked)) {
        message_len = sprintf(message, "locked\n");
    } else {
        message_len = sprintf(message, "unlocked\n");
    }
+   if (message_len > len) {
+       return -EINVAL;
+   }
 
    if (copy_to_user(buffer, message, message_len)) {
        return -EFAULT;
@@ -131,18 +364,28 @@ static ssize_t solenoid_read(struct file *filep, char *buffer, size_t len, loff_
    return message_len;
 }
 
-static void __exit solenoid_exit(void) {
+static int solenoid_remove(struct platform_device *pdev) {
     printk(KERN_INFO "Exiting the Solenoid module\n");
 
     // Unregister the device
     unregister_chrdev(major, DEVICE_NAME);
+    debugfs_remove_recursive(debugfs_dir);
 
-    // Free the GPIO
-    gpio_free(SOLENOID_GPIO);
+    // The GPIOs themselves are released by devm
+    reinit_completion(&solenoid_ready);
+    lock_gpios = NULL;
+    return 0;
 }
 
+// The minor picks the lock
 static int solenoid_open(struct inode *inodep, struct file *filep){
-   printk(KERN_INFO "%s: Device has been opened\n", DEVICE_NAME);
+   unsigned int minor = iminor(inodep);
+
+   if (!lock_gpios || (minor != SOLENOID_GROUP_MINOR && minor >= lock_gpios->ndescs)) {
+       return -ENODEV;
+   }
+   filep->private_data = (void *)(uintptr_t)minor;
+   printk(KERN_INFO "%s: Device %u has been opened\n", DEVICE_NAME, minor);
    return 0;
 }
 
@@ -151,5 +394,46 @@ static int solenoid_release(struct inode *inodep, struct file *filep){
    return 0;
 }
 
-module_init(solenoid_init);
-module_exit(solenoid_exit);
+static int group_stats_show(struct seq_file *m, void *v)
+{
+    u64 ops, last_ns;
+    unsigned int last_locks, last_banks, i;
+
+    spin_lock(&locked_lock);
+    ops = group_skew.ops;
+    last_ns = group_skew.last_ns;
+    last_locks = group_skew.last_locks;
+    last_banks = group_skew.last_banks;
+    spin_unlock(&locked_lock);
+
+    seq_printf(m, "locks: %u, driven high 0x%lx\n", lock_gpios->ndescs, READ_ONCE(locked));
+    for (i = 0; i < lock_gpios->ndescs; i++)
+        seq_printf(m, "lock%u: gpio %d, bank of lock %u\n", i, lock_gpio_num[i], lock_bank[i]);
+    seq_printf(m, "group ops: %llu, last %u locks on %u banks, skew %llu ns\n", ops, last_locks, last_banks, last_ns);
+    lat_hist_seq_header(m);
+    lat_hist_seq_show(m, "skew", &group_skew.hist);
+    return 0;
+}
+
+static int group_stats_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, group_stats_show, NULL);
+}
+
+// Any write resets the skew histogram
+static ssize_t group_stats_write(struct file *file, const char __user *buffer, size_t len, loff_t *offset)
+{
+    lat_hist_reset(&group_skew.hist);
+    return len;
+}
+
+static const struct file_operations group_stats_fops = {
+    .owner = THIS_MODULE,
+    .open = group_stats_open,
+    .read = seq_read,
+    .write = group_stats_write,
+    .llseek = seq_lseek,
+    .release = single_release,
+};
+
+module_platform_driver(solenoid_driver);
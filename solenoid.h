@@ -1,9 +1,17 @@
 #ifndef SOLENOID_H
 #define SOLENOID_H
 
-int initialize_solenoid(int gpio_pin);
-void cleanup_solenoid(int gpio_pin);
-void activate_solenoid(int gpio_pin);
-void deactivate_solenoid(int gpio_pin);
+#include <linux/ktime.h>
+
+#define SOLENOID_MAX_LOCKS 16 // Entries of lock-gpios, and minors of the character device
+
+// Locks are numbered in lock-gpios order
+bool solenoid_wait_ready(unsigned long timeout); // The locks are probed asynchronously
+unsigned int solenoid_count(void);
+int initialize_solenoid(unsigned int lock);
+void cleanup_solenoid(unsigned int lock);
+ktime_t activate_solenoid(unsigned int lock);   // Returns when the GPIO was driven, 0 for an unknown lock
+ktime_t deactivate_solenoid(unsigned int lock);
+ktime_t solenoid_set_group(unsigned long mask, bool value); // Bit i is lock i, one write per GPIO bank
 
 #endif // SOLENOID_H
@@ -0,0 +1,53 @@
+/**
+ * @file solenoid_trace.h
+ * @brief Tracepoints for solenoid transitions, single and grouped
+*/
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM solenoid
+
+#if !defined(SOLENOID_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define SOLENOID_TRACE_H
+
+#include <linux/tracepoint.h>
+
+TRACE_EVENT(solenoid_set,
+    TP_PROTO(int gpio, bool value),
+    TP_ARGS(gpio, value),
+    TP_STRUCT__entry(
+        __field(int, gpio)
+        __field(bool, value)
+    ),
+    TP_fast_assign(
+        __entry->gpio = gpio;
+        __entry->value = value;
+    ),
+    TP_printk("gpio=%d %s", __entry->gpio, __entry->value ? "on" : "off")
+);
+
+TRACE_EVENT(solenoid_set_group,
+    TP_PROTO(unsigned long mask, bool value, unsigned int banks, u64 skew_ns),
+    TP_ARGS(mask, value, banks, skew_ns),
+    TP_STRUCT__entry(
+        __field(unsigned long, mask)
+        __field(bool, value)
+        __field(unsigned int, banks)
+        __field(u64, skew_ns)
+    ),
+    TP_fast_assign(
+        __entry->mask = mask;
+        __entry->value = value;
+        __entry->banks = banks;
+        __entry->skew_ns = skew_ns;
+    ),
+    TP_printk("mask=0x%lx %s banks=%u skew=%llu ns", __entry->mask, __entry->value ? "on" : "off",
+              __entry->banks, __entry->skew_ns)
+);
+
+#endif // SOLENOID_TRACE_H
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE solenoid_trace
+#include <trace/define_trace.h>
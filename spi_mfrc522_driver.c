@@ -6,423 +6,1723 @@
 #include <linux/gpio.h>
 #include <linux/delay.h>
 #include <linux/fs.h>
+#include <linux/slab.h>
+#include <linux/ktime.h>
+#include <linux/mutex.h>
+#include <linux/debugfs.h>
+#include <linux/uaccess.h>
+#include <linux/pm_runtime.h>
+#include <linux/crypto.h>
+#include <linux/random.h>
+#include <linux/relay.h>
+#include <linux/of.h>
+#include <linux/gpio/consumer.h>
+#include <linux/completion.h>
+#include <linux/idr.h>
+#include <linux/list.h>
+#include <linux/workqueue.h>
+
+#include "mfrc522.h"
+#include "nfc_reader.h"
+#include "nfc_bus_stats.h"
+#include "nfc_capture.h"
+#include "latency_hist.h"
+#include "desfire.h"
+
+#define CREATE_TRACE_POINTS
+#include "mfrc522_trace.h"
 
 MODULE_LICENSE("Dual BSD/GPL");
 MODULE_AUTHOR("Alex Melnick and Alfonso Meraz");
 MODULE_DESCRIPTION("Linux driver for MFRC522");
 
 const static bool DEBUG = true;
-static int major = 61; //* FOR TESTING PURPOSES
+static int major; //* FOR TESTING PURPOSES; 0: let the kernel pick
+module_param(major, int, 0444);
+MODULE_PARM_DESC(major, "Character device major number, 0 for a dynamic one");
+
+static long mfrc522_ioctl(struct file *file, unsigned int cmd, unsigned long arg);
+static const struct file_operations bus_stats_fops;
+static const struct file_operations wake_latency_fops;
+static const struct file_operations lpcd_fops;
+static const struct file_operations rf_tune_fops;
+static const struct file_operations desfire_fops;
+static const struct file_operations capture_fops;
+static const struct file_operations health_fops;
+static const struct file_operations registers_fops;
+static const struct file_operations registers_bin_fops;
 
 //* FOR TESTING PURPOSES
-static struct file_operations fops;
+static struct file_operations fops = {
+    .owner = THIS_MODULE,
+    .unlocked_ioctl = mfrc522_ioctl,
+};
+
+#define MFRC522_SPI_BUF_SIZE (MFRC522_FIFO_SIZE + 1) // Address byte plus a full FIFO
+
+// NRSTPD pulse of mfrc522_hard_reset() and the crystal start-up after it
+#define MFRC522_RESET_PULSE_US 10
+#define MFRC522_STARTUP_US     500
+
+// RF capture relay buffers per CPU; a poll with nobody in the field logs about 100 bytes
+#define RF_CAPTURE_SUBBUF_SIZE (16 * 1024)
+#define RF_CAPTURE_SUBBUFS     16
+
+// What runtime suspend does between polls
+enum mfrc522_pm_mode {
+    MFRC522_PM_NONE,        // Stay fully powered with the field on
+    MFRC522_PM_ANTENNA_OFF, // Switch the antenna drivers off, keep the oscillator running
+    MFRC522_PM_POWER_DOWN,  // Soft power-down: oscillator and antenna drivers off
+};
+
+static int pm_mode = MFRC522_PM_POWER_DOWN;
+module_param(pm_mode, int, 0644);
+MODULE_PARM_DESC(pm_mode, "Between polls: 0 = stay on, 1 = antenna off, 2 = soft power-down (default)");
+
+static int autosuspend_ms = 20;
+module_param(autosuspend_ms, int, 0444);
+MODULE_PARM_DESC(autosuspend_ms, "Idle time before the reader is suspended, in ms");
+
+// Cards need the field for a few ms before they answer; ISO 14443-3 allows up to 5 ms
+static unsigned int field_guard_us = 5000;
+module_param(field_guard_us, uint, 0644);
+MODULE_PARM_DESC(field_guard_us, "Wait after the field comes back before the first command, in us");
+
+// RF defaults applied by mfrc522_configure(); the rf_tune debugfs file updates them
+static unsigned int rx_gain = 4;
+module_param(rx_gain, uint, 0644);
+MODULE_PARM_DESC(rx_gain, "RFCfgReg RxGain, 0 (18 dB) to 7 (48 dB)");
+
+static unsigned int mod_width = MFRC522_MOD_WIDTH_RESET;
+module_param(mod_width, uint, 0644);
+MODULE_PARM_DESC(mod_width, "ModWidthReg, pause width of the 100% ASK modulation");
+
+static bool force_100ask = true;
+module_param(force_100ask, bool, 0644);
+MODULE_PARM_DESC(force_100ask, "TxASKReg Force100ASK (required by ISO 14443A)");
 
-#define GPIO_RST 68
-#define SPEED 9600 // Speed of SPI bus (default 9.6 kBd)
+
+#define RF_TUNE_TRIALS 8 // Default WUPA/SELECT rounds per configuration
+
+static bool lpcd;
+module_param(lpcd, bool, 0444);
+MODULE_PARM_DESC(lpcd, "Probe for cards by antenna load instead of REQA while the field is off (calibrated at load, keep the field empty)");
+
+static unsigned int lpcd_threshold = 2;
+module_param(lpcd_threshold, uint, 0644);
+MODULE_PARM_DESC(lpcd_threshold, "TestADCReg deviation from the baseline, in ADC steps, that wakes the reader");
+
+// Fault handling: a failed SPI message is resent, then a chip that still misbehaves goes through mfrc522_recover()
+static unsigned int spi_retries = 2;
+module_param(spi_retries, uint, 0644);
+MODULE_PARM_DESC(spi_retries, "Times a failed SPI message is resent before the register access fails");
+
+static unsigned int health_ms = 1000;
+module_param(health_ms, uint, 0644);
+MODULE_PARM_DESC(health_ms, "Interval of the VersionReg/ModeReg health probe of each reader in ms, 0 to disable");
+
+static int capture_set(const char *val, const struct kernel_param *kp);
+static const struct kernel_param_ops capture_ops = {
+    .set = capture_set,
+    .get = param_get_bool,
+};
+
+static bool capture;
+module_param_cb(capture, &capture_ops, &capture, 0644);
+MODULE_PARM_DESC(capture, "Record every RF frame into the rf* relay files in debugfs, oldest overwritten first");
+
+// Factory default AES key of a fresh DESFire EV1
+static char *desfire_key = "00000000000000000000000000000000";
+module_param(desfire_key, charp, 0400);
+MODULE_PARM_DESC(desfire_key, "AES-128 key, 32 hex digits, DESFire credential files are read with");
+
+static char *ntag_pwd = "";
+module_param(ntag_pwd, charp, 0400);
+MODULE_PARM_DESC(ntag_pwd, "NTAG21x password, 8 hex digits, sent with PWD_AUTH before the read_blocks op reads an NTAG; empty for none");
 
 static int __init mfrc522_spi_init(void);
 static void __exit mfrc522_spi_exit(void);
 
-static int mfrc522_spi_write_then_read(struct spi_device *spi, const void *txbuf, unsigned n_tx, void *rxbuf, unsigned n_rx);
-static int mfrc522_spi_write_byte(struct spi_device *spi, uint8_t address, uint8_t data);
-static int mfrc522_spi_write_data(struct spi_device *spi, uint8_t address, uint8_t *data, uint8_t length);
-static int mfrc522_spi_read_byte(struct spi_device *spi, uint8_t address, uint8_t *data);
-static int mfrc522_spi_read_data(struct spi_device *spi, uint8_t address, uint8_t *data, uint8_t length);
-//static int mfrc522_send_command(struct spi_device *spi, uint8_t RcvOff, uint8_t PowerDown, uint8_t Command);
-static int mfrc522_self_test(struct spi_device *spi);
-
-static int mfrc522_hard_reset(void);
-static int mfrc522_read_version(struct spi_device *spi);
-
-static struct spi_device *mfrc522_spi_device;
-
-struct spi_board_info spi_device_info = { 
-    .modalias = "mfrc522-driver",   // Name of our SPI device driver
-    .max_speed_hz = SPEED,           // Speed of SPI bus (9.6 kBd) - Hope this is right
-    .mode = SPI_MODE_0,             // ? SPI mode (not 100% sure this is the correct mode)
-    .bus_num = 1,                   // ? SPI bus number (not 100% sure this is the correct number)
-    .chip_select = 0,               // SPI chip select - we have only one device connected
+struct mfrc522_reader;
+
+static int mfrc522_spi_transfer(struct mfrc522_reader *rd, unsigned len, unsigned len_in);
+static int mfrc522_spi_write_data(void *priv, uint8_t address, const uint8_t *data, unsigned int length);
+static int mfrc522_spi_read_data(void *priv, uint8_t address, uint8_t *data, unsigned int length);
+static u64 mfrc522_spi_now_ns(void *priv);
+static void mfrc522_spi_delay(void *priv, u32 us);
+static void mfrc522_spi_event(void *priv, enum mfrc522_event event, u8 value);
+static void mfrc522_spi_capture(void *priv, const struct mfrc522_frame *frame);
+
+static int mfrc522_hard_reset(void *priv);
+static void mfrc522_health_work(struct work_struct *work);
+static void desfire_aes_init(struct mfrc522_reader *rd);
+static void desfire_aes_free(struct mfrc522_reader *rd);
+static void rf_capture_init(struct mfrc522_reader *rd);
+static int mfrc522_reader_scan(struct nfc_reader *reader, struct nfc_scan *scan);
+static int mfrc522_reader_read_blocks(struct nfc_reader *reader, const struct mfrc522_uid *uid, u8 key_type,
+                                      const u8 *key, u8 block, unsigned int count, u8 *data);
+static int mfrc522_reader_read_file(struct nfc_reader *reader, const struct mfrc522_uid *uid, u32 aid, u8 key_no,
+                                    u8 file, u32 offset, enum desfire_comm comm, u8 *data, unsigned int len);
+
+static int mfrc522_probe(struct spi_device *spi);
+static int mfrc522_remove(struct spi_device *spi);
+static int mfrc522_runtime_suspend(struct device *dev);
+static int mfrc522_runtime_resume(struct device *dev);
+
+/*
+ * One per MFRC522 bound from the device tree, on any bus and chip select.
+ * Each registers with the controller, which polls it on its own thread.
+*/
+struct mfrc522_reader {
+    struct spi_device *spi;
+    struct gpio_desc *reset;            // NRSTPD, NULL without a reset line
+    int index;                          // mfrc522-<index> in the logs, debugfs mfrc522/<index>
+    char name[16];
+    struct list_head node;              // In mfrc522_readers
+    struct nfc_reader nfc;              // What the controller polls
+    bool registered;
+    struct mfrc522_dev dev;             // Protocol state used by mfrc522_core.c
+    struct mutex lock;                  // Serializes everything that talks to this chip
+    struct mfrc522_inventory inventory; // Cards found by the last pass
+    uint8_t *tx_buf;                    // DMA-safe transfer buffers, one burst at a time
+    uint8_t *rx_buf;
+    struct nfc_bus_stats __percpu *bus_stats; // Per-CPU, summed by debugfs and the ioctl
+    struct dentry *debugfs_dir;
+    struct lat_hist wake_latency;       // Runtime resume plus field guard, until the reader can send REQA
+    u64 pending_wake_ns;                // Wake time not yet reported through a scan
+    bool field_on;                      // Antenna drivers on and cards had the guard time to power up
+    struct mfrc522_lpcd lpcd_state;
+    struct mfrc522_tune_result rf_tune_result; // Winner of the last tuning run
+
+    // AES for desfire.c: the card key is set once at probe, the session key after every authentication
+    struct {
+        struct crypto_cipher *card;
+        struct crypto_cipher *session;
+    } desfire_aes;
+    struct mfrc522_tcl desfire_tcl;     // Last ISO 14443-4 session, for debugfs
+
+    // Flight recorder of RF frames; counters are updated under lock
+    struct {
+        struct rchan *chan;
+        u64 frames;
+        u64 bytes;
+        u64 overwritten;    // Sub-buffers reused before anybody read them
+    } rf_capture;
+
+    // Health probe and recovery ladder; counters are updated under lock
+    struct delayed_work health_work;
+    struct {
+        u64 probes;
+        u64 probe_failures;
+        u64 resent;                     // SPI messages sent again after a failure
+        u64 tiers[MFRC522_RECOVERY_TIERS]; // Recoveries by the step that ended them
+        int last_cause;                 // What triggered the last one
+        enum mfrc522_recovery last_tier;
+        u64 last_ns;                    // ktime of the last one, 0 if none yet
+        struct lat_hist time;           // Successful recoveries, ladder start to healthy
+    } recovery;
+};
+
+static LIST_HEAD(mfrc522_readers);
+static DEFINE_MUTEX(mfrc522_readers_lock);  // List membership, not the chips
+static DEFINE_IDA(mfrc522_ida);
+static struct dentry *debugfs_root;         // mfrc522/, holding the totals and one directory per reader
+
+// nfc_reader_run() lends out the first reader probed
+static struct mfrc522_reader *mfrc522_primary;
+
+static int desfire_aes_encrypt(void *priv, bool session, u8 *block);
+static int desfire_aes_decrypt(void *priv, bool session, u8 *block);
+static int desfire_aes_set_session_key(void *priv, const u8 *key);
+static void desfire_aes_random(void *priv, u8 *buf, unsigned int len);
+
+static const struct desfire_crypto_ops desfire_aes_ops = {
+    .encrypt = desfire_aes_encrypt,
+    .decrypt = desfire_aes_decrypt,
+    .set_session_key = desfire_aes_set_session_key,
+    .random = desfire_aes_random,
+};
+
+static const struct mfrc522_bus_ops mfrc522_spi_ops = {
+    .read = mfrc522_spi_read_data,
+    .write = mfrc522_spi_write_data,
+    .now_ns = mfrc522_spi_now_ns,
+    .event = mfrc522_spi_event,
+    .capture = mfrc522_spi_capture,
+    .hard_reset = mfrc522_hard_reset,
+    .delay = mfrc522_spi_delay,
+};
+
+static const struct dev_pm_ops mfrc522_pm_ops = {
+    SET_RUNTIME_PM_OPS(mfrc522_runtime_suspend, mfrc522_runtime_resume, NULL)
+};
+
+static const struct of_device_id mfrc522_of_match[] = {
+    { .compatible = "nxp,mfrc522" },
+    { }
+};
+MODULE_DEVICE_TABLE(of, mfrc522_of_match);
+
+static const struct spi_device_id mfrc522_spi_id[] = {
+    { "mfrc522", 0 },
+    { }
+};
+MODULE_DEVICE_TABLE(spi, mfrc522_spi_id);
+
+// Bound from the device tree (nfc-lock-overlay.dts); probing resets and tests the chip, so it runs asynchronously
+static struct spi_driver mfrc522_spi_driver = {
+    .driver = {
+        .name = "mfrc522-driver",
+        .owner = THIS_MODULE,
+        .of_match_table = mfrc522_of_match,
+        .pm = &mfrc522_pm_ops,
+        .probe_type = PROBE_PREFER_ASYNCHRONOUS,
+        .suppress_bind_attrs = true, // The exported functions assume the reader stays bound
+    },
+    .id_table = mfrc522_spi_id,
+    .probe = mfrc522_probe,
+    .remove = mfrc522_remove,
 };
 
 static int __init mfrc522_spi_init(void)
 {
-    // Get the SPI master driver
-    struct spi_master *master;
-    int result, version;
-    
+    int result;
+
     //* FOR TESTING PURPOSES
-    register_chrdev(major, "spi_mfrc522_driver", &fops); // Register the device
+    result = register_chrdev(major, "spi_mfrc522_driver", &fops); // Register the device
+    if (result < 0) {
+        printk(KERN_ALERT "Cannot get major number %d.\n", major);
+        return result;
+    }
+    if (!major)
+        major = result;
 
+    debugfs_root = debugfs_create_dir("mfrc522", NULL);
+    debugfs_create_file("bus_stats", 0644, debugfs_root, NULL, &bus_stats_fops);
 
-    master = spi_busnum_to_master(spi_device_info.bus_num);
+    // Each chip is set up by mfrc522_probe() once its device tree node is matched
+    result = spi_register_driver(&mfrc522_spi_driver);
+    if (result) {
+        printk(KERN_ALERT "Failed to register the SPI driver.\n");
+        debugfs_remove_recursive(debugfs_root);
+        unregister_chrdev(major, "spi_mfrc522_driver");
+        return result;
+    }
+    if (DEBUG) printk(KERN_INFO "MFRC522 SPI driver registered, major %d.\n", major);
+    return 0;
+}
 
+static void __exit mfrc522_spi_exit(void)
+{
+    spi_unregister_driver(&mfrc522_spi_driver);
+    debugfs_remove_recursive(debugfs_root);
+    //* FOR TESTING PURPOSES
+    unregister_chrdev(major, "spi_mfrc522_driver"); // Unregister the device
+    ida_destroy(&mfrc522_ida);
+    printk(KERN_INFO "MFRC522 SPI driver deinitialized.\n");
+}
 
-    if(DEBUG) printk(KERN_INFO "Initializing MFRC522 SPI driver.\n");
+static int mfrc522_spi_transfer(struct mfrc522_reader *rd, unsigned len, unsigned len_in)
+{   /*
+    ptr *struct mfrc522_reader rd: The reader; its spi device is the SPI slave, on whatever bus and chip select.
+    unsigned len: Number of bytes to clock from rd->tx_buf; the same number is received into rd->rx_buf.
+    unsigned len_in: How many of the received bytes are register data, for the statistics.
+    The MFRC522 is full duplex, so one transfer carries the address bytes and the data.
+    A failed message is sent again up to spi_retries times. Not for the FIFO: a burst that was
+    partly clocked before it failed has already moved bytes, so the exchange fails instead.
+    */
 
-    // Add the slave device to the SPI controller    
-    if (!master) {
-        printk(KERN_ALERT "SPI Master not found.\n");
-        return -ENODEV;
-    } else if (DEBUG) {
-        printk(KERN_INFO "SPI Master found.\n");
+    struct spi_transfer t = {
+        .tx_buf = rd->tx_buf,       // Set the transmit buffer
+        .rx_buf = rd->rx_buf,       // Set the receive buffer
+        .len = len,                 // Set the length of both buffers
+    };
+    struct spi_message m;           // SPI message object
+    struct nfc_bus_stats *stats;
+    unsigned int attempt, retries;
+    u64 start;
+    int result;
+
+    retries = ((rd->tx_buf[0] >> 1) & 0x3F) == FIFODataReg ? 0 : spi_retries;
+    for (attempt = 0; ; attempt++) {
+        spi_message_init(&m);           // Initialize the SPI message, again for every attempt
+        spi_message_add_tail(&t, &m);   // Add the transfer to the message
+
+        start = ktime_get_ns();
+        result = spi_sync(rd->spi, &m);  // Execute the SPI transaction
+
+        stats = nfc_bus_stats_begin(rd->bus_stats);
+        stats->c.messages++;
+        stats->c.bytes_out += len;
+        stats->c.busy_ns += ktime_get_ns() - start;
+        if (result)
+            stats->c.xfer_errors++;
+        else
+            stats->c.bytes_in += len_in;
+        nfc_bus_stats_end(rd->bus_stats, stats);
+
+        if (!result || attempt >= retries)
+            break;
+        rd->recovery.resent++;
     }
 
-    mfrc522_spi_device = spi_new_device(master, &spi_device_info);
-    if (!mfrc522_spi_device) {
-        printk(KERN_ALERT "Failed to create SPI slave.\n");
-        spi_master_put(master); // Decrement the reference count of the master in case of failure since we won't be using it
-        return -ENODEV;
-    } else if (DEBUG) {
-        printk(KERN_INFO "SPI slave created.\n");
+    if (result) {
+        printk_ratelimited(KERN_WARNING "%s: SPI transaction failed %u times: %d\n", rd->name, attempt + 1, result);
+        return result;
+    }
+
+    return 0;
+}
+
+static int mfrc522_spi_write_data(void *priv, uint8_t address, const uint8_t *data, unsigned int length) {
+    // Write data to the MFRC522 (datasheet 8.1.2.3): address byte 0AAAAAA0, then the data bytes
+    struct mfrc522_reader *rd = priv;
+    int result;
+
+    if (length > MFRC522_FIFO_SIZE)
+        return -EINVAL;
+
+    // Prepare the buffer
+    rd->tx_buf[0] = (address << 1) & 0x7E; // Set the address
+    memcpy(rd->tx_buf + 1, data, length); // Copy the data to the buffer
+
+    // Write the data
+    result = mfrc522_spi_transfer(rd, length + 1, 0);
+    if (address == FIFODataReg)
+        trace_mfrc522_fifo_write(data, length, result);
+    else
+        trace_mfrc522_reg_write(address, data[0], result);
+    if (result) {
+        printk_ratelimited(KERN_WARNING "%s: Failed to write data to address 0x%x.\n", rd->name, address);
+        return -EIO;
     }
 
+    return 0;
+}
+
+static int mfrc522_spi_read_data(void *priv, uint8_t address, uint8_t *data, unsigned int length) {
+    // Read data from the MFRC522 (datasheet 8.1.2.2): every byte sent is an address 1AAAAAA0,
+    // and the chip answers each one on the following byte. A burst costs length + 1 bytes.
+    struct mfrc522_reader *rd = priv;
+    int result;
+
+    if (length > MFRC522_FIFO_SIZE)
+        return -EINVAL;
 
-    // Configure the SPI interface to take effect on the bus
-    mfrc522_spi_device->bits_per_word = 8; // 8 bits per word (byte)
-    result = spi_setup(mfrc522_spi_device);
+    memset(rd->tx_buf, 0x80 | ((address << 1) & 0x7E), length);
+    rd->tx_buf[length] = 0x00; // Final byte ends the read
+
+    // Read the data
+    result = mfrc522_spi_transfer(rd, length + 1, length);
+    if (address == FIFODataReg)
+        trace_mfrc522_fifo_read(rd->rx_buf + 1, length, result);
+    else
+        trace_mfrc522_reg_read(address, rd->rx_buf[1], result);
+    if (result) {
+        printk_ratelimited(KERN_WARNING "%s: Failed to read data from address 0x%x.\n", rd->name, address);
+        return -EIO;
+    }
+
+    memcpy(data, rd->rx_buf + 1, length); // Copy the data to the pointer
+
+    return 0;
+}
+
+static u64 mfrc522_spi_now_ns(void *priv)
+{
+    return ktime_get_ns();
+}
+
+// Guard times of ISO 14443-4 cards, from a few hundred us up to seconds: sleep instead of polling the chip
+static void mfrc522_spi_delay(void *priv, u32 us)
+{
+    usleep_range(us, us + us / 8 + 10);
+}
+
+static void mfrc522_spi_event(void *priv, enum mfrc522_event event, u8 value)
+{
+    // Fold what the core saw on the RF side into the bus counters
+    struct mfrc522_reader *rd = priv;
+    struct nfc_bus_stats *stats = nfc_bus_stats_begin(rd->bus_stats);
+
+    if (event == MFRC522_EVENT_RETRY) {
+        stats->c.retries++;
+    } else {
+        stats->c.crc_errors += !!(value & MFRC522_ERR_CRC);
+        stats->c.parity_errors += !!(value & MFRC522_ERR_PARITY);
+        stats->c.protocol_errors += !!(value & MFRC522_ERR_PROTOCOL);
+        stats->c.collisions += !!(value & MFRC522_ERR_COLL);
+        stats->c.fifo_overflows += !!(value & MFRC522_ERR_BUFFER_OVFL);
+    }
+    nfc_bus_stats_end(rd->bus_stats, stats);
+}
+
+/**
+ * @brief Write one captured frame straight into the relay buffer
+ *
+ * Called by the core under the reader's lock. The record is built in place in the
+ * sub-buffer, and readers splice() whole sub-buffers out of the rf* files, so
+ * the frame bytes are copied once, from the FIFO buffer into the relay page.
+*/
+static void mfrc522_spi_capture(void *priv, const struct mfrc522_frame *frame)
+{
+    struct mfrc522_reader *rd = priv;
+    unsigned int len = sizeof(struct nfc_rf_frame) + frame->tx_len + frame->rx_len;
+    unsigned int size = ALIGN(len, NFC_RF_FRAME_ALIGN);
+    struct nfc_rf_frame *rec;
+    u8 *p;
+
+    preempt_disable(); // relay_reserve() hands out space in this CPU's buffer
+    rec = relay_reserve(rd->rf_capture.chan, size);
+    if (rec) {
+        rec->time_ns = frame->start_ns;
+        rec->duration_ns = min_t(u64, frame->end_ns - frame->start_ns, U32_MAX);
+        rec->result = frame->result;
+        rec->size = size;
+        rec->tx_len = frame->tx_len;
+        rec->rx_len = frame->rx_len;
+        rec->tx_last_bits = frame->tx_last_bits;
+        rec->rx_last_bits = frame->rx_last_bits;
+        rec->flags = frame->flags;
+        rec->error = frame->error;
+        rec->coll = frame->coll;
+        rec->reserved = 0;
+        p = (u8 *)(rec + 1);
+        memcpy(p, frame->tx, frame->tx_len);
+        if (frame->rx_len)
+            memcpy(p + frame->tx_len, frame->rx, frame->rx_len);
+        memset(p + frame->tx_len + frame->rx_len, 0, size - len);
+        rd->rf_capture.frames++;
+        rd->rf_capture.bytes += size;
+    }
+    preempt_enable();
+}
+
+// Always accept the next sub-buffer: the capture keeps the latest frames, not the first ones
+static int rf_capture_subbuf_start(struct rchan_buf *buf, void *subbuf, void *prev_subbuf, size_t prev_padding)
+{
+    struct mfrc522_reader *rd = buf->chan->private_data;
+
+    if (relay_buf_full(buf))
+        rd->rf_capture.overwritten++;
+    return 1;
+}
+
+static struct dentry *rf_capture_create_buf_file(const char *filename, struct dentry *parent, umode_t mode,
+                                                 struct rchan_buf *buf, int *is_global)
+{
+    return debugfs_create_file(filename, 0400, parent, buf, &relay_file_operations);
+}
+
+static int rf_capture_remove_buf_file(struct dentry *dentry)
+{
+    debugfs_remove(dentry);
+    return 0;
+}
+
+static struct rchan_callbacks rf_capture_callbacks = {
+    .subbuf_start = rf_capture_subbuf_start,
+    .create_buf_file = rf_capture_create_buf_file,
+    .remove_buf_file = rf_capture_remove_buf_file,
+};
+
+// The buffers are set up at probe so capture can be switched on without allocating
+static void rf_capture_init(struct mfrc522_reader *rd)
+{
+    rd->rf_capture.chan = relay_open("rf", rd->debugfs_dir, RF_CAPTURE_SUBBUF_SIZE, RF_CAPTURE_SUBBUFS,
+                                     &rf_capture_callbacks, rd);
+    if (!rd->rf_capture.chan) {
+        printk(KERN_WARNING "%s: RF capture relay unavailable.\n", rd->name);
+        return;
+    }
+    mutex_lock(&rd->lock);
+    rd->dev.capture = capture;
+    mutex_unlock(&rd->lock);
+}
+
+static int capture_set(const char *val, const struct kernel_param *kp)
+{
+    struct mfrc522_reader *rd;
+    int result = param_set_bool(val, kp);
+
+    if (result)
+        return result;
+    mutex_lock(&mfrc522_readers_lock);
+    list_for_each_entry(rd, &mfrc522_readers, node) {
+        mutex_lock(&rd->lock);
+        rd->dev.capture = capture && rd->rf_capture.chan;
+        mutex_unlock(&rd->lock);
+    }
+    mutex_unlock(&mfrc522_readers_lock);
+    return 0;
+}
+
+static int mfrc522_probe(struct spi_device *spi)
+{
+    struct mfrc522_reader *rd;
+    struct gpio_desc *reset;
+    int result;
+    uint8_t version;
+
+    // Optional: without a reset line the chip is only soft-reset by mfrc522_configure()
+    reset = devm_gpiod_get_optional(&spi->dev, "reset", GPIOD_OUT_LOW);
+    if (IS_ERR(reset))
+        return PTR_ERR(reset);
+
+    // Configure the SPI interface to take effect on the bus; the clock comes from spi-max-frequency
+    spi->bits_per_word = 8; // 8 bits per word (byte)
+    spi->mode = SPI_MODE_0;
+    result = spi_setup(spi);
     if (result) {
         printk(KERN_ALERT "SPI slave setup failed.\n");
-        spi_unregister_device(mfrc522_spi_device);
-        return -ENODEV;
+        return result;
     } else if (DEBUG) {
         printk(KERN_INFO "SPI slave setup successful.\n");
     }
+    if (rx_gain > 7 || mod_width > 0xFF) {
+        printk(KERN_ALERT "Invalid rx_gain or mod_width.\n");
+        return -EINVAL;
+    }
+
+    rd = devm_kzalloc(&spi->dev, sizeof(*rd), GFP_KERNEL);
+    if (!rd)
+        return -ENOMEM;
+    rd->index = ida_simple_get(&mfrc522_ida, 0, 0, GFP_KERNEL);
+    if (rd->index < 0)
+        return rd->index;
+    snprintf(rd->name, sizeof(rd->name), "mfrc522-%d", rd->index);
+    rd->spi = spi;
+    rd->reset = reset;
+    mutex_init(&rd->lock);
+    lat_hist_init(&rd->wake_latency);
+    lat_hist_init(&rd->recovery.time);
+    INIT_DELAYED_WORK(&rd->health_work, mfrc522_health_work);
+    spi_set_drvdata(spi, rd);
+
+    rd->bus_stats = nfc_bus_stats_alloc();
+    rd->tx_buf = kmalloc(MFRC522_SPI_BUF_SIZE, GFP_KERNEL);
+    rd->rx_buf = kmalloc(MFRC522_SPI_BUF_SIZE, GFP_KERNEL);
+    if (!rd->bus_stats || !rd->tx_buf || !rd->rx_buf) {
+        result = -ENOMEM;
+        goto err_buf;
+    }
+    mfrc522_dev_init(&rd->dev, &mfrc522_spi_ops, rd);
+    rd->dev.rf.rx_gain = rx_gain;
+    rd->dev.rf.mod_width = mod_width;
+    rd->dev.rf.force_100ask = force_100ask;
+    rd->dev.stream_rx = spi->max_speed_hz >= MFRC522_STREAM_MIN_HZ;
+    desfire_aes_init(rd);
+
+    // Start active and hold a reference through the setup below
+    pm_runtime_set_active(&spi->dev);
+    pm_runtime_set_autosuspend_delay(&spi->dev, autosuspend_ms);
+    pm_runtime_use_autosuspend(&spi->dev);
+    pm_runtime_get_noresume(&spi->dev);
+    pm_runtime_enable(&spi->dev);
 
     // Initialize the MFRC522
-    mfrc522_hard_reset(); // Reset the MFRC522
-    // version = mfrc522_read_version(mfrc522_spi_device); // Read the version of the MFRC522
-    // if (DEBUG) { printk(KERN_INFO "MFRC522 version: %x (expecting 0x92)\n", version); }
-    // // TODO - Configure the MFRC522
-    // // TODO - Enable the antenna
+    mfrc522_hard_reset(rd); // Reset the MFRC522
+    result = mfrc522_read_version(&rd->dev, &version); // Read the version of the MFRC522
+    if (result == -ENODEV) {
+        printk(KERN_ALERT "%s: MFRC522 not found (version 0x%02x).\n", rd->name, version);
+        goto err_pm;
+    } else if (result) {
+        printk(KERN_ALERT "%s: MFRC522 version unreadable: %d\n", rd->name, result); // version was never written
+        goto err_pm;
+    } else if (DEBUG) {
+        printk(KERN_INFO "%s: MFRC522 version: %x (expecting 0x91 or 0x92)\n", rd->name, version);
+    }
 
     // Perform a self-test
-    mfrc522_self_test(mfrc522_spi_device);
+    result = mfrc522_self_test(&rd->dev);
+    if (result) {
+        printk(KERN_WARNING "%s: Self-test failed.\n", rd->name);
+    } else {
+        printk(KERN_INFO "%s: Self-test successful.\n", rd->name);
+    }
+
+    // Configure the MFRC522 for ISO 14443A and enable the antenna
+    result = mfrc522_configure(&rd->dev);
+    if (result) {
+        printk(KERN_ALERT "%s: Failed to configure the MFRC522.\n", rd->name);
+        goto err_pm;
+    }
+    rd->field_on = true;
+
+    // Low-power card detection baseline, taken with the field empty; leaves the antenna off
+    if (lpcd) {
+        result = mfrc522_lpcd_calibrate(&rd->dev, &rd->lpcd_state, 16);
+        if (result) {
+            printk(KERN_ALERT "%s: LPCD calibration failed.\n", rd->name);
+            goto err_pm;
+        }
+        rd->field_on = false;
+        printk(KERN_INFO "%s: LPCD baseline I %u/16, Q %u/16\n", rd->name,
+               rd->lpcd_state.base_i, rd->lpcd_state.base_q);
+    }
 
-    printk(KERN_INFO "MFRC522 SPI driver initialized.\n");
+    rd->debugfs_dir = debugfs_create_dir(rd->name + strlen("mfrc522-"), debugfs_root);
+    debugfs_create_file("bus_stats", 0644, rd->debugfs_dir, rd, &bus_stats_fops);
+    debugfs_create_file("wake_latency", 0644, rd->debugfs_dir, rd, &wake_latency_fops);
+    debugfs_create_file("rf_tune", 0644, rd->debugfs_dir, rd, &rf_tune_fops);
+    debugfs_create_file("desfire", 0444, rd->debugfs_dir, rd, &desfire_fops);
+    debugfs_create_file("capture", 0444, rd->debugfs_dir, rd, &capture_fops);
+    debugfs_create_file("health", 0644, rd->debugfs_dir, rd, &health_fops);
+    debugfs_create_file("registers", 0444, rd->debugfs_dir, rd, &registers_fops);
+    debugfs_create_file("registers.bin", 0444, rd->debugfs_dir, rd, &registers_bin_fops);
+    rf_capture_init(rd);
+    if (lpcd)
+        debugfs_create_file("lpcd", 0444, rd->debugfs_dir, rd, &lpcd_fops);
+
+    // From here the reader may sleep
+    pm_runtime_mark_last_busy(&spi->dev);
+    pm_runtime_put_autosuspend(&spi->dev);
+
+    mutex_lock(&mfrc522_readers_lock);
+    list_add_tail(&rd->node, &mfrc522_readers);
+    if (!mfrc522_primary)
+        mfrc522_primary = rd;
+    mutex_unlock(&mfrc522_readers_lock);
+
+    // The controller polls every reader on a thread of its own
+    rd->nfc.name = rd->name;
+    rd->nfc.scan = mfrc522_reader_scan;
+    rd->nfc.read_blocks = mfrc522_reader_read_blocks;
+    rd->nfc.read_file = mfrc522_reader_read_file;
+    result = nfc_reader_register(&rd->nfc);
+    if (result)
+        printk(KERN_WARNING "%s: not polled, the controller has no free reader slot (%d).\n", rd->name, result);
+    rd->registered = !result;
+
+    schedule_delayed_work(&rd->health_work, msecs_to_jiffies(health_ms ? health_ms : 1000));
+    printk(KERN_INFO "%s: MFRC522 on SPI bus %d, chip select %d initialized.\n", rd->name,
+           spi->master->bus_num, spi->chip_select);
     return 0;
+
+err_pm:
+    pm_runtime_disable(&spi->dev);
+    pm_runtime_dont_use_autosuspend(&spi->dev);
+    pm_runtime_put_noidle(&spi->dev);
+    pm_runtime_set_suspended(&spi->dev);
+err_buf:
+    desfire_aes_free(rd);
+    kfree(rd->tx_buf);
+    kfree(rd->rx_buf);
+    free_percpu(rd->bus_stats);
+    ida_simple_remove(&mfrc522_ida, rd->index);
+    return result;
 }
 
-static void __exit mfrc522_spi_exit(void)
+static int mfrc522_remove(struct spi_device *spi)
 {
-    //* FOR TESTING PURPOSES
-    unregister_chrdev(major, "spi_mfrc522_driver"); // Unregister the device
+    struct mfrc522_reader *rd = spi_get_drvdata(spi);
+
+    if (rd->registered)
+        nfc_reader_unregister(&rd->nfc); // Waits for a pass in progress
+    cancel_delayed_work_sync(&rd->health_work);
+    mutex_lock(&mfrc522_readers_lock);
+    list_del(&rd->node);
+    if (mfrc522_primary == rd)
+        mfrc522_primary = list_first_entry_or_null(&mfrc522_readers, struct mfrc522_reader, node);
+    mutex_unlock(&mfrc522_readers_lock);
+
+    if (rd->rf_capture.chan) {
+        mutex_lock(&rd->lock);
+        rd->dev.capture = false;
+        mutex_unlock(&rd->lock);
+        relay_close(rd->rf_capture.chan);
+        rd->rf_capture.chan = NULL;
+    }
+    debugfs_remove_recursive(rd->debugfs_dir);
 
-   
     // Deinitialize the MFRC522
-    // TODO - Implement this function
-    if (DEBUG) { printk(KERN_INFO "MFRC522 deinitialized.\n");}
+    pm_runtime_get_sync(&spi->dev);
+    mfrc522_antenna_off(&rd->dev);
+    if (DEBUG) { printk(KERN_INFO "%s: MFRC522 deinitialized.\n", rd->name);}
+
+    pm_runtime_disable(&spi->dev);
+    pm_runtime_dont_use_autosuspend(&spi->dev);
+    pm_runtime_put_noidle(&spi->dev);
+    pm_runtime_set_suspended(&spi->dev);
+    desfire_aes_free(rd);
+    kfree(rd->tx_buf);
+    kfree(rd->rx_buf);
+    free_percpu(rd->bus_stats);
+    ida_simple_remove(&mfrc522_ida, rd->index);
+    return 0;
+}
 
-    // Unregister the SPI slave device
-    spi_unregister_device(mfrc522_spi_device);
-    printk(KERN_INFO "MFRC522 SPI driver deinitialized.\n");
+static int mfrc522_runtime_suspend(struct device *dev)
+{
+    struct mfrc522_reader *rd = dev_get_drvdata(dev);
+    int result = 0;
+
+    if (pm_mode == MFRC522_PM_NONE)
+        return 0;
+
+    mutex_lock(&rd->lock);
+    result = mfrc522_antenna_off(&rd->dev);
+    if (!result) {
+        rd->field_on = false;
+        if (pm_mode == MFRC522_PM_POWER_DOWN)
+            result = mfrc522_power_down(&rd->dev);
+    }
+    mutex_unlock(&rd->lock);
+
+    return result ? -EAGAIN : 0; // Stay active if the bus failed
 }
 
-static int mfrc522_spi_write_then_read(struct spi_device *spi, const void *txbuf, unsigned n_tx, void *rxbuf, unsigned n_rx)
-{   /* 
-    ptr *struct spi_device spi: Pointer to the SPI device structure; represents the SPI slave device.
-    ptr *const void txbuf: Pointer to the buffer containing the data to be transmitted.
-    unsigned n_tx: Number of bytes to transmit.
-    ptr *void rxbuf: Pointer to the buffer where the received data will be stored.
-    unsigned n_rx: Number of bytes expected to be received.
-    */
+// The field is switched back on by the next scan, which may not need it when LPCD is used
+static int mfrc522_runtime_resume(struct device *dev)
+{
+    struct mfrc522_reader *rd = dev_get_drvdata(dev);
+    u64 start = ktime_get_ns();
+    int result;
 
-    struct spi_transfer t[2] = {0}; // Array of two transfer structures (one for transmit, one for receive)
-    struct spi_message m;           // SPI message object
+    mutex_lock(&rd->lock);
+    result = mfrc522_power_up(&rd->dev); // Harmless if the chip was not powered down
+    if (!result)
+        rd->pending_wake_ns = ktime_get_ns() - start;
+    mutex_unlock(&rd->lock);
+
+    if (result)
+        printk(KERN_WARNING "%s: MFRC522 failed to wake up: %d\n", rd->name, result);
+    return result;
+}
+
+// Caller holds rd->lock
+static int mfrc522_field_up(struct mfrc522_reader *rd)
+{
     int result;
 
-    if (DEBUG) { printk(KERN_INFO "SPI writing 0x%x then reading.\n", *(int *)txbuf); }
+    if (rd->field_on)
+        return 0;
+    result = mfrc522_antenna_on(&rd->dev);
+    if (result)
+        return result;
+    usleep_range(field_guard_us, field_guard_us + 500);
+    rd->field_on = true;
+    return 0;
+}
 
-    spi_message_init(&m);           // Initialize the SPI message
-    memset(t, 0, sizeof(t));        // Clear the transfer structures
+static const char *const recovery_tier_names[MFRC522_RECOVERY_TIERS] = {
+    [MFRC522_RECOVER_IDLE] = "idle",
+    [MFRC522_RECOVER_SOFT_RESET] = "soft_reset",
+    [MFRC522_RECOVER_HARD_RESET] = "hard_reset",
+    [MFRC522_RECOVER_FAILED] = "failed",
+};
 
-    t[0].tx_buf = txbuf;            // Set the transmit buffer
-    t[0].len = n_tx;                // Set the length of the transmit buffer
-    spi_message_add_tail(&t[0], &m);// Add the first transfer to the message
+/**
+ * @brief Run the recovery ladder on a reader that failed an access or the health probe
+ * @param cause What the access or the probe returned
+ *
+ * Caller holds rd->lock. The ladder leaves the field off and the cards
+ * unpowered, so the next scan brings the field up with its guard time and
+ * resolves every card from scratch.
+*/
+static int mfrc522_recover_locked(struct mfrc522_reader *rd, int cause)
+{
+    enum mfrc522_recovery tier;
+    u64 start = ktime_get_ns();
+    int result;
 
-    t[1].rx_buf = rxbuf;            // Set the receive buffer
-    t[1].len = n_rx;                // Set the length of the receive buffer
-    spi_message_add_tail(&t[1], &m);// Add the second transfer to the message
+    result = mfrc522_recover(&rd->dev, &tier);
+    rd->field_on = false;
+    rd->inventory.count = 0;
+
+    rd->recovery.tiers[tier]++;
+    rd->recovery.last_cause = cause;
+    rd->recovery.last_tier = tier;
+    rd->recovery.last_ns = ktime_get_ns();
+    if (!result)
+        lat_hist_record(&rd->recovery.time, rd->recovery.last_ns - start);
+
+    // A suspended reader goes back to sleep; the resets woke it up
+    if (!result && pm_mode == MFRC522_PM_POWER_DOWN && pm_runtime_status_suspended(&rd->spi->dev))
+        result = mfrc522_power_down(&rd->dev);
+
+    if (result)
+        printk_ratelimited(KERN_ERR "%s: MFRC522 not recovered after %d: %d\n", rd->name, cause, result);
+    else
+        printk_ratelimited(KERN_WARNING "%s: MFRC522 recovered from %d by %s in %llu us\n", rd->name, cause,
+                           recovery_tier_names[tier], div_u64(rd->recovery.last_ns - start, 1000));
+    return result;
+}
 
-    result = spi_sync(spi, &m);      // Execute the SPI transaction
-    if (result) {
-        printk(KERN_WARNING "SPI transaction failed.\n");
-        return result;
-    } else if (DEBUG) {
-        printk(KERN_INFO "SPI transaction successful.\n");
+// Catches a chip that reset itself or stopped answering while nothing was talking to it
+static void mfrc522_health_work(struct work_struct *work)
+{
+    struct mfrc522_reader *rd = container_of(to_delayed_work(work), struct mfrc522_reader, health_work);
+    int result;
+
+    if (health_ms) {
+        mutex_lock(&rd->lock);
+        rd->recovery.probes++;
+        result = mfrc522_check_health(&rd->dev);
+        if (result) {
+            rd->recovery.probe_failures++;
+            mfrc522_recover_locked(rd, result);
+        }
+        mutex_unlock(&rd->lock);
     }
+    // With the probe off, look again every second for it being switched on
+    schedule_delayed_work(&rd->health_work, msecs_to_jiffies(health_ms ? health_ms : 1000));
+}
+
+static int lpcd_show(struct seq_file *m, void *v)
+{
+    struct mfrc522_reader *rd = m->private;
+    struct mfrc522_lpcd snap;
+
+    mutex_lock(&rd->lock);
+    snap = rd->lpcd_state;
+    mutex_unlock(&rd->lock);
+
+    seq_printf(m, "baseline_i:  %u/16\n", snap.base_i);
+    seq_printf(m, "baseline_q:  %u/16\n", snap.base_q);
+    seq_printf(m, "last_i:      %u\n", snap.last_i);
+    seq_printf(m, "last_q:      %u\n", snap.last_q);
+    seq_printf(m, "threshold:   %u\n", snap.threshold);
+    seq_printf(m, "probes:      %llu\n", snap.probes);
+    seq_printf(m, "wakes:       %llu\n", snap.wakes);
+    seq_printf(m, "false_wakes: %llu (%llu per mille of wakes)\n", snap.false_wakes,
+               snap.wakes ? div64_u64(snap.false_wakes * 1000, snap.wakes) : 0);
+    return 0;
+}
 
+static int lpcd_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, lpcd_show, inode->i_private);
+}
+
+static const struct file_operations lpcd_fops = {
+    .owner = THIS_MODULE,
+    .open = lpcd_open,
+    .read = seq_read,
+    .llseek = seq_lseek,
+    .release = single_release,
+};
+
+static int rf_tune_show(struct seq_file *m, void *v)
+{
+    struct mfrc522_reader *rd = m->private;
+    struct mfrc522_tune_result res;
+    struct mfrc522_rf_config rf;
+
+    mutex_lock(&rd->lock);
+    rf = rd->dev.rf;
+    res = rd->rf_tune_result;
+    mutex_unlock(&rd->lock);
+
+    seq_printf(m, "rx_gain:      %u\n", rf.rx_gain);
+    seq_printf(m, "mod_width:    0x%02x\n", rf.mod_width);
+    seq_printf(m, "force_100ask: %u\n", rf.force_100ask);
+    if (res.trials)
+        seq_printf(m, "last tune:    %u/%u first try, %u frames with errors\n", res.first_try, res.trials, res.errors);
     return 0;
 }
 
-static int mfrc522_spi_write_byte(struct spi_device *spi, uint8_t address, uint8_t data)
+static int rf_tune_open(struct inode *inode, struct file *file)
 {
-    // Write a byte to the MFRC522
+    return single_open(file, rf_tune_show, inode->i_private);
+}
+
+/**
+ * @brief Sweep RF settings against the tags in the field; write the number of rounds per setting (0 for the default)
+ *
+ * The winner is programmed into this reader only; each antenna has its own
+ * surroundings, so the rx_gain/mod_width/force_100ask parameters are left alone.
+*/
+static ssize_t rf_tune_write(struct file *file, const char __user *buffer, size_t len, loff_t *offset)
+{
+    struct mfrc522_reader *rd = ((struct seq_file *)file->private_data)->private;
+    struct device *dev = &rd->spi->dev;
+    struct mfrc522_tune_result res;
+    unsigned int trials = 0;
     int result;
-    char txbuf[2] = {address << 1, data}; // Buffer to store the address and data
-    char rxbuf[1] = {0};              // Buffer to store the response
 
-    if (DEBUG) { printk(KERN_INFO "Writing 0x%x to address 0x%x.\n", data, address); }
+    result = kstrtouint_from_user(buffer, len, 0, &trials);
+    if (result && result != -EINVAL)
+        return result;
+    if (!trials)
+        trials = RF_TUNE_TRIALS;
+
+    result = pm_runtime_get_sync(dev);
+    if (result < 0) {
+        pm_runtime_put_noidle(dev);
+        return result;
+    }
+    mutex_lock(&rd->lock);
+    result = mfrc522_field_up(rd);
+    if (!result)
+        result = mfrc522_rf_tune(&rd->dev, trials, &res);
+    if (!result)
+        rd->rf_tune_result = res;
+    mutex_unlock(&rd->lock);
+    pm_runtime_mark_last_busy(dev);
+    pm_runtime_put_autosuspend(dev);
 
-    // Write the byte
-    result = mfrc522_spi_write_then_read(spi, txbuf, 2, rxbuf, 1);
     if (result) {
-        printk(KERN_WARNING "Failed to write 0x%x to address 0x%x.\n", data, address);
-        return -ENODEV;
-    } else if (DEBUG) {
-        printk(KERN_INFO "Wrote 0x%x to address 0x%x.\n", data, address);
+        printk(KERN_WARNING "%s: RF tuning failed: %d\n", rd->name, result);
+        return result;
     }
+    printk(KERN_INFO "%s: RF tuned: RxGain %u, ModWidth 0x%02x, Force100ASK %u (%u/%u first try)\n",
+           rd->name, res.rf.rx_gain, res.rf.mod_width, res.rf.force_100ask, res.first_try, res.trials);
+    return len;
+}
+
+static const struct file_operations rf_tune_fops = {
+    .owner = THIS_MODULE,
+    .open = rf_tune_open,
+    .read = seq_read,
+    .write = rf_tune_write,
+    .llseek = seq_lseek,
+    .release = single_release,
+};
 
+static int desfire_show(struct seq_file *m, void *v)
+{
+    struct mfrc522_reader *rd = m->private;
+    struct mfrc522_tcl tcl;
+
+    mutex_lock(&rd->lock);
+    tcl = rd->desfire_tcl;
+    mutex_unlock(&rd->lock);
+
+    seq_printf(m, "aes:        %s\n", rd->desfire_aes.card ? "yes" : "no");
+    seq_printf(m, "ats:        %*phN\n", tcl.ats_len, tcl.ats);
+    seq_printf(m, "fsd:        %u\n", tcl.fsd);
+    seq_printf(m, "fsc:        %u\n", tcl.fsc);
+    seq_printf(m, "fwt_us:     %u\n", tcl.fwt_us);
+    seq_printf(m, "i_blocks:   %u\n", tcl.i_blocks);
+    seq_printf(m, "r_blocks:   %u\n", tcl.r_blocks);
+    seq_printf(m, "wtx:        %u\n", tcl.wtx);
+    seq_printf(m, "recoveries: %u\n", tcl.recoveries);
     return 0;
 }
 
-static int mfrc522_spi_write_data(struct spi_device *spi, uint8_t address, uint8_t *data, uint8_t length) {
-    // Write data to the MFRC522
+static int desfire_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, desfire_show, inode->i_private);
+}
+
+static const struct file_operations desfire_fops = {
+    .owner = THIS_MODULE,
+    .open = desfire_open,
+    .read = seq_read,
+    .llseek = seq_lseek,
+    .release = single_release,
+};
+
+static int capture_show(struct seq_file *m, void *v)
+{
+    struct mfrc522_reader *rd = m->private;
+    u64 frames, bytes, overwritten;
+
+    mutex_lock(&rd->lock);
+    frames = rd->rf_capture.frames;
+    bytes = rd->rf_capture.bytes;
+    overwritten = rd->rf_capture.overwritten;
+    mutex_unlock(&rd->lock);
+
+    seq_printf(m, "capture:     %s\n", !rd->rf_capture.chan ? "unavailable" : capture ? "on" : "off");
+    seq_printf(m, "buffer:      %u x %u bytes per CPU\n", RF_CAPTURE_SUBBUFS, RF_CAPTURE_SUBBUF_SIZE);
+    seq_printf(m, "frames:      %llu\n", frames);
+    seq_printf(m, "bytes:       %llu\n", bytes);
+    seq_printf(m, "overwritten: %llu\n", overwritten);
+    return 0;
+}
+
+static int capture_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, capture_show, inode->i_private);
+}
+
+static const struct file_operations capture_fops = {
+    .owner = THIS_MODULE,
+    .open = capture_open,
+    .read = seq_read,
+    .llseek = seq_lseek,
+    .release = single_release,
+};
+
+/**
+ * @brief Read the whole register map in one SPI message
+ * @param regs MFRC522_NUM_REGS bytes, by register address
+ *
+ * A read takes a new address on every byte (datasheet 8.1.2.2), so 64
+ * addresses and a closing 0 clock out every register in 65 bytes. Caller
+ * holds rd->lock, so the map is never caught halfway through a command the
+ * driver is issuing. FIFODataReg is not read, that would pop the FIFO; its
+ * byte is 0. The chip is not woken up: a suspended reader is dumped as it
+ * sleeps.
+*/
+static int mfrc522_snapshot_locked(struct mfrc522_reader *rd, u8 *regs)
+{
+    unsigned int reg;
     int result;
-    char *txbuf = kmalloc(length + 1, GFP_KERNEL); // Buffer to store the address and data
-    char rxbuf[1] = {0};                           // Buffer to store the response
 
-    if (DEBUG) { printk(KERN_INFO "Writing data to address 0x%x.\n", address); }
+    BUILD_BUG_ON(MFRC522_SPI_BUF_SIZE < MFRC522_NUM_REGS + 1);
+    for (reg = 0; reg < MFRC522_NUM_REGS; reg++)
+        rd->tx_buf[reg] = 0x80 | (((reg == FIFODataReg ? 0 : reg) << 1) & 0x7E); // Reserved 0x00 instead
+    rd->tx_buf[MFRC522_NUM_REGS] = 0x00;
 
-    // Prepare the buffer
-    txbuf[0] = address << 1; // Set the address
-    memcpy(txbuf + 1, data, length); // Copy the data to the buffer
+    result = mfrc522_spi_transfer(rd, MFRC522_NUM_REGS + 1, MFRC522_NUM_REGS);
+    if (result)
+        return -EIO;
+    memcpy(regs, rd->rx_buf + 1, MFRC522_NUM_REGS);
+    regs[FIFODataReg] = 0;
+    return 0;
+}
 
-    // Write the data
-    result = mfrc522_spi_write_then_read(spi, txbuf, length + 1, rxbuf, 1);
-    if (result) {
-        printk(KERN_WARNING "Failed to write data to address 0x%x.\n", address);
-        return -ENODEV;
-    } else if (DEBUG) {
-        printk(KERN_INFO "Wrote data to address 0x%x.\n", address);
+#define REG_NAME(reg) [reg] = #reg
+static const char *const mfrc522_reg_names[MFRC522_NUM_REGS] = {
+    REG_NAME(CommandReg), REG_NAME(ComIEnReg), REG_NAME(DivIEnReg), REG_NAME(ComIrqReg), REG_NAME(DivIrqReg),
+    REG_NAME(ErrorReg), REG_NAME(Status1Reg), REG_NAME(Status2Reg), REG_NAME(FIFODataReg), REG_NAME(FIFOLevelReg),
+    REG_NAME(WaterLevelReg), REG_NAME(ControlReg), REG_NAME(BitFramingReg), REG_NAME(CollReg), REG_NAME(ModeReg),
+    REG_NAME(TxModeReg), REG_NAME(RxModeReg), REG_NAME(TxControlReg), REG_NAME(TxASKReg), REG_NAME(TxSelReg),
+    REG_NAME(RxSelReg), REG_NAME(RxThresholdReg), REG_NAME(DemodReg), REG_NAME(MfTxReg), REG_NAME(MfRxReg),
+    REG_NAME(SerialSpeedReg), REG_NAME(CRCResultRegH), REG_NAME(CRCResultRegL), REG_NAME(ModWidthReg),
+    REG_NAME(RFCfgReg), REG_NAME(GsNReg), REG_NAME(CWGsPReg), REG_NAME(ModGsPReg), REG_NAME(TModeReg),
+    REG_NAME(TPrescalerReg), REG_NAME(TReloadRegH), REG_NAME(TReloadRegL), REG_NAME(TCounterValRegH),
+    REG_NAME(TCounterValRegL), REG_NAME(TestSel1Reg), REG_NAME(TestSel2Reg), REG_NAME(TestPinEnReg),
+    REG_NAME(TestPinValueReg), REG_NAME(TestBusReg), REG_NAME(AutoTestReg), REG_NAME(VersionReg),
+    REG_NAME(AnalogTestReg), REG_NAME(TestDAC1Reg), REG_NAME(TestDAC2Reg), REG_NAME(TestADCReg),
+};
+#undef REG_NAME
+
+// Single-bit flags worth naming in a dump, by bit number (datasheet section 9.3)
+static const char *const mfrc522_reg_bits[MFRC522_NUM_REGS][8] = {
+    [CommandReg] = { [4] = "PowerDown", [5] = "RcvOff" },
+    [ComIEnReg] = { "TimerIEn", "ErrIEn", "LoAlertIEn", "HiAlertIEn", "IdleIEn", "RxIEn", "TxIEn", "IRqInv" },
+    [DivIEnReg] = { [2] = "CRCIEn", [4] = "MfinActIEn", [7] = "IRQPushPull" },
+    [ComIrqReg] = { "TimerIRq", "ErrIRq", "LoAlertIRq", "HiAlertIRq", "IdleIRq", "RxIRq", "TxIRq", "Set1" },
+    [DivIrqReg] = { [2] = "CRCIRq", [4] = "MfinActIRq", [7] = "Set2" },
+    [ErrorReg] = { "ProtocolErr", "ParityErr", "CRCErr", "CollErr", "BufferOvfl", NULL, "TempErr", "WrErr" },
+    [Status1Reg] = { "LoAlert", "HiAlert", NULL, "TRunning", "IRq", "CRCReady", "CRCOk" },
+    [Status2Reg] = { [3] = "MFCrypto1On", [6] = "I2CForceHS", [7] = "TempSensClear" },
+    [CollReg] = { [5] = "CollPosNotValid", [7] = "ValuesAfterColl" },
+    [TxModeReg] = { [7] = "TxCRCEn" },
+    [RxModeReg] = { [7] = "RxCRCEn" },
+    [TxControlReg] = { "Tx1RFEn", "Tx2RFEn", NULL, "Tx2CW", "InvTx1RFOff", "InvTx2RFOff", "InvTx1RFOn", "InvTx2RFOn" },
+    [TxASKReg] = { [6] = "Force100ASK" },
+    [TModeReg] = { [7] = "TAuto" },
+};
+
+static const char *const mfrc522_cmd_names[16] = {
+    [MFRC522_CMD_IDLE] = "Idle", [MFRC522_CMD_MEM] = "Mem", [MFRC522_CMD_GEN_RAND_ID] = "Generate RandomID",
+    [MFRC522_CMD_CALC_CRC] = "CalcCRC", [MFRC522_CMD_TRANSMIT] = "Transmit", [MFRC522_CMD_NO_CHANGE] = "NoCmdChange",
+    [MFRC522_CMD_RECEIVE] = "Receive", [MFRC522_CMD_TRANSCEIVE] = "Transceive",
+    [MFRC522_CMD_MF_AUTHENT] = "MFAuthent", [MFRC522_CMD_SOFT_RESET] = "SoftReset",
+};
+
+// Multi-bit fields first, then the flags that are set
+static void registers_annotate(struct seq_file *m, u8 reg, u8 val)
+{
+    unsigned int bit;
+
+    switch (reg) {
+    case CommandReg:
+        seq_printf(m, " %s", mfrc522_cmd_names[val & 0x0F] ?: "?");
+        break;
+    case FIFOLevelReg:
+        seq_printf(m, " %u bytes", val & 0x7F);
+        break;
+    case ControlReg:
+        seq_printf(m, " RxLastBits=%u", val & 0x07);
+        break;
+    case BitFramingReg:
+        seq_printf(m, " TxLastBits=%u RxAlign=%u", val & 0x07, (val >> 4) & 0x07);
+        break;
+    case Status2Reg:
+        seq_printf(m, " ModemState=%u", val & 0x07);
+        break;
+    case CollReg:
+        seq_printf(m, " CollPos=%u", val & MFRC522_COLL_POS_MASK);
+        break;
+    case RFCfgReg:
+        seq_printf(m, " RxGain=%u", (val & MFRC522_RX_GAIN_MASK) >> MFRC522_RX_GAIN_SHIFT);
+        break;
+    case VersionReg:
+        seq_puts(m, val == 0x92 ? " v2.0" : val == 0x91 ? " v1.0" : " unknown");
+        break;
     }
+    for (bit = 8; bit--; )
+        if ((val & BIT(bit)) && mfrc522_reg_bits[reg][bit])
+            seq_printf(m, " %s", mfrc522_reg_bits[reg][bit]);
+}
+
+static int registers_show(struct seq_file *m, void *v)
+{
+    struct mfrc522_reader *rd = m->private;
+    u8 regs[MFRC522_NUM_REGS];
+    bool field_on;
+    u64 start, end;
+    unsigned int reg;
+    int result;
 
-    kfree(txbuf); // Free the buffer
+    mutex_lock(&rd->lock);
+    start = ktime_get_ns();
+    result = mfrc522_snapshot_locked(rd, regs);
+    end = ktime_get_ns();
+    field_on = rd->field_on;
+    mutex_unlock(&rd->lock);
+    if (result)
+        return result;
 
+    seq_printf(m, "# %s at %llu ns, read in %llu us, field %s, %s\n", rd->name, start, div_u64(end - start, 1000),
+               field_on ? "on" : "off", pm_runtime_status_suspended(&rd->spi->dev) ? "suspended" : "active");
+    for (reg = 0; reg < MFRC522_NUM_REGS; reg++) {
+        if (!mfrc522_reg_names[reg] || reg == FIFODataReg)
+            continue; // Reserved, or not read
+        seq_printf(m, "0x%02x %-16s 0x%02x", reg, mfrc522_reg_names[reg], regs[reg]);
+        registers_annotate(m, reg, regs[reg]);
+        seq_putc(m, '\n');
+    }
     return 0;
+}
 
+static int registers_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, registers_show, inode->i_private);
 }
 
-static int mfrc522_spi_read_byte(struct spi_device *spi, uint8_t address, uint8_t *data)
+static const struct file_operations registers_fops = {
+    .owner = THIS_MODULE,
+    .open = registers_open,
+    .read = seq_read,
+    .llseek = seq_lseek,
+    .release = single_release,
+};
+
+// The same snapshot as 64 raw bytes by register address, for tools and diffs
+static int registers_bin_show(struct seq_file *m, void *v)
 {
-    // Read a byte from the MFRC522
+    struct mfrc522_reader *rd = m->private;
+    u8 regs[MFRC522_NUM_REGS];
     int result;
-    char txbuf[1] = {address << 1}; // Buffer to store the address
-    char rxbuf[1] = {0};       // Buffer to store the response
 
-    if (DEBUG) { printk(KERN_INFO "Reading from address 0x%x.\n", address); }
+    mutex_lock(&rd->lock);
+    result = mfrc522_snapshot_locked(rd, regs);
+    mutex_unlock(&rd->lock);
+    if (result)
+        return result;
+    seq_write(m, regs, sizeof(regs));
+    return 0;
+}
 
-    // Read the byte
-    result = mfrc522_spi_write_then_read(spi, txbuf, 1, rxbuf, 1);
-    if (result) {
-        printk(KERN_WARNING "Failed to read from address 0x%x.\n", address);
-        return -ENODEV;
-    } else if (DEBUG) {
-        printk(KERN_INFO "Read 0x%x from address 0x%x.\n", rxbuf[0], address);
-    }
+static int registers_bin_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, registers_bin_show, inode->i_private);
+}
+
+static const struct file_operations registers_bin_fops = {
+    .owner = THIS_MODULE,
+    .open = registers_bin_open,
+    .read = seq_read,
+    .llseek = seq_lseek,
+    .release = single_release,
+};
+
+static int health_show(struct seq_file *m, void *v)
+{
+    struct mfrc522_reader *rd = m->private;
+    unsigned int i;
+
+    mutex_lock(&rd->lock);
+    seq_printf(m, "interval_ms:     %u\n", health_ms);
+    seq_printf(m, "probes:          %llu\n", rd->recovery.probes);
+    seq_printf(m, "probe_failures:  %llu\n", rd->recovery.probe_failures);
+    seq_printf(m, "spi_resent:      %llu\n", rd->recovery.resent);
+    for (i = 0; i < MFRC522_RECOVERY_TIERS; i++)
+        seq_printf(m, "%-16s %llu\n", recovery_tier_names[i], rd->recovery.tiers[i]);
+    if (rd->recovery.last_ns)
+        seq_printf(m, "last:            %s after %d, %llu ms ago\n", recovery_tier_names[rd->recovery.last_tier],
+                   rd->recovery.last_cause, div_u64(ktime_get_ns() - rd->recovery.last_ns, NSEC_PER_MSEC));
+    mutex_unlock(&rd->lock);
+
+    seq_putc(m, '\n');
+    lat_hist_seq_header(m);
+    lat_hist_seq_show(m, "recovery", &rd->recovery.time);
+    return 0;
+}
+
+static int health_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, health_show, inode->i_private);
+}
+
+// Any write resets the counters and the histogram
+static ssize_t health_write(struct file *file, const char __user *buffer, size_t len, loff_t *offset)
+{
+    struct mfrc522_reader *rd = ((struct seq_file *)file->private_data)->private;
 
-    *data = rxbuf[0]; // Store the data in the pointer
+    mutex_lock(&rd->lock);
+    memset(&rd->recovery, 0, offsetof(typeof(rd->recovery), time));
+    mutex_unlock(&rd->lock);
+    lat_hist_reset(&rd->recovery.time);
+    return len;
+}
 
+static const struct file_operations health_fops = {
+    .owner = THIS_MODULE,
+    .open = health_open,
+    .read = seq_read,
+    .write = health_write,
+    .llseek = seq_lseek,
+    .release = single_release,
+};
+
+static int wake_latency_show(struct seq_file *m, void *v)
+{
+    struct mfrc522_reader *rd = m->private;
+
+    lat_hist_seq_header(m);
+    lat_hist_seq_show(m, "wake_to_ready", &rd->wake_latency);
     return 0;
 }
 
-static int mfrc522_spi_read_data(struct spi_device *spi, uint8_t address, uint8_t *data, uint8_t length) {
-    // Read data from the MFRC522
-    int result;
-    char txbuf[1] = {address << 1}; // Buffer to store the address
-    char *rxbuf = kmalloc(length, GFP_KERNEL); // Buffer to store the response
+static int wake_latency_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, wake_latency_show, inode->i_private);
+}
 
-    if (DEBUG) { printk(KERN_INFO "Reading data from address 0x%x.\n", address); }
+// Any write resets the histogram
+static ssize_t wake_latency_write(struct file *file, const char __user *buffer, size_t len, loff_t *offset)
+{
+    struct mfrc522_reader *rd = ((struct seq_file *)file->private_data)->private;
 
-    // Read the data
-    result = mfrc522_spi_write_then_read(spi, txbuf, 1, rxbuf, length);
-    if (result) {
-        printk(KERN_WARNING "Failed to read data from address 0x%x.\n", address);
-        return -ENODEV;
-    } else if (DEBUG) {
-        printk(KERN_INFO "Read data from address 0x%x.\n", address);
+    lat_hist_reset(&rd->wake_latency);
+    return len;
+}
+
+static const struct file_operations wake_latency_fops = {
+    .owner = THIS_MODULE,
+    .open = wake_latency_open,
+    .read = seq_read,
+    .write = wake_latency_write,
+    .llseek = seq_lseek,
+    .release = single_release,
+};
+
+// Sum of every reader's counters, for the top-level file and the ioctl
+static void bus_stats_total(struct nfc_bus_counters *total)
+{
+    struct mfrc522_reader *rd;
+    struct nfc_bus_counters c;
+    __u64 *dst = (__u64 *)total;
+    const __u64 *src = (const __u64 *)&c;
+    unsigned int i;
+
+    memset(total, 0, sizeof(*total));
+    mutex_lock(&mfrc522_readers_lock);
+    list_for_each_entry(rd, &mfrc522_readers, node) {
+        nfc_bus_stats_sum(rd->bus_stats, &c);
+        for (i = 0; i < NFC_BUS_COUNTERS; i++)
+            dst[i] += src[i];
     }
+    mutex_unlock(&mfrc522_readers_lock);
+}
+
+static void bus_stats_reset_all(void)
+{
+    struct mfrc522_reader *rd;
 
-    memcpy(data, rxbuf, length); // Copy the data to the pointer
+    mutex_lock(&mfrc522_readers_lock);
+    list_for_each_entry(rd, &mfrc522_readers, node)
+        nfc_bus_stats_reset(rd->bus_stats);
+    mutex_unlock(&mfrc522_readers_lock);
+}
 
-    kfree(rxbuf); // Free the buffer
+// mfrc522/bus_stats has no reader and shows the total, mfrc522/<index>/bus_stats one reader
+static int bus_stats_show(struct seq_file *m, void *v)
+{
+    struct mfrc522_reader *rd = m->private;
+    struct nfc_bus_counters c;
 
+    if (rd) {
+        nfc_bus_stats_seq_show(m, rd->bus_stats);
+        return 0;
+    }
+    bus_stats_total(&c);
+    seq_printf(m, "messages:        %llu\n", c.messages);
+    seq_printf(m, "bytes_out:       %llu\n", c.bytes_out);
+    seq_printf(m, "bytes_in:        %llu\n", c.bytes_in);
+    seq_printf(m, "xfer_errors:     %llu\n", c.xfer_errors);
+    seq_printf(m, "retries:         %llu\n", c.retries);
+    seq_printf(m, "crc_errors:      %llu\n", c.crc_errors);
+    seq_printf(m, "parity_errors:   %llu\n", c.parity_errors);
+    seq_printf(m, "protocol_errors: %llu\n", c.protocol_errors);
+    seq_printf(m, "collisions:      %llu\n", c.collisions);
+    seq_printf(m, "fifo_overflows:  %llu\n", c.fifo_overflows);
+    seq_printf(m, "busy_us:         %llu\n", div_u64(c.busy_ns, 1000));
     return 0;
+}
 
+static int bus_stats_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, bus_stats_show, inode->i_private);
 }
 
-/**
- * @brief Send a command to the MFRC522 command register 
- * @param spi Pointer to the SPI device structure
- * @param RcvOff Analogue part of the receiver is switched off
- * @param PowerDown High: Soft power-down mode entered; Low: Wake up procedure begins
- * @param Command Command to send
-*/
-static int mfrc522_send_command(struct spi_device *spi, uint8_t RcvOff, uint8_t PowerDown, uint8_t Command)
+// Any write resets the counters, of every reader for the top-level file
+static ssize_t bus_stats_write(struct file *file, const char __user *buffer, size_t len, loff_t *offset)
 {
-    // From MFRC522 datasheet 9.3.1.2 CommandReg register (page 38)
-    // Prepare the command
-    // Bit  7   6     5     4     3     2     1     0
-    //      0   0 RcvOff PowerDown   Command[3:0] 
+    struct mfrc522_reader *rd = ((struct seq_file *)file->private_data)->private;
 
-    uint8_t commandReg = 0x01; // Command register
-    uint8_t data = (RcvOff << 6) | (PowerDown << 5) | Command; // Command byte
+    if (rd)
+        nfc_bus_stats_reset(rd->bus_stats);
+    else
+        bus_stats_reset_all();
+    return len;
+}
 
-    if (DEBUG) { printk(KERN_INFO "Sending command 0x%x.\n", data); }
+static const struct file_operations bus_stats_fops = {
+    .owner = THIS_MODULE,
+    .open = bus_stats_open,
+    .read = seq_read,
+    .write = bus_stats_write,
+    .llseek = seq_lseek,
+    .release = single_release,
+};
 
-    // Send the command
-    return mfrc522_spi_write_byte(spi, commandReg, data);
+static long mfrc522_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+    struct nfc_bus_counters counters;
+
+    switch (cmd) {
+    case NFC_IOC_GET_BUS_STATS:
+        bus_stats_total(&counters);
+        if (copy_to_user((void __user *)arg, &counters, sizeof(counters)))
+            return -EFAULT;
+        return 0;
+    case NFC_IOC_RESET_BUS_STATS:
+        bus_stats_reset_all();
+        return 0;
+    default:
+        return -ENOTTY;
+    }
 }
 
-static int mfrc522_hard_reset(void)
+/**
+ * @brief Run one inventory pass on a reader and report the cards in its field
+ * @param scan UIDs found, ktime stamps of the first answer and the last UID resolved, and the wake-up time
+ *
+ * Wakes the reader through runtime PM if needed; it suspends again autosuspend_ms after the pass.
+*/
+static int mfrc522_scan(struct mfrc522_reader *rd, struct nfc_scan *scan)
 {
-    // Reset the MFRC522
+    struct device *dev = &rd->spi->dev;
+    bool detected = false;
+    u64 start;
     int result;
 
-    if (DEBUG) { printk(KERN_INFO "Resetting the MFRC522.\n"); }
-
-    // Set up the GPIO
-    result = gpio_request(GPIO_RST, "RST");  // Request the GPIO
+    result = pm_runtime_get_sync(dev); // Wakes the reader if it was suspended
     if (result < 0) {
-        printk(KERN_WARNING "NFC_tag: unable to request GPIO %d\n", GPIO_RST);
+        pm_runtime_put_noidle(dev);
         return result;
-    } else if (DEBUG) {
-        printk(KERN_INFO "NFC_tag: requested GPIO %d\n", GPIO_RST);
     }
-    result = gpio_direction_output(GPIO_RST, 1); // Set the GPIO as an output
+
+    mutex_lock(&rd->lock);
+    scan->wake_ns = rd->pending_wake_ns;
+    rd->pending_wake_ns = 0;
+
+    // With nobody known to be in the field, a load probe decides whether REQA is worth it
+    if (lpcd && !rd->field_on && !rd->inventory.count) {
+        rd->lpcd_state.threshold = lpcd_threshold;
+        result = mfrc522_lpcd_probe(&rd->dev, &rd->lpcd_state, &detected);
+        if (!result && !detected) {
+            scan->count = 0;
+            scan->t_answer = 0;
+            scan->t_resolved = 0;
+            goto out;
+        }
+    }
+
+    start = ktime_get_ns();
+    if (!rd->field_on) {
+        result = mfrc522_field_up(rd);
+        if (result)
+            goto out;
+        scan->wake_ns += ktime_get_ns() - start;
+    }
+    if (scan->wake_ns)
+        lat_hist_record(&rd->wake_latency, scan->wake_ns);
+
+    result = mfrc522_inventory(&rd->dev, &rd->inventory);
+    if (!result) {
+        memcpy(scan->uids, rd->inventory.uids, rd->inventory.count * sizeof(rd->inventory.uids[0]));
+        scan->count = rd->inventory.count;
+        scan->t_answer = ns_to_ktime(rd->inventory.t_answer);
+        scan->t_resolved = ns_to_ktime(rd->inventory.t_resolved);
+        if (detected)
+            mfrc522_lpcd_result(&rd->lpcd_state, rd->inventory.count);
+    }
+    if (lpcd && !rd->inventory.count && !mfrc522_antenna_off(&rd->dev))
+        rd->field_on = false; // Back to probing without waiting for autosuspend
+out:
+    if (result == -EIO)
+        mfrc522_recover_locked(rd, result); // The bus gave up after spi_retries; the next pass starts clean
+    mutex_unlock(&rd->lock);
+
+    pm_runtime_mark_last_busy(dev);
+    pm_runtime_put_autosuspend(dev);
+
+    if (result)
+        printk_ratelimited(KERN_WARNING "%s: inventory failed: %d\n", rd->name, result); // Every pass while the bus is down
+    return result;
+}
+
+/**
+ * @brief Read an NTAG21x token as if it had 16 byte blocks: block b is pages 4b to 4b + 3
+ *
+ * The key is not used; with ntag_pwd set the pages are unlocked with
+ * PWD_AUTH instead. A credential takes one FAST_READ.
+*/
+static int mfrc522_read_pages_locked(struct mfrc522_reader *rd, const struct mfrc522_uid *uid, u8 block,
+                                     unsigned int count, u8 *data)
+{
+    unsigned int pages_per_block = MFRC522_MF_BLOCK_SIZE / MFRC522_UL_PAGE_SIZE;
+    u8 pwd[MFRC522_UL_PWD_SIZE];
+    bool auth = *ntag_pwd;
+    int result;
+
+    if (block * pages_per_block > U8_MAX)
+        return -EINVAL;
+    if (auth && (strlen(ntag_pwd) != 2 * sizeof(pwd) || hex2bin(pwd, ntag_pwd, sizeof(pwd))))
+        return -EINVAL;
+    result = mfrc522_ntag_read_card(&rd->dev, uid, auth ? pwd : NULL, block * pages_per_block,
+                                    count * pages_per_block, data);
+    memzero_explicit(pwd, sizeof(pwd));
+    return result;
+}
+
+/**
+ * @brief Read count consecutive MIFARE Classic blocks of one sector of a card in the reader's field
+ *
+ * All of them are read under a single authentication. NTAG21x tokens are
+ * read with FAST_READ.
+*/
+static int mfrc522_read_blocks(struct mfrc522_reader *rd, const struct mfrc522_uid *uid, u8 key_type, const u8 *key,
+                               u8 block, unsigned int count, u8 *data)
+{
+    struct device *dev = &rd->spi->dev;
+    int result;
+
+    result = pm_runtime_get_sync(dev);
     if (result < 0) {
-        printk(KERN_WARNING "NFC_tag: unable to set GPIO %d as output\n", GPIO_RST);
+        pm_runtime_put_noidle(dev);
         return result;
-    } else if (DEBUG) {
-        printk(KERN_INFO "NFC_tag: set GPIO %d as output\n", GPIO_RST);
     }
+    mutex_lock(&rd->lock);
+    result = mfrc522_field_up(rd);
+    if (!result && uid->sak == PICC_SAK_ULTRALIGHT)
+        result = mfrc522_read_pages_locked(rd, uid, block, count, data);
+    else if (!result)
+        result = mfrc522_mifare_read_card(&rd->dev, uid, key_type, key, block, count, data);
+    if (result == -EIO)
+        mfrc522_recover_locked(rd, result);
+    mutex_unlock(&rd->lock);
+    pm_runtime_mark_last_busy(dev);
+    pm_runtime_put_autosuspend(dev);
+    return result;
+}
 
-    // Reset the MFRC522
-    gpio_set_value(GPIO_RST, 0); // Set the GPIO low
+static int mfrc522_reader_scan(struct nfc_reader *reader, struct nfc_scan *scan)
+{
+    return mfrc522_scan(container_of(reader, struct mfrc522_reader, nfc), scan);
+}
 
-    // Wait for a short period
-    msleep(200); // Wait for 200 ms - cannot find on the datasheet so leaving low for a long period
+static int mfrc522_reader_read_blocks(struct nfc_reader *reader, const struct mfrc522_uid *uid, u8 key_type,
+                                      const u8 *key, u8 block, unsigned int count, u8 *data)
+{
+    return mfrc522_read_blocks(container_of(reader, struct mfrc522_reader, nfc), uid, key_type, key, block,
+                               count, data);
+}
 
-    // Release the reset
-    gpio_set_value(GPIO_RST, 1);
+/**
+ * @brief Run fn with the first reader awake, the field on and the chip to itself
+ *
+ * For modules that drive cards directly, like NFC_tag.c.
+*/
+int nfc_reader_run(int (*fn)(struct mfrc522_dev *dev, void *arg), void *arg)
+{
+    struct mfrc522_reader *rd = mfrc522_primary;
+    struct device *dev;
+    int result;
 
-    // Free the GPIO
-    gpio_free(GPIO_RST);
+    if (!rd)
+        return -ENODEV; // Not probed yet
+    dev = &rd->spi->dev;
 
-    return 0;
+    result = pm_runtime_get_sync(dev);
+    if (result < 0) {
+        pm_runtime_put_noidle(dev);
+        return result;
+    }
+    mutex_lock(&rd->lock);
+    result = mfrc522_field_up(rd);
+    if (!result)
+        result = fn(&rd->dev, arg);
+    if (result == -EIO)
+        mfrc522_recover_locked(rd, result);
+    mutex_unlock(&rd->lock);
+    pm_runtime_mark_last_busy(dev);
+    pm_runtime_put_autosuspend(dev);
+    return result;
 }
+EXPORT_SYMBOL_GPL(nfc_reader_run);
 
-static int mfrc522_read_version(struct spi_device *spi)
+/**
+ * @brief Read len bytes of a file from a DESFire application over ISO 14443-4
+ *
+ * Authenticates with desfire_key as key_no first, unless key_no is
+ * DESFIRE_NO_AUTH. data must hold DESFIRE_READ_SPACE(len) bytes; the card
+ * leaves the field HALTed.
+*/
+static int mfrc522_read_file(struct mfrc522_reader *rd, const struct mfrc522_uid *uid, u32 aid, u8 key_no, u8 file,
+                             u32 offset, enum desfire_comm comm, u8 *data, unsigned int len)
 {
-    //* Read the version of the MFRC522 - should be 0x92
+    struct device *dev = &rd->spi->dev;
+    struct mfrc522_uid selected = *uid;
+    struct mfrc522_tcl tcl;
+    struct desfire df;
+    u8 atqa[2];
     int result;
-    char txbuf[1] = {0x37}; // Command to read the version
-    char rxbuf[1] = {0};    // Buffer to store the version
 
-    if (DEBUG) { printk(KERN_INFO "Reading the version of the MFRC522.\n"); }
+    if (!(uid->sak & PICC_SAK_ISO14443_4))
+        return -EMEDIUMTYPE;
+    if (key_no != DESFIRE_NO_AUTH && !rd->desfire_aes.card)
+        return -ENOKEY;
 
-    // Send the command to read the version
-    result = mfrc522_spi_write_then_read(spi, txbuf, 1, rxbuf, 1);
-    if (result) {
-        printk(KERN_WARNING "Failed to read the version of the MFRC522.\n");
-        return -ENODEV;
-    } else if (DEBUG) {
-        printk(KERN_INFO "Version of the MFRC522: %d\n", rxbuf[0]);
-    }
-
-    if (rxbuf[0] != 0x92) {
-        printk(KERN_WARNING "Incorrect version of the MFRC522.\n");
-        return -ENODEV;
-    }
-
-    return (int)rxbuf[0]; // Return the version
-}
-
-static int mfrc522_self_test(struct spi_device *spi) {
-    /*
-        Procedure to perform a self-test on the MFRC522:
-        1. Perform a soft reset.
-        2. Clear the internal buffer by writing 25 bytes of 00h and implement the Config command.
-        3. Enable the self test by writing 09h to the AutoTestReg register.
-        4. Write 00h to the FIFO buffer.
-        5. Start the self test with the CalcCRC command.
-        6. The self test is initiated.
-        7. When the self test has completed, the FIFO buffer contains the following 64 bytes:
-            00h, EBh, 66h, BAh, 57h, BFh, 23h, 95h,
-            D0h, E3h, 0Dh, 3Dh, 27h, 89h, 5Ch, DEh,
-            9Dh, 3Bh, A7h, 00h, 21h, 5Bh, 89h, 82h, 
-            51h, 3Ah, EBh, 02h, 0Ch, A5h, 00h, 49h, 
-            7Ch, 84h, 4Dh, B3h, CCh, D2h, 1Bh, 81h,
-            5Dh, 48h, 76h, D5h, 71h, 061h, 21h, A9h,
-            86h, 96h, 83h, 38h, CFh, 9Dh, 5Bh, 6Dh, 
-            DCh, 15h, BAh, 3Eh, 7Dh, 95h, 03Bh, 2Fh
-    */
+    result = pm_runtime_get_sync(dev);
+    if (result < 0) {
+        pm_runtime_put_noidle(dev);
+        return result;
+    }
+    mutex_lock(&rd->lock);
+    result = mfrc522_field_up(rd);
+    if (!result)
+        result = mfrc522_request_a(&rd->dev, PICC_CMD_WUPA, atqa);
+    if (!result)
+        result = mfrc522_reselect(&rd->dev, &selected);
+    if (!result)
+        result = mfrc522_tcl_activate(&rd->dev, &tcl, MFRC522_TCL_FSD_MAX);
+    if (!result) {
+        desfire_init(&df, &rd->dev, &tcl, rd->desfire_aes.card ? &desfire_aes_ops : NULL, rd);
+        result = desfire_select_application(&df, aid);
+        if (!result && key_no != DESFIRE_NO_AUTH)
+            result = desfire_authenticate_aes(&df, key_no);
+        if (!result)
+            result = desfire_read_data(&df, file, offset, len, comm, data);
+        mfrc522_tcl_deselect(&rd->dev, &tcl);
+        memzero_explicit(&df, sizeof(df));
+        rd->desfire_tcl = tcl;
+    }
+    if (result == -EIO)
+        mfrc522_recover_locked(rd, result);
+    mutex_unlock(&rd->lock);
+    pm_runtime_mark_last_busy(dev);
+    pm_runtime_put_autosuspend(dev);
+    return result;
+}
 
-    // int result, 
-    int i;
-    uint8_t *temp;               // Temporary byte to read from the FIFO buffer
-    uint8_t zeros[25] = {0}; // 25 bytes of 00h
-    uint8_t result[64] = {0}; // Buffer to store the result initialized to 0 
-    uint8_t expected_result[64] = {
-        0x00, 0xEB, 0x66, 0xBA, 0x57, 0xBF, 0x23, 0x95,
-        0xD0, 0xE3, 0x0D, 0x3D, 0x27, 0x89, 0x5C, 0xDE,
-        0x9D, 0x3B, 0xA7, 0x00, 0x21, 0x5B, 0x89, 0x82,
-        0x51, 0x3A, 0xEB, 0x02, 0x0C, 0xA5, 0x00, 0x49,
-        0x7C, 0x84, 0x4D, 0xB3, 0xCC, 0xD2, 0x1B, 0x81,
-        0x5D, 0x48, 0x76, 0xD5, 0x71, 0x61, 0x21, 0xA9,
-        0x86, 0x96, 0x83, 0x38, 0xCF, 0x9D, 0x5B, 0x6D,
-        0xDC, 0x15, 0xBA, 0x3E, 0x7D, 0x95, 0x3B, 0x2F
-    };
+static int mfrc522_reader_read_file(struct nfc_reader *reader, const struct mfrc522_uid *uid, u32 aid, u8 key_no,
+                                    u8 file, u32 offset, enum desfire_comm comm, u8 *data, unsigned int len)
+{
+    return mfrc522_read_file(container_of(reader, struct mfrc522_reader, nfc), uid, aid, key_no, file, offset,
+                             comm, data, len);
+}
 
-    uint8_t FIFOLevelReg = 0x0A; // FIFO level register
-    uint8_t FIFODataReg  = 0x09;  // FIFO data register
-    uint8_t AutoTestReg  = 0x36;  // Auto test register
+static int desfire_aes_encrypt(void *priv, bool session, u8 *block)
+{
+    struct mfrc522_reader *rd = priv;
 
-    
+    crypto_cipher_encrypt_one(session ? rd->desfire_aes.session : rd->desfire_aes.card, block, block);
+    return 0;
+}
 
-    if (DEBUG) { printk(KERN_INFO "Performing a self-test on the MFRC522.\n"); }
+static int desfire_aes_decrypt(void *priv, bool session, u8 *block)
+{
+    struct mfrc522_reader *rd = priv;
 
-   // 1. Perform a soft reset
-    mfrc522_send_command(spi, 0, 0, 0b1111); // Soft reset
-    msleep(150);                             // Wait for 150 ms
+    crypto_cipher_decrypt_one(session ? rd->desfire_aes.session : rd->desfire_aes.card, block, block);
+    return 0;
+}
 
-    if (DEBUG) { printk(KERN_INFO "Soft reset complete.\n"); }
+static int desfire_aes_set_session_key(void *priv, const u8 *key)
+{
+    struct mfrc522_reader *rd = priv;
 
-    // 2. Clear the internal buffer by writing 25 bytes of 00h and implement the Config command
-    mfrc522_spi_write_byte(spi, FIFOLevelReg, 0x80); // Flush the FIFO buffer
-    mfrc522_spi_write_data(spi, FIFODataReg, zeros, 25); // Clear the internal buffer
-    mfrc522_send_command(spi, 0, 0, 0b0001); // Mem command
+    return crypto_cipher_setkey(rd->desfire_aes.session, key, DESFIRE_AES_BLOCK);
+}
 
-    // 3. Enable the self test by writing 09h to the AutoTestReg register
-    mfrc522_spi_write_byte(spi, AutoTestReg, 0x09); // Enable the self test
+static void desfire_aes_random(void *priv, u8 *buf, unsigned int len)
+{
+    get_random_bytes(buf, len);
+}
 
-    // 4. Write 00h to the FIFO buffer
-    mfrc522_spi_write_byte(spi, FIFODataReg, 0x00); // Write 00h to the FIFO buffer
+// Without AES only free-access files can be read, so a bad key or missing cipher is not fatal
+static void desfire_aes_init(struct mfrc522_reader *rd)
+{
+    u8 key[DESFIRE_AES_BLOCK];
+    int result;
 
-    // 5. Start the self test with the CalcCRC command
-    mfrc522_send_command(spi, 0, 0, 0b0100); // CalcCRC command
+    if (strlen(desfire_key) != 2 * sizeof(key) || hex2bin(key, desfire_key, sizeof(key))) {
+        printk(KERN_WARNING "desfire_key must be 32 hex digits, DESFire authentication disabled.\n");
+        return;
+    }
+    rd->desfire_aes.card = crypto_alloc_cipher("aes", 0, 0);
+    rd->desfire_aes.session = crypto_alloc_cipher("aes", 0, 0);
+    if (IS_ERR(rd->desfire_aes.card) || IS_ERR(rd->desfire_aes.session)) {
+        printk(KERN_WARNING "No AES cipher, DESFire authentication disabled.\n");
+        goto err;
+    }
+    result = crypto_cipher_setkey(rd->desfire_aes.card, key, sizeof(key));
+    memzero_explicit(key, sizeof(key));
+    if (result)
+        goto err;
+    return;
+
+err:
+    memzero_explicit(key, sizeof(key));
+    if (!IS_ERR(rd->desfire_aes.card))
+        crypto_free_cipher(rd->desfire_aes.card);
+    if (!IS_ERR(rd->desfire_aes.session))
+        crypto_free_cipher(rd->desfire_aes.session);
+    rd->desfire_aes.card = NULL;
+    rd->desfire_aes.session = NULL;
+}
 
-    // 6. The self test is initiated
-    for (i = 0; i < 64; i++) { // CRC is done after 64 bytes
-        mfrc522_spi_read_byte(spi, FIFOLevelReg, temp); // Read the data from the FIFO buffer
+static void desfire_aes_free(struct mfrc522_reader *rd)
+{
+    if (rd->desfire_aes.card) {
+        crypto_free_cipher(rd->desfire_aes.card);
+        crypto_free_cipher(rd->desfire_aes.session);
     }
-    mfrc522_send_command(spi, 0, 0, 0b0000); // Idle command to stop the CRC
+    rd->desfire_aes.card = NULL;
+    rd->desfire_aes.session = NULL;
+}
 
-    // 7. Read the data from the FIFO buffer
-    mfrc522_spi_read_data(spi, FIFODataReg, result, 64); // Read the data from the FIFO buffer
-    mfrc522_spi_write_byte(spi, AutoTestReg, 0x00); // Disable the self test
+static int mfrc522_hard_reset(void *priv)
+{
+    // Reset the MFRC522 through NRSTPD; reset-gpios is active low in the device tree
+    struct mfrc522_reader *rd = priv;
 
-    // Compare the result with the expected result
-    for (i = 0; i < 64; i++) {
-        printk(KERN_INFO "Result: 0x%02x, Expected: 0x%02x\n", result[i], expected_result[i]);
-        if (result[i] != expected_result[i]) {
-            printk(KERN_WARNING "Self-test failed.\n");
-            return -ENODEV;
-        }
-    }
+    if (!rd->reset)
+        return -ENODEV; // No reset line: mfrc522_recover() gives up
+    if (DEBUG) { printk(KERN_INFO "%s: Resetting the MFRC522.\n", rd->name); }
+
+    gpiod_set_value_cansleep(rd->reset, 1); // Hold the chip in reset
+
+    // Datasheet 8.8.1: any low pulse longer than 100 ns resets the chip
+    usleep_range(MFRC522_RESET_PULSE_US, 2 * MFRC522_RESET_PULSE_US);
+
+    // Release the reset; the SPI interface answers once the crystal runs again
+    gpiod_set_value_cansleep(rd->reset, 0);
+    usleep_range(MFRC522_STARTUP_US, 2 * MFRC522_STARTUP_US);
 
-    printk(KERN_INFO "Self-test successful.\n");
     return 0;
 }
 
 module_init(mfrc522_spi_init);
-module_exit(mfrc522_spi_exit);
\ No newline at end of file
+module_exit(mfrc522_spi_exit);